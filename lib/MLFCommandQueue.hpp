@@ -0,0 +1,100 @@
+/**
+ * @file MLFCommandQueue.hpp
+ * @author Pawel Wieczorek
+ * @brief Lock-free multi-producer single-consumer queue of pending commands
+ * @date 2022-07-02
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+
+/**
+ * @brief Single command submitted to MLF Controller by a user thread
+ *
+ * Requests live on the stack of the submitting thread, which blocks until
+ *  `done` is set by the I/O thread. Errors are reported through `error`,
+ *  so every caller receives status of its own command only.
+ */
+struct MLFRequest {
+    std::atomic<MLFRequest*> next {nullptr};
+
+    int cmd = 0;
+    void* data = nullptr;
+    int len = 0;
+    void* resp = nullptr;
+    int* respLen = nullptr;
+
+    std::exception_ptr error;
+    std::atomic<bool> done {false};
+
+    /* When the command was written and its response received */
+    std::chrono::steady_clock::time_point sentAt, doneAt;
+};
+
+/**
+ * @brief Intrusive MPSC queue (D. Vyukov's algorithm)
+ *
+ * Any number of threads may call `push` concurrently. Only the I/O thread
+ *  is allowed to call `pop`. Neither of operations takes a lock.
+ */
+class MLFCommandQueue {
+    MLFRequest stub;
+    std::atomic<MLFRequest*> head;
+    MLFRequest* tail;
+
+public:
+    MLFCommandQueue() : head(&stub), tail(&stub) {}
+
+    MLFCommandQueue(const MLFCommandQueue&) = delete;
+    MLFCommandQueue& operator=(const MLFCommandQueue&) = delete;
+
+    void push(MLFRequest* req) {
+        req->next.store(nullptr, std::memory_order_relaxed);
+        MLFRequest* prev = head.exchange(req, std::memory_order_acq_rel);
+        prev->next.store(req, std::memory_order_release);
+    }
+
+    /**
+     * @brief Take the oldest request out of the queue
+     *
+     * @return MLFRequest* request or nullptr if queue is empty or a producer
+     *          is in the middle of `push` (check `empty` in such case)
+     */
+    MLFRequest* pop(void) {
+        MLFRequest* cur = tail;
+        MLFRequest* next = cur->next.load(std::memory_order_acquire);
+
+        if(cur == &stub) {
+            if(next == nullptr)
+                return nullptr;
+            tail = next;
+            cur = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+
+        if(next != nullptr) {
+            tail = next;
+            return cur;
+        }
+
+        // `cur` is the last element - it can be taken only after putting
+        //  stub behind it, otherwise concurrent push would be lost
+        if(cur != head.load(std::memory_order_acquire))
+            return nullptr;
+        push(&stub);
+
+        next = cur->next.load(std::memory_order_acquire);
+        if(next != nullptr) {
+            tail = next;
+            return cur;
+        }
+        return nullptr;
+    }
+
+    bool empty(void) const {
+        return head.load(std::memory_order_acquire) == tail &&
+               tail->next.load(std::memory_order_acquire) == nullptr;
+    }
+};
@@ -0,0 +1,88 @@
+/**
+ * @file MLFPacket.hpp
+ * @author Pawel Wieczorek
+ * @brief Encoding and decoding of MLF packets kept in memory
+ * @date 2022-07-09
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "uapi/mlf_protocol_uapi.h"
+
+/*
+ * Requests and responses share the same layout - only magic of header
+ *  differs (MLF_HEADER_MAGIC vs MLF_RESP_HEADER_MAGIC):
+ *  |   HEADER   |   BODY   |   FOOTER   |
+ */
+#define MLF_PACKET_OVERHEAD     (sizeof(struct MLF_req_packet_header) + sizeof(struct MLF_packet_footer))
+
+static inline size_t MLFPacketSize(int len) {
+    return MLF_PACKET_OVERHEAD + len;
+}
+
+/**
+ * @brief Put a complete packet into `out`
+ *
+ * @param out   buffer of at least MLFPacketSize(len) bytes
+ * @param magic MLF_HEADER_MAGIC or MLF_RESP_HEADER_MAGIC
+ * @param code  command ID or error code
+ * @param data  (optional) packet body
+ * @param len   size of `data`
+ * @return size_t number of bytes written to `out`
+ */
+static inline size_t MLFEncodePacket(char* out, uint32_t magic, int code, const void* data, int len) {
+    struct MLF_req_packet_header header = {
+        .magic = magic,
+        .cmd = (uint8_t)code,
+        .data_size = (uint16_t)len
+    };
+    struct MLF_packet_footer footer = {
+        .magic = MLF_FOOTER_MAGIC
+    };
+
+    memcpy(out, &header, sizeof header);
+    if(len > 0)
+        memcpy(out + sizeof header, data, len);
+    memcpy(out + sizeof header + len, &footer, sizeof footer);
+    return MLFPacketSize(len);
+}
+
+/**
+ * @brief Find the first packet in `in`
+ *
+ * Body is not copied - `data` points into `in`.
+ *
+ * @param in    received bytes
+ * @param avail number of bytes in `in`
+ * @param magic expected magic of header
+ * @param code  place for command ID or error code
+ * @param data  place for pointer to packet body
+ * @param len   place for size of packet body
+ * @return int  size of decoded packet, 0 if more data is needed,
+ *               -1 if packet is malformed
+ */
+static inline int MLFDecodePacket(const char* in, size_t avail, uint32_t magic,
+                                  int* code, const char** data, int* len) {
+    struct MLF_req_packet_header header;
+    struct MLF_packet_footer footer;
+
+    if(avail < sizeof header)
+        return 0;
+    memcpy(&header, in, sizeof header);
+    if(header.magic != magic || header.data_size > MLF_MAX_DATA_SIZE)
+        return -1;
+
+    if(avail < MLFPacketSize(header.data_size))
+        return 0;
+    memcpy(&footer, in + sizeof header + header.data_size, sizeof footer);
+    if(footer.magic != MLF_FOOTER_MAGIC)
+        return -1;
+
+    *code = header.cmd;
+    *data = in + sizeof header;
+    *len = header.data_size;
+    return MLFPacketSize(header.data_size);
+}
@@ -7,8 +7,10 @@
 #include "MLFProtoLib.hpp"
 #include "MLFProtoLib.h"
 
-#include "uapi/mlf_protocol_uapi.h"
+#include "MLFPacket.hpp"
+#include "MLFTrace.hpp"
 
+#include <algorithm>
 #include <fcntl.h>
 
 
@@ -19,6 +21,7 @@
 
 /* Linux specific includes */
 #include <dirent.h>
+#include <poll.h>
 #include <string.h>
 #include <sys/types.h>
 #include <termios.h>
@@ -74,6 +77,20 @@ static void ConfigureSerialPort(int fd) {
         throw MLFException("failed to setup usb connection - set attrs", true);
 }
 
+/**
+ * @brief Wait until there's data to be read from serial port
+ * 
+ * @return true if data is available, false on timeout
+ */
+static bool WaitForData(int fd, int timeoutMs) {
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN
+    };
+
+    return poll(&pfd, 1, timeoutMs) > 0;
+}
+
 #elif _WIN32
 
 /* Windows specific include files */
@@ -172,6 +189,24 @@ static void ConfigureSerialPort(int fd) {
     // TODO: Set timeouts using SetCommTimeouts
 }
 
+/**
+* @brief Wait until there's data to be read from serial port
+*
+* @return true if data is available, false on timeout
+*/
+static bool WaitForData(int fd, int timeoutMs) {
+    HANDLE serialPort = (HANDLE)_get_osfhandle(fd);
+    COMSTAT stat;
+    DWORD errors;
+
+    for(int i = 0; i <= timeoutMs; i++) {
+        if(ClearCommError(serialPort, &errors, &stat) && stat.cbInQue > 0)
+            return true;
+        Sleep(1);
+    }
+    return false;
+}
+
 /* Nasty fix to overcome "Posix name deprecated" error */
 #define open        ::_open
 #define read        ::_read
@@ -217,6 +252,7 @@ void MLFProtoLib::_read(void* data, size_t len) {
 }
 
 void MLFProtoLib::_write(void* data, size_t len) {
+    MLF_TRACE_SCOPE("tty.write", "bytes", len);
     int ret;
     size_t alreadyWritten = 0;
 
@@ -228,40 +264,22 @@ void MLFProtoLib::_write(void* data, size_t len) {
     }
 }
 
-/*
- * Packets from host to controller looks as follow:
- *  |   HEADER   |   BODY   |   FOOTER   |
- *  , where HEADER contains: magic, command no., body size
- *          BODY contains command specific data
- *          FOOTER contains: magic
- */
-
- /**
-  * @brief Send command with optional data from host to controller
-  *
-  * @param cmd  ID of command to invoke on controller's side
-  * @param data (optional) pointer to data sent with command
-  * @param len  (optional) size of `data` array
-  */
+/**
+ * @brief Send command with optional data from host to controller
+ *
+ * @param cmd  ID of command to invoke on controller's side
+ * @param data (optional) pointer to data sent with command
+ * @param len  (optional) size of `data` array
+ */
 void MLFProtoLib::_sendData(int cmd, void* data, int len) {
-    struct MLF_req_packet_header header = {
-        .magic = MLF_HEADER_MAGIC,
-        .cmd = (uint8_t)cmd,
-        .data_size = (uint16_t)len
-    };
-    struct MLF_packet_footer footer = {
-        .magic = MLF_FOOTER_MAGIC
-    };
-
-    const size_t packet_size = sizeof header + len + sizeof footer;
-    char* packet = new char[packet_size];
-    memcpy(packet, &header, sizeof header);
-    memcpy(packet + sizeof header, data, len);
-    memcpy(packet + sizeof header + len, &footer, sizeof footer);
-
+    // Buffer is reused, so sending doesn't allocate in steady state
+    {
+        MLF_TRACE_SCOPE("packet.encode", "cmd", cmd);
+        sendBuffer.resize(MLFPacketSize(len));
+        MLFEncodePacket(sendBuffer.data(), MLF_HEADER_MAGIC, cmd, data, len);
+    }
 
-    _write(packet, packet_size);
-    delete[] packet;
+    _write(sendBuffer.data(), sendBuffer.size());
 }
 
 /*
@@ -269,6 +287,45 @@ void MLFProtoLib::_sendData(int cmd, void* data, int len) {
  *  requests, except they contain error code instead of command ID in header.
  */
 
+/*
+ * Error codes between MLF_RET_PING and MLF_RET_INVALID_CMD are used by
+ *  asynchronous events, which can be interleaved with responses.
+ */
+static bool IsEventCode(int code) {
+    return code > MLF_RET_PING && code < MLF_RET_INVALID_CMD;
+}
+
+/**
+ * @brief Receive single packet (response or event) from controller
+ *          into `recvBuffer`
+ * 
+ * @returns error status sent by controller
+ */
+int MLFProtoLib::_recvPacket(void) {
+    struct MLF_resp_packet_header header;
+    struct MLF_packet_footer footer;
+
+    // Read header - most of the time is spent here waiting for controller
+    {
+        MLF_TRACE_SCOPE("response.wait");
+        _read(&header, sizeof(header));
+    }
+    MLF_TRACE_SCOPE("response.decode", "bytes", header.data_size);
+    if(header.magic != MLF_RESP_HEADER_MAGIC)
+        throw MLFException("invalid header magic was received from MLF Controller");
+
+    // Read data associated with packet
+    recvBuffer.resize(header.data_size);
+    _read(recvBuffer.data(), header.data_size);
+
+    // Read footer
+    _read(&footer, sizeof(footer));
+    if(footer.magic != MLF_FOOTER_MAGIC)
+        throw MLFException("invalid footer magic was received from MLF Controller");
+
+    return header.error_code;
+}
+
 /**
  * @brief Receive response from controller
  * 
@@ -280,40 +337,50 @@ void MLFProtoLib::_sendData(int cmd, void* data, int len) {
  * @returns error status sent by controller
  */
 int MLFProtoLib::_recvData(void* output, int outputLen, int* actualLen) {
-    char* data_buffer = NULL;
-    struct MLF_resp_packet_header header;
-    struct MLF_packet_footer footer;
+    int ret;
 
-    // Read header
-    _read(&header, sizeof(header));
-    if(header.magic != MLF_RESP_HEADER_MAGIC)
-        throw MLFException("invalid header magic was received from MLF Controller");
+    while(IsEventCode(ret = _recvPacket()))
+        _handleEvent(ret);
 
-    try {
-        // Read data associated with packet
-        data_buffer = new char[header.data_size];
-        _read(data_buffer, header.data_size);
-
-        // Read footer
-        _read(&footer, sizeof(footer));
-        if(footer.magic != MLF_FOOTER_MAGIC)
-            throw MLFException("invalid footer magic was received from MLF Controller");
-
-        // Copy result
-        if(outputLen > header.data_size)
-            outputLen = header.data_size;
-        if(actualLen != nullptr)
-            *actualLen = header.data_size;
-        if(output != nullptr)
-            memcpy(output, data_buffer, outputLen);
-    }
-    catch (...) {
-        delete[] data_buffer;
-        throw;
+    // Copy result
+    if(outputLen > (int)recvBuffer.size())
+        outputLen = recvBuffer.size();
+    if(actualLen != nullptr)
+        *actualLen = recvBuffer.size();
+    if(output != nullptr)
+        memcpy(output, recvBuffer.data(), outputLen);
+
+    return ret;
+}
+
+void MLFProtoLib::_handleEvent(int event) {
+    MLF_TRACE_SCOPE("event.handle", "event", event);
+    switch(event) {
+    case MLF_RET_EVENT_CREDITS:
+        if(recvBuffer.size() >= sizeof(struct MLF_resp_flow_credits))
+            flowCredits = ((struct MLF_resp_flow_credits*) recvBuffer.data())->credits;
+        break;
+    default:
+        // Unknown events are silently ignored
+        break;
     }
+}
 
-    delete[] data_buffer;
-    return header.error_code;
+/**
+ * @brief Handle events sent by controller while no command is pending
+ * 
+ * @param timeoutMs how long to wait for the first event
+ */
+void MLFProtoLib::_pollEvents(int timeoutMs) {
+    int ret;
+
+    if(!WaitForData(dev, timeoutMs))
+        return;
+
+    ret = _recvPacket();
+    if(!IsEventCode(ret))
+        throw MLFException("unexpected response was received from MLF Controller");
+    _handleEvent(ret);
 }
 
 void MLFProtoLib::invokeCmd(int cmd, void* data, int len) {
@@ -322,7 +389,7 @@ void MLFProtoLib::invokeCmd(int cmd, void* data, int len) {
     _sendData(cmd, data, len);
     ret = _recvData();
     if(ret != MLF_RET_OK)
-        errorToException("contoller failed to process command", ret);
+        errorToException("controller failed to process command", ret);
 }
 
 void MLFProtoLib::invokeCmd(int cmd, void* data, int len, void* resp, int* respLen) {
@@ -331,7 +398,650 @@ void MLFProtoLib::invokeCmd(int cmd, void* data, int len, void* resp, int* respL
     _sendData(cmd, data, len);
     ret = _recvData(resp, *respLen, respLen);
     if(ret != MLF_RET_OK)
-        errorToException("contoller failed to process command", ret);
+        errorToException("controller failed to process command", ret);
+}
+
+/************************************
+ * COMMANDS QUEUE
+ ************************************/
+
+/*
+ * Only the I/O thread touches `dev`. User threads put requests either into
+ *  `controlQueue` or (for frames) into `pendingFrame` slot and sleep until
+ *  the I/O thread marks them as done. Frames have the lowest priority, so
+ *  brightness/state changes never wait behind queued frames - at most
+ *  behind a single frame already being transmitted.
+ */
+
+void MLFProtoLib::ringDoorbell(void) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(!ioIdle.load())
+        return;
+
+    std::lock_guard<std::mutex> lock(doorbellLock);
+    doorbell.notify_one();
+}
+
+void MLFProtoLib::complete(MLFRequest* req) {
+    {
+        std::lock_guard<std::mutex> lock(completionLock);
+        req->done.store(true, std::memory_order_release);
+    }
+    // `req` might be already gone at this point
+    completion.notify_all();
+}
+
+/*
+ * With flow control enabled, frames are sent only when controller has
+ *  granted a credit (after pushing the previous frame out to LEDs). Until
+ *  then the newest frame waits in `pendingFrame`, so host-side queueing
+ *  never exceeds a single frame.
+ */
+#define FLOW_POLL_INTERVAL_MS       2
+#define FLOW_CREDIT_TIMEOUT         std::chrono::milliseconds(250)
+
+bool MLFProtoLib::frameSlotAvailable(void) {
+    auto now = std::chrono::steady_clock::now();
+
+    if(!flowControl || flowCredits > 0 || pendingFrame.load() == nullptr)
+        return true;
+
+    if(creditWaitStart == std::chrono::steady_clock::time_point())
+        creditWaitStart = now;
+
+    // Wait only shortly, so control commands are still handled promptly
+    MLF_TRACE_SCOPE("flow.wait", "credits", flowCredits);
+    try {
+        _pollEvents(FLOW_POLL_INTERVAL_MS);
+    }
+    catch (MLFException&) {
+        // Let the frame itself report the broken connection
+        flowCredits = 1;
+    }
+
+    if(flowCredits <= 0 && now - creditWaitStart < FLOW_CREDIT_TIMEOUT)
+        return false;
+
+    // Credit might have been lost - don't stall the stream forever
+    if(flowCredits <= 0)
+        flowCredits = 1;
+    creditWaitStart = std::chrono::steady_clock::time_point();
+    return true;
+}
+
+void MLFProtoLib::sendFramePacket(int cmd, int len, bool last) {
+    struct MLF_resp_flow_credits credits;
+    int respLen = sizeof(credits);
+
+    // Credit is consumed by the whole frame - i.e. its last packet
+    if(!flowControl || !last) {
+        invokeCmd(cmd, frameBuffer.data(), len);
+        return;
+    }
+
+    flowCredits--;
+    invokeCmd(cmd, frameBuffer.data(), len, &credits, &respLen);
+    if(respLen >= (int)sizeof(credits))
+        flowCredits = credits.credits;
+}
+
+/*
+ * Encoding of frames is chosen based on controller's capabilities. Packed
+ *  RGB24 fragments need 25% less bandwidth than RGB32, so they're preferred
+ *  whenever available. Otherwise frames fitting into a single packet are
+ *  sent with MLF_CMD_SET_COLOR, which is supported by every firmware.
+ */
+#define SET_COLOR_MAX_LEDS      ((MLF_MAX_DATA_SIZE - sizeof(struct MLF_req_cmd_set_color)) / sizeof(int))
+#define FRAGMENT_MAX_LEDS(BPL)  ((MLF_MAX_DATA_SIZE - sizeof(struct MLF_req_cmd_set_color_fragment)) / (BPL))
+#define RGB24_BYTES_PER_LED     3
+#define FRAGMENT_PAYLOAD(LEDS, BPL) ((int)sizeof(struct MLF_req_cmd_set_color_fragment) + (LEDS) * (BPL))
+
+/*
+ * USB Full Speed CDC moves data in 64 byte packets. Transfer ending with
+ *  a full packet has to be terminated with a zero-length packet, which costs
+ *  another USB transaction - such packet sizes are avoided.
+ */
+#define USB_FS_PACKET_SIZE      64
+
+static bool EndsWithFullUSBPacket(int payload) {
+    return MLFPacketSize(payload) % USB_FS_PACKET_SIZE == 0;
+}
+
+void MLFProtoLib::sendFrameRGB32(const int* colors, int count) {
+    struct MLF_req_cmd_set_color* data;
+    const int dataLen = sizeof(*data) + sizeof(int) * count;
+
+    {
+        MLF_TRACE_SCOPE("frame.encode", "leds", count);
+        frameBuffer.resize(dataLen);
+        data = (struct MLF_req_cmd_set_color*) frameBuffer.data();
+        data->strip = 0;
+        memcpy(data->colors, colors, count * sizeof(int));
+    }
+
+    sendFramePacket(MLF_CMD_SET_COLOR, dataLen, true);
+}
+
+void MLFProtoLib::sendFrameFragments(const int* colors, int count, bool rgb24) {
+    const int bytesPerLed = rgb24 ? RGB24_BYTES_PER_LED : sizeof(int);
+    const int maxLeds = fragmentLeds(count, bytesPerLed);
+
+    frameId++;
+    for(int offset = 0; offset < count; ) {
+        struct MLF_req_cmd_set_color_fragment* data;
+        int fragmentLeds = std::min<int>(count - offset, maxLeds);
+        const int rest = count - offset - fragmentLeds;
+
+        // Move a single LED to the next fragment, if either of them would
+        //  end with a full USB packet (doesn't cost an extra round trip)
+        if(rest > 0 && fragmentLeds > 1 &&
+           (EndsWithFullUSBPacket(FRAGMENT_PAYLOAD(fragmentLeds, bytesPerLed)) ||
+            (rest < maxLeds && EndsWithFullUSBPacket(FRAGMENT_PAYLOAD(rest, bytesPerLed)))))
+            fragmentLeds--;
+
+        const int dataLen = FRAGMENT_PAYLOAD(fragmentLeds, bytesPerLed);
+        const bool last = offset + fragmentLeds >= count;
+
+        {
+            MLF_TRACE_SCOPE("frame.encode", "leds", fragmentLeds);
+            frameBuffer.resize(dataLen);
+            data = (struct MLF_req_cmd_set_color_fragment*) frameBuffer.data();
+            data->frame_id = frameId;
+            data->flags = (last ? MLF_FRAGMENT_LAST : 0) | (rgb24 ? MLF_FRAGMENT_RGB24 : 0);
+            data->offset = (uint16_t)offset;
+
+            if(rgb24) {
+                uint8_t* out = (uint8_t*) data->colors;
+                for(int i = 0; i < fragmentLeds; i++, out += RGB24_BYTES_PER_LED) {
+                    const int color = colors[offset + i];
+                    out[0] = color & 0xff;
+                    out[1] = (color >> 8) & 0xff;
+                    out[2] = (color >> 16) & 0xff;
+                }
+            }
+            else {
+                memcpy(data->colors, colors + offset, fragmentLeds * sizeof(int));
+            }
+        }
+
+        sendFramePacket(MLF_CMD_SET_COLOR_FRAGMENT, dataLen, last);
+        offset += fragmentLeds;
+    }
+}
+
+void MLFProtoLib::sendFrame(MLFRequest* req) {
+    const int* colors = (const int*) req->data;
+    const int count = req->len;
+    const bool fragments = caps & MLF_CAP_FRAGMENTS;
+    MLF_TRACE_SCOPE("frame.send", "leds", count);
+
+    if(fragments && (caps & MLF_CAP_PIXFMT_RGB24))
+        sendFrameFragments(colors, count, true);
+    else if(count <= (int)SET_COLOR_MAX_LEDS)
+        sendFrameRGB32(colors, count);
+    else if(fragments)
+        sendFrameFragments(colors, count, false);
+    else
+        throw MLFException("frame is too large for MLF Controller");
+}
+
+/************************************
+ * LINK TUNING
+ ************************************/
+
+/*
+ * Every packet of a frame is a round trip, so the best fragment size
+ *  depends on how round trip time grows with packet size. `probeLink`
+ *  measures it with MLF_CMD_LINK_PROBE (ignored by controller) for packets
+ *  filling 1..32 USB packets - both ending just before and exactly at USB
+ *  packet boundary - with several kilobytes sent per size, so the sustained
+ *  rate is measured rather than a burst absorbed by buffers. `fragmentLeds`
+ *  picks the size giving the shortest predicted transfer of the whole
+ *  frame. Without measurement the largest fragments allowed by controller
+ *  are used.
+ */
+#define LINK_PROBE_DEFAULT_ROUNDS   5
+#define LINK_PROBE_MIN_BYTES        8192
+#define LINK_PROBE_MAX_PACKETS      256
+
+static const int LinkProbeUSBPackets[] = { 1, 2, 3, 4, 6, 8, 12, 16, 24, 32 };
+
+void MLFProtoLib::probeLink(int rounds) {
+    const int maxPayload = std::min<int>(max_payload, MLF_MAX_DATA_SIZE);
+    std::vector<int> sizes = { 0, maxPayload };
+    std::vector<char> payload(maxPayload);
+    std::vector<MLFLinkSample> curve;
+
+    requireCaps(MLF_CAP_LINK_PROBE, "link probing");
+
+    for(int packets : LinkProbeUSBPackets) {
+        const int full = packets * USB_FS_PACKET_SIZE - MLF_PACKET_OVERHEAD;
+        if(full - 1 >= 0 && full - 1 <= maxPayload)
+            sizes.push_back(full - 1);
+        if(full >= 0 && full <= maxPayload)
+            sizes.push_back(full);
+    }
+    std::sort(sizes.begin(), sizes.end());
+    sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+
+    for(int size : sizes) {
+        // Packets go back to back, as fragments of frames do - a few of them
+        //  would fit into buffers on the way and look faster than they are
+        const int count = std::min(LINK_PROBE_MAX_PACKETS,
+                                   std::max(rounds, LINK_PROBE_MIN_BYTES / (int)MLFPacketSize(size)));
+        const auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < count; i++)
+            invokeCmd(MLF_CMD_LINK_PROBE, payload.data(), size);
+
+        const double rttUs = std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - start).count() / count;
+        curve.push_back({
+            .payloadBytes = size,
+            .wireBytes = (int)MLFPacketSize(size),
+            .rttUs = rttUs,
+            .throughputKBps = size / rttUs * 1000.0,
+        });
+    }
+
+    std::lock_guard<std::mutex> lock(linkLock);
+    linkCurve = curve;
+    chunkCount = -1;
+}
+
+/* Interpolated round trip time of packet not ending with a full USB packet */
+double MLFProtoLib::predictRttUs(int payload) const {
+    const MLFLinkSample* prev = nullptr;
+
+    for(auto& sample : linkCurve) {
+        if(EndsWithFullUSBPacket(sample.payloadBytes))
+            continue;
+        if(sample.payloadBytes >= payload) {
+            if(prev == nullptr || sample.payloadBytes == prev->payloadBytes)
+                return sample.rttUs;
+            return prev->rttUs + (sample.rttUs - prev->rttUs) *
+                   (payload - prev->payloadBytes) / (sample.payloadBytes - prev->payloadBytes);
+        }
+        prev = &sample;
+    }
+
+    return prev ? prev->rttUs * payload / std::max(prev->payloadBytes, 1) : 0;
+}
+
+/**
+ * @brief Number of LEDs per fragment giving the shortest transfer of frame
+ *          of `count` LEDs
+ */
+int MLFProtoLib::chooseFragmentLeds(int count, int bytesPerLed) const {
+    const int headerLen = sizeof(struct MLF_req_cmd_set_color_fragment);
+    const int maxLeds = (std::min<int>(max_payload, MLF_MAX_DATA_SIZE) - headerLen) / bytesPerLed;
+    double bestUs = 0;
+    int best = maxLeds;
+
+    for(auto& sample : linkCurve) {
+        const int leds = (sample.payloadBytes - headerLen) / bytesPerLed;
+        if(leds <= 0 || leds > maxLeds || EndsWithFullUSBPacket(sample.payloadBytes))
+            continue;
+
+        const int rest = count % leds;
+        const double us = (count / leds) * predictRttUs(FRAGMENT_PAYLOAD(leds, bytesPerLed)) +
+                          (rest ? predictRttUs(FRAGMENT_PAYLOAD(rest, bytesPerLed)) : 0);
+        if(bestUs == 0 || us < bestUs) {
+            bestUs = us;
+            best = leds;
+        }
+    }
+
+    return best;
+}
+
+/* Chosen chunking is cached, since frames are usually of the same size */
+int MLFProtoLib::fragmentLeds(int count, int bytesPerLed) {
+    if(count != chunkCount || bytesPerLed != chunkBytesPerLed) {
+        chunkCount = count;
+        chunkBytesPerLed = bytesPerLed;
+        chunkLeds = chooseFragmentLeds(count, bytesPerLed);
+    }
+    return chunkLeds;
+}
+
+/************************************
+ * BATCHING
+ ************************************/
+
+/*
+ * Commands without response data can be sent together in MLF_CMD_BATCH,
+ *  which controller applies atomically - there's a single round trip and
+ *  LEDs never show a half-applied scene.
+ */
+static bool AppendBatchCmd(std::vector<char>& buffer, int cmd, const void* data, int len) {
+    struct MLF_batch_cmd sub = {
+        .cmd = (uint8_t)cmd,
+        .data_size = (uint16_t)len
+    };
+    const size_t offset = buffer.size();
+
+    if(offset + sizeof(sub) + len > MLF_MAX_DATA_SIZE)
+        return false;
+
+    buffer.resize(offset + sizeof(sub) + len);
+    memcpy(buffer.data() + offset, &sub, sizeof(sub));
+    if(len > 0)
+        memcpy(buffer.data() + offset + sizeof(sub), data, len);
+    return true;
+}
+
+/*
+ * SET_COLOR_AT queues a frame for presentation, which controller doesn't
+ *  roll back when a later command of batch fails
+ */
+static bool IsBatchableCmd(int cmd) {
+    return cmd != MLF_CMD_SET_COLOR && cmd != MLF_CMD_SET_COLOR_AT &&
+           cmd != MLF_CMD_SET_COLOR_FRAGMENT && cmd != MLF_CMD_SET_FLOW_CONTROL &&
+           cmd != MLF_CMD_BATCH && cmd != MLF_CMD_LINK_PROBE && cmd != MLF_CMD_SET_STRIP_CONFIG;
+}
+
+bool MLFProtoLib::isBatchable(MLFRequest* req) const {
+    return (caps & MLF_CAP_BATCH) && IsBatchableCmd(req->cmd) &&
+           req->respLen == nullptr &&
+           req->len + sizeof(struct MLF_batch_cmd) <= MLF_MAX_DATA_SIZE;
+}
+
+/**
+ * @brief Take commands queued right after `first` which can share a packet
+ * 
+ * @return int number of requests put into `reqs`
+ */
+int MLFProtoLib::collectBatch(MLFRequest* first, MLFRequest** reqs) {
+    size_t size = sizeof(struct MLF_batch_cmd) + first->len;
+    int count = 1;
+    reqs[0] = first;
+
+    while(count < MLF_BATCH_MAX_CMDS) {
+        MLFRequest* next = controlQueue.pop();
+        if(next == nullptr)
+            break;
+
+        size += sizeof(struct MLF_batch_cmd) + next->len;
+        if(!isBatchable(next) || size > MLF_MAX_DATA_SIZE) {
+            // Handled in the next iteration, so order is preserved
+            heldRequest = next;
+            break;
+        }
+        reqs[count++] = next;
+    }
+
+    return count;
+}
+
+void MLFProtoLib::sendBatch(MLFRequest** reqs, int count) {
+    int ret = MLF_RET_OK, executed = 0;
+    std::exception_ptr error;
+    const auto sentAt = std::chrono::steady_clock::now();
+
+    batchBuffer.clear();
+    for(int i = 0; i < count; i++)
+        AppendBatchCmd(batchBuffer, reqs[i]->cmd, reqs[i]->data, reqs[i]->len);
+
+    try {
+        _sendData(MLF_CMD_BATCH, batchBuffer.data(), batchBuffer.size());
+        ret = _recvData();
+        if(recvBuffer.size() >= sizeof(struct MLF_resp_cmd_batch))
+            executed = std::min<int>(count, ((struct MLF_resp_cmd_batch*) recvBuffer.data())->count);
+        if(ret != MLF_RET_OK && executed == 0)
+            errorToException("controller failed to process batch", ret);
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+
+    // Walk over combined response - every caller gets status of its own command.
+    //  Controller rolls back the whole batch if any command fails, so commands
+    //  which succeeded before it fail too.
+    size_t offset = sizeof(struct MLF_resp_cmd_batch);
+    for(int i = 0; i < count; i++) {
+        MLFRequest* req = reqs[i];
+
+        if(error) {
+            req->error = error;
+        }
+        else if(i >= executed) {
+            req->error = std::make_exception_ptr(
+                MLFException("command was not executed - previous command in batch failed"));
+        }
+        else if(offset + sizeof(struct MLF_batch_resp) <= recvBuffer.size()) {
+            auto sub = (struct MLF_batch_resp*)(recvBuffer.data() + offset);
+            offset += sizeof(*sub) + sub->data_size;
+            if(sub->error_code != MLF_RET_OK) {
+                try {
+                    errorToException("controller failed to process command", sub->error_code);
+                }
+                catch (...) {
+                    req->error = std::current_exception();
+                }
+            }
+            else if(ret != MLF_RET_OK) {
+                req->error = std::make_exception_ptr(
+                    MLFException("command was rolled back - another command in batch failed"));
+            }
+        }
+
+        req->sentAt = sentAt;
+        req->doneAt = std::chrono::steady_clock::now();
+        complete(req);
+    }
+}
+
+/*
+ * Commands issued between `beginBatch` and `endBatch` are kept per thread,
+ *  so other threads sharing the object aren't affected
+ */
+struct MLFThreadBatch {
+    MLFProtoLib* owner = nullptr;
+    int depth = 0;
+    int count = 0;
+    std::vector<char> cmds;
+};
+static thread_local MLFThreadBatch threadBatch;
+
+/**
+ * @brief Start collecting commands without response (setBrightness,
+ *          setEffect, turnOn, ...) issued by the calling thread
+ * 
+ * Commands are sent together by `endBatch` and applied by controller
+ *  atomically. Commands returning data, issued in the meantime, send
+ *  already collected commands first, so order is always preserved.
+ */
+void MLFProtoLib::beginBatch(void) {
+    if(threadBatch.owner != nullptr && threadBatch.owner != this)
+        throw MLFException("Failed to begin batch - another batch is in progress");
+
+    threadBatch.owner = this;
+    threadBatch.depth++;
+}
+
+/**
+ * @brief Send all commands collected since `beginBatch` in a single packet
+ */
+void MLFProtoLib::endBatch(void) {
+    if(threadBatch.owner != this)
+        throw MLFException("Failed to end batch - batch hasn't been started");
+
+    if(--threadBatch.depth > 0)
+        return;
+
+    try {
+        flushBatch();
+    }
+    catch (...) {
+        threadBatch.owner = nullptr;
+        throw;
+    }
+    threadBatch.owner = nullptr;
+}
+
+void MLFProtoLib::flushBatch(void) {
+    std::vector<char> cmds;
+    const int count = threadBatch.count;
+
+    cmds.swap(threadBatch.cmds);
+    threadBatch.count = 0;
+    if(count == 0)
+        return;
+
+    // Older firmware - send commands one by one
+    if(!(caps & MLF_CAP_BATCH)) {
+        for(size_t offset = 0; offset < cmds.size(); ) {
+            auto sub = (struct MLF_batch_cmd*)(cmds.data() + offset);
+            MLFRequest req;
+            req.cmd = sub->cmd;
+            req.data = sub->data;
+            req.len = sub->data_size;
+
+            submit(req);
+            offset += sizeof(*sub) + sub->data_size;
+        }
+        return;
+    }
+
+    // Single command doesn't need batch
+    if(count == 1) {
+        auto sub = (struct MLF_batch_cmd*) cmds.data();
+        MLFRequest req;
+        req.cmd = sub->cmd;
+        req.data = sub->data;
+        req.len = sub->data_size;
+
+        submit(req);
+        return;
+    }
+
+    std::vector<char> resp(MLF_MAX_DATA_SIZE);
+    int respLen = resp.size();
+    MLFRequest req;
+    req.cmd = MLF_CMD_BATCH;
+    req.data = cmds.data();
+    req.len = cmds.size();
+    req.resp = resp.data();
+    req.respLen = &respLen;
+
+    submit(req);
+}
+
+void MLFProtoLib::ioLoop(void) {
+    MLFRequest* req;
+    MLFTrace::setThreadName("MLFProtoLib I/O");
+
+    MLFRequest* batch[MLF_BATCH_MAX_CMDS];
+    int batchCount;
+
+    while(true) {
+        req = heldRequest ? heldRequest : controlQueue.pop();
+        heldRequest = nullptr;
+        if(req == nullptr && frameSlotAvailable())
+            req = pendingFrame.exchange(nullptr, std::memory_order_acq_rel);
+
+        if(req != nullptr && isBatchable(req)) {
+            batchCount = collectBatch(req, batch);
+            if(batchCount > 1) {
+                sendBatch(batch, batchCount);
+                continue;
+            }
+        }
+
+        if(req != nullptr) {
+            req->sentAt = std::chrono::steady_clock::now();
+            try {
+                if(req->cmd == MLF_CMD_SET_COLOR)
+                    sendFrame(req);
+                else if(req->cmd == MLF_CMD_LINK_PROBE)
+                    probeLink(req->len);
+                else if(req->cmd == MLF_CMD_SET_STRIP_CONFIG)
+                    setStripConfigIO(req);
+                else if(req->respLen != nullptr)
+                    invokeCmd(req->cmd, req->data, req->len, req->resp, req->respLen);
+                else
+                    invokeCmd(req->cmd, req->data, req->len);
+            }
+            catch (...) {
+                req->error = std::current_exception();
+            }
+            req->doneAt = std::chrono::steady_clock::now();
+            complete(req);
+            continue;
+        }
+
+        if(ioStop.load())
+            break;
+
+        std::unique_lock<std::mutex> lock(doorbellLock);
+        ioIdle.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        doorbell.wait(lock, [this] {
+            return ioStop.load() || !controlQueue.empty() || pendingFrame.load() != nullptr;
+        });
+        ioIdle.store(false);
+    }
+}
+
+void MLFProtoLib::waitFor(MLFRequest& req) {
+    MLF_TRACE_SCOPE("queue.wait", "cmd", req.cmd);
+    std::unique_lock<std::mutex> lock(completionLock);
+    completion.wait(lock, [&req] { return req.done.load(std::memory_order_acquire); });
+    lock.unlock();
+
+    if(req.error)
+        std::rethrow_exception(req.error);
+}
+
+void MLFProtoLib::submit(MLFRequest& req) {
+    controlQueue.push(&req);
+    ringDoorbell();
+    waitFor(req);
+}
+
+void MLFProtoLib::submitCmd(int cmd, void* data, int len, void* resp, int* respLen) {
+    MLFRequest req;
+
+    if(threadBatch.owner == this) {
+        const bool batchable = resp == nullptr && IsBatchableCmd(cmd);
+
+        if(batchable && threadBatch.count < MLF_BATCH_MAX_CMDS &&
+           AppendBatchCmd(threadBatch.cmds, cmd, data, len)) {
+            threadBatch.count++;
+            return;
+        }
+
+        // Commands have to be executed in order they were issued
+        flushBatch();
+        if(batchable && AppendBatchCmd(threadBatch.cmds, cmd, data, len)) {
+            threadBatch.count++;
+            return;
+        }
+    }
+
+    req.cmd = cmd;
+    req.data = data;
+    req.len = len;
+    req.resp = resp;
+    req.respLen = respLen;
+
+    submit(req);
+}
+
+void MLFProtoLib::submitFrame(int* colors, int len) {
+    MLFRequest req;
+    MLFRequest* superseded;
+    req.cmd = MLF_CMD_SET_COLOR;
+    req.data = colors;
+    req.len = len;
+
+    // Only the newest frame is worth sending
+    superseded = pendingFrame.exchange(&req, std::memory_order_acq_rel);
+    if(superseded != nullptr)
+        complete(superseded);
+    ringDoorbell();
+
+    waitFor(req);
 }
 
 void MLFProtoLib::errorToException(const char* message, int error) {
@@ -356,7 +1066,7 @@ void MLFProtoLib::errorToException(const char* message, int error) {
 }
 
 
-MLFProtoLib::MLFProtoLib(std::string path) {
+MLFProtoLib::MLFProtoLib(std::string path, bool tuneLink) {
     if(path == "") {
         path = GetPathToUSBDevice();
         if(path == "")
@@ -371,25 +1081,120 @@ MLFProtoLib::MLFProtoLib(std::string path) {
     try {
         ConfigureSerialPort(dev);
 
-        // Retrieve basic info
-        struct MLF_resp_cmd_get_info resp;
-        int resp_size = sizeof(resp);
-
-        invokeCmd(MLF_CMD_GET_INFO, nullptr, 0, &resp, &resp_size);
-        if(resp_size != sizeof(resp))
-            throw MLFException("failed to get info from MLF Controller");
-
-        fw_version = resp.fw_version;
-        leds_count_top = resp.leds_count_top;
-        leds_count_bottom = resp.leds_count_bottom;
+        ControllerInfo info;
+        getInfo(info);
+        fw_version = info.fwVersion;
+        protocol_version = info.protocolVersion;
+        caps = info.caps;
+        max_payload = info.maxPayload;
+        max_fps = info.maxFps;
+        leds_count_top = info.ledsCountTop;
+        leds_count_bottom = info.ledsCountBottom;
+        strips.swap(info.strips);
+
+        enableFlowControl();
+        if(tuneLink)
+            probeLink(LINK_PROBE_DEFAULT_ROUNDS);
     }
     catch (...) {
         close(dev);
         throw;
     }
+
+    ioThread = std::thread(&MLFProtoLib::ioLoop, this);
+}
+
+/*
+ * Older firmware ignores data of GET_INFO and responds with bare
+ *  MLF_resp_cmd_get_info - such controller supports RGB32 frames only.
+ */
+void MLFProtoLib::getInfo(ControllerInfo& info) {
+    struct MLF_req_cmd_get_info req = {
+        .protocol_version = MLF_PROTOCOL_VERSION
+    };
+    std::vector<char> buffer(MLF_MAX_DATA_SIZE);
+    int respLen = buffer.size();
+    auto ext = (struct MLF_resp_cmd_get_info_ext*) buffer.data();
+
+    invokeCmd(MLF_CMD_GET_INFO, &req, sizeof req, buffer.data(), &respLen);
+    if(respLen < (int)sizeof(ext->info))
+        throw MLFException("failed to get info from MLF Controller");
+
+    info.fwVersion = ext->info.fw_version;
+    info.ledsCountTop = ext->info.leds_count_top;
+    info.ledsCountBottom = ext->info.leds_count_bottom;
+
+    if(respLen < (int)sizeof(*ext)) {
+        info.protocolVersion = 1;
+        info.caps = MLF_CAP_PIXFMT_RGB32;
+        info.maxPayload = MLF_MAX_DATA_SIZE;
+        info.maxFps = 0;
+        info.strips = {
+            { STRIP_BOTTOM, MLF_LED_WS2812B, info.ledsCountBottom, 0 },
+            { STRIP_TOP, MLF_LED_WS2812B, info.ledsCountTop, info.ledsCountBottom },
+        };
+        return;
+    }
+
+    info.protocolVersion = ext->protocol_version;
+    info.caps = ext->caps;
+    info.maxPayload = ext->max_payload;
+    info.maxFps = ext->max_fps;
+
+    const int stripsCount = std::min<int>(ext->strips_count,
+        (respLen - sizeof(*ext)) / sizeof(struct MLF_strip_info));
+    info.strips.clear();
+    for(int i = 0; i < stripsCount; i++) {
+        const struct MLF_strip_info& strip = ext->strips[i];
+        info.strips.push_back({ strip.strip, strip.led_type, strip.leds_count, strip.first_led });
+    }
+}
+
+void MLFProtoLib::requireCaps(uint32_t required, const char* feature) const {
+    if((caps & required) != required)
+        throw MLFException((std::string(feature) + " is not supported by MLF Controller").c_str());
+}
+
+void MLFProtoLib::enableFlowControl(void) {
+    struct MLF_req_cmd_set_flow_control req = {
+        .enable = 1
+    };
+    struct MLF_resp_flow_credits credits;
+    int respLen = sizeof(credits);
+
+    // Without flow control frames are sent as soon as they arrive
+    if(!(caps & MLF_CAP_FLOW_CONTROL))
+        return;
+
+    invokeCmd(MLF_CMD_SET_FLOW_CONTROL, &req, sizeof req, &credits, &respLen);
+    flowControl = respLen >= (int)sizeof(credits);
+    flowCredits = credits.credits;
 }
 
 MLFProtoLib::~MLFProtoLib() {
+    ioStop.store(true);
+    {
+        std::lock_guard<std::mutex> lock(doorbellLock);
+        doorbell.notify_one();
+    }
+    ioThread.join();
+
+    // Next host may not know flow control, so it mustn't get credit events
+    if(flowControl) {
+        struct MLF_req_cmd_set_flow_control req = {
+            .enable = 0
+        };
+        struct MLF_resp_flow_credits credits;
+        int respLen = sizeof(credits);
+
+        try {
+            invokeCmd(MLF_CMD_SET_FLOW_CONTROL, &req, sizeof req, &credits, &respLen);
+        }
+        catch (...) {
+            // Controller is gone already
+        }
+    }
+
     close(dev);
 }
 
@@ -398,24 +1203,94 @@ void MLFProtoLib::getFWVersion(int& version) const {
 }
 
 void MLFProtoLib::getLedsCount(int& top, int& bottom) const {
+    std::lock_guard<std::mutex> lock(infoLock);
     top = leds_count_top;
     bottom = leds_count_bottom;
 }
 
+void MLFProtoLib::getProtocolVersion(int& version) const {
+    version = protocol_version;
+}
+
+/**
+ * @brief Get features supported by controller
+ * 
+ * @param capabilities bitmap of MLF_CAPS values
+ */
+void MLFProtoLib::getCapabilities(uint32_t& capabilities) const {
+    capabilities = caps;
+}
+
+/**
+ * @brief Get limits of controller
+ * 
+ * @param maxPayload maximal size of packet's data
+ * @param maxFps     maximal refresh rate of LEDs (0 if unknown)
+ */
+void MLFProtoLib::getLimits(int& maxPayload, int& maxFps) const {
+    maxPayload = max_payload;
+    maxFps = max_fps;
+}
+
+void MLFProtoLib::getStrips(std::vector<MLFStripInfo>& info) const {
+    std::lock_guard<std::mutex> lock(infoLock);
+    info = strips;
+}
+
+/**
+ * @brief Measure round trip time of packets of different sizes and choose
+ *          chunking of frames accordingly
+ * 
+ * Takes from tens to hundreds of milliseconds. Requires MLF_CAP_LINK_PROBE.
+ * 
+ * @param rounds minimal number of probes per packet size
+ */
+void MLFProtoLib::autoTune(int rounds) {
+    MLFRequest req;
+    req.cmd = MLF_CMD_LINK_PROBE;
+    req.len = rounds;
+
+    requireCaps(MLF_CAP_LINK_PROBE, "link probing");
+    submit(req);
+}
+
+void MLFProtoLib::getLinkStats(MLFLinkStats& stats) {
+    const int bytesPerLed = (caps & MLF_CAP_PIXFMT_RGB24) ? RGB24_BYTES_PER_LED : sizeof(int);
+    int count;
+    {
+        std::lock_guard<std::mutex> lock(infoLock);
+        count = leds_count_top + leds_count_bottom;
+    }
+    std::lock_guard<std::mutex> lock(linkLock);
+
+    stats.tuned = !linkCurve.empty();
+    stats.curve = linkCurve;
+    stats.baseRttUs = linkCurve.empty() ? 0 : linkCurve.front().rttUs;
+    stats.fragmentLeds = 0;
+    stats.fragmentWireBytes = 0;
+
+    // Same choice as made by `sendFrame` for a frame of all LEDs
+    if((caps & MLF_CAP_FRAGMENTS) &&
+       ((caps & MLF_CAP_PIXFMT_RGB24) || count > (int)SET_COLOR_MAX_LEDS)) {
+        stats.fragmentLeds = std::min(chooseFragmentLeds(count, bytesPerLed), count);
+        stats.fragmentWireBytes = MLFPacketSize(FRAGMENT_PAYLOAD(stats.fragmentLeds, bytesPerLed));
+    }
+}
+
 void MLFProtoLib::turnOn(void) {
-    invokeCmd(MLF_CMD_TURN_ON);
+    submitCmd(MLF_CMD_TURN_ON);
 }
 
 void MLFProtoLib::turnOff(void) {
-    invokeCmd(MLF_CMD_TURN_OFF);
+    submitCmd(MLF_CMD_TURN_OFF);
 }
 
 int MLFProtoLib::isTurnedOn(void) {
     struct MLF_resp_cmd_get_on_state on_state;
     int respLen = sizeof(on_state);
 
-    invokeCmd(MLF_CMD_GET_ON_STATE, nullptr, 0, &on_state, &respLen);
-    if(respLen < sizeof(on_state))
+    submitCmd(MLF_CMD_GET_ON_STATE, nullptr, 0, &on_state, &respLen);
+    if(respLen < (int)sizeof(on_state))
         throw MLFException("Failed to request on_state - invalid response size");
     return !!on_state.is_on;
 }
@@ -426,25 +1301,14 @@ void MLFProtoLib::setBrightness(int brightness) {
         .strip = 0b11
     };
 
-    invokeCmd(MLF_CMD_SET_BRIGHTNESS, &data, sizeof data);
+    submitCmd(MLF_CMD_SET_BRIGHTNESS, &data, sizeof data);
 }
 
 void MLFProtoLib::setColors(int* colors, int len) {
-    const int dataLen = sizeof(struct MLF_req_cmd_set_color) + sizeof(int) * len;
-    struct MLF_req_cmd_set_color* data = NULL;
-    data = (struct MLF_req_cmd_set_color*) new char[dataLen];
-
-    memcpy(data->colors, colors, len * sizeof(int));
-
-    try {
-        invokeCmd(MLF_CMD_SET_COLOR, data, dataLen);
-    }
-    catch (...) {
-        delete[] data;
-        throw;
-    }
+    MLF_TRACE_SCOPE("api.setColors", "leds", len);
 
-    delete[] data;
+    // Colors are encoded by I/O thread - `colors` stays valid until it's done
+    submitFrame(colors, len);
 }
 
 void MLFProtoLib::setEffect(int effect, int speed, int strip, int color) {
@@ -455,15 +1319,83 @@ void MLFProtoLib::setEffect(int effect, int speed, int strip, int color) {
         .color = (uint32_t)color,
     };
 
-    invokeCmd(MLF_CMD_SET_EFFECT, &data, sizeof data);
+    submitCmd(MLF_CMD_SET_EFFECT, &data, sizeof data);
+}
+
+/**
+ * @brief Make controller fade to every following frame over `durationMs`
+ *
+ * Frames become keyframes - controller interpolates between them at its
+ *  own refresh rate, so they can be sent at a fraction of output frame
+ *  rate. 0 shows frames immediately. Requires MLF_CAP_TRANSITIONS.
+ */
+void MLFProtoLib::setTransition(int durationMs) {
+    struct MLF_req_cmd_set_transition data = {
+        .duration_ms = (uint16_t)durationMs
+    };
+
+    requireCaps(MLF_CAP_TRANSITIONS, "frame transitions");
+    if(durationMs < 0 || durationMs > UINT16_MAX)
+        throw MLFException("Invalid transition duration");
+
+    submitCmd(MLF_CMD_SET_TRANSITION, &data, sizeof data);
+}
+
+/**
+ * @brief Change type of LEDs (MLF_LED_TYPE) and their number on a strip
+ *
+ * Layout of frame changes with it, so controller info is read again before
+ *  this returns - following frames are sent for the new layout. Requires
+ *  MLF_CAP_STRIP_CONFIG.
+ */
+void MLFProtoLib::setStripConfig(int strip, int ledType, int ledsCount) {
+    struct MLF_req_cmd_set_strip_config data = {
+        .strip = (uint8_t)strip,
+        .led_type = (uint8_t)ledType,
+        .leds_count = (uint16_t)ledsCount
+    };
+    MLFRequest req;
+
+    requireCaps(MLF_CAP_STRIP_CONFIG, "strip configuration");
+    if((strip != STRIP_TOP && strip != STRIP_BOTTOM) || ledsCount <= 0 || ledsCount > UINT16_MAX)
+        throw MLFException("Invalid strip configuration");
+
+    // Controller refuses it inside batch
+    if(threadBatch.owner == this)
+        flushBatch();
+
+    req.cmd = MLF_CMD_SET_STRIP_CONFIG;
+    req.data = &data;
+    req.len = sizeof data;
+    submit(req);
+}
+
+/*
+ * Runs on I/O thread, so no frame is encoded for the old layout afterwards.
+ *  Only the layout of strips changes - capabilities and limits are kept.
+ */
+void MLFProtoLib::setStripConfigIO(MLFRequest* req) {
+    ControllerInfo info;
+
+    invokeCmd(req->cmd, req->data, req->len);
+    getInfo(info);
+
+    // Controller disables flow control on GET_INFO
+    if(flowControl)
+        enableFlowControl();
+
+    std::lock_guard<std::mutex> lock(infoLock);
+    leds_count_top = info.ledsCountTop;
+    leds_count_bottom = info.ledsCountBottom;
+    strips.swap(info.strips);
 }
 
 int MLFProtoLib::getBrightness(void) {
     struct MLF_resp_cmd_get_brightness data = {0};
     int respLen = sizeof(data);
 
-    invokeCmd(MLF_CMD_GET_BRIGHTNESS, NULL, 0, &data, &respLen);
-    if(respLen < sizeof(data))
+    submitCmd(MLF_CMD_GET_BRIGHTNESS, NULL, 0, &data, &respLen);
+    if(respLen < (int)sizeof(data))
         throw MLFException("Failed to get brightness - invalid response size");
 
     return data.brightness;
@@ -473,8 +1405,8 @@ void MLFProtoLib::getEffect(int* effect, int* speed, int* color) {
     struct MLF_resp_cmd_get_effect data = {0};
     int respLen = sizeof(data);
 
-    invokeCmd(MLF_CMD_GET_EFFECT, NULL, 0, &data, &respLen);
-    if(respLen < sizeof(data))
+    submitCmd(MLF_CMD_GET_EFFECT, NULL, 0, &data, &respLen);
+    if(respLen < (int)sizeof(data))
         throw MLFException("Failed to get effect - invalid response size");
     
     if(effect)
@@ -485,20 +1417,204 @@ void MLFProtoLib::getEffect(int* effect, int* speed, int* color) {
         *color = data.color;
 }
 
+/************************************
+ * CLOCK SYNCHRONIZATION
+ ************************************/
+
+/*
+ * Controller's microsecond clock is sampled NTP-style: the sample with the
+ *  shortest round trip gives the best estimation of offset (controller's
+ *  time is assumed to be taken in the middle of round trip). Samples from
+ *  consecutive `syncClock` calls are fitted with a line to get drift.
+ */
+#define CLOCK_MAX_SAMPLES       8
+
+static int64_t ToNs(std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+double MLFProtoLib::hostToDeviceUs(int64_t hostNs) {
+    return clockRefDevUs + (hostNs - clockRefHostNs) / 1000.0 * clockRate;
+}
+
+void MLFProtoLib::addClockSample(int64_t hostNs, uint32_t devUs) {
+    ClockSample sample = { hostNs, devUs };
+    double sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+
+    // Controller's clock is 32-bit only - unwrap it using current estimation
+    if(!clockSamples.empty()) {
+        int64_t predicted = (int64_t) hostToDeviceUs(hostNs);
+        sample.devUs = predicted + (int32_t)(devUs - (uint32_t)predicted);
+    }
+
+    if(clockSamples.size() >= CLOCK_MAX_SAMPLES)
+        clockSamples.erase(clockSamples.begin());
+    clockSamples.push_back(sample);
+
+    // Least squares fit relative to the newest sample (keeps precision)
+    for(auto& s : clockSamples) {
+        double x = (s.hostNs - sample.hostNs) / 1000.0;
+        double y = s.devUs - sample.devUs;
+        sumX += x;
+        sumY += y;
+        sumXX += x * x;
+        sumXY += x * y;
+    }
+
+    const double n = clockSamples.size();
+    const double det = n * sumXX - sumX * sumX;
+    clockRate = (n > 1 && det > 0) ? (n * sumXY - sumX * sumY) / det : 1.0;
+    clockRefHostNs = sample.hostNs;
+    clockRefDevUs = sample.devUs + (sumY - clockRate * sumX) / n;
+}
+
+/**
+ * @brief Estimate offset and drift between host and controller clocks
+ * 
+ * Should be called periodically (e.g. every few seconds) to keep the drift
+ *  estimation up to date.
+ * 
+ * @param rounds number of round trips used for this measurement
+ */
+void MLFProtoLib::syncClock(int rounds) {
+    struct MLF_resp_cmd_get_clock clock;
+    int64_t bestRtt = INT64_MAX, bestHostNs = 0;
+    uint32_t bestDevUs = 0;
+
+    requireCaps(MLF_CAP_CLOCK_SYNC, "clock synchronization");
+    for(int i = 0; i < rounds; i++) {
+        MLFRequest req;
+        int respLen = sizeof(clock);
+        req.cmd = MLF_CMD_GET_CLOCK;
+        req.resp = &clock;
+        req.respLen = &respLen;
+
+        submit(req);
+        if(respLen < (int)sizeof(clock))
+            throw MLFException("Failed to get clock - invalid response size");
+
+        const int64_t rtt = ToNs(req.doneAt) - ToNs(req.sentAt);
+        if(rtt < bestRtt) {
+            bestRtt = rtt;
+            bestHostNs = ToNs(req.sentAt) + rtt / 2;
+            bestDevUs = clock.time_us;
+        }
+    }
+
+    if(rounds > 0) {
+        std::lock_guard<std::mutex> lock(clockLock);
+        addClockSample(bestHostNs, bestDevUs);
+    }
+}
+
+bool MLFProtoLib::isClockSynced(void) {
+    std::lock_guard<std::mutex> lock(clockLock);
+    return !clockSamples.empty();
+}
+
+/**
+ * @brief Get current estimation of controller's clock
+ * 
+ * @param offsetUs controller time minus host time (in microseconds)
+ * @param driftPpm how much faster controller's clock runs
+ */
+void MLFProtoLib::getClockSync(double& offsetUs, double& driftPpm) {
+    std::lock_guard<std::mutex> lock(clockLock);
+    const int64_t now = ToNs(std::chrono::steady_clock::now());
+
+    offsetUs = hostToDeviceUs(now) - now / 1000.0;
+    driftPpm = (clockRate - 1.0) * 1e6;
+}
+
+/**
+ * @brief Set colors of all LEDs at the given point in time
+ * 
+ * Requires clock to be synchronized with `syncClock` first. Controller
+ *  keeps only a few scheduled frames - don't schedule them too early.
+ */
+void MLFProtoLib::setColorsAt(int* colors, int len, std::chrono::steady_clock::time_point when) {
+    struct MLF_req_cmd_set_color_at* data;
+    std::vector<char> buffer(sizeof(*data) + sizeof(int) * len);
+    data = (struct MLF_req_cmd_set_color_at*) buffer.data();
+
+    requireCaps(MLF_CAP_CLOCK_SYNC, "scheduled presentation");
+    {
+        std::lock_guard<std::mutex> lock(clockLock);
+        if(clockSamples.empty())
+            throw MLFException("Failed to schedule colors - clock is not synchronized");
+        data->present_at_us = (uint32_t)(int64_t) hostToDeviceUs(ToNs(when));
+    }
+    memcpy(data->colors, colors, len * sizeof(int));
+
+    submitCmd(MLF_CMD_SET_COLOR_AT, buffer.data(), buffer.size());
+}
+
+void MLFProtoLib::getPresentStats(MLFPresentStats& stats) {
+    struct MLF_resp_cmd_get_present_stats data = {0};
+    int respLen = sizeof(data);
+
+    requireCaps(MLF_CAP_CLOCK_SYNC, "scheduled presentation");
+    submitCmd(MLF_CMD_GET_PRESENT_STATS, NULL, 0, &data, &respLen);
+    if(respLen < (int)sizeof(data))
+        throw MLFException("Failed to get presentation stats - invalid response size");
+
+    stats.presented = data.presented;
+    stats.late = data.late;
+    stats.dropped = data.dropped;
+    stats.jitterMinUs = data.jitter_min_us;
+    stats.jitterMaxUs = data.jitter_max_us;
+    stats.jitterAvgUs = data.jitter_avg_us;
+}
+
+/************************************
+ * TRACING
+ ************************************/
+
+/**
+ * @brief Start or stop recording of trace events (process-wide)
+ * 
+ * Events are recorded only if library was built with MLF_TRACE option.
+ *  Each thread keeps its newest events in its own ring.
+ */
+void MLFProtoLib::setTracing(bool enabled) {
+    MLFTrace::enable(enabled);
+}
+
+void MLFProtoLib::clearTrace(void) {
+    MLFTrace::clear();
+}
+
+/**
+ * @brief Write recorded events in Chrome trace format (chrome://tracing,
+ *          ui.perfetto.dev)
+ */
+void MLFProtoLib::dumpTrace(const std::string& path) {
+    if(!MLFTrace::dump(path))
+        throw MLFException("failed to write trace file", true);
+}
+
 /************************************
  * C bindings
  ************************************/
 struct MLF_C_Object {
     MLFProtoLib* instance;
-    const char* exceptionMessage;
 };
 
+/*
+ * Handle may be shared between threads, so the last error is kept per
+ *  thread - each caller sees the status of its own calls only
+ */
+static thread_local std::string lastError;
+
+static void setLastError(std::exception& ex) {
+    lastError = ex.what();
+}
+
 
 MLF_handler MLFProtoLib_Init(char* path) {
     try {
         MLF_handler handle = new MLF_C_Object;
         handle->instance = new MLFProtoLib(path);
-        handle->exceptionMessage = NULL;
         return handle;
     }
     catch (std::exception& ex) {
@@ -513,7 +1629,6 @@ void MLFProtoLib_Deinit(MLF_handler handle) {
         return;
     
     try {
-        free((void*) handle->exceptionMessage);
         delete handle->instance;
         delete handle;
     }
@@ -549,9 +1664,7 @@ int MLFProtoLib_TurnOn(MLF_handler handle) {
     try {
         handle->instance->turnOn();
     } catch (std::exception& ex) {
-        if(handle->exceptionMessage)
-            free((void*) handle->exceptionMessage);
-        handle->exceptionMessage = strdup(ex.what());
+        setLastError(ex);
         return -1;
     }
     return 0;
@@ -563,9 +1676,7 @@ int MLFProtoLib_TurnOff(MLF_handler handle) {
         return 0;
     }
     catch (std::exception& ex) {
-        if(handle->exceptionMessage)
-            free((void*) handle->exceptionMessage);
-        handle->exceptionMessage = strdup(ex.what());
+        setLastError(ex);
         return -1;
     }
 }
@@ -576,9 +1687,7 @@ int MLFProtoLib_IsTurnedOn(MLF_handler handle) {
     try {
         result = handle->instance->isTurnedOn();
     } catch (std::exception& ex) {
-        if(handle->exceptionMessage)
-            free((void*) handle->exceptionMessage);
-        handle->exceptionMessage = strdup(ex.what());
+        setLastError(ex);
         return -1;
     }
 
@@ -591,9 +1700,7 @@ int MLFProtoLib_SetBrightness(MLF_handler handle, int val) {
         return 0;
     }
     catch (std::exception& ex) {
-        if(handle->exceptionMessage)
-            free((void*) handle->exceptionMessage);
-        handle->exceptionMessage = strdup(ex.what());
+        setLastError(ex);
         return -1;
     }
 }
@@ -604,9 +1711,7 @@ int MLFProtoLib_SetColors(MLF_handler handle, int* colors, int len) {
         return 0;
     }
     catch (std::exception& ex) {
-        if(handle->exceptionMessage)
-            free((void*) handle->exceptionMessage);
-        handle->exceptionMessage = strdup(ex.what());
+        setLastError(ex);
         return -1;
     }
 }
@@ -617,9 +1722,29 @@ int MLFProtoLib_SetEffect(MLF_handler handle, int effect, int speed, int strip,
         return 0;
     }
     catch (std::exception& ex) {
-        if(handle->exceptionMessage)
-            free((void*) handle->exceptionMessage);
-        handle->exceptionMessage = strdup(ex.what());
+        setLastError(ex);
+        return -1;
+    }
+}
+
+int MLFProtoLib_SetTransition(MLF_handler handle, int durationMs) {
+    try {
+        handle->instance->setTransition(durationMs);
+        return 0;
+    }
+    catch (std::exception& ex) {
+        setLastError(ex);
+        return -1;
+    }
+}
+
+int MLFProtoLib_SetStripConfig(MLF_handler handle, int strip, int ledType, int ledsCount) {
+    try {
+        handle->instance->setStripConfig(strip, ledType, ledsCount);
+        return 0;
+    }
+    catch (std::exception& ex) {
+        setLastError(ex);
         return -1;
     }
 }
@@ -629,9 +1754,7 @@ int MLFProtoLib_GetBrightness(MLF_handler handle) {
     try {
         result = handle->instance->getBrightness();
     } catch (std::exception& ex) {
-        if(handle->exceptionMessage)
-            free((void*) handle->exceptionMessage);
-        handle->exceptionMessage = strdup(ex.what());
+        setLastError(ex);
         return -1;
     }
     return result;
@@ -641,14 +1764,123 @@ int MLFProtoLib_GetEffect(MLF_handler handle, int* effect, int* speed, int* colo
     try {
         handle->instance->getEffect(effect, speed, color);
     } catch (std::exception& ex) {
-        if(handle->exceptionMessage)
-            free((void*) handle->exceptionMessage);
-        handle->exceptionMessage = strdup(ex.what());
+        setLastError(ex);
         return -1;
     }
     return 0;
 }
 
+int MLFProtoLib_GetCapabilities(MLF_handler handle, int* protocolVersion, unsigned int* capabilities) {
+    try {
+        int ver;
+        uint32_t c;
+        handle->instance->getProtocolVersion(ver);
+        handle->instance->getCapabilities(c);
+        *protocolVersion = ver;
+        *capabilities = c;
+        return 0;
+    }
+    catch (std::exception& ex) {
+        setLastError(ex);
+        return -1;
+    }
+}
+
+int MLFProtoLib_AutoTune(MLF_handler handle, int rounds) {
+    try {
+        handle->instance->autoTune(rounds);
+        return 0;
+    }
+    catch (std::exception& ex) {
+        setLastError(ex);
+        return -1;
+    }
+}
+
+int MLFProtoLib_GetLinkStats(MLF_handler handle, int* fragmentLeds, int* payloadBytes,
+                             double* rttUs, int maxSamples) {
+    try {
+        MLFLinkStats stats;
+        handle->instance->getLinkStats(stats);
+
+        const int count = std::min<int>(stats.curve.size(), maxSamples);
+        for(int i = 0; i < count; i++) {
+            payloadBytes[i] = stats.curve[i].payloadBytes;
+            rttUs[i] = stats.curve[i].rttUs;
+        }
+        *fragmentLeds = stats.fragmentLeds;
+        return count;
+    }
+    catch (std::exception& ex) {
+        setLastError(ex);
+        return -1;
+    }
+}
+
+void MLFProtoLib_SetTracing(int enabled) {
+    MLFProtoLib::setTracing(enabled);
+}
+
+int MLFProtoLib_DumpTrace(const char* path) {
+    try {
+        MLFProtoLib::dumpTrace(path);
+        return 0;
+    }
+    catch (std::exception& ex) {
+        setLastError(ex);
+        return -1;
+    }
+}
+
+int MLFProtoLib_BeginBatch(MLF_handler handle) {
+    try {
+        handle->instance->beginBatch();
+        return 0;
+    }
+    catch (std::exception& ex) {
+        setLastError(ex);
+        return -1;
+    }
+}
+
+int MLFProtoLib_EndBatch(MLF_handler handle) {
+    try {
+        handle->instance->endBatch();
+        return 0;
+    }
+    catch (std::exception& ex) {
+        setLastError(ex);
+        return -1;
+    }
+}
+
 const char* MLFProtoLib_GetError(MLF_handler handle) {
-    return handle->exceptionMessage;
+    if(lastError.empty())
+        return NULL;
+    return lastError.c_str();
+}
+
+int MLFProtoLib_SyncClock(MLF_handler handle, int rounds) {
+    try {
+        handle->instance->syncClock(rounds);
+        return 0;
+    }
+    catch (std::exception& ex) {
+        setLastError(ex);
+        return -1;
+    }
+}
+
+int MLFProtoLib_SetColorsAt(MLF_handler handle, int* colors, int len, long long presentAtNs) {
+    try {
+        std::chrono::steady_clock::time_point when(
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::nanoseconds(presentAtNs)));
+        handle->instance->setColorsAt(colors, len, when);
+        return 0;
+    }
+    catch (std::exception& ex) {
+        setLastError(ex);
+        return -1;
+    }
 }
@@ -51,6 +51,56 @@ void MLFProtoLib_GetFWVersion(MLF_handler handle, int* version);
  */
 void MLFProtoLib_GetLedsCount(MLF_handler handle, int* top, int* bottom);
 
+/**
+ * @brief Retrieve protocol version and features supported by controller
+ * 
+ * @param handle          MLFProtoLib handler
+ * @param protocolVersion version of MLF protocol (1 for older firmware)
+ * @param capabilities    bitmap of MLF_CAP_* flags (see mlf_protocol.h)
+ * @return int            0 on success, -1 otherwise
+ */
+int MLFProtoLib_GetCapabilities(MLF_handler handle, int* protocolVersion, unsigned int* capabilities);
+
+/**
+ * @brief Measure round trip time of packets of different sizes and choose
+ *          chunking of frames accordingly (requires MLF_CAP_LINK_PROBE)
+ * 
+ * @param handle MLFProtoLib handler
+ * @param rounds minimal number of probes per packet size
+ * @return int   0 on success, -1 otherwise
+ */
+int MLFProtoLib_AutoTune(MLF_handler handle, int rounds);
+
+/**
+ * @brief Start or stop recording of trace events in all MLFProtoLib objects
+ * 
+ * @param enabled 0 - stop, 1 - start
+ */
+void MLFProtoLib_SetTracing(int enabled);
+
+/**
+ * @brief Write recorded trace events in Chrome trace / Perfetto JSON format
+ * 
+ * @param path   output file
+ * @return int   0 on success, -1 otherwise
+ */
+int MLFProtoLib_DumpTrace(const char* path);
+
+/**
+ * @brief Retrieve round trip time curve measured by MLFProtoLib_AutoTune
+ * 
+ * @param handle       MLFProtoLib handler
+ * @param fragmentLeds LEDs per fragment chosen for frame of all LEDs (0 if
+ *                      such frame fits into a single packet)
+ * @param payloadBytes array of at least `maxSamples` sizes of packet's data
+ * @param rttUs        array of at least `maxSamples` round trip times
+ * @param maxSamples   size of both arrays
+ * @return int         number of stored samples (0 if link wasn't tuned),
+ *                      -1 in case of an error
+ */
+int MLFProtoLib_GetLinkStats(MLF_handler handle, int* fragmentLeds, int* payloadBytes,
+                             double* rttUs, int maxSamples);
+
 /**
  * @brief Bring back all LEDs to the state from before calling
  *          MLFProtoLib_TurnOff
@@ -107,6 +157,29 @@ int MLFProtoLib_SetColors(MLF_handler handle, int* colors, int len);
  */
 int MLFProtoLib_SetEffect(MLF_handler handle, int effect, int speed, int strip, int color);
 
+/**
+ * @brief Fade LEDs to every following frame over given time
+ *          (requires MLF_CAP_TRANSITIONS)
+ * 
+ * @param handle     MLFProtoLib handler
+ * @param durationMs transition time in milliseconds, 0 to show frames
+ *                    immediately
+ * @return int       0 on success, -1 otherwise
+ */
+int MLFProtoLib_SetTransition(MLF_handler handle, int durationMs);
+
+/**
+ * @brief Change type and number of LEDs of a single strip
+ *          (requires MLF_CAP_STRIP_CONFIG)
+ * 
+ * @param handle    MLFProtoLib handler
+ * @param strip     target strip (1 - top, 2 - bottom)
+ * @param ledType   0 - WS2812B, 1 - APA102/SK9822, 2 - SK6812 RGBW
+ * @param ledsCount number of LEDs, up to capacity of firmware
+ * @return int      0 on success, -1 otherwise
+ */
+int MLFProtoLib_SetStripConfig(MLF_handler handle, int strip, int ledType, int ledsCount);
+
 /**
  * @brief Acquire currently set brightness from MegaLeaf controller
  * 
@@ -126,10 +199,53 @@ int MLFProtoLib_GetBrightness(MLF_handler handle);
 int MLFProtoLib_GetEffect(MLF_handler handle, int* effect, int* speed, int* color);
 
 /**
- * @brief Retrieve the last error reported by library
+ * @brief Start collecting commands without response (brightness, effects,
+ *          on/off state) issued by the calling thread
+ * 
+ * @param handle MLFProtoLib handler
+ * @return int   0 on success, -1 otherwise
+ */
+int MLFProtoLib_BeginBatch(MLF_handler handle);
+
+/**
+ * @brief Send commands collected since MLFProtoLib_BeginBatch in a single
+ *          packet - controller applies all of them at once
+ * 
+ * @param handle MLFProtoLib handler
+ * @return int   0 on success, -1 otherwise
+ */
+int MLFProtoLib_EndBatch(MLF_handler handle);
+
+/**
+ * @brief Estimate offset and drift of controller's clock. Has to be called
+ *          before MLFProtoLib_SetColorsAt and should be repeated periodically
+ * 
+ * @param handle MLFProtoLib handler
+ * @param rounds number of round trips used for the measurement
+ * @return int   0 on success, -1 otherwise
+ */
+int MLFProtoLib_SyncClock(MLF_handler handle, int rounds);
+
+/**
+ * @brief Set color of all LEDS at the given point in time
+ * 
+ * @param handle      MLFProtoLib handler
+ * @param colors      array of integers representing color of each LED
+ * @param len         number of elements in `colors`
+ * @param presentAtNs time of presentation (CLOCK_MONOTONIC, nanoseconds)
+ * @return int        0 on success, -1 otherwise
+ */
+int MLFProtoLib_SetColorsAt(MLF_handler handle, int* colors, int len, long long presentAtNs);
+
+/**
+ * @brief Retrieve the last error reported by library to the calling thread
+ * 
+ * Handler can be shared between threads - each of them gets the error of
+ *  its own failed call only.
  * 
  * @param handle MLFProtoLib handler
- * @return const char* string containing error content
+ * @return const char* string containing error content (valid until the next
+ *          failed call in this thread) or NULL if no error occurred
  */
 const char* MLFProtoLib_GetError(MLF_handler handle);
 
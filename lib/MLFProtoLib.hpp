@@ -1,5 +1,15 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include "MLFCommandQueue.hpp"
 
 /**
  * @brief 
@@ -15,8 +25,71 @@ public:
 };
 
 /**
- * @brief 
+ * @brief Statistics of frames presented with `setColorsAt`
  * 
+ * Jitter is the difference between actual and requested presentation time
+ *  measured by controller.
+ */
+struct MLFPresentStats {
+    int presented;
+    int late;
+    int dropped;
+    int jitterMinUs;
+    int jitterMaxUs;
+    int jitterAvgUs;
+};
+
+/**
+ * @brief Description of a single LED strip reported by controller
+ * 
+ * `firstLed` is the index of strip's first LED in colors passed to
+ *  `setColors`.
+ */
+struct MLFStripInfo {
+    int strip;
+    int ledType;
+    int ledsCount;
+    int firstLed;
+};
+
+/**
+ * @brief Round trip time of a single packet size measured by `autoTune`
+ * 
+ * `wireBytes` includes header and footer of packet. `rttUs` is the average
+ *  time per packet, when packets are sent one after another.
+ */
+struct MLFLinkSample {
+    int payloadBytes;
+    int wireBytes;
+    double rttUs;
+    double throughputKBps;
+};
+
+/**
+ * @brief Characteristics of the link and chunking of frames chosen for it
+ * 
+ * `fragmentLeds` is the number of LEDs per fragment used for a frame of all
+ *  LEDs (0 if such frame is sent in a single packet).
+ */
+struct MLFLinkStats {
+    bool tuned;
+    double baseRttUs;
+    int fragmentLeds;
+    int fragmentWireBytes;
+    std::vector<MLFLinkSample> curve;
+};
+
+/**
+ * @brief Connection to MegaLeaf controller
+ *
+ * Object can be safely shared between threads. Every command is put into
+ *  a lock-free queue and executed by a single I/O thread owning the device.
+ *  Control commands always go before pending frames, and a frame set with
+ *  `setColors` may be superseded by a newer one before being sent.
+ *  Commands without response queued at the same time by different threads
+ *  (or issued between `beginBatch` and `endBatch`) are sent in a single
+ *  MLF_CMD_BATCH packet. Calls of a single thread outside of a batch are
+ *  blocking, so they are never coalesced.
  */
 class MLFProtoLib {
     /* Char device used to communicate with device */
@@ -25,9 +98,75 @@ class MLFProtoLib {
     /* Path to file pointed by `dev` member (for debug purpose) */
     std::string device_name;
 
-    int leds_count_top, leds_count_bottom;
+    /* Reported by GET_INFO */
+    struct ControllerInfo {
+        int fwVersion;
+        int protocolVersion;
+        uint32_t caps;
+        int maxPayload;
+        int maxFps;
+        int ledsCountTop, ledsCountBottom;
+        std::vector<MLFStripInfo> strips;
+    };
+
     int fw_version;
 
+    /* Negotiated with GET_INFO (older firmware reports version 1), never
+       changed once I/O thread is started */
+    int protocol_version = 1;
+    uint32_t caps = 0;
+    int max_payload = 0;
+    int max_fps = 0;
+
+    /* Layout of strips - replaced by I/O thread after SET_STRIP_CONFIG,
+       so read under `infoLock` by other threads */
+    mutable std::mutex infoLock;
+    int leds_count_top, leds_count_bottom;
+    std::vector<MLFStripInfo> strips;
+
+    /* Packet being sent */
+    std::vector<char> sendBuffer;
+
+    /* Data of the last received packet */
+    std::vector<char> recvBuffer;
+
+    /* Encoded frame (or its fragment) being sent */
+    std::vector<char> frameBuffer;
+    uint8_t frameId = 0;
+
+    /* Measured by `probeLink` (written by I/O thread only) and chunking
+       of the last frame */
+    std::mutex linkLock;
+    std::vector<MLFLinkSample> linkCurve;
+    int chunkCount = -1, chunkBytesPerLed = 0, chunkLeds = 0;
+
+    /* Credit-based flow control (accessed by I/O thread only) */
+    bool flowControl = false;
+    int flowCredits = 0;
+    std::chrono::steady_clock::time_point creditWaitStart;
+
+    /* Estimation of controller's clock (see `syncClock`) */
+    struct ClockSample {
+        int64_t hostNs;
+        int64_t devUs;
+    };
+    std::mutex clockLock;
+    std::vector<ClockSample> clockSamples;
+    int64_t clockRefHostNs = 0;
+    double clockRefDevUs = 0;
+    double clockRate = 1.0;
+
+    /* Multi-thread support */
+    MLFCommandQueue controlQueue;
+    MLFRequest* heldRequest = nullptr;
+    std::vector<char> batchBuffer;
+    std::atomic<MLFRequest*> pendingFrame {nullptr};
+    std::atomic<bool> ioIdle {false};
+    std::atomic<bool> ioStop {false};
+    std::mutex doorbellLock, completionLock;
+    std::condition_variable doorbell, completion;
+    std::thread ioThread;
+
 
     void _read(void* data, size_t len);
     void _write(void* data, size_t len);
@@ -35,18 +174,59 @@ class MLFProtoLib {
     int  _calcCRC(void* data, int len);
     int  _appendCRC(int crc, void* data, int len);
     void _sendData(int cmd, void* data = nullptr, int len = 0);
+    int  _recvPacket(void);
     int  _recvData(void* output = NULL, int outputLen = 0, int* actualLen = 0);
+    void _handleEvent(int event);
+    void _pollEvents(int timeoutMs);
     void invokeCmd(int cmd, void* data = nullptr, int len = 0);
     void invokeCmd(int cmd, void* data, int len, void* resp, int* respLen);
 
     void errorToException(const char* message, int error);
 
+    void getInfo(ControllerInfo& info);
+    void requireCaps(uint32_t required, const char* feature) const;
+    void enableFlowControl(void);
+    bool frameSlotAvailable(void);
+    void sendFramePacket(int cmd, int len, bool last);
+    void sendFrameRGB32(const int* colors, int count);
+    void sendFrameFragments(const int* colors, int count, bool rgb24);
+    int  chooseFragmentLeds(int count, int bytesPerLed) const;
+    int  fragmentLeds(int count, int bytesPerLed);
+    double predictRttUs(int payload) const;
+    void probeLink(int rounds);
+    void sendFrame(MLFRequest* req);
+
+    bool isBatchable(MLFRequest* req) const;
+    int  collectBatch(MLFRequest* first, MLFRequest** reqs);
+    void sendBatch(MLFRequest** reqs, int count);
+    void flushBatch(void);
+    void setStripConfigIO(MLFRequest* req);
+
+    void ioLoop(void);
+    void ringDoorbell(void);
+    void complete(MLFRequest* req);
+    void waitFor(MLFRequest& req);
+    void submit(MLFRequest& req);
+    void submitCmd(int cmd, void* data = nullptr, int len = 0,
+                   void* resp = nullptr, int* respLen = nullptr);
+    void submitFrame(int* colors, int len);
+
+    void addClockSample(int64_t hostNs, uint32_t devUs);
+    double hostToDeviceUs(int64_t hostNs);
+
 public:
-    MLFProtoLib(std::string path = "");
+    MLFProtoLib(std::string path = "", bool tuneLink = false);
     ~MLFProtoLib();
 
     void getFWVersion(int& version) const;
     void getLedsCount(int& top, int& bottom) const;
+    void getProtocolVersion(int& version) const;
+    void getCapabilities(uint32_t& capabilities) const;
+    void getLimits(int& maxPayload, int& maxFps) const;
+    void getStrips(std::vector<MLFStripInfo>& info) const;
+
+    void autoTune(int rounds = 5);
+    void getLinkStats(MLFLinkStats& stats);
 
     void turnOn(void);
     void turnOff(void);
@@ -55,7 +235,22 @@ public:
     void setBrightness(int brightness);
     void setColors(int* colors, int len);
     void setEffect(int effect, int speed, int strip, int color);
+    void setTransition(int durationMs);
+    void setStripConfig(int strip, int ledType, int ledsCount);
 
     int getBrightness(void);
     void getEffect(int* effect, int* speed, int* color);
+
+    void beginBatch(void);
+    void endBatch(void);
+
+    void syncClock(int rounds = 8);
+    bool isClockSynced(void);
+    void getClockSync(double& offsetUs, double& driftPpm);
+    void setColorsAt(int* colors, int len, std::chrono::steady_clock::time_point when);
+    void getPresentStats(MLFPresentStats& stats);
+
+    static void setTracing(bool enabled);
+    static void clearTrace(void);
+    static void dumpTrace(const std::string& path);
 };
@@ -3,7 +3,7 @@
 """
 
 from ctypes import *
-from typing import Final, Tuple
+from typing import Final, List, Tuple
 
 __author__ = 'Pawel Wieczorek'
 
@@ -28,6 +28,27 @@ _MLF_LIBRARY.MLFProtoLib_GetFWVersion.argtypes = [c_void_p, c_void_p]
 _MLF_LIBRARY.MLFProtoLib_GetLedsCount.restype = None
 _MLF_LIBRARY.MLFProtoLib_GetLedsCount.argtypes = [c_void_p, c_void_p, c_void_p]
 
+#   int MLFProtoLib_GetCapabilities(MLF_handler handle, int* protocolVersion, unsigned int* capabilities)
+_MLF_LIBRARY.MLFProtoLib_GetCapabilities.restype = c_int
+_MLF_LIBRARY.MLFProtoLib_GetCapabilities.argtypes = [c_void_p, c_void_p, c_void_p]
+
+#   int MLFProtoLib_AutoTune(MLF_handler handle, int rounds)
+_MLF_LIBRARY.MLFProtoLib_AutoTune.restype = c_int
+_MLF_LIBRARY.MLFProtoLib_AutoTune.argtypes = [c_void_p, c_int]
+
+#   int MLFProtoLib_GetLinkStats(MLF_handler handle, int* fragmentLeds, int* payloadBytes,
+#                                double* rttUs, int maxSamples)
+_MLF_LIBRARY.MLFProtoLib_GetLinkStats.restype = c_int
+_MLF_LIBRARY.MLFProtoLib_GetLinkStats.argtypes = [c_void_p, c_void_p, c_void_p, c_void_p, c_int]
+
+#   void MLFProtoLib_SetTracing(int enabled)
+_MLF_LIBRARY.MLFProtoLib_SetTracing.restype = None
+_MLF_LIBRARY.MLFProtoLib_SetTracing.argtypes = [c_int]
+
+#   int MLFProtoLib_DumpTrace(const char* path)
+_MLF_LIBRARY.MLFProtoLib_DumpTrace.restype = c_int
+_MLF_LIBRARY.MLFProtoLib_DumpTrace.argtypes = [c_char_p]
+
 #   int MLFProtoLib_TurnOn(MLF_handler handle)
 _MLF_LIBRARY.MLFProtoLib_TurnOn.restype = c_int
 _MLF_LIBRARY.MLFProtoLib_TurnOn.argtypes = [c_void_p]
@@ -52,6 +73,14 @@ _MLF_LIBRARY.MLFProtoLib_SetColors.argtypes = [c_void_p, c_void_p, c_int]
 _MLF_LIBRARY.MLFProtoLib_SetEffect.restype = c_int
 _MLF_LIBRARY.MLFProtoLib_SetEffect.argtypes = [c_void_p, c_int, c_int, c_int, c_int]
 
+#   int MLFProtoLib_SetTransition(MLF_handler handle, int durationMs)
+_MLF_LIBRARY.MLFProtoLib_SetTransition.restype = c_int
+_MLF_LIBRARY.MLFProtoLib_SetTransition.argtypes = [c_void_p, c_int]
+
+#   int MLFProtoLib_SetStripConfig(MLF_handler handle, int strip, int ledType, int ledsCount)
+_MLF_LIBRARY.MLFProtoLib_SetStripConfig.restype = c_int
+_MLF_LIBRARY.MLFProtoLib_SetStripConfig.argtypes = [c_void_p, c_int, c_int, c_int]
+
 #   int MLFProtoLib_GetBrightness(MLF_handler handle)
 _MLF_LIBRARY.MLFProtoLib_GetBrightness.restype = c_int
 _MLF_LIBRARY.MLFProtoLib_GetBrightness.argtypes = [c_void_p]
@@ -60,6 +89,22 @@ _MLF_LIBRARY.MLFProtoLib_GetBrightness.argtypes = [c_void_p]
 _MLF_LIBRARY.MLFProtoLib_GetEffect.restype = c_int
 _MLF_LIBRARY.MLFProtoLib_GetEffect.argtypes = [c_void_p, c_void_p, c_void_p, c_void_p]
 
+#   int MLFProtoLib_SyncClock(MLF_handler handle, int rounds)
+_MLF_LIBRARY.MLFProtoLib_SyncClock.restype = c_int
+_MLF_LIBRARY.MLFProtoLib_SyncClock.argtypes = [c_void_p, c_int]
+
+#   int MLFProtoLib_SetColorsAt(MLF_handler handle, int* colors, int len, long long presentAtNs)
+_MLF_LIBRARY.MLFProtoLib_SetColorsAt.restype = c_int
+_MLF_LIBRARY.MLFProtoLib_SetColorsAt.argtypes = [c_void_p, c_void_p, c_int, c_longlong]
+
+#   int MLFProtoLib_BeginBatch(MLF_handler handle)
+_MLF_LIBRARY.MLFProtoLib_BeginBatch.restype = c_int
+_MLF_LIBRARY.MLFProtoLib_BeginBatch.argtypes = [c_void_p]
+
+#   int MLFProtoLib_EndBatch(MLF_handler handle)
+_MLF_LIBRARY.MLFProtoLib_EndBatch.restype = c_int
+_MLF_LIBRARY.MLFProtoLib_EndBatch.argtypes = [c_void_p]
+
 #  const char* MLFProtoLib_GetError(MLF_handler handle)
 _MLF_LIBRARY.MLFProtoLib_GetError.resType = c_char_p
 _MLF_LIBRARY.MLFProtoLib_GetError.argtypes = [c_void_p]
@@ -94,6 +139,41 @@ class MLFProto:
         _MLF_LIBRARY.MLFProtoLib_GetLedsCount(self._handle, byref(top), byref(bottom))
         return (top.value, bottom.value)
 
+    def getCapabilities(self) -> Tuple[int, int]:
+        version = c_int()
+        caps = c_uint()
+        ret = _MLF_LIBRARY.MLFProtoLib_GetCapabilities(self._handle, byref(version), byref(caps))
+        if ret != 0:
+            raise MLFException("Failed to get capabilities of MLF panel" + self._getError())
+        return (version.value, caps.value)
+
+    def autoTune(self, rounds: int = 5) -> None:
+        ret = _MLF_LIBRARY.MLFProtoLib_AutoTune(self._handle, rounds)
+        if ret != 0:
+            raise MLFException("Failed to tune link to MLF panel" + self._getError())
+
+    def getLinkStats(self) -> Tuple[int, List[Tuple[int, float]]]:
+        """ Returns LEDs per fragment and (payload bytes, round trip us) curve """
+        maxSamples = 64
+        fragmentLeds = c_int()
+        payloadBytes = (c_int * maxSamples)()
+        rttUs = (c_double * maxSamples)()
+        count = _MLF_LIBRARY.MLFProtoLib_GetLinkStats(self._handle, byref(fragmentLeds),
+                                                      payloadBytes, rttUs, maxSamples)
+        if count < 0:
+            raise MLFException("Failed to get link stats" + self._getError())
+        return (fragmentLeds.value, [(payloadBytes[i], rttUs[i]) for i in range(count)])
+
+    @staticmethod
+    def setTracing(enabled: bool) -> None:
+        _MLF_LIBRARY.MLFProtoLib_SetTracing(1 if enabled else 0)
+
+    def dumpTrace(self, path: str) -> None:
+        """ Writes trace events in Chrome trace format (ui.perfetto.dev) """
+        ret = _MLF_LIBRARY.MLFProtoLib_DumpTrace(path.encode())
+        if ret != 0:
+            raise MLFException("Failed to dump trace" + self._getError())
+
     def turnOn(self) -> None:
         ret = _MLF_LIBRARY.MLFProtoLib_TurnOn(self._handle)
         if ret != 0:
@@ -122,12 +202,45 @@ class MLFProto:
         if ret != 0:
             raise MLFException("Failed to change color of MLF panel" + self._getError())
 
+    def setTransition(self, durationMs: int) -> None:
+        ret = _MLF_LIBRARY.MLFProtoLib_SetTransition(self._handle, durationMs)
+        if ret != 0:
+            raise MLFException("Failed to set transition of MLF panel" + self._getError())
+
+    def setStripConfig(self, strip: int, ledType: int, ledsCount: int) -> None:
+        ret = _MLF_LIBRARY.MLFProtoLib_SetStripConfig(self._handle, strip, ledType, ledsCount)
+        if ret != 0:
+            raise MLFException("Failed to configure strip of MLF panel" + self._getError())
+
+    def syncClock(self, rounds: int = 8) -> None:
+        ret = _MLF_LIBRARY.MLFProtoLib_SyncClock(self._handle, rounds)
+        if ret != 0:
+            raise MLFException("Failed to synchronize clock with MLF panel" + self._getError())
+
+    def setColorsAt(self, colors, presentAtNs: int) -> None:
+        """ presentAtNs is expressed in time.monotonic_ns() units """
+        dst = c_int * len(colors)
+        dst = dst(*colors)
+        ret = _MLF_LIBRARY.MLFProtoLib_SetColorsAt(self._handle, byref(dst), len(dst), presentAtNs)
+        if ret != 0:
+            raise MLFException("Failed to schedule colors on MLF panel" + self._getError())
 
     def setEffect(self, effect: 'MLFEffect', speed: int = 0, strip: int = 0b11, color: int = 0):
         ret = _MLF_LIBRARY.MLFProtoLib_SetEffect(self._handle, effect, speed, strip, color)
         if ret != 0:
             raise MLFException("Failed to set effect on MLF panel" + self._getError())
 
+    def beginBatch(self) -> None:
+        """ Commands issued until endBatch are applied by controller at once """
+        ret = _MLF_LIBRARY.MLFProtoLib_BeginBatch(self._handle)
+        if ret != 0:
+            raise MLFException("Failed to begin batch" + self._getError())
+
+    def endBatch(self) -> None:
+        ret = _MLF_LIBRARY.MLFProtoLib_EndBatch(self._handle)
+        if ret != 0:
+            raise MLFException("Failed to send batch to MLF panel" + self._getError())
+
     def getBrightness(self) -> int:
         ret = _MLF_LIBRARY.MLFProtoLib_GetBrightness(self._handle)
         if ret < 0:
@@ -151,6 +264,15 @@ class MLFEffect:
     RAINBOW: Final[int]         = 2
     PROGRESS_BAR: Final[int]    = 3
 
+class MLFStrip:
+    TOP: Final[int]             = 1
+    BOTTOM: Final[int]          = 2
+
+class MLFLedType:
+    WS2812B: Final[int]         = 0
+    APA102: Final[int]          = 1
+    SK6812_RGBW: Final[int]     = 2
+
 ################################
 # Example usage of lib
 ################################
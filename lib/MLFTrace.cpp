@@ -0,0 +1,149 @@
+/**
+ * @file MLFTrace.cpp
+ * @author Pawel Wieczorek
+ * @brief Scoped trace events dumped in Chrome trace (Perfetto) format
+ * @date 2022-07-19
+ */
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "MLFTrace.hpp"
+
+#define MLF_TRACE_RING_SIZE         8192
+#define MLF_TRACE_THREAD_NAME_LEN   32
+
+/*
+ * Ring is written by its thread only. Each slot is guarded by a sequence
+ *  number (odd while being written), so `dump` running concurrently skips
+ *  slots being overwritten instead of reporting torn events.
+ */
+struct MLFTraceEvent {
+    std::atomic<uint32_t> seq {0};
+    const char* name;
+    const char* argName;
+    int64_t startNs;
+    int64_t durationNs;
+    int64_t arg;
+};
+
+struct MLFTraceRing {
+    int tid;
+    char threadName[MLF_TRACE_THREAD_NAME_LEN] = "";
+    std::atomic<uint64_t> head {0};
+    std::atomic<uint64_t> tail {0};
+    MLFTraceEvent events[MLF_TRACE_RING_SIZE];
+};
+
+std::atomic<bool> MLFTrace::active {false};
+
+/* Rings outlive their threads, so events of finished threads are dumped too */
+static std::mutex ringsLock;
+static std::vector<std::shared_ptr<MLFTraceRing>> rings;
+static thread_local std::shared_ptr<MLFTraceRing> threadRing;
+static thread_local const char* threadName = "";
+
+/* Ring is allocated by the first event, so threads never traced cost nothing */
+static MLFTraceRing* GetThreadRing(void) {
+    if(!threadRing) {
+        threadRing = std::make_shared<MLFTraceRing>();
+        strncpy(threadRing->threadName, threadName, sizeof(threadRing->threadName) - 1);
+
+        std::lock_guard<std::mutex> lock(ringsLock);
+        threadRing->tid = rings.size() + 1;
+        rings.push_back(threadRing);
+    }
+    return threadRing.get();
+}
+
+void MLFTrace::enable(bool on) {
+    active.store(on, std::memory_order_relaxed);
+}
+
+void MLFTrace::clear(void) {
+    std::lock_guard<std::mutex> lock(ringsLock);
+    for(auto& ring : rings)
+        ring->tail.store(ring->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+}
+
+void MLFTrace::setThreadName(const char* name) {
+    threadName = name;
+    if(threadRing)
+        strncpy(threadRing->threadName, name, sizeof(threadRing->threadName) - 1);
+}
+
+void MLFTrace::record(const char* name, const char* argName, int64_t startNs,
+                      int64_t durationNs, int64_t arg) {
+    MLFTraceRing* ring = GetThreadRing();
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+    MLFTraceEvent& event = ring->events[head % MLF_TRACE_RING_SIZE];
+    const uint32_t seq = event.seq.load(std::memory_order_relaxed);
+
+    event.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    event.name = name;
+    event.argName = argName;
+    event.startNs = startNs;
+    event.durationNs = durationNs;
+    event.arg = arg;
+
+    event.seq.store(seq + 2, std::memory_order_release);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+bool MLFTrace::dump(const std::string& path) {
+    std::vector<std::shared_ptr<MLFTraceRing>> snapshot;
+    FILE* out;
+    bool first = true;
+
+    {
+        std::lock_guard<std::mutex> lock(ringsLock);
+        snapshot = rings;
+    }
+
+    out = fopen(path.c_str(), "w");
+    if(out == nullptr)
+        return false;
+
+    // Timestamps are in microseconds - fractions keep nanosecond resolution
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for(auto& ring : snapshot) {
+        if(ring->threadName[0]) {
+            fprintf(out, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                         "\"args\": {\"name\": \"%s\"}}", first ? "" : ",", ring->tid, ring->threadName);
+            first = false;
+        }
+
+        const uint64_t head = ring->head.load(std::memory_order_acquire);
+        const uint64_t tail = std::max(ring->tail.load(std::memory_order_relaxed),
+                                       head > MLF_TRACE_RING_SIZE ? head - MLF_TRACE_RING_SIZE : 0);
+        for(uint64_t i = tail; i < head; i++) {
+            MLFTraceEvent& event = ring->events[i % MLF_TRACE_RING_SIZE];
+            const uint32_t seq = event.seq.load(std::memory_order_acquire);
+            if(seq & 1)
+                continue;
+
+            const char* name = event.name;
+            const char* argName = event.argName;
+            const int64_t startNs = event.startNs, durationNs = event.durationNs, arg = event.arg;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(event.seq.load(std::memory_order_relaxed) != seq)
+                continue;
+
+            fprintf(out, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                         "\"ts\": %.3f, \"dur\": %.3f", first ? "" : ",", name, ring->tid,
+                    startNs / 1000.0, durationNs / 1000.0);
+            if(argName)
+                fprintf(out, ", \"args\": {\"%s\": %lld}", argName, (long long)arg);
+            fprintf(out, "}");
+            first = false;
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    return fclose(out) == 0;
+}
@@ -0,0 +1,84 @@
+/**
+ * @file MLFTrace.hpp
+ * @author Pawel Wieczorek
+ * @brief Scoped trace events dumped in Chrome trace (Perfetto) format
+ * @date 2022-07-19
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <string>
+
+/**
+ * @brief Process-wide recorder of trace events
+ *
+ * Every thread writes its events into its own ring, without any lock, so
+ *  recording doesn't disturb timing of traced code. When tracing is off,
+ *  a scope costs a single relaxed load. Rings keep only the newest
+ *  MLF_TRACE_RING_SIZE events of each thread.
+ */
+class MLFTrace {
+    static std::atomic<bool> active;
+
+public:
+    static bool enabled(void) {
+        return active.load(std::memory_order_relaxed);
+    }
+
+    static int64_t now(void) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static void enable(bool on);
+    static void clear(void);
+    /* `name` has to be a string literal */
+    static void setThreadName(const char* name);
+    static void record(const char* name, const char* argName, int64_t startNs,
+                       int64_t durationNs, int64_t arg);
+
+    /**
+     * @brief Write events of all threads as Chrome trace JSON
+     *
+     * @return bool false if file couldn't be written
+     */
+    static bool dump(const std::string& path);
+};
+
+/**
+ * @brief Event lasting from construction to destruction of the object
+ *
+ * `name` and `argName` have to be string literals (only pointers are
+ *  stored). Argument is omitted if `argName` is null.
+ */
+class MLFTraceScope {
+    const char* name;
+    const char* argName;
+    int64_t arg;
+    int64_t start;
+
+public:
+    MLFTraceScope(const char* name, const char* argName = nullptr, int64_t arg = 0)
+        : name(name), argName(argName), arg(arg),
+          start(MLFTrace::enabled() ? MLFTrace::now() : 0) {}
+
+    ~MLFTraceScope() {
+        if(start)
+            MLFTrace::record(name, argName, start, MLFTrace::now() - start, arg);
+    }
+
+    void setArg(int64_t value) {
+        arg = value;
+    }
+};
+
+#define MLF_TRACE_CONCAT_(A, B)     A##B
+#define MLF_TRACE_CONCAT(A, B)      MLF_TRACE_CONCAT_(A, B)
+
+#ifdef MLF_ENABLE_TRACE
+#define MLF_TRACE_SCOPE(...)        MLFTraceScope MLF_TRACE_CONCAT(traceScope, __LINE__)(__VA_ARGS__)
+#else
+#define MLF_TRACE_SCOPE(...)        do {} while(0)
+#endif
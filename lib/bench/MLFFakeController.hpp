@@ -0,0 +1,197 @@
+/**
+ * @file MLFFakeController.hpp
+ * @author Pawel Wieczorek
+ * @brief Fake MLF Controller serving a pseudo-terminal (Linux only)
+ * @date 2022-07-09
+ */
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "MLFPacket.hpp"
+#include "MLFProtoLib.hpp"
+
+/**
+ * @brief Minimal controller answering every command immediately
+ *
+ * Controller is always reached over a pseudo-terminal, as MLFProtoLib
+ *  opens a device path. It's served either by a thread of the calling
+ *  process or by a forked child, so the cost of crossing a process
+ *  boundary can be measured as well. It doesn't advertise flow control nor clock sync,
+ *  so frames are never paced by it.
+ */
+class MLFFakeController {
+public:
+    enum Mode {
+        PtyThread,
+        PtyChildProcess,
+    };
+
+    MLFFakeController(Mode mode, int ledsCount,
+                      uint32_t caps = MLF_CAP_PIXFMT_RGB32 | MLF_CAP_PIXFMT_RGB24 | MLF_CAP_FRAGMENTS)
+        : ledsCount(ledsCount), caps(caps) {
+        struct termios tty;
+
+        master = posix_openpt(O_RDWR | O_NOCTTY);
+        if(master < 0 || grantpt(master) || unlockpt(master))
+            throw MLFException("failed to create pseudo-terminal", true);
+        slavePath = ptsname(master);
+
+        // Keep slave open, so master never sees a hang up between clients
+        slave = open(slavePath.c_str(), O_RDWR | O_NOCTTY);
+        if(slave < 0 || tcgetattr(slave, &tty))
+            throw MLFException("failed to open pseudo-terminal", true);
+        cfmakeraw(&tty);
+        tcsetattr(slave, TCSANOW, &tty);
+
+        if(mode == PtyThread) {
+            thread = std::thread(&MLFFakeController::serve, this);
+            return;
+        }
+
+        child = fork();
+        if(child < 0)
+            throw MLFException("failed to fork fake controller", true);
+        if(child == 0) {
+            serve();
+            _exit(0);
+        }
+    }
+
+    ~MLFFakeController() {
+        stop.store(true);
+        if(thread.joinable())
+            thread.join();
+        if(child > 0) {
+            kill(child, SIGTERM);
+            waitpid(child, nullptr, 0);
+        }
+        close(slave);
+        close(master);
+    }
+
+    MLFFakeController(const MLFFakeController&) = delete;
+    MLFFakeController& operator=(const MLFFakeController&) = delete;
+
+    const std::string& path(void) const {
+        return slavePath;
+    }
+
+    /* Statistics are collected only by controller running in-process */
+    uint64_t packetsReceived(void) const {
+        return packets.load(std::memory_order_relaxed);
+    }
+
+private:
+    int master = -1, slave = -1;
+    std::string slavePath;
+    int ledsCount;
+    uint32_t caps;
+
+    std::thread thread;
+    pid_t child = 0;
+    std::atomic<bool> stop {false};
+    std::atomic<uint64_t> packets {0};
+
+    /* Fixed buffers - controller doesn't allocate while serving */
+    char in[8 * MLF_MAX_DATA_SIZE];
+    char out[MLF_PACKET_OVERHEAD + MLF_MAX_DATA_SIZE];
+
+    /* Put response to `out`, return its size */
+    int handle(int cmd, const char* data, int len, char* out) {
+        char resp[MLF_MAX_DATA_SIZE];
+        int respLen = 0;
+
+        switch(cmd) {
+        case MLF_CMD_GET_INFO: {
+            auto ext = (struct MLF_resp_cmd_get_info_ext*) resp;
+            auto strips = (struct MLF_strip_info*)(resp + sizeof(*ext));
+            const int top = ledsCount / 2, bottom = ledsCount - top;
+
+            ext->info.fw_version = 1;
+            ext->info.leds_count_top = top;
+            ext->info.leds_count_bottom = bottom;
+            ext->protocol_version = MLF_PROTOCOL_VERSION;
+            ext->caps = caps;
+            ext->max_payload = MLF_MAX_DATA_SIZE;
+            ext->max_fps = 0;
+            ext->strips_count = 2;
+            strips[0] = { STRIP_BOTTOM, MLF_LED_WS2812B, (uint16_t)bottom, 0 };
+            strips[1] = { STRIP_TOP, MLF_LED_WS2812B, (uint16_t)top, (uint16_t)bottom };
+            respLen = sizeof(*ext) + 2 * sizeof(struct MLF_strip_info);
+
+            // Hosts not aware of capabilities get the bare info only
+            if(len < (int)sizeof(struct MLF_req_cmd_get_info))
+                respLen = sizeof(ext->info);
+            break;
+        }
+        case MLF_CMD_GET_BRIGHTNESS:
+        case MLF_CMD_GET_ON_STATE:
+            resp[0] = 1;
+            respLen = 1;
+            break;
+        default:
+            break;
+        }
+
+        return MLFEncodePacket(out, MLF_RESP_HEADER_MAGIC, MLF_RET_OK, resp, respLen);
+    }
+
+    void serve(void) {
+        size_t used = 0;
+        struct pollfd pfd = {
+            .fd = master,
+            .events = POLLIN
+        };
+
+        while(!stop.load()) {
+            if(poll(&pfd, 1, 50) <= 0)
+                continue;
+
+            const ssize_t ret = read(master, in + used, sizeof(in) - used);
+            if(ret <= 0)
+                continue;
+            used += ret;
+
+            size_t consumed = 0;
+            while(true) {
+                int cmd, len;
+                const char* data;
+                const int size = MLFDecodePacket(in + consumed, used - consumed,
+                                                 MLF_HEADER_MAGIC, &cmd, &data, &len);
+                if(size < 0) {
+                    // Resynchronize on the next byte
+                    consumed++;
+                    continue;
+                }
+                if(size == 0)
+                    break;
+
+                consumed += size;
+                packets.fetch_add(1, std::memory_order_relaxed);
+
+                const int outLen = handle(cmd, data, len, out);
+                for(int written = 0; written < outLen; ) {
+                    const ssize_t w = write(master, out + written, outLen - written);
+                    if(w <= 0)
+                        break;
+                    written += w;
+                }
+            }
+
+            memmove(in, in + consumed, used - consumed);
+            used -= consumed;
+        }
+    }
+};
@@ -0,0 +1,293 @@
+/**
+ * @file mlf_bench.cpp
+ * @author Pawel Wieczorek
+ * @brief Benchmark of MLF protocol encoding and MLFProtoLib frame path
+ * @date 2022-07-09
+ *
+ * Usage: mlf_bench [--json] [--duration-ms N] [--leds 90,306,...]
+ *                  [--transport pty-thread|pty-process|all]
+ *
+ * Transports - both go through a pseudo-terminal, there's no in-process one:
+ *  pty-thread  - fake controller served by a thread of the benchmark
+ *  pty-process - fake controller served by a forked process, like a real device
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "MLFFakeController.hpp"
+#include "MLFPacket.hpp"
+#include "MLFProtoLib.hpp"
+
+/************************************
+ * ALLOCATIONS COUNTING
+ ************************************/
+
+/*
+ * Replacing global operator new catches allocations of MLFProtoLib as well,
+ *  since the executable's definition takes precedence over libstdc++ one.
+ */
+static std::atomic<uint64_t> allocations {0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = malloc(size ? size : 1);
+    if(ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    free(ptr);
+}
+
+
+/************************************
+ * RESULTS
+ ************************************/
+using Clock = std::chrono::steady_clock;
+
+struct CodecResult {
+    int leds;
+    int packets;
+    double encodeNs;
+    double decodeNs;
+    double encodeMBps;
+};
+
+struct FrameResult {
+    const char* transport;
+    int leds;
+    int frames;
+    double fps;
+    double p50Us, p90Us, p99Us, maxUs;
+    double allocsPerCall;
+};
+
+static double ElapsedNs(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+/************************************
+ * BENCHMARKS
+ ************************************/
+
+/*
+ * Frame is split into RGB32 packets the same way as MLFProtoLib does for
+ *  controllers without RGB24 support - it's the worst case for codec.
+ */
+static CodecResult BenchCodec(int leds, int durationMs) {
+    const int maxLeds = (MLF_MAX_DATA_SIZE - sizeof(struct MLF_req_cmd_set_color_fragment)) / sizeof(int);
+    const int packets = (leds + maxLeds - 1) / maxLeds;
+    std::vector<char> body(MLF_MAX_DATA_SIZE, 0x5a);
+    std::vector<char> wire(packets * MLFPacketSize(MLF_MAX_DATA_SIZE));
+    volatile int sink = 0;
+    size_t wireLen = 0;
+    uint64_t iterations = 0;
+    double encodeNs = 0, decodeNs = 0;
+
+    const auto deadline = Clock::now() + std::chrono::milliseconds(durationMs);
+    while(Clock::now() < deadline) {
+        auto start = Clock::now();
+        wireLen = 0;
+        for(int offset = 0; offset < leds; offset += maxLeds) {
+            const int count = std::min(leds - offset, maxLeds);
+            const int len = sizeof(struct MLF_req_cmd_set_color_fragment) + count * sizeof(int);
+            wireLen += MLFEncodePacket(wire.data() + wireLen, MLF_HEADER_MAGIC,
+                                       MLF_CMD_SET_COLOR_FRAGMENT, body.data(), len);
+        }
+        encodeNs += ElapsedNs(start);
+
+        start = Clock::now();
+        for(size_t pos = 0; pos < wireLen; ) {
+            int cmd, len;
+            const char* data;
+            const int size = MLFDecodePacket(wire.data() + pos, wireLen - pos,
+                                             MLF_HEADER_MAGIC, &cmd, &data, &len);
+            if(size <= 0)
+                break;
+            sink += data[len - 1];
+            pos += size;
+        }
+        decodeNs += ElapsedNs(start);
+        iterations++;
+    }
+    (void)sink;
+
+    return CodecResult {
+        .leds = leds,
+        .packets = packets,
+        .encodeNs = encodeNs / iterations,
+        .decodeNs = decodeNs / iterations,
+        .encodeMBps = wireLen * iterations / (encodeNs / 1e9) / 1e6,
+    };
+}
+
+static double Percentile(std::vector<double>& sorted, double p) {
+    if(sorted.empty())
+        return 0;
+    return sorted[std::min<size_t>(sorted.size() - 1, sorted.size() * p)];
+}
+
+#define WARMUP_FRAMES       20
+#define MAX_SAMPLES         (1 << 20)
+
+static FrameResult BenchFrames(const char* transport, MLFFakeController::Mode mode,
+                               int leds, int durationMs) {
+    MLFFakeController controller(mode, leds);
+    MLFProtoLib lib(controller.path());
+    std::vector<int> colors(leds);
+    std::vector<double> latencies;
+    latencies.reserve(MAX_SAMPLES);
+
+    for(int i = 0; i < leds; i++)
+        colors[i] = i * 0x010203;
+    for(int i = 0; i < WARMUP_FRAMES; i++)
+        lib.setColors(colors.data(), leds);
+
+    const uint64_t allocsBefore = allocations.load();
+    const auto start = Clock::now();
+    const auto deadline = start + std::chrono::milliseconds(durationMs);
+    uint64_t frames = 0;
+
+    while(Clock::now() < deadline) {
+        const auto sent = Clock::now();
+        lib.setColors(colors.data(), leds);
+        if(latencies.size() < MAX_SAMPLES)
+            latencies.push_back(ElapsedNs(sent) / 1000);
+        frames++;
+    }
+
+    const double elapsedNs = ElapsedNs(start);
+    const uint64_t allocs = allocations.load() - allocsBefore;
+    std::sort(latencies.begin(), latencies.end());
+
+    return FrameResult {
+        .transport = transport,
+        .leds = leds,
+        .frames = (int)frames,
+        .fps = frames / (elapsedNs / 1e9),
+        .p50Us = Percentile(latencies, 0.50),
+        .p90Us = Percentile(latencies, 0.90),
+        .p99Us = Percentile(latencies, 0.99),
+        .maxUs = latencies.empty() ? 0 : latencies.back(),
+        .allocsPerCall = frames ? (double)allocs / frames : 0,
+    };
+}
+
+/************************************
+ * OUTPUT
+ ************************************/
+static void PrintText(const std::vector<CodecResult>& codec, const std::vector<FrameResult>& frames) {
+    printf("Packet codec (RGB32 frame)\n");
+    printf("%8s %8s %12s %12s %12s\n", "leds", "packets", "encode ns", "decode ns", "encode MB/s");
+    for(auto& r : codec)
+        printf("%8d %8d %12.1f %12.1f %12.1f\n", r.leds, r.packets, r.encodeNs, r.decodeNs, r.encodeMBps);
+
+    printf("\nsetColors\n");
+    printf("%-11s %8s %8s %10s %10s %10s %10s %10s %8s\n", "transport", "leds", "frames",
+           "fps", "p50 us", "p90 us", "p99 us", "max us", "allocs");
+    for(auto& r : frames)
+        printf("%-11s %8d %8d %10.1f %10.1f %10.1f %10.1f %10.1f %8.2f\n", r.transport, r.leds,
+               r.frames, r.fps, r.p50Us, r.p90Us, r.p99Us, r.maxUs, r.allocsPerCall);
+}
+
+static void PrintJson(const std::vector<CodecResult>& codec, const std::vector<FrameResult>& frames) {
+    printf("{\n  \"codec\": [");
+    for(size_t i = 0; i < codec.size(); i++) {
+        auto& r = codec[i];
+        printf("%s\n    {\"leds\": %d, \"packets\": %d, \"encode_ns\": %.1f, "
+               "\"decode_ns\": %.1f, \"encode_mbps\": %.1f}",
+               i ? "," : "", r.leds, r.packets, r.encodeNs, r.decodeNs, r.encodeMBps);
+    }
+    printf("\n  ],\n  \"set_colors\": [");
+    for(size_t i = 0; i < frames.size(); i++) {
+        auto& r = frames[i];
+        printf("%s\n    {\"transport\": \"%s\", \"leds\": %d, \"frames\": %d, \"fps\": %.1f, "
+               "\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}, "
+               "\"allocs_per_call\": %.2f}",
+               i ? "," : "", r.transport, r.leds, r.frames, r.fps,
+               r.p50Us, r.p90Us, r.p99Us, r.maxUs, r.allocsPerCall);
+    }
+    printf("\n  ]\n}\n");
+}
+
+static void Usage(const char* name) {
+    fprintf(stderr, "Usage: %s [--json] [--duration-ms N] [--leds 90,306,...] "
+                    "[--transport pty-thread|pty-process|all]\n", name);
+}
+
+int main(int argc, char** argv) {
+    std::vector<int> sizes = { 90, 306, 1000, 4000 };
+    std::string transport = "all";
+    int durationMs = 1000;
+    bool json = false;
+
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--json")) {
+            json = true;
+        }
+        else if(!strcmp(argv[i], "--duration-ms") && i + 1 < argc) {
+            durationMs = atoi(argv[++i]);
+        }
+        else if(!strcmp(argv[i], "--transport") && i + 1 < argc) {
+            transport = argv[++i];
+        }
+        else if(!strcmp(argv[i], "--leds") && i + 1 < argc) {
+            sizes.clear();
+            for(char* tok = strtok(argv[++i], ","); tok; tok = strtok(nullptr, ","))
+                sizes.push_back(atoi(tok));
+        }
+        else {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<CodecResult> codec;
+    std::vector<FrameResult> frames;
+
+    try {
+        for(int leds : sizes)
+            codec.push_back(BenchCodec(leds, durationMs / 4));
+
+        for(int leds : sizes) {
+            if(transport == "all" || transport == "pty-thread")
+                frames.push_back(BenchFrames("pty-thread", MLFFakeController::PtyThread, leds, durationMs));
+            if(transport == "all" || transport == "pty-process")
+                frames.push_back(BenchFrames("pty-process", MLFFakeController::PtyChildProcess, leds, durationMs));
+        }
+    }
+    catch (std::exception& ex) {
+        fprintf(stderr, "Benchmark failed: %s\n", ex.what());
+        return 1;
+    }
+
+    if(json)
+        PrintJson(codec, frames);
+    else
+        PrintText(codec, frames);
+    return 0;
+}
@@ -0,0 +1,267 @@
+/**
+ * @file mlf_color_bench.c
+ * @author Pawel Wieczorek
+ * @brief Benchmark of firmware color math - float HSL against fixed-point
+ * @date 2022-08-02
+ *
+ * Usage: mlf_color_bench [--leds N] [--frames N]
+ *
+ * Firmware's color_math.c is compiled for the host, next to a copy of
+ *  float hsl2rgb which effects used before. Every path renders the same
+ *  rainbow into a frame, so numbers are per LED of effect_rainbow. Cycles
+ *  are host TSC ticks - they show the ratio between paths, not the time on
+ *  Cortex-M4, where float round() and divisions cost relatively more.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "color_math.h"
+
+struct Options {
+    int leds;
+    int frames;
+};
+
+struct Result {
+    const char* name;
+    double nsPerLed;
+    double cyclesPerLed;
+    uint32_t checksum;
+};
+
+static volatile uint32_t sink;
+
+static uint64_t NowNs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t Cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint32_t Checksum(const struct Color* frame, int leds) {
+    uint32_t sum = 0;
+
+    for(int i = 0; i < leds; i++)
+        sum = sum * 31 + ((uint32_t) frame[i].r << 16 | frame[i].g << 8 | frame[i].b);
+    return sum;
+}
+
+/************************************
+ * FLOAT REFERENCE (mlf_effects.c before color_math)
+ ************************************/
+
+static float hue2rgb(float p, float q, float t) {
+    if (t < 0) t += 1;
+    if (t > 1) t -= 1;
+    if (t < 1./6) return p + (q - p) * 6 * t;
+    if (t < 1./2) return q;
+    if (t < 2./3) return p + (q - p) * (2./3 - t) * 6;
+    return p;
+}
+
+static struct Color hsl2rgb(float h, float s, float l) {
+    struct Color result;
+
+    if(0 == s)
+        result.r = result.g = result.b = l;
+    else {
+        float q = l < 0.5 ? l * (1 + s) : l + s - l * s;
+        float p = 2 * l - q;
+        result.r = round(hue2rgb(p, q, h + 1./3) * 255);
+        result.g = round(hue2rgb(p, q, h) * 255);
+        result.b = round(hue2rgb(p, q, h - 1./3) * 255);
+    }
+
+    return result;
+}
+
+/************************************
+ * RAINBOW RENDERERS
+ ************************************/
+
+static void RainbowFloat(struct Color* frame, int leds, uint32_t n) {
+    float hue = 0.001 * n;
+
+    hue = hue - (long)hue;
+    for(int i = 0; i < leds; i++) {
+        float partialHue = hue + (float)i / leds;
+        if(partialHue > 1.0f)
+            partialHue -= 1.0f;
+        frame[i] = hsl2rgb(partialHue, 1, 0.5);
+    }
+}
+
+static void RainbowWheel(struct Color* frame, int leds, uint32_t n) {
+    uint32_t hue = (uint32_t)((n % 1000) * COLOR_HUE_MAX / 1000) << 16;
+    uint32_t step = COLOR_HUE_STEP(leds);
+
+    for(int i = 0; i < leds; i++, hue += step)
+        frame[i] = color_wheel(hue >> 16);
+}
+
+static void RainbowHsv(struct Color* frame, int leds, uint32_t n) {
+    uint32_t hue = (uint32_t)((n % 1000) * COLOR_HUE_MAX / 1000) << 16;
+    uint32_t step = COLOR_HUE_STEP(leds);
+
+    for(int i = 0; i < leds; i++, hue += step)
+        frame[i] = color_hsv(hue >> 16, 255, 255);
+}
+
+/* Transition step of app.c, as float lerp and as color_blend */
+static struct Color* blendTo;
+
+static void BlendFloat(struct Color* frame, int leds, uint32_t n) {
+    float weight = (n % 257) / 256.0f;
+
+    for(int i = 0; i < leds; i++) {
+        frame[i].r = lroundf(frame[i].r + (blendTo[i].r - frame[i].r) * weight);
+        frame[i].g = lroundf(frame[i].g + (blendTo[i].g - frame[i].g) * weight);
+        frame[i].b = lroundf(frame[i].b + (blendTo[i].b - frame[i].b) * weight);
+    }
+}
+
+static void BlendFixed(struct Color* frame, int leds, uint32_t n) {
+    uint32_t weight = n % (COLOR_BLEND_MAX + 1);
+
+    for(int i = 0; i < leds; i++)
+        frame[i] = color_blend(frame[i], blendTo[i], weight);
+}
+
+/************************************
+ * BENCHMARKS
+ ************************************/
+
+static struct Result Bench(const char* name, void (*render)(struct Color*, int, uint32_t),
+                           const struct Options* opts) {
+    struct Color* frame = calloc(opts->leds, sizeof(struct Color));
+    struct Result result = { name, 0, 0, 0 };
+    uint64_t start, cycles;
+
+    if(frame == NULL) {
+        fprintf(stderr, "Benchmark failed: out of memory\n");
+        exit(1);
+    }
+
+    // Warm up caches and the wheel
+    render(frame, opts->leds, 0);
+
+    start = NowNs();
+    cycles = Cycles();
+    for(int n = 0; n < opts->frames; n++) {
+        render(frame, opts->leds, n);
+        sink += frame[n % opts->leds].g;
+    }
+    cycles = Cycles() - cycles;
+    result.nsPerLed = (double)(NowNs() - start) / opts->frames / opts->leds;
+    result.cyclesPerLed = (double) cycles / opts->frames / opts->leds;
+    result.checksum = Checksum(frame, opts->leds);
+
+    free(frame);
+    return result;
+}
+
+/* The largest channel difference of fixed-point paths from float HSL */
+static void CompareRainbows(const struct Options* opts) {
+    struct Color* ref = calloc(opts->leds, sizeof(struct Color));
+    struct Color* wheel = calloc(opts->leds, sizeof(struct Color));
+    struct Color* hsv = calloc(opts->leds, sizeof(struct Color));
+    int maxWheel = 0, maxHsv = 0;
+
+    if(ref == NULL || wheel == NULL || hsv == NULL) {
+        fprintf(stderr, "Benchmark failed: out of memory\n");
+        exit(1);
+    }
+
+    for(uint32_t n = 0; n < 1000; n++) {
+        RainbowFloat(ref, opts->leds, n);
+        RainbowWheel(wheel, opts->leds, n);
+        RainbowHsv(hsv, opts->leds, n);
+        for(int i = 0; i < opts->leds; i++) {
+            const uint8_t* r = &ref[i].r;
+            const uint8_t* w = &wheel[i].r;
+            const uint8_t* h = &hsv[i].r;
+
+            for(int c = 0; c < 3; c++) {
+                if(abs(r[c] - w[c]) > maxWheel)
+                    maxWheel = abs(r[c] - w[c]);
+                if(abs(r[c] - h[c]) > maxHsv)
+                    maxHsv = abs(r[c] - h[c]);
+            }
+        }
+    }
+    printf("max channel error against float: wheel %d, hsv %d (of 255)\n", maxWheel, maxHsv);
+
+    free(ref);
+    free(wheel);
+    free(hsv);
+}
+
+/************************************
+ * MAIN
+ ************************************/
+
+static void Usage(const char* name) {
+    fprintf(stderr, "Usage: %s [--leds N] [--frames N]\n", name);
+}
+
+static int ParseArgs(int argc, char** argv, struct Options* opts) {
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--leds") && i + 1 < argc)
+            opts->leds = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--frames") && i + 1 < argc)
+            opts->frames = atoi(argv[++i]);
+        else
+            return 0;
+    }
+
+    return opts->leds > 0 && opts->frames > 0;
+}
+
+int main(int argc, char** argv) {
+    struct Options opts = { 306, 20000 };
+    struct Result results[5];
+    int count = 0;
+
+    if(!ParseArgs(argc, argv, &opts)) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    blendTo = calloc(opts.leds, sizeof(struct Color));
+    if(blendTo == NULL) {
+        fprintf(stderr, "Benchmark failed: out of memory\n");
+        return 1;
+    }
+    RainbowFloat(blendTo, opts.leds, 500);
+
+    results[count++] = Bench("rainbow float hsl2rgb", RainbowFloat, &opts);
+    results[count++] = Bench("rainbow color_hsv", RainbowHsv, &opts);
+    results[count++] = Bench("rainbow color_wheel", RainbowWheel, &opts);
+    results[count++] = Bench("blend float", BlendFloat, &opts);
+    results[count++] = Bench("blend color_blend", BlendFixed, &opts);
+
+    printf("%d LEDs x %d frames\n", opts.leds, opts.frames);
+    printf("%-24s %10s %12s %10s\n", "path", "ns/LED", "cycles/LED", "checksum");
+    for(int i = 0; i < count; i++)
+        printf("%-24s %10.2f %12.2f %10x\n", results[i].name, results[i].nsPerLed,
+               results[i].cyclesPerLed, results[i].checksum);
+    CompareRainbows(&opts);
+
+    free(blendTo);
+    return 0;
+}
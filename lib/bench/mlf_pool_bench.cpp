@@ -0,0 +1,232 @@
+/**
+ * @file mlf_pool_bench.cpp
+ * @author Pawel Wieczorek
+ * @brief Benchmark of MLFControllerPool driving many fake controllers
+ * @date 2022-07-20
+ *
+ * Usage: mlf_pool_bench [--controllers N] [--leds N] [--fps N]
+ *                       [--duration-ms N] [--backend uring|epoll|proto|all]
+ *
+ * Every controller is a MLFFakeController served by its own process over
+ *  a pseudo-terminal. Frames are submitted to all controllers on every tick
+ *  of a frame clock. `proto` runs one MLFProtoLib with its own thread per
+ *  controller instead, as a baseline.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+#include "MLFControllerPool.hpp"
+#include "MLFFakeController.hpp"
+#include "MLFProtoLib.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    int controllers = 100;
+    int leds = 306;
+    int fps = 60;
+    int durationMs = 3000;
+    std::string backend = "all";
+};
+
+struct Result {
+    std::string backend;
+    uint64_t framesSubmitted;
+    uint64_t framesSent;
+    uint64_t framesFailed;
+    double fpsPerController;
+    double latencyAvgUs;
+    double latencyMaxUs;
+    double cpuCores;
+};
+
+static double CpuSeconds(void) {
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void FillFrame(std::vector<int>& colors, uint64_t tick) {
+    for(size_t i = 0; i < colors.size(); i++)
+        colors[i] = (int)((i + tick) * 0x010203) & 0xffffff;
+}
+
+/************************************
+ * BENCHMARKS
+ ************************************/
+
+static Result BenchPool(const Options& opts, MLFPoolBackend backend,
+                        const std::vector<std::unique_ptr<MLFFakeController>>& fakes) {
+    MLFControllerPool pool(opts.controllers, backend);
+    std::vector<int> colors(opts.leds);
+    Result result = {};
+
+    for(auto& fake : fakes)
+        pool.addController(fake->path());
+
+    const auto period = std::chrono::nanoseconds(1000000000ull / opts.fps);
+    const double cpuStart = CpuSeconds();
+    const Clock::time_point start = Clock::now();
+    const Clock::time_point end = start + std::chrono::milliseconds(opts.durationMs);
+
+    for(uint64_t tick = 0; start + tick * period < end; tick++) {
+        std::this_thread::sleep_until(start + tick * period);
+        FillFrame(colors, tick);
+        for(int id = 0; id < opts.controllers; id++)
+            pool.setColors(id, colors.data(), opts.leds);
+    }
+
+    // Let the last frames reach controllers
+    std::this_thread::sleep_for(period);
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    result.backend = pool.getBackendName();
+    result.cpuCores = (CpuSeconds() - cpuStart) / elapsed;
+    for(int id = 0; id < opts.controllers; id++) {
+        MLFPoolStats stats;
+        pool.getStats(id, stats);
+        result.framesSubmitted += stats.framesSubmitted;
+        result.framesSent += stats.framesSent;
+        result.framesFailed += stats.framesFailed;
+        result.latencyAvgUs += stats.latencyAvgUs * stats.framesSent;
+        result.latencyMaxUs = std::max(result.latencyMaxUs, stats.latencyMaxUs);
+    }
+    result.latencyAvgUs /= std::max<uint64_t>(result.framesSent, 1);
+    result.fpsPerController = result.framesSent / elapsed / opts.controllers;
+    return result;
+}
+
+/* One blocking MLFProtoLib per controller, each driven by its own thread */
+static Result BenchProto(const Options& opts,
+                         const std::vector<std::unique_ptr<MLFFakeController>>& fakes) {
+    std::vector<std::unique_ptr<MLFProtoLib>> libs;
+    std::vector<std::thread> threads;
+    std::vector<uint64_t> sent(opts.controllers), failed(opts.controllers);
+    std::vector<double> latencySum(opts.controllers), latencyMax(opts.controllers);
+    Result result = {};
+
+    for(auto& fake : fakes)
+        libs.push_back(std::make_unique<MLFProtoLib>(fake->path()));
+
+    const auto period = std::chrono::nanoseconds(1000000000ull / opts.fps);
+    const double cpuStart = CpuSeconds();
+    const Clock::time_point start = Clock::now();
+    const Clock::time_point end = start + std::chrono::milliseconds(opts.durationMs);
+
+    for(int id = 0; id < opts.controllers; id++) {
+        threads.emplace_back([&, id] {
+            std::vector<int> colors(opts.leds);
+
+            for(uint64_t tick = 0; start + tick * period < end; tick++) {
+                const Clock::time_point due = start + tick * period;
+                std::this_thread::sleep_until(due);
+                FillFrame(colors, tick);
+                try {
+                    libs[id]->setColors(colors.data(), opts.leds);
+                }
+                catch (MLFException&) {
+                    failed[id]++;
+                    continue;
+                }
+
+                const double us = std::chrono::duration<double, std::micro>(Clock::now() - due).count();
+                sent[id]++;
+                latencySum[id] += us;
+                latencyMax[id] = std::max(latencyMax[id], us);
+            }
+        });
+    }
+    for(auto& thread : threads)
+        thread.join();
+
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    result.backend = "MLFProtoLib x thread";
+    result.cpuCores = (CpuSeconds() - cpuStart) / elapsed;
+    for(int id = 0; id < opts.controllers; id++) {
+        result.framesSubmitted += sent[id] + failed[id];
+        result.framesSent += sent[id];
+        result.framesFailed += failed[id];
+        result.latencyAvgUs += latencySum[id];
+        result.latencyMaxUs = std::max(result.latencyMaxUs, latencyMax[id]);
+    }
+    result.latencyAvgUs /= std::max<uint64_t>(result.framesSent, 1);
+    result.fpsPerController = result.framesSent / elapsed / opts.controllers;
+    return result;
+}
+
+/************************************
+ * MAIN
+ ************************************/
+
+static void Usage(const char* name) {
+    fprintf(stderr, "Usage: %s [--controllers N] [--leds N] [--fps N] [--duration-ms N] "
+                    "[--backend uring|epoll|proto|all]\n", name);
+}
+
+static bool ParseArgs(int argc, char** argv, Options& opts) {
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--controllers") && i + 1 < argc)
+            opts.controllers = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--leds") && i + 1 < argc)
+            opts.leds = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--fps") && i + 1 < argc)
+            opts.fps = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--duration-ms") && i + 1 < argc)
+            opts.durationMs = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--backend") && i + 1 < argc)
+            opts.backend = argv[++i];
+        else
+            return false;
+    }
+
+    return opts.controllers > 0 && opts.leds > 0 && opts.fps > 0 && opts.durationMs > 0;
+}
+
+int main(int argc, char** argv) {
+    Options opts;
+    std::vector<Result> results;
+
+    if(!ParseArgs(argc, argv, opts)) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        // Controllers are forked before any thread is started
+        std::vector<std::unique_ptr<MLFFakeController>> fakes;
+        for(int i = 0; i < opts.controllers; i++)
+            fakes.push_back(std::make_unique<MLFFakeController>(MLFFakeController::PtyChildProcess, opts.leds));
+
+        if(opts.backend == "all" || opts.backend == "uring")
+            results.push_back(BenchPool(opts, MLFPoolBackend::IOUring, fakes));
+        if(opts.backend == "all" || opts.backend == "epoll")
+            results.push_back(BenchPool(opts, MLFPoolBackend::Epoll, fakes));
+        if(opts.backend == "all" || opts.backend == "proto")
+            results.push_back(BenchProto(opts, fakes));
+    }
+    catch (std::exception& ex) {
+        fprintf(stderr, "Benchmark failed: %s\n", ex.what());
+        return 1;
+    }
+
+    printf("%d controllers x %d LEDs at %d fps, %d ms\n", opts.controllers, opts.leds, opts.fps, opts.durationMs);
+    printf("%-34s %10s %10s %8s %10s %10s %12s %10s\n", "backend", "submitted", "sent",
+           "failed", "fps/ctrl", "avg us", "max us", "CPU cores");
+    for(auto& r : results)
+        printf("%-34s %10llu %10llu %8llu %10.1f %10.1f %12.1f %10.2f\n", r.backend.c_str(),
+               (unsigned long long) r.framesSubmitted, (unsigned long long) r.framesSent,
+               (unsigned long long) r.framesFailed, r.fpsPerController,
+               r.latencyAvgUs, r.latencyMaxUs, r.cpuCores);
+    return 0;
+}
@@ -0,0 +1,160 @@
+/**
+ * @file MLFDaemonClient.cpp
+ * @author Pawel Wieczorek
+ * @brief Client of mlfd daemon sharing MLF Controller between processes
+ * @date 2022-07-16
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "MLFDaemonClient.hpp"
+
+
+static std::string GetSocketPath(std::string path) {
+    if(path != "")
+        return path;
+
+    const char* env = getenv("MLFD_SOCKET");
+    return env ? env : MLFD_DEFAULT_SOCKET;
+}
+
+MLFDaemonClient::MLFDaemonClient(std::string socketPath) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    MLFDRequest req = { .cmd = MLFD_CMD_HELLO, .arg = MLFD_VERSION };
+    MLFDResponse resp;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = &resp, .iov_len = sizeof resp };
+    struct msghdr msg = {};
+    struct cmsghdr* cmsg;
+    int fd = -1;
+
+    socketPath = GetSocketPath(socketPath);
+    if(socketPath.size() >= sizeof addr.sun_path)
+        throw MLFException("mlfd socket path too long");
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(sock < 0)
+        throw MLFException("failed to create mlfd socket", true);
+    if(connect(sock, (struct sockaddr*)&addr, sizeof addr) < 0) {
+        close(sock);
+        throw MLFException("failed to connect to mlfd", true);
+    }
+
+    // Frame ring comes with response to HELLO
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    if(send(sock, &req, sizeof req, 0) != sizeof req ||
+       recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof resp) {
+        close(sock);
+        throw MLFException("failed to register at mlfd", true);
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+    if(resp.status < 0 || fd < 0) {
+        close(sock);
+        throw MLFException("mlfd rejected connection");
+    }
+
+    ringSize = MLFDRingSize(resp.ledsCount);
+    void* mem = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED) {
+        close(sock);
+        throw MLFException("failed to map mlfd frame ring", true);
+    }
+
+    ring = (MLFDRingHeader*)mem;
+    if(ring->magic != MLFD_SHM_MAGIC || ring->version != MLFD_VERSION ||
+       ring->ledsCount != resp.ledsCount) {
+        munmap(mem, ringSize);
+        close(sock);
+        throw MLFException("invalid mlfd frame ring");
+    }
+    writeSeq = ring->writeSeq.load(std::memory_order_relaxed);
+}
+
+MLFDaemonClient::~MLFDaemonClient() {
+    if(ring)
+        munmap(ring, ringSize);
+    if(sock >= 0)
+        close(sock);
+}
+
+void MLFDaemonClient::request(uint32_t cmd, int32_t arg, MLFDResponse* resp) {
+    MLFDRequest req = { .cmd = cmd, .arg = arg };
+    MLFDResponse localResp;
+
+    if(resp == nullptr)
+        resp = &localResp;
+
+    if(send(sock, &req, sizeof req, 0) != sizeof req ||
+       recv(sock, resp, sizeof *resp, 0) != sizeof *resp)
+        throw MLFException("failed to communicate with mlfd", true);
+
+    if(resp->status < 0) {
+        errno = -resp->status;
+        throw MLFException("mlfd request failed", true);
+    }
+}
+
+int MLFDaemonClient::getLedsCount(void) const {
+    return ring->ledsCount;
+}
+
+void MLFDaemonClient::setColors(const int* colors, int len, int offset) {
+    if(offset < 0 || len < 0 || (uint32_t)(offset + len) > ring->ledsCount)
+        throw MLFException("invalid range of LEDs");
+
+    MLFDFrameSlot* slot = MLFDRingSlot(ring, ring->ledsCount, writeSeq);
+    const uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+
+    // Odd sequence marks slot being written (see MLFDaemonProtocol.hpp)
+    slot->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->offset = offset;
+    slot->count = len;
+    memcpy(slot->colors, colors, len * sizeof(int));
+
+    slot->seq.store(seq + 2, std::memory_order_release);
+    ring->writeSeq.store(++writeSeq, std::memory_order_release);
+}
+
+uint64_t MLFDaemonClient::getFramesConsumed(void) const {
+    return ring->readSeq.load(std::memory_order_acquire);
+}
+
+void MLFDaemonClient::setPriority(int priority) {
+    request(MLFD_CMD_SET_PRIORITY, priority);
+}
+
+void MLFDaemonClient::setBrightness(int brightness) {
+    request(MLFD_CMD_SET_BRIGHTNESS, brightness);
+}
+
+void MLFDaemonClient::turnOn(void) {
+    request(MLFD_CMD_TURN_ON, 0);
+}
+
+void MLFDaemonClient::turnOff(void) {
+    request(MLFD_CMD_TURN_OFF, 0);
+}
+
+void MLFDaemonClient::getStats(uint64_t& framesReceived, uint64_t& framesSent) {
+    MLFDResponse resp;
+
+    request(MLFD_CMD_GET_STATS, 0, &resp);
+    framesReceived = resp.framesReceived;
+    framesSent = resp.framesSent;
+}
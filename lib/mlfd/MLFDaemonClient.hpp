@@ -0,0 +1,60 @@
+/**
+ * @file MLFDaemonClient.hpp
+ * @author Pawel Wieczorek
+ * @brief Client of mlfd daemon sharing MLF Controller between processes
+ * @date 2022-07-16
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+#include "MLFProtoLib.hpp"
+#include "MLFDaemonProtocol.hpp"
+
+/**
+ * @brief Connection to mlfd daemon
+ *
+ * Frames are written directly into a ring in shared memory, so `setColors`
+ *  doesn't make any syscall and never waits for controller. Daemon takes
+ *  the newest frame of every client, merges them by priority and sends
+ *  the result at the pace of controller.
+ *
+ * Object is meant to be used by a single thread.
+ */
+class MLFDaemonClient {
+    /* Control socket */
+    int sock = -1;
+
+    MLFDRingHeader* ring = nullptr;
+    size_t ringSize = 0;
+    uint64_t writeSeq = 0;
+
+    void request(uint32_t cmd, int32_t arg, MLFDResponse* resp = nullptr);
+
+public:
+    MLFDaemonClient(std::string socketPath = "");
+    ~MLFDaemonClient();
+
+    int getLedsCount(void) const;
+
+    /**
+     * @brief Publish colors of LEDs [offset, offset + len)
+     *
+     * LEDs not covered by the frame are taken from clients of lower
+     *  priority (or turned off if there are none).
+     */
+    void setColors(const int* colors, int len, int offset = 0);
+
+    /* Frames published up to the newest one taken by daemon (older are skipped) */
+    uint64_t getFramesConsumed(void) const;
+
+    /* Frames of clients with higher priority are drawn on top (default 0) */
+    void setPriority(int priority);
+
+    void setBrightness(int brightness);
+    void turnOn(void);
+    void turnOff(void);
+
+    void getStats(uint64_t& framesReceived, uint64_t& framesSent);
+};
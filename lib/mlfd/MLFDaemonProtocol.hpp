@@ -0,0 +1,100 @@
+/**
+ * @file MLFDaemonProtocol.hpp
+ * @author Pawel Wieczorek
+ * @brief Shared memory layout and control messages of mlfd daemon
+ * @date 2022-07-16
+ */
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Control socket used when neither path nor MLFD_SOCKET is given */
+#define MLFD_DEFAULT_SOCKET     "/tmp/mlfd.sock"
+
+/************************************
+ * FRAME RING
+ ************************************/
+
+/*
+ * Every client gets its own shared memory segment with a ring of frames.
+ *  Client is the only writer and daemon is the only reader, so no locks
+ *  nor syscalls are needed:
+ *   - writer bumps `seq` of slot to odd value, copies colors, bumps it to
+ *     even value and publishes the slot by incrementing `writeSeq`,
+ *   - reader takes the newest published slot and retries if `seq` of slot
+ *     has changed during copying (writer has lapped the whole ring).
+ */
+#define MLFD_SHM_MAGIC          0x44464C4DU     // "MLFD"
+#define MLFD_VERSION            1
+#define MLFD_RING_SLOTS         4
+#define MLFD_CACHE_LINE         64
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "frame ring requires lock-free 64-bit atomics");
+
+struct alignas(MLFD_CACHE_LINE) MLFDRingHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t slots;
+    uint32_t ledsCount;
+    uint32_t slotStride;
+
+    /* Number of frames published by client */
+    alignas(MLFD_CACHE_LINE) std::atomic<uint64_t> writeSeq;
+
+    /* Value of `writeSeq` at the newest frame taken by daemon */
+    alignas(MLFD_CACHE_LINE) std::atomic<uint64_t> readSeq;
+};
+
+struct MLFDFrameSlot {
+    std::atomic<uint32_t> seq;
+    uint16_t offset;        // index of the first LED set by this frame
+    uint16_t count;         // number of LEDs in `colors`
+    uint32_t colors[];
+};
+
+static inline size_t MLFDSlotStride(uint32_t ledsCount) {
+    const size_t size = sizeof(MLFDFrameSlot) + ledsCount * sizeof(uint32_t);
+    return (size + MLFD_CACHE_LINE - 1) / MLFD_CACHE_LINE * MLFD_CACHE_LINE;
+}
+
+static inline size_t MLFDRingSize(uint32_t ledsCount) {
+    return sizeof(MLFDRingHeader) + MLFD_RING_SLOTS * MLFDSlotStride(ledsCount);
+}
+
+/* Layout isn't read from header, which client can overwrite at will */
+static inline MLFDFrameSlot* MLFDRingSlot(MLFDRingHeader* ring, uint32_t ledsCount, uint64_t seq) {
+    return (MLFDFrameSlot*)((char*)(ring + 1) + (seq % MLFD_RING_SLOTS) * MLFDSlotStride(ledsCount));
+}
+
+/************************************
+ * CONTROL SOCKET
+ ************************************/
+
+/*
+ * Control socket is a SOCK_SEQPACKET unix socket. Each request gets
+ *  exactly one response. Response to MLFD_CMD_HELLO carries file
+ *  descriptor of client's frame ring (SCM_RIGHTS).
+ */
+enum MLFDCommand : uint32_t {
+    MLFD_CMD_HELLO          = 0,
+    MLFD_CMD_SET_PRIORITY,
+    MLFD_CMD_SET_BRIGHTNESS,
+    MLFD_CMD_TURN_ON,
+    MLFD_CMD_TURN_OFF,
+    MLFD_CMD_GET_STATS,
+};
+
+struct MLFDRequest {
+    uint32_t cmd;
+    int32_t arg;
+};
+
+struct MLFDResponse {
+    int32_t status;             // 0 or negative errno
+    uint32_t ledsCount;
+    uint64_t framesReceived;    // frames taken from client's ring
+    uint64_t framesSent;        // merged frames sent to controller
+};
@@ -0,0 +1,482 @@
+/**
+ * @file mlfd.cpp
+ * @author Pawel Wieczorek
+ * @brief Daemon sharing MLF Controller between many local processes
+ * @date 2022-07-16
+ *
+ * Usage: mlfd [--device PATH] [--socket PATH] [--max-fps N] [--poll-us N]
+ *
+ * Daemon owns the device. Every client connected to the control socket gets
+ *  its own ring of frames in shared memory (see MLFDaemonProtocol.hpp).
+ *  Frame thread takes the newest frame of every client, draws them one on
+ *  top of another in order of priority and sends the result to controller,
+ *  no faster than controller accepts frames (flow control of MLFProtoLib)
+ *  and no faster than `--max-fps`.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "MLFProtoLib.hpp"
+#include "MLFDaemonProtocol.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+#define MAX_CLIENTS             64
+#define CONTROL_POLL_MS         100
+#define MAX_READ_RETRIES        8
+
+/************************************
+ * CLIENTS
+ ************************************/
+struct Client {
+    int sock;
+    int priority = 0;
+    uint64_t order;
+
+    /* Frame ring - mapped after HELLO */
+    MLFDRingHeader* ring = nullptr;
+    size_t ringSize = 0;
+    uint64_t readSeq = 0;
+
+    /* The newest frame taken from ring */
+    bool hasFrame = false;
+    uint16_t offset = 0, count = 0;
+    std::vector<uint32_t> frame;
+    uint64_t framesReceived = 0;
+
+    ~Client() {
+        if(ring)
+            munmap(ring, ringSize);
+        close(sock);
+    }
+};
+
+class MLFDaemon {
+    MLFProtoLib& lib;
+    int ledsCount;
+    Clock::duration minInterval;
+    Clock::duration pollInterval;
+
+    int listenSock = -1;
+    std::string socketPath;
+
+    /* Clients are added and removed by control thread only */
+    std::mutex clientsLock;
+    std::list<std::unique_ptr<Client>> clients;
+    uint64_t clientsCounter = 0;
+    bool dirty = false;
+
+    std::vector<int> merged;
+
+    /* Frame being copied from ring - swapped with client's one once whole */
+    std::vector<uint32_t> incoming;
+    std::atomic<uint64_t> framesSent {0};
+
+    bool takeFrame(Client& client);
+    void mergeFrames(void);
+    int  createRing(Client& client);
+    void handleRequest(Client& client);
+
+public:
+    MLFDaemon(MLFProtoLib& lib, int maxFps, int pollUs);
+    ~MLFDaemon();
+
+    void listen(const std::string& path);
+    void controlLoop(void);
+    void frameLoop(void);
+};
+
+static volatile sig_atomic_t stop;
+
+static void OnSignal(int sig) {
+    stop = 1;
+}
+
+MLFDaemon::MLFDaemon(MLFProtoLib& lib, int maxFps, int pollUs) : lib(lib) {
+    int top, bottom, maxPayload, deviceFps;
+
+    lib.getLedsCount(top, bottom);
+    lib.getLimits(maxPayload, deviceFps);
+    ledsCount = top + bottom;
+    merged.resize(ledsCount);
+    incoming.resize(ledsCount);
+
+    if(maxFps <= 0)
+        maxFps = deviceFps;
+    minInterval = maxFps > 0 ? std::chrono::microseconds(1000000 / maxFps) : Clock::duration(0);
+    pollInterval = std::chrono::microseconds(pollUs);
+}
+
+MLFDaemon::~MLFDaemon() {
+    if(listenSock >= 0) {
+        close(listenSock);
+        unlink(socketPath.c_str());
+    }
+}
+
+/*
+ * Ring is backed by an already unlinked POSIX shared memory object, so it
+ *  disappears together with the last of daemon and client.
+ */
+int MLFDaemon::createRing(Client& client) {
+    char name[64];
+    int fd;
+
+    snprintf(name, sizeof name, "/mlfd-%d-%llu", (int)getpid(), (unsigned long long)client.order);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if(fd < 0)
+        return -errno;
+    shm_unlink(name);
+
+    client.ringSize = MLFDRingSize(ledsCount);
+    if(ftruncate(fd, client.ringSize) < 0) {
+        close(fd);
+        return -errno;
+    }
+
+    void* mem = mmap(nullptr, client.ringSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(mem == MAP_FAILED) {
+        close(fd);
+        return -errno;
+    }
+
+    // Memory is zeroed by ftruncate - only constant fields have to be set
+    MLFDRingHeader* ring = (MLFDRingHeader*)mem;
+    ring->magic = MLFD_SHM_MAGIC;
+    ring->version = MLFD_VERSION;
+    ring->slots = MLFD_RING_SLOTS;
+    ring->ledsCount = ledsCount;
+    ring->slotStride = MLFDSlotStride(ledsCount);
+
+    client.frame.resize(ledsCount);
+    {
+        std::lock_guard<std::mutex> guard(clientsLock);
+        client.ring = ring;
+    }
+    return fd;
+}
+
+void MLFDaemon::handleRequest(Client& client) {
+    MLFDRequest req;
+    MLFDResponse resp = {};
+    int fd = -1;
+
+    // Disconnection and malformed requests are handled by caller
+    if(recv(client.sock, &req, sizeof req, 0) != sizeof req)
+        throw MLFException("client disconnected");
+
+    resp.ledsCount = ledsCount;
+    try {
+        switch(req.cmd) {
+        case MLFD_CMD_HELLO:
+            if(req.arg != MLFD_VERSION || client.ring)
+                resp.status = -EPROTO;
+            else if((fd = createRing(client)) < 0)
+                resp.status = fd;
+            break;
+        case MLFD_CMD_SET_PRIORITY: {
+            std::lock_guard<std::mutex> guard(clientsLock);
+            client.priority = req.arg;
+            dirty = true;
+            break;
+        }
+        case MLFD_CMD_SET_BRIGHTNESS:
+            if(req.arg < 0 || req.arg > 255)
+                resp.status = -EINVAL;
+            else
+                lib.setBrightness(req.arg);
+            break;
+        case MLFD_CMD_TURN_ON:
+            lib.turnOn();
+            break;
+        case MLFD_CMD_TURN_OFF:
+            lib.turnOff();
+            break;
+        case MLFD_CMD_GET_STATS: {
+            std::lock_guard<std::mutex> guard(clientsLock);
+            resp.framesReceived = client.framesReceived;
+            resp.framesSent = framesSent.load();
+            break;
+        }
+        default:
+            resp.status = -EINVAL;
+            break;
+        }
+    }
+    catch (MLFException& ex) {
+        fprintf(stderr, "mlfd: %s\n", ex.what());
+        resp.status = -EIO;
+    }
+
+    struct iovec iov = { .iov_base = &resp, .iov_len = sizeof resp };
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if(fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+    }
+
+    ssize_t ret = sendmsg(client.sock, &msg, MSG_NOSIGNAL);
+    if(fd >= 0)
+        close(fd);
+    if(ret != sizeof resp)
+        throw MLFException("client disconnected");
+}
+
+void MLFDaemon::listen(const std::string& path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if(path.size() >= sizeof addr.sun_path)
+        throw MLFException("socket path too long");
+    strcpy(addr.sun_path, path.c_str());
+
+    listenSock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(listenSock < 0)
+        throw MLFException("failed to create control socket", true);
+
+    unlink(path.c_str());
+    if(bind(listenSock, (struct sockaddr*)&addr, sizeof addr) < 0 ||
+       ::listen(listenSock, 8) < 0)
+        throw MLFException("failed to bind control socket", true);
+    socketPath = path;
+}
+
+void MLFDaemon::controlLoop(void) {
+    std::vector<struct pollfd> fds;
+    std::vector<Client*> polled;
+
+    while(!stop) {
+        fds.assign(1, { .fd = listenSock, .events = POLLIN });
+        polled.assign(1, nullptr);
+        for(auto& client : clients) {
+            fds.push_back({ .fd = client->sock, .events = POLLIN });
+            polled.push_back(client.get());
+        }
+
+        if(poll(fds.data(), fds.size(), CONTROL_POLL_MS) <= 0)
+            continue;
+
+        if(fds[0].revents & POLLIN) {
+            int sock = accept4(listenSock, nullptr, nullptr, SOCK_CLOEXEC);
+            if(sock >= 0 && clients.size() >= MAX_CLIENTS) {
+                fprintf(stderr, "mlfd: too many clients\n");
+                close(sock);
+            }
+            else if(sock >= 0) {
+                auto client = std::make_unique<Client>();
+                client->sock = sock;
+                client->order = clientsCounter++;
+
+                std::lock_guard<std::mutex> guard(clientsLock);
+                clients.push_back(std::move(client));
+            }
+        }
+
+        for(size_t i = 1; i < fds.size(); i++) {
+            if(fds[i].revents == 0)
+                continue;
+
+            try {
+                if(fds[i].revents & POLLIN)
+                    handleRequest(*polled[i]);
+                else
+                    throw MLFException("client disconnected");
+            }
+            catch (MLFException&) {
+                // Area of the client gets redrawn without it
+                std::lock_guard<std::mutex> guard(clientsLock);
+                clients.remove_if([&](auto& c) { return c.get() == polled[i]; });
+                dirty = true;
+            }
+        }
+    }
+}
+
+/*
+ * Seqlock read of the newest published frame. Writer never waits for
+ *  daemon - if it laps the ring during copying, copying is repeated.
+ *  Colors are copied aside first, so the last frame taken is never torn.
+ */
+bool MLFDaemon::takeFrame(Client& client) {
+    MLFDRingHeader* ring = client.ring;
+    uint64_t seq = ring->writeSeq.load(std::memory_order_acquire);
+
+    if(seq == client.readSeq)
+        return false;
+
+    for(int retry = 0; retry < MAX_READ_RETRIES; retry++) {
+        MLFDFrameSlot* slot = MLFDRingSlot(ring, ledsCount, seq - 1);
+        const uint32_t slotSeq = slot->seq.load(std::memory_order_acquire);
+
+        if((slotSeq & 1) == 0) {
+            const uint16_t offset = slot->offset;
+            const uint16_t count = std::min<uint32_t>(slot->count, ledsCount - std::min<uint32_t>(offset, ledsCount));
+            memcpy(incoming.data(), slot->colors, count * sizeof(uint32_t));
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(slot->seq.load(std::memory_order_relaxed) == slotSeq) {
+                client.frame.swap(incoming);
+                client.readSeq = seq;
+                client.offset = offset;
+                client.count = count;
+                client.hasFrame = true;
+                client.framesReceived++;
+                ring->readSeq.store(seq, std::memory_order_release);
+                return true;
+            }
+        }
+
+        seq = ring->writeSeq.load(std::memory_order_acquire);
+    }
+
+    // Client is writing faster than frame can be copied - try next time
+    return false;
+}
+
+void MLFDaemon::mergeFrames(void) {
+    std::vector<Client*> order;
+
+    for(auto& client : clients)
+        if(client->hasFrame)
+            order.push_back(client.get());
+
+    // Frames of higher priority go last, the older client wins a tie
+    std::sort(order.begin(), order.end(), [](Client* a, Client* b) {
+        return a->priority != b->priority ? a->priority < b->priority : a->order > b->order;
+    });
+
+    std::fill(merged.begin(), merged.end(), 0);
+    for(Client* client : order)
+        memcpy(&merged[client->offset], client->frame.data(), client->count * sizeof(uint32_t));
+}
+
+void MLFDaemon::frameLoop(void) {
+    Clock::time_point lastSent;
+
+    while(!stop) {
+        bool changed;
+        {
+            std::lock_guard<std::mutex> guard(clientsLock);
+            changed = dirty;
+            dirty = false;
+            for(auto& client : clients)
+                if(client->ring && takeFrame(*client))
+                    changed = true;
+            if(changed)
+                mergeFrames();
+        }
+
+        if(!changed) {
+            std::this_thread::sleep_for(pollInterval);
+            continue;
+        }
+
+        std::this_thread::sleep_until(lastSent + minInterval);
+        lastSent = Clock::now();
+
+        // Blocks until controller is able to take the frame
+        lib.setColors(merged.data(), ledsCount);
+        framesSent++;
+    }
+}
+
+
+/************************************
+ * ENTRY POINT
+ ************************************/
+static void Usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --device PATH    MLF Controller (found automatically by default)\n"
+            "  --socket PATH    control socket (default: $MLFD_SOCKET or " MLFD_DEFAULT_SOCKET ")\n"
+            "  --max-fps N      limit of frames sent per second (default: controller's limit)\n"
+            "  --poll-us N      interval of checking rings for new frames (default: 1000)\n",
+            name);
+}
+
+int main(int argc, char** argv) {
+    std::string device, socketPath;
+    int maxFps = 0, pollUs = 1000;
+
+    if(getenv("MLFD_SOCKET"))
+        socketPath = getenv("MLFD_SOCKET");
+    else
+        socketPath = MLFD_DEFAULT_SOCKET;
+
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--device") && i + 1 < argc)
+            device = argv[++i];
+        else if(!strcmp(argv[i], "--socket") && i + 1 < argc)
+            socketPath = argv[++i];
+        else if(!strcmp(argv[i], "--max-fps") && i + 1 < argc)
+            maxFps = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--poll-us") && i + 1 < argc)
+            pollUs = atoi(argv[++i]);
+        else {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    struct sigaction sa = {};
+    sa.sa_handler = OnSignal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    try {
+        MLFProtoLib lib(device);
+        MLFDaemon daemon(lib, maxFps, pollUs);
+        std::exception_ptr frameError;
+
+        daemon.listen(socketPath);
+        fprintf(stderr, "mlfd: listening on %s\n", socketPath.c_str());
+
+        std::thread frameThread([&]() {
+            try {
+                daemon.frameLoop();
+            }
+            catch (...) {
+                frameError = std::current_exception();
+                stop = 1;
+            }
+        });
+
+        daemon.controlLoop();
+        frameThread.join();
+        if(frameError)
+            std::rethrow_exception(frameError);
+    }
+    catch (std::exception& ex) {
+        fprintf(stderr, "mlfd: %s\n", ex.what());
+        return 1;
+    }
+    return 0;
+}
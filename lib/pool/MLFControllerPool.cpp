@@ -0,0 +1,474 @@
+/**
+ * @file MLFControllerPool.cpp
+ * @author Pawel Wieczorek
+ * @brief Many MLF Controllers driven by a single event loop thread
+ * @date 2022-07-20
+ */
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "MLFControllerPool.hpp"
+#include "MLFPacket.hpp"
+
+/*
+ * Every controller has a page of buffer area - request (up to a full
+ *  packet) at its start and response behind it. Responses to frame
+ *  packets are just a header and footer, so a small buffer is enough.
+ */
+#define CONTROLLER_BUFFER_SIZE  4096
+#define TX_BUFFER_SIZE          2560
+#define RX_BUFFER_SIZE          (CONTROLLER_BUFFER_SIZE - TX_BUFFER_SIZE)
+
+#define RESPONSE_TIMEOUT_MS     200
+#define HANDSHAKE_TIMEOUT_MS    1000
+#define MAX_COMPLETIONS         64
+
+#define SET_COLOR_MAX_LEDS      ((MLF_MAX_DATA_SIZE - sizeof(struct MLF_req_cmd_set_color)) / sizeof(int))
+#define RGB24_BYTES_PER_LED     3
+#define FRAGMENT_PAYLOAD(LEDS, BPL) ((int)sizeof(struct MLF_req_cmd_set_color_fragment) + (LEDS) * (BPL))
+#define USB_FS_PACKET_SIZE      64
+
+static_assert(TX_BUFFER_SIZE >= MLF_PACKET_OVERHEAD + MLF_MAX_DATA_SIZE, "request doesn't fit into buffer");
+
+static bool EndsWithFullUSBPacket(int payload) {
+    return MLFPacketSize(payload) % USB_FS_PACKET_SIZE == 0;
+}
+
+static bool IsEventCode(int code) {
+    return code > MLF_RET_PING && code < MLF_RET_INVALID_CMD;
+}
+
+/* Put header and footer around body already written behind the header */
+static size_t FinishPacket(uint8_t* out, int cmd, int len) {
+    struct MLF_req_packet_header header = {
+        .magic = MLF_HEADER_MAGIC,
+        .cmd = (uint8_t)cmd,
+        .data_size = (uint16_t)len
+    };
+    struct MLF_packet_footer footer = {
+        .magic = MLF_FOOTER_MAGIC
+    };
+
+    memcpy(out, &header, sizeof header);
+    memcpy(out + sizeof header + len, &footer, sizeof footer);
+    return MLFPacketSize(len);
+}
+
+static void ConfigureSerialPort(int fd) {
+    struct termios tty;
+
+    if(tcgetattr(fd, &tty) != 0)
+        throw MLFException("failed to setup usb connection - get attrs", true);
+
+    cfmakeraw(&tty);
+    cfsetospeed(&tty, B1152000);
+    cfsetispeed(&tty, B1152000);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cflag &= ~CRTSCTS;
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+
+    if(tcsetattr(fd, TCSANOW, &tty) != 0)
+        throw MLFException("failed to setup usb connection - set attrs", true);
+}
+
+/************************************
+ * SETUP
+ ************************************/
+
+MLFControllerPool::MLFControllerPool(int maxControllers, MLFPoolBackend backend)
+    : maxControllers(maxControllers), controllers(maxControllers) {
+    if(maxControllers <= 0)
+        throw MLFException("Invalid number of controllers");
+
+    if(backend != MLFPoolBackend::Epoll) {
+        engine = MLFCreateIOUringEngine(maxControllers);
+        if(!engine && backend == MLFPoolBackend::IOUring)
+            throw MLFException("io_uring is not available");
+    }
+    if(!engine)
+        engine = MLFCreateEpollEngine(maxControllers);
+
+    bufferAreaSize = (size_t)maxControllers * CONTROLLER_BUFFER_SIZE;
+    void* area = mmap(nullptr, bufferAreaSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(area == MAP_FAILED)
+        throw MLFException("failed to allocate buffers of controllers", true);
+    bufferArea = (uint8_t*) area;
+
+    try {
+        engine->setBufferArea(bufferArea, bufferAreaSize);
+    }
+    catch (...) {
+        munmap(bufferArea, bufferAreaSize);
+        throw;
+    }
+
+    ready.reserve(maxControllers);
+    readyTaken.reserve(maxControllers);
+    loopThread = std::thread(&MLFControllerPool::loop, this);
+}
+
+MLFControllerPool::~MLFControllerPool() {
+    loopStop.store(true);
+    engine->wake();
+    loopThread.join();
+
+    // Transfers in flight are cancelled by closing engine first
+    engine.reset();
+    for(auto& ctrl : controllers) {
+        if(ctrl && ctrl->fd >= 0)
+            close(ctrl->fd);
+    }
+    munmap(bufferArea, bufferAreaSize);
+}
+
+/**
+ * @brief Ask controller for info on the caller's thread
+ *
+ * Controller isn't known to the event loop yet, so it can be talked to
+ *  with plain blocking I/O.
+ */
+void MLFControllerPool::handshake(Controller& ctrl) {
+    struct MLF_req_cmd_get_info req = {
+        .protocol_version = MLF_PROTOCOL_VERSION
+    };
+    char packet[MLF_PACKET_OVERHEAD + sizeof req];
+    char in[MLF_PACKET_OVERHEAD + MLF_MAX_DATA_SIZE];
+    const size_t packetLen = MLFEncodePacket(packet, MLF_HEADER_MAGIC, MLF_CMD_GET_INFO, &req, sizeof req);
+    const auto deadline = Clock::now() + std::chrono::milliseconds(HANDSHAKE_TIMEOUT_MS);
+    size_t used = 0;
+
+    tcflush(ctrl.fd, TCIOFLUSH);
+    if(write(ctrl.fd, packet, packetLen) != (ssize_t)packetLen)
+        throw MLFException("failed to send data to MLF Controller", true);
+
+    while(true) {
+        int code, len;
+        const char* data;
+        const int size = MLFDecodePacket(in, used, MLF_RESP_HEADER_MAGIC, &code, &data, &len);
+
+        if(size < 0)
+            throw MLFException("received malformed packet from MLF Controller");
+        if(size > 0 && IsEventCode(code)) {
+            memmove(in, in + size, used - size);
+            used -= size;
+            continue;
+        }
+        if(size > 0) {
+            auto ext = (const struct MLF_resp_cmd_get_info_ext*) data;
+            if(code != MLF_RET_OK || len < (int)sizeof(ext->info))
+                throw MLFException("failed to get info from MLF Controller");
+
+            ctrl.ledsCount = ext->info.leds_count_top + ext->info.leds_count_bottom;
+            if(len < (int)sizeof(*ext)) {
+                ctrl.caps = MLF_CAP_PIXFMT_RGB32;
+                ctrl.maxPayload = MLF_MAX_DATA_SIZE;
+            }
+            else {
+                ctrl.caps = ext->caps;
+                ctrl.maxPayload = std::min<int>(ext->max_payload, MLF_MAX_DATA_SIZE);
+            }
+            return;
+        }
+
+        struct pollfd pfd = {
+            .fd = ctrl.fd,
+            .events = POLLIN
+        };
+        const int timeoutMs = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+        if(timeoutMs <= 0 || poll(&pfd, 1, timeoutMs) <= 0)
+            throw MLFException("MLF Controller didn't respond");
+
+        const ssize_t ret = read(ctrl.fd, in + used, sizeof(in) - used);
+        if(ret <= 0)
+            throw MLFException("failed to receive data from MLF Controller", true);
+        used += ret;
+    }
+}
+
+int MLFControllerPool::addController(const std::string& path) {
+    std::lock_guard<std::mutex> lock(addLock);
+    const int id = controllersCount.load();
+
+    if(id >= maxControllers)
+        throw MLFException("Too many controllers in pool");
+
+    auto ctrl = std::make_unique<Controller>();
+    ctrl->path = path;
+    ctrl->tx = bufferArea + (size_t)id * CONTROLLER_BUFFER_SIZE;
+    ctrl->rx = ctrl->tx + TX_BUFFER_SIZE;
+
+    // Blocking descriptor - io_uring polls it internally
+    ctrl->fd = open(path.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if(ctrl->fd < 0)
+        throw MLFException("failed to open MLF Controller device", true);
+
+    try {
+        ConfigureSerialPort(ctrl->fd);
+        handshake(*ctrl);
+        engine->attach(id, ctrl->fd);
+    }
+    catch (...) {
+        close(ctrl->fd);
+        throw;
+    }
+
+    // Loop thread sees controller once the count is published
+    controllers[id] = std::move(ctrl);
+    controllersCount.store(id + 1);
+    return id;
+}
+
+MLFControllerPool::Controller& MLFControllerPool::get(int id) const {
+    if(id < 0 || id >= controllersCount.load())
+        throw MLFException("Invalid controller ID");
+    return *controllers[id];
+}
+
+int MLFControllerPool::getControllersCount(void) const {
+    return controllersCount.load();
+}
+
+int MLFControllerPool::getLedsCount(int id) const {
+    return get(id).ledsCount;
+}
+
+void MLFControllerPool::getStats(int id, MLFPoolStats& stats) const {
+    Controller& ctrl = get(id);
+    std::lock_guard<std::mutex> lock(ctrl.lock);
+
+    stats = ctrl.stats;
+    stats.latencyAvgUs = stats.framesSent ? ctrl.latencySumUs / stats.framesSent : 0;
+}
+
+const char* MLFControllerPool::getBackendName(void) const {
+    return engine->name();
+}
+
+/************************************
+ * FRAMES
+ ************************************/
+
+void MLFControllerPool::setColors(int id, const int* colors, int len) {
+    Controller& ctrl = get(id);
+    const bool fragments = ctrl.caps & MLF_CAP_FRAGMENTS;
+
+    if(len <= 0 || (!fragments && len > (int)SET_COLOR_MAX_LEDS))
+        throw MLFException("frame is too large for MLF Controller");
+
+    {
+        std::lock_guard<std::mutex> lock(ctrl.lock);
+        if(ctrl.hasPending)
+            ctrl.stats.framesSuperseded++;
+        ctrl.pending.assign(colors, colors + len);
+        ctrl.hasPending = true;
+        ctrl.submittedAt = Clock::now();
+        ctrl.stats.framesSubmitted++;
+    }
+
+    // Controller already waits for the loop to pick its mailbox
+    if(ctrl.queued.exchange(true))
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(readyLock);
+        ready.push_back(id);
+    }
+    if(!wakePending.exchange(true))
+        engine->wake();
+}
+
+void MLFControllerPool::takeReady(void) {
+    // Cleared first - controllers queued from now on wake the loop again
+    wakePending.store(false);
+    {
+        std::lock_guard<std::mutex> lock(readyLock);
+        readyTaken.swap(ready);
+    }
+
+    for(int id : readyTaken) {
+        controllers[id]->queued.store(false);
+        if(!controllers[id]->busy)
+            startFrame(id);
+    }
+    readyTaken.clear();
+}
+
+void MLFControllerPool::startFrame(int id) {
+    Controller& ctrl = *controllers[id];
+
+    {
+        std::lock_guard<std::mutex> lock(ctrl.lock);
+        if(!ctrl.hasPending)
+            return;
+        ctrl.frame.swap(ctrl.pending);
+        ctrl.frameSubmittedAt = ctrl.submittedAt;
+        ctrl.hasPending = false;
+    }
+
+    ctrl.busy = true;
+    ctrl.offset = 0;
+    ctrl.frameId++;
+    sendPacket(id);
+}
+
+/**
+ * @brief Encode the next packet of frame into controller's tx buffer and
+ *          start its transfer
+ *
+ * Packets are chosen the same way as by MLFProtoLib: RGB24 fragments when
+ *  available, single SET_COLOR otherwise and RGB32 fragments for frames
+ *  not fitting into it.
+ */
+void MLFControllerPool::sendPacket(int id) {
+    Controller& ctrl = *controllers[id];
+    uint8_t* body = ctrl.tx + sizeof(struct MLF_req_packet_header);
+    const int count = ctrl.frame.size();
+    const bool fragments = ctrl.caps & MLF_CAP_FRAGMENTS;
+    const bool rgb24 = fragments && (ctrl.caps & MLF_CAP_PIXFMT_RGB24);
+    size_t txLen;
+
+    if(!rgb24 && count <= (int)SET_COLOR_MAX_LEDS) {
+        auto data = (struct MLF_req_cmd_set_color*) body;
+        data->strip = 0;
+        memcpy(data->colors, ctrl.frame.data(), count * sizeof(int));
+        txLen = FinishPacket(ctrl.tx, MLF_CMD_SET_COLOR, sizeof(*data) + count * sizeof(int));
+        ctrl.lastPacket = true;
+    }
+    else {
+        const int bytesPerLed = rgb24 ? RGB24_BYTES_PER_LED : sizeof(int);
+        const int maxLeds = (ctrl.maxPayload - (int)sizeof(struct MLF_req_cmd_set_color_fragment)) / bytesPerLed;
+        int fragmentLeds = std::min(count - ctrl.offset, maxLeds);
+        const int rest = count - ctrl.offset - fragmentLeds;
+
+        // Same USB packet boundary avoidance as MLFProtoLib::sendFrameFragments
+        if(rest > 0 && fragmentLeds > 1 &&
+           (EndsWithFullUSBPacket(FRAGMENT_PAYLOAD(fragmentLeds, bytesPerLed)) ||
+            (rest < maxLeds && EndsWithFullUSBPacket(FRAGMENT_PAYLOAD(rest, bytesPerLed)))))
+            fragmentLeds--;
+
+        auto data = (struct MLF_req_cmd_set_color_fragment*) body;
+        const int* colors = ctrl.frame.data() + ctrl.offset;
+        ctrl.lastPacket = ctrl.offset + fragmentLeds >= count;
+        data->frame_id = ctrl.frameId;
+        data->flags = (ctrl.lastPacket ? MLF_FRAGMENT_LAST : 0) | (rgb24 ? MLF_FRAGMENT_RGB24 : 0);
+        data->offset = (uint16_t)ctrl.offset;
+
+        if(rgb24) {
+            uint8_t* out = (uint8_t*) data->colors;
+            for(int i = 0; i < fragmentLeds; i++, out += RGB24_BYTES_PER_LED) {
+                out[0] = colors[i] & 0xff;
+                out[1] = (colors[i] >> 8) & 0xff;
+                out[2] = (colors[i] >> 16) & 0xff;
+            }
+        }
+        else {
+            memcpy(data->colors, colors, fragmentLeds * sizeof(int));
+        }
+
+        txLen = FinishPacket(ctrl.tx, MLF_CMD_SET_COLOR_FRAGMENT, FRAGMENT_PAYLOAD(fragmentLeds, bytesPerLed));
+        ctrl.offset += fragmentLeds;
+    }
+
+    ctrl.rxUsed = 0;
+    engine->transfer(id, ctrl.tx, txLen, ctrl.rx, RX_BUFFER_SIZE, RESPONSE_TIMEOUT_MS);
+}
+
+/**
+ * @brief Handle bytes of response read by a transfer
+ *
+ * Response may arrive in pieces or be preceded by events - the rest of it
+ *  is read by a transfer without request.
+ */
+void MLFControllerPool::complete(int id, int result) {
+    Controller& ctrl = *controllers[id];
+
+    if(result < 0) {
+        finishFrame(id, false);
+        return;
+    }
+    ctrl.rxUsed += result;
+
+    while(true) {
+        int code, len;
+        const char* data;
+        const int size = MLFDecodePacket((const char*) ctrl.rx, ctrl.rxUsed, MLF_RESP_HEADER_MAGIC,
+                                         &code, &data, &len);
+
+        if(size < 0 || (size == 0 && ctrl.rxUsed == RX_BUFFER_SIZE)) {
+            finishFrame(id, false);
+            return;
+        }
+        if(size == 0) {
+            engine->transfer(id, nullptr, 0, ctrl.rx + ctrl.rxUsed, RX_BUFFER_SIZE - ctrl.rxUsed,
+                             RESPONSE_TIMEOUT_MS);
+            return;
+        }
+        if(IsEventCode(code)) {
+            memmove(ctrl.rx, ctrl.rx + size, ctrl.rxUsed - size);
+            ctrl.rxUsed -= size;
+            continue;
+        }
+
+        if(code != MLF_RET_OK) {
+            finishFrame(id, false);
+            return;
+        }
+        break;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(ctrl.lock);
+        ctrl.stats.packetsSent++;
+    }
+    if(ctrl.lastPacket)
+        finishFrame(id, true);
+    else
+        sendPacket(id);
+}
+
+void MLFControllerPool::finishFrame(int id, bool ok) {
+    Controller& ctrl = *controllers[id];
+    const double latencyUs = std::chrono::duration<double, std::micro>(Clock::now() - ctrl.frameSubmittedAt).count();
+
+    // Drop whatever is left of the failed exchange, next frame starts clean
+    if(!ok)
+        tcflush(ctrl.fd, TCIOFLUSH);
+
+    {
+        std::lock_guard<std::mutex> lock(ctrl.lock);
+        if(ok) {
+            ctrl.stats.framesSent++;
+            ctrl.latencySumUs += latencyUs;
+            ctrl.stats.latencyMaxUs = std::max(ctrl.stats.latencyMaxUs, latencyUs);
+        }
+        else {
+            ctrl.stats.framesFailed++;
+        }
+    }
+
+    ctrl.busy = false;
+    startFrame(id);
+}
+
+void MLFControllerPool::loop(void) {
+    MLFIOCompletion done[MAX_COMPLETIONS];
+
+    while(!loopStop.load()) {
+        const int count = engine->wait(done, MAX_COMPLETIONS);
+
+        for(int i = 0; i < count; i++) {
+            if(done[i].ctrl == MLF_IO_WAKEUP)
+                takeReady();
+            else
+                complete(done[i].ctrl, done[i].result);
+        }
+    }
+}
@@ -0,0 +1,132 @@
+/**
+ * @file MLFControllerPool.hpp
+ * @author Pawel Wieczorek
+ * @brief Many MLF Controllers driven by a single event loop thread
+ * @date 2022-07-20
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "MLFIOEngine.hpp"
+#include "MLFProtoLib.hpp"
+
+enum class MLFPoolBackend {
+    Auto,       // io_uring if kernel allows it, epoll otherwise
+    IOUring,
+    Epoll,
+};
+
+/**
+ * @brief Statistics of frames of a single controller
+ *
+ * Latency is measured from `setColors` to acknowledgement of the last
+ *  packet of frame. Frame replaced by a newer one before it was started
+ *  is counted as superseded.
+ */
+struct MLFPoolStats {
+    uint64_t framesSubmitted;
+    uint64_t framesSent;
+    uint64_t framesSuperseded;
+    uint64_t framesFailed;
+    uint64_t packetsSent;
+    double latencyAvgUs;
+    double latencyMaxUs;
+};
+
+/**
+ * @brief Pool of controllers sharing one I/O thread
+ *
+ * Unlike MLFProtoLib `setColors` never blocks - frame is put into
+ *  controller's mailbox and sent by the event loop as soon as the previous
+ *  one is acknowledged. Every packet is a single transfer of I/O engine
+ *  (write of request linked with read of response), so the loop thread
+ *  only encodes packets and reacts to completions.
+ *
+ * Controllers are driven without flow control or clock sync, they can be
+ *  added at any time but not removed.
+ */
+class MLFControllerPool {
+    typedef std::chrono::steady_clock Clock;
+
+    struct Controller {
+        int fd = -1;
+        std::string path;
+        int ledsCount;
+        uint32_t caps;
+        int maxPayload;
+
+        /* Buffers in area registered with I/O engine */
+        uint8_t* tx;
+        uint8_t* rx;
+        size_t rxUsed;
+
+        /* Mailbox and stats, shared with callers of `setColors` */
+        std::mutex lock;
+        std::vector<int> pending;
+        bool hasPending = false;
+        Clock::time_point submittedAt;
+        std::atomic<bool> queued {false};
+        MLFPoolStats stats = {};
+        double latencySumUs = 0;
+
+        /* Frame being sent, owned by the event loop */
+        std::vector<int> frame;
+        Clock::time_point frameSubmittedAt;
+        bool busy = false;
+        bool lastPacket;
+        int offset;
+        uint8_t frameId = 0;
+    };
+
+    std::unique_ptr<MLFIOEngine> engine;
+    int maxControllers;
+    std::vector<std::unique_ptr<Controller>> controllers;
+    std::atomic<int> controllersCount {0};
+    std::mutex addLock;
+
+    uint8_t* bufferArea = nullptr;
+    size_t bufferAreaSize = 0;
+
+    /* Controllers with a new frame in mailbox */
+    std::mutex readyLock;
+    std::vector<int> ready, readyTaken;
+    std::atomic<bool> wakePending {false};
+
+    std::thread loopThread;
+    std::atomic<bool> loopStop {false};
+
+    Controller& get(int id) const;
+    void handshake(Controller& ctrl);
+    void loop(void);
+    void takeReady(void);
+    void startFrame(int id);
+    void sendPacket(int id);
+    void complete(int id, int result);
+    void finishFrame(int id, bool ok);
+
+public:
+    MLFControllerPool(int maxControllers = 256, MLFPoolBackend backend = MLFPoolBackend::Auto);
+    ~MLFControllerPool();
+
+    MLFControllerPool(const MLFControllerPool&) = delete;
+    MLFControllerPool& operator=(const MLFControllerPool&) = delete;
+
+    /* Open controller and ask it for info, return its ID */
+    int addController(const std::string& path);
+
+    int getControllersCount(void) const;
+    int getLedsCount(int id) const;
+    void getStats(int id, MLFPoolStats& stats) const;
+    const char* getBackendName(void) const;
+
+    /* Queue frame for controller, replacing frame which wasn't started yet */
+    void setColors(int id, const int* colors, int len);
+};
@@ -0,0 +1,59 @@
+/**
+ * @file MLFIOEngine.hpp
+ * @author Pawel Wieczorek
+ * @brief Event loop backends of MLFControllerPool (io_uring and epoll)
+ * @date 2022-07-20
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+
+/* `ctrl` of completion reporting that `wake` was called */
+#define MLF_IO_WAKEUP           -1
+
+/**
+ * @brief Result of a single transfer
+ *
+ * `result` is the number of bytes read (> 0) or negative errno
+ *  (-ETIMEDOUT if controller didn't respond in time).
+ */
+struct MLFIOCompletion {
+    int ctrl;
+    int result;
+};
+
+/**
+ * @brief Asynchronous I/O on descriptors of many controllers
+ *
+ * Transfer is a write of the whole request followed by a single read of
+ *  whatever part of response is available. Each controller has at most one
+ *  transfer in progress and it always ends with exactly one completion.
+ *  All methods except `wake` are called by the event loop thread only.
+ */
+class MLFIOEngine {
+public:
+    virtual ~MLFIOEngine() {}
+
+    virtual const char* name(void) const = 0;
+
+    /* Buffers passed to `transfer` always point into this area */
+    virtual void setBufferArea(uint8_t* area, size_t size) = 0;
+
+    virtual void attach(int ctrl, int fd) = 0;
+
+    /* `txLen` may be 0 - then only response is read */
+    virtual void transfer(int ctrl, const uint8_t* tx, size_t txLen,
+                          uint8_t* rx, size_t rxLen, int timeoutMs) = 0;
+
+    /* Submit queued transfers and wait for at least one completion */
+    virtual int wait(MLFIOCompletion* out, int max) = 0;
+
+    /* Make `wait` return MLF_IO_WAKEUP completion (from any thread) */
+    virtual void wake(void) = 0;
+};
+
+/* Return nullptr if io_uring isn't available (old kernel, seccomp, ...) */
+std::unique_ptr<MLFIOEngine> MLFCreateIOUringEngine(int maxControllers);
+std::unique_ptr<MLFIOEngine> MLFCreateEpollEngine(int maxControllers);
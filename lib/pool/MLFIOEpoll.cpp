@@ -0,0 +1,270 @@
+/**
+ * @file MLFIOEpoll.cpp
+ * @author Pawel Wieczorek
+ * @brief epoll backend of MLFControllerPool
+ * @date 2022-07-20
+ *
+ * Fallback for kernels without io_uring. Requests are written right away
+ *  (non-blocking, rest of it on EPOLLOUT) and responses are read once
+ *  descriptor becomes readable, so a round trip costs write, epoll_wait
+ *  and read syscalls.
+ */
+#include <chrono>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
+
+#include "MLFIOEngine.hpp"
+#include "MLFProtoLib.hpp"
+
+#define MAX_EPOLL_EVENTS        256
+#define WAKE_EVENT_DATA         UINT32_MAX
+
+using Clock = std::chrono::steady_clock;
+
+
+class MLFIOEpoll : public MLFIOEngine {
+    struct Op {
+        int fd = -1;
+        const uint8_t* tx;
+        size_t txLen, txDone;
+        uint8_t* rx;
+        size_t rxLen;
+        bool active = false;
+        bool writing = false;
+        uint32_t seq = 0;
+    };
+
+    /* Every transfer has the same timeout, so deadlines come in order */
+    struct Deadline {
+        Clock::time_point at;
+        int ctrl;
+        uint32_t seq;
+    };
+
+    int ep = -1;
+    int wakeFd = -1;
+    std::vector<Op> ops;
+    std::vector<MLFIOCompletion> ready;
+    std::deque<Deadline> deadlines;
+
+    void watchWrites(int ctrl, bool enable);
+    void tryWrite(int ctrl);
+    void tryRead(int ctrl, uint32_t events);
+    void finish(int ctrl, int result);
+    int nextTimeoutMs(void);
+
+public:
+    MLFIOEpoll(int maxControllers);
+    ~MLFIOEpoll();
+
+    const char* name(void) const override;
+    void setBufferArea(uint8_t* area, size_t size) override;
+    void attach(int ctrl, int fd) override;
+    void transfer(int ctrl, const uint8_t* tx, size_t txLen,
+                  uint8_t* rx, size_t rxLen, int timeoutMs) override;
+    int wait(MLFIOCompletion* out, int max) override;
+    void wake(void) override;
+};
+
+MLFIOEpoll::MLFIOEpoll(int maxControllers) : ops(maxControllers) {
+    struct epoll_event ev = {};
+
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.u32 = WAKE_EVENT_DATA;
+    if(ep < 0 || wakeFd < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, wakeFd, &ev) < 0) {
+        MLFException ex("failed to set up epoll", true);
+        if(ep >= 0)
+            close(ep);
+        if(wakeFd >= 0)
+            close(wakeFd);
+        throw ex;
+    }
+}
+
+MLFIOEpoll::~MLFIOEpoll() {
+    if(ep >= 0)
+        close(ep);
+    if(wakeFd >= 0)
+        close(wakeFd);
+    ep = wakeFd = -1;
+}
+
+const char* MLFIOEpoll::name(void) const {
+    return "epoll";
+}
+
+void MLFIOEpoll::setBufferArea(uint8_t* area, size_t size) {
+    // Plain read and write don't need buffers to be known upfront
+}
+
+void MLFIOEpoll::attach(int ctrl, int fd) {
+    struct epoll_event ev = {};
+
+    ops[ctrl].fd = fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    // Level triggered - controller never sends anything unless asked to
+    ev.events = EPOLLIN;
+    ev.data.u32 = ctrl;
+    if(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0)
+        throw MLFException("failed to add controller to epoll", true);
+}
+
+void MLFIOEpoll::watchWrites(int ctrl, bool enable) {
+    struct epoll_event ev = {};
+    Op& op = ops[ctrl];
+
+    if(op.writing == enable)
+        return;
+    op.writing = enable;
+    ev.events = EPOLLIN | (enable ? EPOLLOUT : 0);
+    ev.data.u32 = ctrl;
+    epoll_ctl(ep, EPOLL_CTL_MOD, op.fd, &ev);
+}
+
+void MLFIOEpoll::finish(int ctrl, int result) {
+    ops[ctrl].active = false;
+    watchWrites(ctrl, false);
+    ready.push_back({ ctrl, result });
+}
+
+void MLFIOEpoll::tryWrite(int ctrl) {
+    Op& op = ops[ctrl];
+
+    while(op.txDone < op.txLen) {
+        const ssize_t ret = write(op.fd, op.tx + op.txDone, op.txLen - op.txDone);
+        if(ret > 0) {
+            op.txDone += ret;
+        }
+        else if(ret < 0 && errno == EAGAIN) {
+            watchWrites(ctrl, true);
+            return;
+        }
+        else if(ret < 0 && errno != EINTR) {
+            finish(ctrl, -errno);
+            return;
+        }
+    }
+
+    watchWrites(ctrl, false);
+}
+
+void MLFIOEpoll::tryRead(int ctrl, uint32_t events) {
+    Op& op = ops[ctrl];
+    uint8_t discard[256];
+    ssize_t ret;
+
+    // Leftovers of a timed out transfer
+    if(!op.active) {
+        ret = read(op.fd, discard, sizeof discard);
+        if(ret <= 0 && (events & (EPOLLHUP | EPOLLERR)))
+            epoll_ctl(ep, EPOLL_CTL_DEL, op.fd, nullptr);
+        return;
+    }
+    if(op.txDone < op.txLen)
+        return;
+
+    ret = read(op.fd, op.rx, op.rxLen);
+    if(ret > 0)
+        finish(ctrl, ret);
+    else if(ret == 0)
+        finish(ctrl, -EIO);
+    else if(errno != EAGAIN && errno != EINTR)
+        finish(ctrl, -errno);
+}
+
+void MLFIOEpoll::transfer(int ctrl, const uint8_t* tx, size_t txLen,
+                          uint8_t* rx, size_t rxLen, int timeoutMs) {
+    Op& op = ops[ctrl];
+
+    op.tx = tx;
+    op.txLen = txLen;
+    op.txDone = 0;
+    op.rx = rx;
+    op.rxLen = rxLen;
+    op.active = true;
+    op.seq++;
+    deadlines.push_back({ Clock::now() + std::chrono::milliseconds(timeoutMs), ctrl, op.seq });
+    tryWrite(ctrl);
+}
+
+/* Time to the nearest deadline of a transfer, -1 if there's none */
+int MLFIOEpoll::nextTimeoutMs(void) {
+    // Drop deadlines of finished transfers
+    while(!deadlines.empty()) {
+        const Deadline& d = deadlines.front();
+        if(ops[d.ctrl].active && ops[d.ctrl].seq == d.seq)
+            break;
+        deadlines.pop_front();
+    }
+
+    if(!ready.empty())
+        return 0;
+    if(deadlines.empty())
+        return -1;
+
+    const Clock::time_point now = Clock::now();
+    if(deadlines.front().at <= now)
+        return 0;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(deadlines.front().at - now).count() + 1;
+}
+
+int MLFIOEpoll::wait(MLFIOCompletion* out, int max) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int count = 0;
+
+    while(ready.empty()) {
+        const int n = epoll_wait(ep, events, MAX_EPOLL_EVENTS, nextTimeoutMs());
+        if(n < 0 && errno != EINTR)
+            throw MLFException("epoll_wait failed", true);
+
+        for(int i = 0; i < n; i++) {
+            const uint32_t ctrl = events[i].data.u32;
+
+            if(ctrl == WAKE_EVENT_DATA) {
+                uint64_t value;
+                if(read(wakeFd, &value, sizeof value) > 0)
+                    ready.push_back({ MLF_IO_WAKEUP, 0 });
+                continue;
+            }
+
+            if((events[i].events & EPOLLOUT) && ops[ctrl].active)
+                tryWrite(ctrl);
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                tryRead(ctrl, events[i].events);
+        }
+
+        // Controllers which didn't respond in time
+        const Clock::time_point now = Clock::now();
+        while(!deadlines.empty() && deadlines.front().at <= now) {
+            const Deadline d = deadlines.front();
+            deadlines.pop_front();
+            if(ops[d.ctrl].active && ops[d.ctrl].seq == d.seq)
+                finish(d.ctrl, -ETIMEDOUT);
+        }
+    }
+
+    for(; count < max && count < (int)ready.size(); count++)
+        out[count] = ready[count];
+    ready.erase(ready.begin(), ready.begin() + count);
+    return count;
+}
+
+void MLFIOEpoll::wake(void) {
+    const uint64_t one = 1;
+
+    if(write(wakeFd, &one, sizeof one) < 0) {
+        // Counter can't overflow in practice - loop is woken anyway
+    }
+}
+
+std::unique_ptr<MLFIOEngine> MLFCreateEpollEngine(int maxControllers) {
+    return std::unique_ptr<MLFIOEngine>(new MLFIOEpoll(maxControllers));
+}
@@ -0,0 +1,386 @@
+/**
+ * @file MLFIOUring.cpp
+ * @author Pawel Wieczorek
+ * @brief io_uring backend of MLFControllerPool
+ * @date 2022-07-20
+ *
+ * Ring is set up with raw syscalls, so liburing isn't needed. Every
+ *  transfer is a chain of 3 SQEs:
+ *   WRITE(_FIXED) -> READ(_FIXED) -> LINK_TIMEOUT
+ *  so a whole round trip with controller costs no syscall on its own -
+ *  chains of all controllers are submitted with a single io_uring_enter,
+ *  which also waits for completions. Frame buffers of all controllers are
+ *  registered with kernel, unless it's not allowed (RLIMIT_MEMLOCK).
+ */
+#include "MLFIOEngine.hpp"
+
+#ifdef MLF_POOL_HAVE_IO_URING
+
+#include <algorithm>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#include "MLFProtoLib.hpp"
+
+/* Chain of a single transfer */
+#define CHAIN_SQES              3
+#define MAX_RING_ENTRIES        32768
+
+/* user_data is (ctrl << 2) | kind */
+enum OpKind {
+    OP_WRITE,
+    OP_READ,
+    OP_TIMEOUT,
+};
+#define WAKE_USER_DATA          UINT64_MAX
+
+static int SysSetup(unsigned entries, struct io_uring_params* p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int SysEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int SysRegister(int fd, unsigned opcode, const void* arg, unsigned nrArgs) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+
+class MLFIOUring : public MLFIOEngine {
+    struct Op {
+        int fd = -1;
+        const uint8_t* tx;
+        size_t txLen, txDone;
+        uint8_t* rx;
+        size_t rxLen;
+        int inflight = 0;
+        int result;
+        bool retry;
+        struct __kernel_timespec timeout;
+    };
+
+    int ring = -1;
+    int wakeFd = -1;
+
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0, cqRingSize = 0;
+    struct io_uring_sqe* sqes = (struct io_uring_sqe*) MAP_FAILED;
+    size_t sqesSize = 0;
+
+    unsigned *sqHead, *sqTail, *sqArray, sqMask, sqEntries;
+    unsigned *cqHead, *cqTail, cqMask;
+    struct io_uring_cqe* cqes;
+    unsigned sqLocalTail = 0;
+    unsigned toSubmit = 0;
+
+    bool fixedBuffers = false;
+    std::vector<Op> ops;
+
+    uint64_t wakeValue;
+    bool wakeArmed = false;
+
+    void unmap(void);
+    struct io_uring_sqe* getSqe(void);
+    void enter(unsigned minComplete);
+    void queueChain(int ctrl);
+    void fail(Op& op, int error);
+
+public:
+    MLFIOUring(int maxControllers);
+    ~MLFIOUring();
+
+    const char* name(void) const override;
+    void setBufferArea(uint8_t* area, size_t size) override;
+    void attach(int ctrl, int fd) override;
+    void transfer(int ctrl, const uint8_t* tx, size_t txLen,
+                  uint8_t* rx, size_t rxLen, int timeoutMs) override;
+    int wait(MLFIOCompletion* out, int max) override;
+    void wake(void) override;
+};
+
+MLFIOUring::MLFIOUring(int maxControllers) : ops(maxControllers) {
+    struct io_uring_params p;
+    unsigned entries = std::min(maxControllers * CHAIN_SQES + 1, MAX_RING_ENTRIES);
+
+    memset(&p, 0, sizeof p);
+    ring = SysSetup(entries, &p);
+    if(ring < 0)
+        throw MLFException("failed to set up io_uring", true);
+
+    sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    if(sqRing == MAP_FAILED)
+        goto error;
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        cqRing = sqRing;
+    else
+        cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+    if(cqRing == MAP_FAILED)
+        goto error;
+
+    sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe*) mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED)
+        goto error;
+
+    sqHead = (unsigned*)((char*)sqRing + p.sq_off.head);
+    sqTail = (unsigned*)((char*)sqRing + p.sq_off.tail);
+    sqMask = *(unsigned*)((char*)sqRing + p.sq_off.ring_mask);
+    sqEntries = *(unsigned*)((char*)sqRing + p.sq_off.ring_entries);
+    sqArray = (unsigned*)((char*)sqRing + p.sq_off.array);
+    cqHead = (unsigned*)((char*)cqRing + p.cq_off.head);
+    cqTail = (unsigned*)((char*)cqRing + p.cq_off.tail);
+    cqMask = *(unsigned*)((char*)cqRing + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)((char*)cqRing + p.cq_off.cqes);
+    sqLocalTail = *sqTail;
+
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    if(wakeFd < 0)
+        goto error;
+    return;
+
+error:
+    const int err = errno;
+    unmap();
+    errno = err;
+    throw MLFException("failed to map io_uring", true);
+}
+
+MLFIOUring::~MLFIOUring() {
+    unmap();
+}
+
+void MLFIOUring::unmap(void) {
+    if(sqes != MAP_FAILED)
+        munmap(sqes, sqesSize);
+    if(cqRing != MAP_FAILED && cqRing != sqRing)
+        munmap(cqRing, cqRingSize);
+    if(sqRing != MAP_FAILED)
+        munmap(sqRing, sqRingSize);
+    sqes = (struct io_uring_sqe*) MAP_FAILED;
+    sqRing = cqRing = MAP_FAILED;
+
+    // Closing the ring cancels whatever is still in flight
+    if(ring >= 0)
+        close(ring);
+    if(wakeFd >= 0)
+        close(wakeFd);
+    ring = wakeFd = -1;
+}
+
+const char* MLFIOUring::name(void) const {
+    return fixedBuffers ? "io_uring" : "io_uring (unregistered buffers)";
+}
+
+void MLFIOUring::setBufferArea(uint8_t* area, size_t size) {
+    struct iovec iov = {
+        .iov_base = area,
+        .iov_len = size
+    };
+
+    // Pinned pages count against RLIMIT_MEMLOCK - plain READ/WRITE work too
+    fixedBuffers = SysRegister(ring, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+}
+
+void MLFIOUring::attach(int ctrl, int fd) {
+    ops[ctrl].fd = fd;
+}
+
+struct io_uring_sqe* MLFIOUring::getSqe(void) {
+    // Make room by handing queued entries over to kernel
+    while(sqLocalTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+        enter(0);
+
+    const unsigned index = sqLocalTail & sqMask;
+    struct io_uring_sqe* sqe = &sqes[index];
+
+    memset(sqe, 0, sizeof *sqe);
+    sqArray[index] = index;
+    sqLocalTail++;
+    toSubmit++;
+    return sqe;
+}
+
+void MLFIOUring::enter(unsigned minComplete) {
+    int ret;
+
+    __atomic_store_n(sqTail, sqLocalTail, __ATOMIC_RELEASE);
+    do {
+        ret = SysEnter(ring, toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0);
+    } while(ret < 0 && errno == EINTR);
+
+    // EBUSY/EAGAIN - completions have to be reaped first, retried by caller
+    if(ret < 0 && errno != EBUSY && errno != EAGAIN)
+        throw MLFException("io_uring_enter failed", true);
+    if(ret > 0)
+        toSubmit -= ret;
+}
+
+void MLFIOUring::queueChain(int ctrl) {
+    Op& op = ops[ctrl];
+    struct io_uring_sqe* sqe;
+
+    if(op.txDone < op.txLen) {
+        sqe = getSqe();
+        sqe->opcode = fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = op.fd;
+        sqe->addr = (uintptr_t)(op.tx + op.txDone);
+        sqe->len = op.txLen - op.txDone;
+        sqe->off = (uint64_t) -1;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = ((uint64_t)ctrl << 2) | OP_WRITE;
+        op.inflight++;
+    }
+
+    sqe = getSqe();
+    sqe->opcode = fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = op.fd;
+    sqe->addr = (uintptr_t) op.rx;
+    sqe->len = op.rxLen;
+    sqe->off = (uint64_t) -1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = ((uint64_t)ctrl << 2) | OP_READ;
+    op.inflight++;
+
+    sqe = getSqe();
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) &op.timeout;
+    sqe->len = 1;
+    sqe->user_data = ((uint64_t)ctrl << 2) | OP_TIMEOUT;
+    op.inflight++;
+}
+
+void MLFIOUring::transfer(int ctrl, const uint8_t* tx, size_t txLen,
+                          uint8_t* rx, size_t rxLen, int timeoutMs) {
+    Op& op = ops[ctrl];
+
+    op.tx = tx;
+    op.txLen = txLen;
+    op.txDone = 0;
+    op.rx = rx;
+    op.rxLen = rxLen;
+    op.result = 0;
+    op.retry = false;
+    op.timeout.tv_sec = timeoutMs / 1000;
+    op.timeout.tv_nsec = (timeoutMs % 1000) * 1000000ll;
+    queueChain(ctrl);
+}
+
+/* The first error of a chain is reported */
+void MLFIOUring::fail(Op& op, int error) {
+    if(op.result == 0)
+        op.result = error;
+}
+
+int MLFIOUring::wait(MLFIOCompletion* out, int max) {
+    int count = 0;
+
+    if(!wakeArmed) {
+        struct io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wakeFd;
+        sqe->addr = (uintptr_t) &wakeValue;
+        sqe->len = sizeof wakeValue;
+        sqe->user_data = WAKE_USER_DATA;
+        wakeArmed = true;
+    }
+
+    while(count == 0) {
+        unsigned head = *cqHead;
+        const bool empty = head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+        // Queued transfers go to kernel even if completions are waiting
+        if(empty || toSubmit > 0)
+            enter(empty ? 1 : 0);
+
+        for(; count < max && head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE); head++) {
+            const struct io_uring_cqe* cqe = &cqes[head & cqMask];
+            const int res = cqe->res;
+
+            if(cqe->user_data == WAKE_USER_DATA) {
+                wakeArmed = false;
+                out[count++] = { MLF_IO_WAKEUP, 0 };
+                continue;
+            }
+
+            const int ctrl = cqe->user_data >> 2;
+            Op& op = ops[ctrl];
+            op.inflight--;
+
+            switch(cqe->user_data & 3) {
+            case OP_WRITE:
+                if(res < 0)
+                    fail(op, res);
+                else if(op.txDone + res < op.txLen)
+                    op.retry = true;        // short write breaks the chain
+                op.txDone += res > 0 ? res : 0;
+                break;
+            case OP_READ:
+                if(res > 0 && op.result == 0)
+                    op.result = res;
+                else if(res == 0)
+                    fail(op, -EIO);
+                else if(res < 0 && res != -ECANCELED)
+                    fail(op, res);
+                break;
+            case OP_TIMEOUT:
+                if(res == -ETIME)
+                    fail(op, -ETIMEDOUT);
+                break;
+            }
+
+            if(op.inflight > 0)
+                continue;
+            if(op.retry && op.result == 0) {
+                op.retry = false;
+                queueChain(ctrl);
+                continue;
+            }
+            out[count++] = { ctrl, op.result ? op.result : -EIO };
+        }
+
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    // Transfers queued by caller are submitted with the next wait
+    return count;
+}
+
+void MLFIOUring::wake(void) {
+    const uint64_t one = 1;
+
+    if(write(wakeFd, &one, sizeof one) < 0) {
+        // Counter can't overflow in practice - loop is woken anyway
+    }
+}
+
+std::unique_ptr<MLFIOEngine> MLFCreateIOUringEngine(int maxControllers) {
+    try {
+        return std::unique_ptr<MLFIOEngine>(new MLFIOUring(maxControllers));
+    }
+    catch(MLFException&) {
+        return nullptr;
+    }
+}
+
+#else
+
+std::unique_ptr<MLFIOEngine> MLFCreateIOUringEngine(int maxControllers) {
+    return nullptr;
+}
+
+#endif
@@ -1 +1 @@
-../../STM32_Controller/App/Inc/mlf_protocol.h
\ No newline at end of file
+../../mcu_stm32/App/Inc/mlf_protocol.h
\ No newline at end of file
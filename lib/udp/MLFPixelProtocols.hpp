@@ -0,0 +1,248 @@
+/**
+ * @file MLFPixelProtocols.hpp
+ * @author Pawel Wieczorek
+ * @brief Encoding and decoding of DDP and E1.31 (sACN) pixel packets
+ * @date 2022-07-17
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/************************************
+ * DDP (Distributed Display Protocol)
+ ************************************/
+
+/*
+ * | flags | seq | type | id | offset (BE32) | length (BE16) | [timecode] | data |
+ *  offset and length are in bytes of data, so a frame can be split
+ *  anywhere. Packet with PUSH flag ends the frame.
+ */
+#define DDP_PORT                4048
+#define DDP_HEADER_LEN          10
+#define DDP_TIMECODE_LEN        4
+#define DDP_MAX_DATA            1440
+
+#define DDP_FLAGS_VER1          0x40
+#define DDP_FLAGS_VER_MASK      0xc0
+#define DDP_FLAGS_TIMECODE      0x10
+#define DDP_FLAGS_QUERY         0x02
+#define DDP_FLAGS_PUSH          0x01
+
+#define DDP_TYPE_UNDEFINED      0x00
+#define DDP_TYPE_RGB24          0x0b
+#define DDP_ID_DISPLAY          1
+
+struct DDPPacket {
+    bool push;
+    uint32_t offset;
+    const uint8_t* data;
+    uint16_t len;
+};
+
+static inline uint32_t ReadBE32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint16_t ReadBE16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+}
+
+static inline void WriteBE32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline void WriteBE16(uint8_t* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+/**
+ * @brief Put a DDP packet with RGB data into `out`
+ *
+ * @param out buffer of at least DDP_HEADER_LEN + len bytes
+ * @return size_t size of the packet
+ */
+static inline size_t DDPEncode(uint8_t* out, uint8_t seq, uint32_t offset,
+                               const uint8_t* data, uint16_t len, bool push) {
+    out[0] = DDP_FLAGS_VER1 | (push ? DDP_FLAGS_PUSH : 0);
+    out[1] = seq & 0x0f;
+    out[2] = DDP_TYPE_RGB24;
+    out[3] = DDP_ID_DISPLAY;
+    WriteBE32(out + 4, offset);
+    WriteBE16(out + 8, len);
+    memcpy(out + DDP_HEADER_LEN, data, len);
+    return DDP_HEADER_LEN + len;
+}
+
+/**
+ * @brief Parse a DDP packet carrying RGB data for the default display
+ *
+ * Body is not copied - `packet->data` points into `in`.
+ *
+ * @return bool false if packet is malformed or not meant for display
+ */
+static inline bool DDPDecode(const uint8_t* in, size_t size, DDPPacket* packet) {
+    size_t header = DDP_HEADER_LEN;
+
+    if(size < DDP_HEADER_LEN || (in[0] & DDP_FLAGS_VER_MASK) != DDP_FLAGS_VER1)
+        return false;
+    if(in[0] & DDP_FLAGS_QUERY)
+        return false;
+    // Some senders leave type undefined or use the legacy value 1
+    if(in[2] != DDP_TYPE_UNDEFINED && in[2] != DDP_TYPE_RGB24 && in[2] != 0x01)
+        return false;
+    if(in[3] != DDP_ID_DISPLAY)
+        return false;
+
+    if(in[0] & DDP_FLAGS_TIMECODE)
+        header += DDP_TIMECODE_LEN;
+
+    packet->push = in[0] & DDP_FLAGS_PUSH;
+    packet->offset = ReadBE32(in + 4);
+    packet->len = ReadBE16(in + 8);
+    packet->data = in + header;
+    return size >= header + packet->len;
+}
+
+
+/************************************
+ * E1.31 (Streaming ACN)
+ ************************************/
+
+/*
+ * Data packet is a 125 byte header (root, framing and DMP layers) followed
+ *  by DMX start code and up to 512 channels of a single universe.
+ *  Synchronization packet (root vector EXTENDED) makes receivers present
+ *  universes which declared the same synchronization address.
+ */
+#define E131_PORT               5568
+#define E131_DATA_HEADER_LEN    125
+#define E131_SYNC_LEN           49
+#define E131_MAX_CHANNELS       512
+#define E131_MAX_UNIVERSE       63999
+
+#define E131_ROOT_VECTOR_DATA       0x00000004
+#define E131_ROOT_VECTOR_EXTENDED   0x00000008
+#define E131_FRAME_VECTOR_DATA      0x00000002
+#define E131_FRAME_VECTOR_SYNC      0x00000001
+#define E131_DMP_VECTOR             0x02
+#define E131_DMP_ADDRESS_TYPE       0xa1
+#define E131_OPTION_TERMINATED      0x40
+
+static const uint8_t E131_ACN_ID[12] = { 'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0 };
+
+struct E131Packet {
+    bool sync;              // synchronization packet - only `universe` is valid
+    uint16_t universe;      // universe of data, or sync address of sync packet
+    uint16_t syncAddress;
+    uint8_t sequence;
+    const uint8_t* channels;
+    uint16_t count;
+};
+
+static inline void E131FlagsLength(uint8_t* p, size_t len) {
+    WriteBE16(p, 0x7000 | len);
+}
+
+static inline void E131EncodeRoot(uint8_t* out, size_t size, uint32_t vector, const uint8_t cid[16]) {
+    WriteBE16(out, 0x0010);
+    WriteBE16(out + 2, 0);
+    memcpy(out + 4, E131_ACN_ID, sizeof E131_ACN_ID);
+    E131FlagsLength(out + 16, size - 16);
+    WriteBE32(out + 18, vector);
+    memcpy(out + 22, cid, 16);
+}
+
+/**
+ * @brief Put an E1.31 data packet into `out`
+ *
+ * @param out buffer of at least E131_DATA_HEADER_LEN + 1 + count bytes
+ * @return size_t size of the packet
+ */
+static inline size_t E131EncodeData(uint8_t* out, const uint8_t cid[16], const char* source,
+                                    uint16_t universe, uint16_t syncAddress, uint8_t sequence,
+                                    const uint8_t* channels, uint16_t count) {
+    const size_t size = E131_DATA_HEADER_LEN + 1 + count;
+
+    memset(out, 0, E131_DATA_HEADER_LEN);
+    E131EncodeRoot(out, size, E131_ROOT_VECTOR_DATA, cid);
+
+    // Framing layer
+    E131FlagsLength(out + 38, size - 38);
+    WriteBE32(out + 40, E131_FRAME_VECTOR_DATA);
+    strncpy((char*)out + 44, source, 63);
+    out[108] = 100;                             // priority
+    WriteBE16(out + 109, syncAddress);
+    out[111] = sequence;
+    out[112] = 0;                               // options
+    WriteBE16(out + 113, universe);
+
+    // DMP layer
+    E131FlagsLength(out + 115, size - 115);
+    out[117] = E131_DMP_VECTOR;
+    out[118] = E131_DMP_ADDRESS_TYPE;
+    WriteBE16(out + 119, 0);                    // first property address
+    WriteBE16(out + 121, 1);                    // address increment
+    WriteBE16(out + 123, count + 1);
+    out[125] = 0;                               // DMX start code
+    memcpy(out + 126, channels, count);
+    return size;
+}
+
+static inline size_t E131EncodeSync(uint8_t* out, const uint8_t cid[16], uint16_t syncAddress, uint8_t sequence) {
+    memset(out, 0, E131_SYNC_LEN);
+    E131EncodeRoot(out, E131_SYNC_LEN, E131_ROOT_VECTOR_EXTENDED, cid);
+    E131FlagsLength(out + 38, E131_SYNC_LEN - 38);
+    WriteBE32(out + 40, E131_FRAME_VECTOR_SYNC);
+    out[44] = sequence;
+    WriteBE16(out + 45, syncAddress);
+    return E131_SYNC_LEN;
+}
+
+/**
+ * @brief Parse E1.31 data or synchronization packet
+ *
+ * Channels are not copied - `packet->channels` points into `in`. Stream
+ *  termination and non-zero start codes are reported as malformed.
+ *
+ * @return bool false if packet is malformed or not supported
+ */
+static inline bool E131Decode(const uint8_t* in, size_t size, E131Packet* packet) {
+    if(size < E131_SYNC_LEN || memcmp(in + 4, E131_ACN_ID, sizeof E131_ACN_ID))
+        return false;
+
+    const uint32_t rootVector = ReadBE32(in + 18);
+    const uint32_t frameVector = ReadBE32(in + 40);
+
+    if(rootVector == E131_ROOT_VECTOR_EXTENDED && frameVector == E131_FRAME_VECTOR_SYNC) {
+        packet->sync = true;
+        packet->sequence = in[44];
+        packet->universe = ReadBE16(in + 45);
+        return true;
+    }
+
+    if(rootVector != E131_ROOT_VECTOR_DATA || frameVector != E131_FRAME_VECTOR_DATA ||
+       size < E131_DATA_HEADER_LEN + 1)
+        return false;
+    if(in[112] & E131_OPTION_TERMINATED)
+        return false;
+    if(in[117] != E131_DMP_VECTOR || in[118] != E131_DMP_ADDRESS_TYPE || in[125] != 0)
+        return false;
+
+    const uint16_t values = ReadBE16(in + 123);
+    if(values < 1 || values > E131_MAX_CHANNELS + 1 || (size_t)E131_DATA_HEADER_LEN + values > size)
+        return false;
+
+    packet->sync = false;
+    packet->syncAddress = ReadBE16(in + 109);
+    packet->sequence = in[111];
+    packet->universe = ReadBE16(in + 113);
+    packet->channels = in + E131_DATA_HEADER_LEN + 1;
+    packet->count = values - 1;
+    return packet->universe >= 1 && packet->universe <= E131_MAX_UNIVERSE;
+}
@@ -0,0 +1,530 @@
+/**
+ * @file mlf_udp_receiver.cpp
+ * @author Pawel Wieczorek
+ * @brief DDP and E1.31 (sACN) receiver forwarding frames to MLF Controller
+ * @date 2022-07-17
+ *
+ * Usage: mlf_udp_receiver [--device PATH | --mlfd SOCKET] [--bind ADDR]
+ *                         [--protocol ddp|e131|all] [--universe N]
+ *                         [--channels-per-universe N] [--color-order RGB]
+ *                         [--multicast]
+ *
+ * Incoming datagrams are read in batches with recvmmsg and assembled into
+ *  a frame of 3 channels per LED (LEDs are numbered as in `setColors`):
+ *  - DDP frame is complete on packet with PUSH flag,
+ *  - E1.31 frame is complete once every universe covering LEDs arrived,
+ *    on synchronization packet (if universes declare sync address) or when
+ *    a universe repeats before frame got complete.
+ *  Complete frame goes to an output thread which hands it over to
+ *  MLFProtoLib (or mlfd); if controller is busy, newer frame replaces it.
+ */
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <errno.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "MLFPixelProtocols.hpp"
+#include "MLFProtoLib.hpp"
+#ifdef MLF_UDP_WITH_MLFD
+#include "MLFDaemonClient.hpp"
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+#define RECV_BATCH              32
+#define RECV_BUFFER_SIZE        1500
+#define SOCKET_BUFFER_SIZE      (1 << 20)
+#define POLL_TIMEOUT_MS         100
+#define CHANNELS_PER_LED        3
+
+/* E1.31 sequence numbers within this distance back are treated as reordered */
+#define E131_SEQUENCE_WINDOW    20
+
+struct Options {
+    std::string device;
+    std::string mlfd;
+    std::string bindAddress = "0.0.0.0";
+    bool ddp = true;
+    bool e131 = true;
+    int startUniverse = 1;
+    int channelsPerUniverse = 510;
+    int colorOrder[CHANNELS_PER_LED] = { 0, 1, 2 };
+    bool multicast = false;
+};
+
+struct Stats {
+    uint64_t datagrams = 0;
+    uint64_t batches = 0;
+    uint64_t invalid = 0;
+    uint64_t reordered = 0;
+    uint64_t framesAssembled = 0;
+    uint64_t framesSuperseded = 0;
+    std::atomic<uint64_t> framesSent {0};
+    std::atomic<int64_t> latencySumNs {0};
+    std::atomic<int64_t> latencyMaxNs {0};
+};
+
+static volatile sig_atomic_t stop;
+
+static void OnSignal(int sig) {
+    stop = 1;
+}
+
+/************************************
+ * OUTPUT
+ ************************************/
+
+/*
+ * Single-slot mailbox between receiving and output thread - receiver never
+ *  waits for controller and only the newest frame gets sent.
+ */
+class FrameOutput {
+    std::function<void(int*, int)> sink;
+    Stats& stats;
+
+    std::mutex lock;
+    std::condition_variable ready;
+    std::vector<int> pending, sending;
+    Clock::time_point pendingAt;
+    bool hasPending = false;
+
+    std::exception_ptr error;
+    std::thread thread;
+
+    void loop(void) {
+        while(true) {
+            Clock::time_point assembledAt;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                ready.wait(guard, [&]() { return hasPending || stop; });
+                if(stop)
+                    return;
+                std::swap(pending, sending);
+                assembledAt = pendingAt;
+                hasPending = false;
+            }
+
+            sink(sending.data(), sending.size());
+
+            const int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    Clock::now() - assembledAt).count();
+            stats.framesSent++;
+            stats.latencySumNs += ns;
+            if(ns > stats.latencyMaxNs)
+                stats.latencyMaxNs = ns;
+        }
+    }
+
+public:
+    FrameOutput(std::function<void(int*, int)> sink, int ledsCount, Stats& stats)
+        : sink(sink), stats(stats), pending(ledsCount), sending(ledsCount) {
+        thread = std::thread([this]() {
+            try {
+                loop();
+            }
+            catch (...) {
+                error = std::current_exception();
+                stop = 1;
+            }
+        });
+    }
+
+    ~FrameOutput() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = 1;
+        }
+        ready.notify_one();
+        thread.join();
+    }
+
+    void checkError(void) {
+        if(error)
+            std::rethrow_exception(error);
+    }
+
+    /* Convert channels of complete frame into colors used by MLFProtoLib */
+    void submit(const uint8_t* channels, const int* order) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if(hasPending)
+                stats.framesSuperseded++;
+
+            for(size_t i = 0; i < pending.size(); i++) {
+                const uint8_t* led = channels + i * CHANNELS_PER_LED;
+                pending[i] = led[order[0]] | (led[order[1]] << 8) | (led[order[2]] << 16);
+            }
+            pendingAt = Clock::now();
+            hasPending = true;
+        }
+        ready.notify_one();
+    }
+};
+
+
+/************************************
+ * RECEIVER
+ ************************************/
+class UdpReceiver {
+    const Options& opts;
+    Stats& stats;
+    FrameOutput& output;
+
+    std::vector<uint8_t> channels;
+
+    /* E1.31 state of the frame being assembled */
+    int universesCount;
+    std::vector<bool> universeSeen;
+    std::vector<int> lastSequence;
+    int universesPending;
+    bool awaitSync = false;
+    uint16_t syncAddress = 0;
+
+    /* recvmmsg buffers */
+    std::vector<uint8_t> buffers;
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iovs[RECV_BATCH];
+
+    void presentFrame(void);
+    void resetUniverses(void);
+    void handleDDP(const uint8_t* data, size_t size);
+    void handleE131(const uint8_t* data, size_t size);
+
+public:
+    UdpReceiver(const Options& opts, int ledsCount, Stats& stats, FrameOutput& output);
+
+    int openSocket(int port);
+    void receive(int sock, bool ddp);
+};
+
+UdpReceiver::UdpReceiver(const Options& opts, int ledsCount, Stats& stats, FrameOutput& output)
+    : opts(opts), stats(stats), output(output), channels(ledsCount * CHANNELS_PER_LED) {
+    universesCount = (channels.size() + opts.channelsPerUniverse - 1) / opts.channelsPerUniverse;
+    universeSeen.resize(universesCount);
+    lastSequence.assign(universesCount, -1);
+    resetUniverses();
+
+    buffers.resize(RECV_BATCH * RECV_BUFFER_SIZE);
+    memset(msgs, 0, sizeof msgs);
+    for(int i = 0; i < RECV_BATCH; i++) {
+        iovs[i].iov_base = &buffers[i * RECV_BUFFER_SIZE];
+        iovs[i].iov_len = RECV_BUFFER_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+int UdpReceiver::openSocket(int port) {
+    struct sockaddr_in addr = {};
+    int sock, one = 1, bufSize = SOCKET_BUFFER_SIZE;
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, opts.bindAddress.c_str(), &addr.sin_addr) != 1)
+        throw MLFException("invalid bind address");
+
+    sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(sock < 0)
+        throw MLFException("failed to create UDP socket", true);
+
+    // Bursts of a whole frame must not overflow the socket
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof bufSize);
+
+    if(bind(sock, (struct sockaddr*)&addr, sizeof addr) < 0)
+        throw MLFException("failed to bind UDP socket", true);
+
+    // sACN multicast group of universe U is 239.255.U_hi.U_lo
+    if(opts.multicast && port == E131_PORT) {
+        for(int i = 0; i < universesCount; i++) {
+            const int universe = opts.startUniverse + i;
+            struct ip_mreq mreq = {};
+            mreq.imr_multiaddr.s_addr = htonl(0xefff0000 | universe);
+            mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+            if(setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq) < 0)
+                throw MLFException("failed to join multicast group", true);
+        }
+    }
+
+    return sock;
+}
+
+void UdpReceiver::resetUniverses(void) {
+    std::fill(universeSeen.begin(), universeSeen.end(), false);
+    universesPending = universesCount;
+    awaitSync = false;
+}
+
+void UdpReceiver::presentFrame(void) {
+    stats.framesAssembled++;
+    output.submit(channels.data(), opts.colorOrder);
+}
+
+void UdpReceiver::handleDDP(const uint8_t* data, size_t size) {
+    DDPPacket packet;
+
+    if(!DDPDecode(data, size, &packet)) {
+        stats.invalid++;
+        return;
+    }
+
+    // Channels beyond the last LED are silently dropped
+    if(packet.offset < channels.size()) {
+        const size_t len = std::min<size_t>(packet.len, channels.size() - packet.offset);
+        memcpy(&channels[packet.offset], packet.data, len);
+    }
+
+    if(packet.push)
+        presentFrame();
+}
+
+void UdpReceiver::handleE131(const uint8_t* data, size_t size) {
+    E131Packet packet;
+
+    if(!E131Decode(data, size, &packet)) {
+        stats.invalid++;
+        return;
+    }
+
+    if(packet.sync) {
+        if(awaitSync && packet.universe == syncAddress) {
+            presentFrame();
+            resetUniverses();
+        }
+        return;
+    }
+
+    const int idx = packet.universe - opts.startUniverse;
+    if(idx < 0 || idx >= universesCount)
+        return;
+
+    // Drop packets arriving out of order (E1.31 6.7.2)
+    if(lastSequence[idx] >= 0) {
+        const int8_t diff = (int8_t)(packet.sequence - lastSequence[idx]);
+        if(diff <= 0 && diff > -E131_SEQUENCE_WINDOW) {
+            stats.reordered++;
+            return;
+        }
+    }
+    lastSequence[idx] = packet.sequence;
+
+    // Universe repeats - sender skipped some universes of previous frame
+    if(universeSeen[idx]) {
+        presentFrame();
+        resetUniverses();
+    }
+
+    const size_t offset = idx * opts.channelsPerUniverse;
+    const size_t len = std::min<size_t>({ (size_t)packet.count, (size_t)opts.channelsPerUniverse,
+                                          channels.size() - offset });
+    memcpy(&channels[offset], packet.channels, len);
+
+    universeSeen[idx] = true;
+    universesPending--;
+    if(packet.syncAddress) {
+        awaitSync = true;
+        syncAddress = packet.syncAddress;
+    }
+
+    if(universesPending == 0 && !awaitSync) {
+        presentFrame();
+        resetUniverses();
+    }
+}
+
+void UdpReceiver::receive(int sock, bool ddp) {
+    int count;
+
+    // Read everything already queued, RECV_BATCH datagrams per syscall
+    do {
+        count = recvmmsg(sock, msgs, RECV_BATCH, MSG_DONTWAIT, nullptr);
+        if(count < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            throw MLFException("failed to receive UDP datagrams", true);
+        }
+
+        stats.batches++;
+        stats.datagrams += count;
+        for(int i = 0; i < count; i++) {
+            const uint8_t* data = (const uint8_t*)iovs[i].iov_base;
+            if(ddp)
+                handleDDP(data, msgs[i].msg_len);
+            else
+                handleE131(data, msgs[i].msg_len);
+        }
+    } while(count == RECV_BATCH);
+}
+
+
+/************************************
+ * ENTRY POINT
+ ************************************/
+static void Usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --device PATH                MLF Controller (found automatically by default)\n"
+#ifdef MLF_UDP_WITH_MLFD
+            "  --mlfd SOCKET                send frames through mlfd instead of device\n"
+#endif
+            "  --bind ADDR                  IPv4 address to listen on (default: 0.0.0.0)\n"
+            "  --protocol ddp|e131|all      protocols to receive (default: all)\n"
+            "  --universe N                 first E1.31 universe (default: 1)\n"
+            "  --channels-per-universe N    used channels of universe (default: 510)\n"
+            "  --color-order ORDER          order of channels, e.g. GRB (default: RGB)\n"
+            "  --multicast                  join E1.31 multicast groups of universes\n",
+            name);
+}
+
+static bool ParseColorOrder(const char* str, int* order) {
+    const char* names = "RGB";
+
+    if(strlen(str) != CHANNELS_PER_LED)
+        return false;
+    for(int c = 0; c < CHANNELS_PER_LED; c++) {
+        const char* pos = strchr(str, names[c]);
+        if(pos == nullptr)
+            return false;
+        order[c] = pos - str;
+    }
+    return true;
+}
+
+static bool ParseArgs(int argc, char** argv, Options& opts) {
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--device") && i + 1 < argc)
+            opts.device = argv[++i];
+#ifdef MLF_UDP_WITH_MLFD
+        else if(!strcmp(argv[i], "--mlfd") && i + 1 < argc)
+            opts.mlfd = argv[++i];
+#endif
+        else if(!strcmp(argv[i], "--bind") && i + 1 < argc)
+            opts.bindAddress = argv[++i];
+        else if(!strcmp(argv[i], "--protocol") && i + 1 < argc) {
+            std::string protocol = argv[++i];
+            opts.ddp = protocol == "ddp" || protocol == "all";
+            opts.e131 = protocol == "e131" || protocol == "all";
+            if(!opts.ddp && !opts.e131)
+                return false;
+        }
+        else if(!strcmp(argv[i], "--universe") && i + 1 < argc)
+            opts.startUniverse = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--channels-per-universe") && i + 1 < argc)
+            opts.channelsPerUniverse = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--color-order") && i + 1 < argc) {
+            if(!ParseColorOrder(argv[++i], opts.colorOrder))
+                return false;
+        }
+        else if(!strcmp(argv[i], "--multicast"))
+            opts.multicast = true;
+        else
+            return false;
+    }
+
+    return opts.startUniverse >= 1 && opts.startUniverse <= E131_MAX_UNIVERSE &&
+           opts.channelsPerUniverse >= CHANNELS_PER_LED &&
+           opts.channelsPerUniverse <= E131_MAX_CHANNELS &&
+           opts.channelsPerUniverse % CHANNELS_PER_LED == 0;
+}
+
+static void PrintStats(const Stats& stats) {
+    const uint64_t sent = stats.framesSent;
+
+    fprintf(stderr, "mlf_udp_receiver: %llu datagrams in %llu batches, %llu invalid, %llu reordered\n",
+            (unsigned long long)stats.datagrams, (unsigned long long)stats.batches,
+            (unsigned long long)stats.invalid, (unsigned long long)stats.reordered);
+    fprintf(stderr, "mlf_udp_receiver: %llu frames assembled, %llu sent, %llu superseded, "
+                    "forward latency avg %.1f us max %.1f us\n",
+            (unsigned long long)stats.framesAssembled, (unsigned long long)sent,
+            (unsigned long long)stats.framesSuperseded,
+            sent ? stats.latencySumNs / 1000.0 / sent : 0.0, stats.latencyMaxNs / 1000.0);
+}
+
+int main(int argc, char** argv) {
+    Options opts;
+    Stats stats;
+
+    if(!ParseArgs(argc, argv, opts)) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    struct sigaction sa = {};
+    sa.sa_handler = OnSignal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    try {
+        std::unique_ptr<MLFProtoLib> lib;
+        std::function<void(int*, int)> sink;
+        int ledsCount;
+
+#ifdef MLF_UDP_WITH_MLFD
+        std::unique_ptr<MLFDaemonClient> client;
+        if(opts.mlfd != "") {
+            client = std::make_unique<MLFDaemonClient>(opts.mlfd);
+            ledsCount = client->getLedsCount();
+            sink = [&](int* colors, int len) { client->setColors(colors, len); };
+        }
+        else
+#endif
+        {
+            int top, bottom;
+            lib = std::make_unique<MLFProtoLib>(opts.device);
+            lib->getLedsCount(top, bottom);
+            ledsCount = top + bottom;
+            sink = [&](int* colors, int len) { lib->setColors(colors, len); };
+        }
+
+        FrameOutput output(sink, ledsCount, stats);
+        UdpReceiver receiver(opts, ledsCount, stats, output);
+        std::vector<struct pollfd> fds;
+        std::vector<bool> isDDP;
+
+        if(opts.ddp) {
+            fds.push_back({ .fd = receiver.openSocket(DDP_PORT), .events = POLLIN });
+            isDDP.push_back(true);
+        }
+        if(opts.e131) {
+            fds.push_back({ .fd = receiver.openSocket(E131_PORT), .events = POLLIN });
+            isDDP.push_back(false);
+        }
+        fprintf(stderr, "mlf_udp_receiver: %d LEDs, listening on %s (%s%s%s)\n", ledsCount,
+                opts.bindAddress.c_str(), opts.ddp ? "DDP" : "",
+                opts.ddp && opts.e131 ? ", " : "", opts.e131 ? "E1.31" : "");
+
+        while(!stop) {
+            if(poll(fds.data(), fds.size(), POLL_TIMEOUT_MS) <= 0)
+                continue;
+            for(size_t i = 0; i < fds.size(); i++)
+                if(fds[i].revents & POLLIN)
+                    receiver.receive(fds[i].fd, isDDP[i]);
+        }
+
+        output.checkError();
+        PrintStats(stats);
+        for(auto& fd : fds)
+            close(fd.fd);
+    }
+    catch (std::exception& ex) {
+        fprintf(stderr, "mlf_udp_receiver: %s\n", ex.what());
+        PrintStats(stats);
+        return 1;
+    }
+    return 0;
+}
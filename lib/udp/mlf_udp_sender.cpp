@@ -0,0 +1,214 @@
+/**
+ * @file mlf_udp_sender.cpp
+ * @author Pawel Wieczorek
+ * @brief Test pattern sender for DDP and E1.31 (sACN) receivers
+ * @date 2022-07-17
+ *
+ * Usage: mlf_udp_sender [--host ADDR] [--protocol ddp|e131] [--leds N]
+ *                       [--fps N] [--frames N] [--universe N]
+ *                       [--channels-per-universe N] [--sync ADDR]
+ *
+ * Sends a moving rainbow, all packets of a frame with a single sendmmsg.
+ *  Default host is 127.0.0.1, so together with mlf_udp_receiver and
+ *  mlf_emulator the whole path can be tested on localhost.
+ */
+#include <arpa/inet.h>
+#include <chrono>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "MLFPixelProtocols.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+#define CHANNELS_PER_LED        3
+#define MAX_PACKET_SIZE         1500
+
+struct Options {
+    std::string host = "127.0.0.1";
+    bool e131 = false;
+    int leds = 306;
+    int fps = 60;
+    int frames = 0;
+    int startUniverse = 1;
+    int channelsPerUniverse = 510;
+    int syncAddress = 0;
+};
+
+static volatile sig_atomic_t stop;
+
+static void OnSignal(int sig) {
+    stop = 1;
+}
+
+/* Hue wheel in integer arithmetic - `pos` in range [0, 767] */
+static void Wheel(int pos, uint8_t* rgb) {
+    const int step = pos % 256;
+
+    switch(pos / 256) {
+    case 0:
+        rgb[0] = 255 - step; rgb[1] = step; rgb[2] = 0;
+        break;
+    case 1:
+        rgb[0] = 0; rgb[1] = 255 - step; rgb[2] = step;
+        break;
+    default:
+        rgb[0] = step; rgb[1] = 0; rgb[2] = 255 - step;
+        break;
+    }
+}
+
+/**
+ * @brief Split channels of a frame into packets
+ *
+ * @return int number of packets put into `packets`
+ */
+static int EncodeFrame(const Options& opts, const std::vector<uint8_t>& channels, uint8_t seq,
+                       std::vector<uint8_t>& packets, std::vector<size_t>& sizes) {
+    static const uint8_t cid[16] = { 'm', 'l', 'f', '_', 'u', 'd', 'p', '_', 's', 'e', 'n', 'd', 'e', 'r' };
+    int count = 0;
+
+    // DDP data length doesn't have to be a multiple of LED size
+    const size_t chunk = opts.e131 ? opts.channelsPerUniverse : DDP_MAX_DATA;
+    for(size_t offset = 0; offset < channels.size(); offset += chunk, count++) {
+        const size_t len = std::min(chunk, channels.size() - offset);
+        uint8_t* out = &packets[count * MAX_PACKET_SIZE];
+
+        if(opts.e131)
+            sizes[count] = E131EncodeData(out, cid, "mlf_udp_sender", opts.startUniverse + count,
+                                          opts.syncAddress, seq, &channels[offset], len);
+        else
+            sizes[count] = DDPEncode(out, seq, offset, &channels[offset], len,
+                                     offset + len == channels.size());
+    }
+
+    if(opts.e131 && opts.syncAddress) {
+        sizes[count] = E131EncodeSync(&packets[count * MAX_PACKET_SIZE], cid, opts.syncAddress, seq);
+        count++;
+    }
+    return count;
+}
+
+static void Usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --host ADDR                  IPv4 address of receiver (default: 127.0.0.1)\n"
+            "  --protocol ddp|e131          protocol to use (default: ddp)\n"
+            "  --leds N                     number of LEDs (default: 306)\n"
+            "  --fps N                      frames per second (default: 60)\n"
+            "  --frames N                   stop after N frames (default: never)\n"
+            "  --universe N                 first E1.31 universe (default: 1)\n"
+            "  --channels-per-universe N    used channels of universe (default: 510)\n"
+            "  --sync ADDR                  send E1.31 sync packets to ADDR after frames\n",
+            name);
+}
+
+int main(int argc, char** argv) {
+    Options opts;
+
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--host") && i + 1 < argc)
+            opts.host = argv[++i];
+        else if(!strcmp(argv[i], "--protocol") && i + 1 < argc) {
+            std::string protocol = argv[++i];
+            if(protocol != "ddp" && protocol != "e131") {
+                Usage(argv[0]);
+                return 1;
+            }
+            opts.e131 = protocol == "e131";
+        }
+        else if(!strcmp(argv[i], "--leds") && i + 1 < argc)
+            opts.leds = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--fps") && i + 1 < argc)
+            opts.fps = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--frames") && i + 1 < argc)
+            opts.frames = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--universe") && i + 1 < argc)
+            opts.startUniverse = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--channels-per-universe") && i + 1 < argc)
+            opts.channelsPerUniverse = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--sync") && i + 1 < argc)
+            opts.syncAddress = atoi(argv[++i]);
+        else {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(opts.leds <= 0 || opts.fps <= 0 || opts.channelsPerUniverse < CHANNELS_PER_LED ||
+       opts.channelsPerUniverse > E131_MAX_CHANNELS) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opts.e131 ? E131_PORT : DDP_PORT);
+    if(inet_pton(AF_INET, opts.host.c_str(), &addr.sin_addr) != 1) {
+        fprintf(stderr, "mlf_udp_sender: invalid host address\n");
+        return 1;
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof addr) < 0) {
+        perror("mlf_udp_sender: failed to create socket");
+        return 1;
+    }
+
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+
+    // Packets of a frame, plus sync packet
+    std::vector<uint8_t> channels(opts.leds * CHANNELS_PER_LED);
+    const size_t chunk = opts.e131 ? opts.channelsPerUniverse : DDP_MAX_DATA;
+    const int maxPackets = (channels.size() + chunk - 1) / chunk + 1;
+    std::vector<uint8_t> packets(maxPackets * MAX_PACKET_SIZE);
+    std::vector<size_t> sizes(maxPackets);
+    std::vector<struct mmsghdr> msgs(maxPackets);
+    std::vector<struct iovec> iovs(maxPackets);
+
+    const auto interval = std::chrono::nanoseconds(1000000000 / opts.fps);
+    auto next = Clock::now();
+    uint64_t sent = 0, packetsSent = 0;
+
+    while(!stop && (opts.frames == 0 || sent < (uint64_t)opts.frames)) {
+        for(int i = 0; i < opts.leds; i++)
+            Wheel((i * 768 / opts.leds + sent * 8) % 768, &channels[i * CHANNELS_PER_LED]);
+
+        const int count = EncodeFrame(opts, channels, sent + 1, packets, sizes);
+        for(int i = 0; i < count; i++) {
+            iovs[i].iov_base = &packets[i * MAX_PACKET_SIZE];
+            iovs[i].iov_len = sizes[i];
+            msgs[i] = {};
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        for(int done = 0; done < count; ) {
+            int ret = sendmmsg(sock, &msgs[done], count - done, 0);
+            if(ret < 0) {
+                perror("mlf_udp_sender: failed to send frame");
+                return 1;
+            }
+            done += ret;
+        }
+
+        sent++;
+        packetsSent += count;
+        next += interval;
+        std::this_thread::sleep_until(next);
+    }
+
+    fprintf(stderr, "mlf_udp_sender: %llu frames, %llu packets\n",
+            (unsigned long long)sent, (unsigned long long)packetsSent);
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,194 @@
+/**
+ * @file MLFVideo.hpp
+ * @author Pawel Wieczorek
+ * @brief Playback of YUV4MPEG2 (Y4M) video on MLF Controller LEDs
+ * @date 2022-07-19
+ *
+ * Pipeline is: Y4M reader -> area sampling onto LED layout (with YUV to RGB
+ *  conversion) -> colors passed to a sink (MLFProtoLib, mlfd, ...) at the
+ *  frame rate of the source. Samples are taken directly from the buffer
+ *  frame was read into - there's no intermediate RGB image.
+ */
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#include "MLFProtoLib.hpp"
+
+/* Planes can be read this many bytes past their end (by SIMD code) */
+#define MLF_VIDEO_PLANE_PADDING     16
+
+/**
+ * @brief Format of Y4M stream taken from its header
+ *
+ * Chroma planes are subsampled by (1 << chromaShiftX) horizontally and
+ *  (1 << chromaShiftY) vertically. Only 8-bit formats are supported.
+ */
+struct MLFVideoFormat {
+    int width;
+    int height;
+    int fpsNum;
+    int fpsDen;
+    int chromaShiftX;
+    int chromaShiftY;
+    bool mono;
+    bool fullRange;
+};
+
+/**
+ * @brief Planes of a single frame, pointing into reader's buffer
+ *
+ * Valid until the next `readFrame`. Monochrome frames point chroma to
+ *  a single neutral row (stride 0). Every plane is followed by at least
+ *  MLF_VIDEO_PLANE_PADDING readable bytes.
+ */
+struct MLFYUVFrame {
+    const uint8_t* y;
+    const uint8_t* u;
+    const uint8_t* v;
+    int yStride;
+    int uvStride;
+};
+
+/**
+ * @brief Reader of uncompressed YUV4MPEG2 stream from a file or pipe
+ *
+ * Each frame is read straight into a single buffer, which is reused for
+ *  the whole stream.
+ */
+class MLFY4MReader {
+    int fd = -1;
+    bool ownFd = false;
+    bool seekable = false;
+    off_t dataStart = 0;
+
+    MLFVideoFormat format = {};
+    std::vector<uint8_t> buffer;
+    std::vector<uint8_t> neutralRow;
+    size_t lumaSize = 0;
+    size_t chromaSize = 0;
+
+    void parseHeader(void);
+    bool readFrameHeader(void);
+
+public:
+    /* "-" reads from standard input */
+    MLFY4MReader(const std::string& path);
+    ~MLFY4MReader();
+
+    const MLFVideoFormat& getFormat(void) const;
+
+    /* Returns false at the end of stream */
+    bool readFrame(MLFYUVFrame& frame);
+
+    /* Start from the first frame again, false if stream isn't seekable */
+    bool rewind(void);
+};
+
+/**
+ * @brief Area of a single LED on the frame
+ *
+ * Coordinates are relative to frame size: (0, 0) is top left corner and
+ *  (1, 1) bottom right one.
+ */
+struct MLFLedArea {
+    float x0, y0;
+    float x1, y1;
+};
+
+/**
+ * @brief Position of every LED, in order of colors passed to `setColors`
+ */
+struct MLFLedLayout {
+    std::vector<MLFLedArea> areas;
+
+    /**
+     * @brief Strips mounted as horizontal rows, the first one at the bottom
+     *
+     * Each row takes an equal band of the frame and each LED an equal part
+     *  of its row. By default LEDs run from right to left, like in ambilight.
+     */
+    static MLFLedLayout Rows(const std::vector<int>& ledsPerRow, bool rightToLeft = true);
+
+    /**
+     * @brief Load layout from text file
+     *
+     * Every line describes one LED as "x0 y0 x1 y1". Empty lines and lines
+     *  starting with '#' are skipped.
+     */
+    static MLFLedLayout Load(const std::string& path);
+};
+
+/**
+ * @brief Converts frames to LED colors by averaging pixels under each LED
+ *
+ * Sampling map (pixel rectangle and scale of every LED) is computed once
+ *  for the format. YUV to RGB conversion uses SSE2 where available.
+ */
+class MLFVideoSampler {
+    struct Span {
+        int x0, x1;
+        int y0, y1;
+        uint64_t scale;
+    };
+
+    MLFVideoFormat format;
+    std::vector<Span> map;
+
+public:
+    MLFVideoSampler(const MLFVideoFormat& format, const MLFLedLayout& layout);
+
+    int getLedsCount(void) const;
+
+    /* Colors are in `setColors` format (0xBBGGRR) */
+    void sample(const MLFYUVFrame& frame, int* colors) const;
+};
+
+struct MLFVideoStats {
+    uint64_t framesRead;
+    uint64_t framesSent;
+    uint64_t framesDropped;
+    uint64_t sampleNs;
+};
+
+/**
+ * @brief Plays Y4M stream on LEDs at its frame rate
+ *
+ * Frame is handed to sink at its presentation time. If playback falls
+ *  behind by more than a frame (slow source or sink), frames are dropped
+ *  to catch up instead of slowing the video down.
+ */
+class MLFVideoPlayer {
+    MLFY4MReader& reader;
+    MLFVideoSampler sampler;
+    std::vector<int> colors;
+
+    int fpsNum, fpsDen;
+    bool loop = false;
+    std::atomic<bool> stopRequested{false};
+    MLFVideoStats stats = {};
+
+public:
+    using Sink = std::function<void(int* colors, int len)>;
+
+    MLFVideoPlayer(MLFY4MReader& reader, const MLFLedLayout& layout);
+
+    /* Override frame rate from header */
+    void setFrameRate(int num, int den = 1);
+
+    /* Start over at the end of (seekable) stream */
+    void setLoop(bool enabled);
+
+    /* Returns at the end of stream or after `stop` */
+    void play(const Sink& sink);
+
+    /* Safe to call from another thread or signal handler */
+    void stop(void);
+
+    void getStats(MLFVideoStats& stats) const;
+};
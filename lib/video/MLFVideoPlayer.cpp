@@ -0,0 +1,81 @@
+/**
+ * @file MLFVideoPlayer.cpp
+ * @author Pawel Wieczorek
+ * @brief Playback of Y4M stream on LEDs at its frame rate
+ * @date 2022-07-19
+ */
+#include <chrono>
+#include <thread>
+
+#include "MLFVideo.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+
+MLFVideoPlayer::MLFVideoPlayer(MLFY4MReader& reader, const MLFLedLayout& layout)
+    : reader(reader), sampler(reader.getFormat(), layout) {
+    colors.resize(sampler.getLedsCount());
+    fpsNum = reader.getFormat().fpsNum;
+    fpsDen = reader.getFormat().fpsDen;
+}
+
+void MLFVideoPlayer::setFrameRate(int num, int den) {
+    if(num <= 0 || den <= 0)
+        throw MLFException("Invalid frame rate");
+    fpsNum = num;
+    fpsDen = den;
+}
+
+void MLFVideoPlayer::setLoop(bool enabled) {
+    loop = enabled;
+}
+
+void MLFVideoPlayer::stop(void) {
+    stopRequested = true;
+}
+
+void MLFVideoPlayer::getStats(MLFVideoStats& stats) const {
+    stats = this->stats;
+}
+
+/**
+ * @brief Hand frames over to sink at their presentation time
+ *
+ * Presentation time of n-th frame is counted from start of playback, so
+ *  delays don't accumulate. Frame which is already more than a frame period
+ *  late is dropped without sampling.
+ */
+void MLFVideoPlayer::play(const Sink& sink) {
+    const auto period = std::chrono::nanoseconds(1000000000ull * fpsDen / fpsNum);
+    const Clock::time_point start = Clock::now();
+    bool framesSinceRewind = false;
+    MLFYUVFrame frame;
+
+    for(uint64_t index = 0; !stopRequested; index++) {
+        if(!reader.readFrame(frame)) {
+            // Don't spin on an empty stream
+            if(loop && framesSinceRewind && reader.rewind()) {
+                framesSinceRewind = false;
+                index--;
+                continue;
+            }
+            break;
+        }
+        framesSinceRewind = true;
+        stats.framesRead++;
+
+        const Clock::time_point presentAt = start + std::chrono::nanoseconds(1000000000ull * fpsDen * index / fpsNum);
+        const Clock::time_point now = Clock::now();
+        if(now > presentAt + period) {
+            stats.framesDropped++;
+            continue;
+        }
+
+        sampler.sample(frame, colors.data());
+        stats.sampleNs += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - now).count();
+
+        std::this_thread::sleep_until(presentAt);
+        sink(colors.data(), colors.size());
+        stats.framesSent++;
+    }
+}
@@ -0,0 +1,294 @@
+/**
+ * @file MLFVideoSampler.cpp
+ * @author Pawel Wieczorek
+ * @brief Area sampling of YUV frames onto LED layout
+ * @date 2022-07-19
+ *
+ * Every pixel under LED is converted to RGB (BT.601, limited or full range)
+ *  and clamped before averaging, exactly like averaging an RGB image would
+ *  do. Conversion is done in 8.8 fixed point, 8 pixels at a time with SSE2.
+ *  Scalar code computing the same values is used on other architectures.
+ */
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__SSE2__) && !defined(MLF_VIDEO_NO_SIMD)
+#define MLF_VIDEO_SSE2
+#include <emmintrin.h>
+#endif
+
+#include "MLFVideo.hpp"
+
+#define SCALE_SHIFT             32
+#define LAYOUT_MAX_LINE         256
+
+/* 32-bit lane gets at most 2 * 255 per group of 8 pixels, 2048 groups per row */
+#define SSE2_FLUSH_ROWS         1024
+
+/* YUV to RGB in 8.8 fixed point */
+struct YUVCoeffs {
+    int16_t yOffset;
+    int16_t y;
+    int16_t vr;
+    int16_t ug;
+    int16_t vg;
+    int16_t ub;
+};
+
+static const YUVCoeffs BT601Limited = { 16, 298, 409, -100, -208, 516 };
+static const YUVCoeffs BT601Full = { 0, 256, 359, -88, -183, 454 };
+
+
+/************************************
+ * LAYOUT
+ ************************************/
+MLFLedLayout MLFLedLayout::Rows(const std::vector<int>& ledsPerRow, bool rightToLeft) {
+    MLFLedLayout layout;
+    const float rowHeight = 1.0f / ledsPerRow.size();
+
+    for(size_t row = 0; row < ledsPerRow.size(); row++) {
+        const int count = ledsPerRow[row];
+        const float y1 = 1.0f - row * rowHeight;
+
+        for(int i = 0; i < count; i++) {
+            const int pos = rightToLeft ? count - 1 - i : i;
+            layout.areas.push_back({ (float)pos / count, y1 - rowHeight,
+                                     (float)(pos + 1) / count, y1 });
+        }
+    }
+
+    return layout;
+}
+
+MLFLedLayout MLFLedLayout::Load(const std::string& path) {
+    MLFLedLayout layout;
+    char line[LAYOUT_MAX_LINE];
+    MLFLedArea area;
+    FILE* file;
+
+    file = fopen(path.c_str(), "r");
+    if(file == NULL)
+        throw MLFException("Failed to open LED layout file", true);
+
+    while(fgets(line, sizeof line, file)) {
+        const char* start = line + strspn(line, " \t");
+        if(*start == '#' || *start == '\n' || *start == '\0')
+            continue;
+
+        if(sscanf(start, "%f %f %f %f", &area.x0, &area.y0, &area.x1, &area.y1) != 4) {
+            fclose(file);
+            throw MLFException("Invalid LED layout file - expected \"x0 y0 x1 y1\" per line");
+        }
+        layout.areas.push_back(area);
+    }
+
+    fclose(file);
+    if(layout.areas.empty())
+        throw MLFException("Invalid LED layout file - no LEDs");
+    return layout;
+}
+
+
+/************************************
+ * CONVERSION
+ ************************************/
+static inline int Clamp8(int value) {
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+#ifndef MLF_VIDEO_SSE2
+/* Sum of RGB of pixels under span, `sum` is added to */
+static void AccumulateSpanScalar(const MLFYUVFrame& frame, const MLFVideoFormat& format,
+                                 int x0, int x1, int y0, int y1, const YUVCoeffs& k, uint64_t* sum) {
+    for(int row = y0; row < y1; row++) {
+        const uint8_t* y = frame.y + (size_t)row * frame.yStride;
+        const size_t chromaRow = (size_t)(row >> format.chromaShiftY) * frame.uvStride;
+        uint32_t r = 0, g = 0, b = 0;
+
+        for(int x = x0; x < x1; x++) {
+            const int luma = k.y * (y[x] - k.yOffset) + 128;
+            const int cu = frame.u[chromaRow + (x >> format.chromaShiftX)] - 128;
+            const int cv = frame.v[chromaRow + (x >> format.chromaShiftX)] - 128;
+
+            r += Clamp8((luma + k.vr * cv) >> 8);
+            g += Clamp8((luma + k.ug * cu + k.vg * cv) >> 8);
+            b += Clamp8((luma + k.ub * cu) >> 8);
+        }
+
+        sum[0] += r;
+        sum[1] += g;
+        sum[2] += b;
+    }
+}
+#else
+/* Pair of 16-bit coefficients for _mm_madd_epi16 */
+static inline __m128i CoeffPair(int16_t lo, int16_t hi) {
+    return _mm_set1_epi32((uint16_t)lo | ((uint32_t)(uint16_t)hi << 16));
+}
+
+/* Round, scale down and clamp 8 channel values to [0, 255] as 16-bit lanes */
+static inline __m128i PackChannel(__m128i lo, __m128i hi) {
+    const __m128i round = _mm_set1_epi32(128);
+    const __m128i packed = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(lo, round), 8),
+                                           _mm_srai_epi32(_mm_add_epi32(hi, round), 8));
+
+    return _mm_min_epi16(_mm_max_epi16(packed, _mm_setzero_si128()), _mm_set1_epi16(255));
+}
+
+static inline __m128i LoadChroma(const uint8_t* chroma, int shiftX) {
+    int32_t pairs;
+
+    if(!shiftX)
+        return _mm_loadl_epi64((const __m128i*) chroma);
+
+    // 4 samples shared by 8 pixels
+    memcpy(&pairs, chroma, sizeof pairs);
+    const __m128i samples = _mm_cvtsi32_si128(pairs);
+    return _mm_unpacklo_epi8(samples, samples);
+}
+
+struct SSE2Coeffs {
+    __m128i yOffset;
+    __m128i r;      // (y, v)
+    __m128i gu;     // (y, u)
+    __m128i gv;     // (y, v)
+    __m128i b;      // (y, u)
+
+    SSE2Coeffs(const YUVCoeffs& k)
+        : yOffset(_mm_set1_epi16(k.yOffset)), r(CoeffPair(k.y, k.vr)), gu(CoeffPair(k.y, k.ug)),
+          gv(CoeffPair(0, k.vg)), b(CoeffPair(k.y, k.ub)) {}
+};
+
+/* Convert 8 pixels to RGB as 16-bit lanes */
+static inline void Convert8(const uint8_t* y, const uint8_t* u, const uint8_t* v, int shiftX,
+                            const SSE2Coeffs& k, __m128i& r, __m128i& g, __m128i& b) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i chromaOffset = _mm_set1_epi16(128);
+    const __m128i y16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) y), zero), k.yOffset);
+    const __m128i u16 = _mm_sub_epi16(_mm_unpacklo_epi8(LoadChroma(u, shiftX), zero), chromaOffset);
+    const __m128i v16 = _mm_sub_epi16(_mm_unpacklo_epi8(LoadChroma(v, shiftX), zero), chromaOffset);
+
+    const __m128i yvLo = _mm_unpacklo_epi16(y16, v16);
+    const __m128i yvHi = _mm_unpackhi_epi16(y16, v16);
+    const __m128i yuLo = _mm_unpacklo_epi16(y16, u16);
+    const __m128i yuHi = _mm_unpackhi_epi16(y16, u16);
+
+    r = PackChannel(_mm_madd_epi16(yvLo, k.r), _mm_madd_epi16(yvHi, k.r));
+    g = PackChannel(_mm_add_epi32(_mm_madd_epi16(yuLo, k.gu), _mm_madd_epi16(yvLo, k.gv)),
+                    _mm_add_epi32(_mm_madd_epi16(yuHi, k.gu), _mm_madd_epi16(yvHi, k.gv)));
+    b = PackChannel(_mm_madd_epi16(yuLo, k.b), _mm_madd_epi16(yuHi, k.b));
+}
+
+static inline void FlushLanes(__m128i& acc, uint64_t* sum) {
+    uint32_t lanes[4];
+
+    _mm_storeu_si128((__m128i*) lanes, acc);
+    *sum += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    acc = _mm_setzero_si128();
+}
+
+/**
+ * @brief Sum of RGB of pixels under span, 8 pixels at a time
+ *
+ * The last group of a row is masked, so it may read up to 7 pixels past
+ *  the span (planes are padded for that). Sums are kept in 32-bit lanes and
+ *  flushed every SSE2_FLUSH_ROWS rows, before they could overflow.
+ */
+static void AccumulateSpanSSE2(const MLFYUVFrame& frame, const MLFVideoFormat& format,
+                               int x0, int x1, int y0, int y1, const YUVCoeffs& coeffs, uint64_t* sum) {
+    const SSE2Coeffs k(coeffs);
+    const int shiftX = format.chromaShiftX;
+    const int groups = (x1 - x0 + 7) / 8;
+    const int tail = x1 - x0 - (groups - 1) * 8;
+    const __m128i lanes = _mm_set_epi16(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m128i tailMask = _mm_cmplt_epi16(lanes, _mm_set1_epi16(tail));
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i accR = _mm_setzero_si128(), accG = accR, accB = accR;
+    __m128i r, g, b;
+
+    for(int row = y0; row < y1; row++) {
+        const uint8_t* y = frame.y + (size_t)row * frame.yStride + x0;
+        const size_t chroma = (size_t)(row >> format.chromaShiftY) * frame.uvStride + (x0 >> shiftX);
+        const uint8_t* u = frame.u + chroma;
+        const uint8_t* v = frame.v + chroma;
+        int i;
+
+        for(i = 0; i < (groups - 1) * 8; i += 8) {
+            Convert8(y + i, u + (i >> shiftX), v + (i >> shiftX), shiftX, k, r, g, b);
+            accR = _mm_add_epi32(accR, _mm_madd_epi16(r, ones));
+            accG = _mm_add_epi32(accG, _mm_madd_epi16(g, ones));
+            accB = _mm_add_epi32(accB, _mm_madd_epi16(b, ones));
+        }
+
+        Convert8(y + i, u + (i >> shiftX), v + (i >> shiftX), shiftX, k, r, g, b);
+        accR = _mm_add_epi32(accR, _mm_madd_epi16(_mm_and_si128(r, tailMask), ones));
+        accG = _mm_add_epi32(accG, _mm_madd_epi16(_mm_and_si128(g, tailMask), ones));
+        accB = _mm_add_epi32(accB, _mm_madd_epi16(_mm_and_si128(b, tailMask), ones));
+
+        if((row - y0) % SSE2_FLUSH_ROWS == SSE2_FLUSH_ROWS - 1) {
+            FlushLanes(accR, &sum[0]);
+            FlushLanes(accG, &sum[1]);
+            FlushLanes(accB, &sum[2]);
+        }
+    }
+
+    FlushLanes(accR, &sum[0]);
+    FlushLanes(accG, &sum[1]);
+    FlushLanes(accB, &sum[2]);
+}
+#endif
+
+
+/************************************
+ * SAMPLER
+ ************************************/
+MLFVideoSampler::MLFVideoSampler(const MLFVideoFormat& format, const MLFLedLayout& layout)
+    : format(format) {
+    for(const MLFLedArea& area : layout.areas) {
+        Span span;
+
+        span.x0 = (int) floorf(std::min(area.x0, area.x1) * format.width);
+        span.x1 = (int) ceilf(std::max(area.x0, area.x1) * format.width);
+        span.y0 = (int) floorf(std::min(area.y0, area.y1) * format.height);
+        span.y1 = (int) ceilf(std::max(area.y0, area.y1) * format.height);
+
+        span.x0 = std::min(std::max(span.x0, 0), format.width - 1);
+        span.y0 = std::min(std::max(span.y0, 0), format.height - 1);
+        span.x1 = std::min(std::max(span.x1, span.x0 + 1), format.width);
+        span.y1 = std::min(std::max(span.y1, span.y0 + 1), format.height);
+
+        // Both pixels sharing chroma sample start at even column
+        span.x0 &= ~((1 << format.chromaShiftX) - 1);
+
+        const uint64_t pixels = (uint64_t)(span.x1 - span.x0) * (span.y1 - span.y0);
+        span.scale = ((1ull << SCALE_SHIFT) + pixels / 2) / pixels;
+        map.push_back(span);
+    }
+}
+
+int MLFVideoSampler::getLedsCount(void) const {
+    return map.size();
+}
+
+void MLFVideoSampler::sample(const MLFYUVFrame& frame, int* colors) const {
+    const YUVCoeffs& k = format.fullRange ? BT601Full : BT601Limited;
+    const uint64_t round = 1ull << (SCALE_SHIFT - 1);
+
+    for(size_t led = 0; led < map.size(); led++) {
+        const Span& span = map[led];
+        uint64_t sum[3] = { 0, 0, 0 };
+
+#ifdef MLF_VIDEO_SSE2
+        AccumulateSpanSSE2(frame, format, span.x0, span.x1, span.y0, span.y1, k, sum);
+#else
+        AccumulateSpanScalar(frame, format, span.x0, span.x1, span.y0, span.y1, k, sum);
+#endif
+
+        const int r = (sum[0] * span.scale + round) >> SCALE_SHIFT;
+        const int g = (sum[1] * span.scale + round) >> SCALE_SHIFT;
+        const int b = (sum[2] * span.scale + round) >> SCALE_SHIFT;
+        colors[led] = std::min(r, 255) | (std::min(g, 255) << 8) | (std::min(b, 255) << 16);
+    }
+}
@@ -0,0 +1,241 @@
+/**
+ * @file MLFY4MReader.cpp
+ * @author Pawel Wieczorek
+ * @brief Reader of uncompressed YUV4MPEG2 (Y4M) streams
+ * @date 2022-07-19
+ *
+ * Stream is a text header line followed by frames, each of them being
+ *  "FRAME[ params]\n" and raw Y, U and V planes:
+ *  YUV4MPEG2 W640 H360 F30000:1001 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "MLFVideo.hpp"
+
+#define Y4M_MAGIC               "YUV4MPEG2"
+#define Y4M_FRAME_MAGIC         "FRAME"
+#define Y4M_MAX_HEADER_SIZE     1024
+#define Y4M_MAX_DIMENSION       16384
+
+
+/************************************
+ * I/O HELPERS
+ ************************************/
+
+/**
+ * @brief Read exactly `len` bytes, unless stream ends
+ *
+ * @return size_t number of bytes read, less than `len` only at the end of stream
+ */
+static size_t ReadFull(int fd, void* buf, size_t len) {
+    size_t done = 0;
+
+    while(done < len) {
+        ssize_t ret = read(fd, (uint8_t*)buf + done, len - done);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret < 0)
+            throw MLFException("Failed to read video stream", true);
+        if(ret == 0)
+            break;
+        done += ret;
+    }
+
+    return done;
+}
+
+/**
+ * @brief Read line (without '\n') of at most Y4M_MAX_HEADER_SIZE bytes
+ *
+ * Header lines are short, reading them byte by byte is simpler than keeping
+ *  the rest of a larger read for frame data.
+ */
+static bool ReadLine(int fd, std::string& line) {
+    char c;
+
+    line.clear();
+    while(ReadFull(fd, &c, 1) == 1) {
+        if(c == '\n')
+            return true;
+        if(line.size() >= Y4M_MAX_HEADER_SIZE)
+            throw MLFException("Invalid Y4M stream - header line too long");
+        line.push_back(c);
+    }
+
+    return false;
+}
+
+
+/************************************
+ * HEADER
+ ************************************/
+MLFY4MReader::MLFY4MReader(const std::string& path) {
+    if(path == "-") {
+        fd = STDIN_FILENO;
+    }
+    else {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            throw MLFException("Failed to open video file", true);
+        ownFd = true;
+    }
+
+    try {
+        parseHeader();
+    }
+    catch(...) {
+        if(ownFd)
+            close(fd);
+        throw;
+    }
+}
+
+MLFY4MReader::~MLFY4MReader() {
+    if(ownFd)
+        close(fd);
+}
+
+void MLFY4MReader::parseHeader(void) {
+    std::string line;
+    std::string colorspace = "420jpeg";
+    size_t pos = 0;
+
+    if(!ReadLine(fd, line) || line.compare(0, strlen(Y4M_MAGIC), Y4M_MAGIC) != 0)
+        throw MLFException("Invalid Y4M stream - missing YUV4MPEG2 header");
+
+    // Parameters are space separated, each starting with a tag letter
+    while((pos = line.find(' ', pos)) != std::string::npos) {
+        const size_t end = line.find(' ', ++pos);
+        const std::string param = line.substr(pos, end == std::string::npos ? end : end - pos);
+
+        if(param.empty())
+            continue;
+
+        switch(param[0]) {
+        case 'W':
+            format.width = atoi(param.c_str() + 1);
+            break;
+        case 'H':
+            format.height = atoi(param.c_str() + 1);
+            break;
+        case 'F':
+            if(sscanf(param.c_str() + 1, "%d:%d", &format.fpsNum, &format.fpsDen) != 2)
+                throw MLFException("Invalid Y4M stream - malformed frame rate");
+            break;
+        case 'C':
+            colorspace = param.substr(1);
+            break;
+        case 'X':
+            if(param == "XCOLORRANGE=FULL")
+                format.fullRange = true;
+            break;
+        default:
+            // Interlacing and pixel aspect ratio don't matter for LEDs
+            break;
+        }
+    }
+
+    if(format.width <= 0 || format.height <= 0 ||
+       format.width > Y4M_MAX_DIMENSION || format.height > Y4M_MAX_DIMENSION)
+        throw MLFException("Invalid Y4M stream - missing or invalid frame size");
+    if(format.fpsNum <= 0 || format.fpsDen <= 0)
+        throw MLFException("Invalid Y4M stream - missing or invalid frame rate");
+
+    // Chroma siting of 4:2:0 variants doesn't matter when averaging areas
+    if(colorspace == "420jpeg" || colorspace == "420paldv" ||
+       colorspace == "420mpeg2" || colorspace == "420") {
+        format.chromaShiftX = 1;
+        format.chromaShiftY = 1;
+    }
+    else if(colorspace == "422") {
+        format.chromaShiftX = 1;
+    }
+    else if(colorspace == "mono") {
+        format.mono = true;
+    }
+    else if(colorspace != "444") {
+        throw MLFException("Unsupported Y4M colorspace - only 8-bit 420, 422, 444 and mono are supported");
+    }
+
+    const int chromaWidth = (format.width + (1 << format.chromaShiftX) - 1) >> format.chromaShiftX;
+    const int chromaHeight = (format.height + (1 << format.chromaShiftY) - 1) >> format.chromaShiftY;
+
+    lumaSize = (size_t)format.width * format.height;
+    chromaSize = format.mono ? 0 : (size_t)chromaWidth * chromaHeight;
+    buffer.resize(lumaSize + 2 * chromaSize + MLF_VIDEO_PLANE_PADDING);
+    if(format.mono)
+        neutralRow.assign(format.width + MLF_VIDEO_PLANE_PADDING, 128);
+
+    dataStart = lseek(fd, 0, SEEK_CUR);
+    seekable = dataStart >= 0;
+}
+
+const MLFVideoFormat& MLFY4MReader::getFormat(void) const {
+    return format;
+}
+
+
+/************************************
+ * FRAMES
+ ************************************/
+
+/**
+ * @brief Read "FRAME" line preceding frame data
+ *
+ * @return false at the end of stream
+ */
+bool MLFY4MReader::readFrameHeader(void) {
+    const size_t magicLen = strlen(Y4M_FRAME_MAGIC);
+    char header[8];
+    std::string rest;
+    size_t len;
+
+    // Almost always it's just "FRAME\n" - read it at once
+    len = ReadFull(fd, header, magicLen + 1);
+    if(len == 0)
+        return false;
+    if(len != magicLen + 1 || memcmp(header, Y4M_FRAME_MAGIC, magicLen) != 0)
+        throw MLFException("Invalid Y4M stream - missing FRAME header");
+
+    // Frame parameters are not used
+    if(header[magicLen] != '\n' && !ReadLine(fd, rest))
+        throw MLFException("Invalid Y4M stream - truncated FRAME header");
+
+    return true;
+}
+
+bool MLFY4MReader::readFrame(MLFYUVFrame& frame) {
+    const size_t frameSize = lumaSize + 2 * chromaSize;
+
+    if(!readFrameHeader())
+        return false;
+    if(ReadFull(fd, buffer.data(), frameSize) != frameSize)
+        throw MLFException("Invalid Y4M stream - truncated frame");
+
+    frame.y = buffer.data();
+    frame.yStride = format.width;
+    if(format.mono) {
+        frame.u = frame.v = neutralRow.data();
+        frame.uvStride = 0;
+    }
+    else {
+        frame.u = buffer.data() + lumaSize;
+        frame.v = buffer.data() + lumaSize + chromaSize;
+        frame.uvStride = (format.width + (1 << format.chromaShiftX) - 1) >> format.chromaShiftX;
+    }
+
+    return true;
+}
+
+bool MLFY4MReader::rewind(void) {
+    if(!seekable)
+        return false;
+    if(lseek(fd, dataStart, SEEK_SET) < 0)
+        throw MLFException("Failed to rewind video stream", true);
+    return true;
+}
@@ -0,0 +1,148 @@
+/**
+ * @file mlf_video.cpp
+ * @author Pawel Wieczorek
+ * @brief Plays YUV4MPEG2 (Y4M) video on MLF Controller
+ * @date 2022-07-19
+ *
+ * Usage: mlf_video [--device PATH | --mlfd SOCKET] [--layout FILE]
+ *                  [--left-to-right] [--fps NUM[:DEN]] [--loop] FILE|-
+ *
+ * Any video can be played by converting it on the fly, e.g.:
+ *  ffmpeg -i clip.mp4 -vf scale=160:-2 -f yuv4mpegpipe - | mlf_video -
+ */
+#include <memory>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "MLFVideo.hpp"
+#ifdef MLF_VIDEO_WITH_MLFD
+#include "MLFDaemonClient.hpp"
+#endif
+
+struct Options {
+    std::string device;
+    std::string mlfd;
+    std::string layout;
+    std::string input;
+    bool rightToLeft = true;
+    bool loop = false;
+    int fpsNum = 0;
+    int fpsDen = 1;
+};
+
+static MLFVideoPlayer* player;
+
+static void OnSignal(int sig) {
+    if(player)
+        player->stop();
+}
+
+static void Usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [options] FILE|-\n"
+            "  --device PATH        MLF Controller (found automatically by default)\n"
+#ifdef MLF_VIDEO_WITH_MLFD
+            "  --mlfd SOCKET        send frames through mlfd instead of device\n"
+#endif
+            "  --layout FILE        LED areas, \"x0 y0 x1 y1\" per line (default: strips as rows)\n"
+            "  --left-to-right      LEDs of default layout run from left to right\n"
+            "  --fps NUM[:DEN]      override frame rate of stream\n"
+            "  --loop               play file again from start at its end\n",
+            name);
+}
+
+static bool ParseArgs(int argc, char** argv, Options& opts) {
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--device") && i + 1 < argc)
+            opts.device = argv[++i];
+#ifdef MLF_VIDEO_WITH_MLFD
+        else if(!strcmp(argv[i], "--mlfd") && i + 1 < argc)
+            opts.mlfd = argv[++i];
+#endif
+        else if(!strcmp(argv[i], "--layout") && i + 1 < argc)
+            opts.layout = argv[++i];
+        else if(!strcmp(argv[i], "--left-to-right"))
+            opts.rightToLeft = false;
+        else if(!strcmp(argv[i], "--fps") && i + 1 < argc) {
+            if(sscanf(argv[++i], "%d:%d", &opts.fpsNum, &opts.fpsDen) < 1 ||
+               opts.fpsNum <= 0 || opts.fpsDen <= 0)
+                return false;
+        }
+        else if(!strcmp(argv[i], "--loop"))
+            opts.loop = true;
+        else if(opts.input == "" && (argv[i][0] != '-' || !strcmp(argv[i], "-")))
+            opts.input = argv[i];
+        else
+            return false;
+    }
+
+    return opts.input != "";
+}
+
+int main(int argc, char** argv) {
+    Options opts;
+    MLFVideoStats stats;
+
+    if(!ParseArgs(argc, argv, opts)) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        std::unique_ptr<MLFProtoLib> lib;
+        MLFVideoPlayer::Sink sink;
+        std::vector<int> rows;
+
+#ifdef MLF_VIDEO_WITH_MLFD
+        std::unique_ptr<MLFDaemonClient> client;
+        if(opts.mlfd != "") {
+            client = std::make_unique<MLFDaemonClient>(opts.mlfd);
+            rows = { client->getLedsCount() };
+            sink = [&](int* colors, int len) { client->setColors(colors, len); };
+        }
+        else
+#endif
+        {
+            int top, bottom;
+            lib = std::make_unique<MLFProtoLib>(opts.device);
+            lib->getLedsCount(top, bottom);
+            rows = { bottom, top };
+            sink = [&](int* colors, int len) { lib->setColors(colors, len); };
+        }
+
+        MLFY4MReader reader(opts.input);
+        const MLFVideoFormat& format = reader.getFormat();
+        MLFVideoPlayer videoPlayer(reader, opts.layout != "" ? MLFLedLayout::Load(opts.layout)
+                                                             : MLFLedLayout::Rows(rows, opts.rightToLeft));
+
+        if(opts.fpsNum)
+            videoPlayer.setFrameRate(opts.fpsNum, opts.fpsDen);
+        videoPlayer.setLoop(opts.loop);
+
+        fprintf(stderr, "mlf_video: %dx%d %s at %.2f fps\n", format.width, format.height,
+                format.mono ? "mono" : (format.chromaShiftY ? "4:2:0" : (format.chromaShiftX ? "4:2:2" : "4:4:4")),
+                opts.fpsNum ? (double) opts.fpsNum / opts.fpsDen : (double) format.fpsNum / format.fpsDen);
+
+        player = &videoPlayer;
+        struct sigaction sa = {};
+        sa.sa_handler = OnSignal;
+        sigaction(SIGINT, &sa, nullptr);
+        sigaction(SIGTERM, &sa, nullptr);
+
+        videoPlayer.play(sink);
+        player = nullptr;
+        videoPlayer.getStats(stats);
+    }
+    catch(MLFException& ex) {
+        fprintf(stderr, "mlf_video: %s\n", ex.what());
+        return 1;
+    }
+
+    fprintf(stderr, "mlf_video: %llu frames read, %llu sent, %llu dropped, sampling %.1f us/frame\n",
+            (unsigned long long) stats.framesRead, (unsigned long long) stats.framesSent,
+            (unsigned long long) stats.framesDropped,
+            stats.framesSent ? stats.sampleNs / 1000.0 / stats.framesSent : 0.0);
+    return 0;
+}
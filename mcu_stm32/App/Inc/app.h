@@ -6,6 +6,13 @@
 #ifndef INC_APP_H_
 #define INC_APP_H_
 
+/*
+ * Slots of packet rings, 2 KB of RAM each. USB absorbs bursts of frames
+ *  from PC, USART gets only commands rerouted by the other controller.
+ */
+#define APP_USB_RX_SLOTS		3
+#define APP_USART_RX_SLOTS		2
+
 void app_init(void);
 void app_main_loop(void);
 
@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * color_math.h - fixed-point color math for effects and transitions, with
+ * 				  hue wheel in flash and saturating blends of 8-bit channels
+ *  (C) 2022 Pawel Wieczorek
+ */
+#ifndef INC_COLOR_MATH_H_
+#define INC_COLOR_MATH_H_
+
+#include <stdint.h>
+
+/*
+ * Hue is 16-bit fraction of full circle, so it wraps around on overflow.
+ *  Wheel has 1024 steps, the lowest 6 bits of hue are dropped.
+ */
+#define COLOR_HUE_MAX			65536UL
+#define COLOR_WHEEL_BITS		10
+#define COLOR_WHEEL_STEPS		(1 << COLOR_WHEEL_BITS)
+
+/*
+ * Hue step between `count` LEDs spread over full circle, 16.16 fixed point.
+ *  Shifted in 64 bits, as unsigned long is only 32 bits wide on Cortex-M4.
+ */
+#define COLOR_HUE_STEP(count)	((uint32_t)(((uint64_t)COLOR_HUE_MAX << 16) / (count)))
+
+// Weight of color_blend - 0 is the first color, 256 the second one
+#define COLOR_BLEND_MAX			256
+
+struct Color {
+	uint8_t r;
+	uint8_t g;
+	uint8_t b;
+};
+
+/* Fully saturated colors, as hsl2rgb(hue, 1, 0.5) */
+extern const struct Color color_wheel_lut[COLOR_WHEEL_STEPS];
+
+/* Perceived brightness to PWM duty, gamma 2.2 */
+extern const uint8_t color_gamma_lut[256];
+
+struct Color color_hsv(uint16_t hue, uint8_t sat, uint8_t val);
+
+static inline struct Color color_wheel(uint16_t hue) {
+	return color_wheel_lut[hue >> (16 - COLOR_WHEEL_BITS)];
+}
+
+static inline uint8_t qadd8(uint8_t a, uint8_t b) {
+	uint32_t sum = (uint32_t)a + b;
+
+	return sum > 0xff ? 0xff : sum;
+}
+
+static inline uint8_t qsub8(uint8_t a, uint8_t b) {
+	return a > b ? a - b : 0;
+}
+
+/* a * scale / 255, exact for 0 and 255 */
+static inline uint8_t scale8(uint8_t a, uint8_t scale) {
+	return ((uint32_t)a * (scale + 1)) >> 8;
+}
+
+static inline uint8_t blend8(uint8_t from, uint8_t to, uint32_t weight) {
+	return ((uint32_t)from * (COLOR_BLEND_MAX - weight) + (uint32_t)to * weight) >> 8;
+}
+
+static inline struct Color color_add(struct Color a, struct Color b) {
+	return (struct Color) { qadd8(a.r, b.r), qadd8(a.g, b.g), qadd8(a.b, b.b) };
+}
+
+static inline struct Color color_sub(struct Color a, struct Color b) {
+	return (struct Color) { qsub8(a.r, b.r), qsub8(a.g, b.g), qsub8(a.b, b.b) };
+}
+
+static inline struct Color color_scale(struct Color color, uint8_t scale) {
+	return (struct Color) { scale8(color.r, scale), scale8(color.g, scale), scale8(color.b, scale) };
+}
+
+static inline struct Color color_blend(struct Color from, struct Color to, uint32_t weight) {
+	return (struct Color) { blend8(from.r, to.r, weight), blend8(from.g, to.g, weight),
+			blend8(from.b, to.b, weight) };
+}
+
+#endif /* INC_COLOR_MATH_H_ */
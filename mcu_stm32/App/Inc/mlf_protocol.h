@@ -36,6 +36,22 @@ enum MLF_commands {
 	MLF_CMD_GET_EFFECT,
 	MLF_CMD_GET_ON_STATE,
 
+	MLF_CMD_SET_FLOW_CONTROL,
+
+	MLF_CMD_GET_CLOCK,
+	MLF_CMD_SET_COLOR_AT,
+	MLF_CMD_GET_PRESENT_STATS,
+
+	MLF_CMD_SET_COLOR_FRAGMENT,
+
+	MLF_CMD_BATCH,
+
+	MLF_CMD_LINK_PROBE,
+
+	MLF_CMD_SET_TRANSITION,
+
+	MLF_CMD_SET_STRIP_CONFIG,
+
 	MLF_CMD_MAX,
 
 	// Nasty, but response is a special type of command with
@@ -48,6 +64,10 @@ enum MLF_error_codes {
 	MLF_RET_OK				= 0,
 	MLF_RET_PING			= 1,
 
+	// Asynchronous events sent by controller without any request.
+	//  Only hosts which have opted in receive them
+	MLF_RET_EVENT_CREDITS	= 2,
+
 	MLF_RET_INVALID_CMD		= 128,
 	MLF_RET_INVALID_HEADER,
 	MLF_RET_INVALID_DATA,
@@ -78,13 +98,61 @@ struct MLF_packet_footer {
 
 /*
  * MLF_CMD_GET_INFO
+ *  Hosts sending MLF_req_cmd_get_info get MLF_resp_cmd_get_info_ext with
+ *  capabilities of controller. Older firmware ignores request data and
+ *  always responds with bare MLF_resp_cmd_get_info.
  */
+#define MLF_PROTOCOL_VERSION				2
+
+enum MLF_CAPS {
+	MLF_CAP_PIXFMT_RGB32	= 1 << 0,	// 4 bytes per LED
+	MLF_CAP_PIXFMT_RGB24	= 1 << 1,	// 3 bytes per LED (MLF_FRAGMENT_RGB24)
+	MLF_CAP_FRAGMENTS		= 1 << 2,	// MLF_CMD_SET_COLOR_FRAGMENT
+	MLF_CAP_FLOW_CONTROL	= 1 << 3,	// MLF_CMD_SET_FLOW_CONTROL
+	MLF_CAP_CLOCK_SYNC		= 1 << 4,	// MLF_CMD_GET_CLOCK, MLF_CMD_SET_COLOR_AT
+	MLF_CAP_ASYNC_EVENTS	= 1 << 5,	// MLF_RET_EVENT_* packets
+	MLF_CAP_ASYNC_TAGS		= 1 << 6,	// reserved - tagged, pipelined requests
+	MLF_CAP_COMPRESSION		= 1 << 7,	// reserved - compressed frames
+	MLF_CAP_CRC				= 1 << 8,	// reserved - packets protected by CRC
+	MLF_CAP_BATCH			= 1 << 9,	// MLF_CMD_BATCH
+	MLF_CAP_LINK_PROBE		= 1 << 10,	// MLF_CMD_LINK_PROBE
+	MLF_CAP_TRANSITIONS		= 1 << 11,	// MLF_CMD_SET_TRANSITION
+	MLF_CAP_STRIP_CONFIG	= 1 << 12,	// MLF_CMD_SET_STRIP_CONFIG
+};
+
+enum MLF_LED_TYPE {
+	MLF_LED_WS2812B			= 0,
+	MLF_LED_APA102			= 1,	// also SK9822
+	MLF_LED_SK6812_RGBW		= 2,
+};
+
+struct MLF_req_cmd_get_info {
+	uint8_t protocol_version;
+} PACKED;
+
 struct MLF_resp_cmd_get_info {
 	uint8_t fw_version;
 	uint16_t leds_count_top;
 	uint16_t leds_count_bottom;
 } PACKED;
 
+struct MLF_strip_info {
+	uint8_t strip;			// MLF_STRIP_ID
+	uint8_t led_type;		// MLF_LED_TYPE
+	uint16_t leds_count;
+	uint16_t first_led;		// index of strip's first LED in frame
+} PACKED;
+
+struct MLF_resp_cmd_get_info_ext {
+	struct MLF_resp_cmd_get_info info;
+	uint8_t protocol_version;
+	uint32_t caps;
+	uint16_t max_payload;
+	uint16_t max_fps;
+	uint8_t strips_count;
+	struct MLF_strip_info strips[0];
+} PACKED;
+
 /*
  * MLF_CMD_SET_BRIGHTNESS
  */
@@ -105,6 +173,90 @@ struct MLF_req_cmd_set_color {
 	uint8_t colors[0];
 } PACKED;
 
+/*
+ * MLF_CMD_SET_COLOR_FRAGMENT
+ *  Frames not fitting into a single packet are split into fragments sent
+ *  in order. Each of them carries colors of LEDs starting from `offset`.
+ *  Frame is shown once fragment with MLF_FRAGMENT_LAST flag arrives.
+ */
+#define MLF_REQ_CMD_SET_COLOR_FRAGMENT_LEN	(sizeof struct MLF_req_cmd_set_color_fragment)
+
+enum MLF_FRAGMENT_FLAGS {
+	MLF_FRAGMENT_LAST		= 1 << 0,
+	MLF_FRAGMENT_RGB24		= 1 << 1,	// colors are 3 bytes (R, G, B) per LED
+};
+
+struct MLF_req_cmd_set_color_fragment {
+	uint8_t frame_id;
+	uint8_t flags;
+	uint16_t offset;
+	uint8_t colors[0];
+} PACKED;
+
+/*
+ * MLF_CMD_BATCH carries a sequence of MLF_batch_cmd entries, executed one
+ *  after another in a single pass - LEDs are refreshed only after all of
+ *  them have been applied. Nothing is executed if any entry is malformed.
+ *  Execution stops at the first failing sub-command and its error code is
+ *  put in header of combined response (MLF_resp_cmd_batch). Frames
+ *  (SET_COLOR, SET_COLOR_AT, SET_COLOR_FRAGMENT) and SET_FLOW_CONTROL are
+ *  not allowed inside, as they can't be rolled back.
+ */
+#define MLF_BATCH_MAX_CMDS					15
+
+struct MLF_batch_cmd {
+	uint8_t cmd;
+	uint16_t data_size;
+	uint8_t data[0];
+} PACKED;
+
+struct MLF_batch_resp {
+	uint8_t error_code;
+	uint16_t data_size;
+	uint8_t data[0];
+} PACKED;
+
+struct MLF_resp_cmd_batch {
+	uint8_t count;						// number of executed sub-commands
+	struct MLF_batch_resp resps[0];		// of variable size
+} PACKED;
+
+/*
+ * MLF_CMD_LINK_PROBE
+ *  Payload of any size (up to max_payload) is received and dropped, and
+ *  empty response is sent back. Host measures round trip time of packets
+ *  of different sizes with it, without touching LEDs. Not allowed inside
+ *  MLF_CMD_BATCH.
+ */
+
+/*
+ * MLF_CMD_SET_TRANSITION
+ *  Frames received after this command are keyframes - controller fades
+ *  every LED linearly from its current color to the new one over
+ *  `duration_ms`, refreshing LEDs at its own rate. Zero (default) shows
+ *  frames immediately.
+ */
+#define MLF_REQ_CMD_SET_TRANSITION_LEN		(sizeof struct MLF_req_cmd_set_transition)
+
+struct MLF_req_cmd_set_transition {
+	uint16_t duration_ms;
+} PACKED;
+
+/*
+ * MLF_CMD_SET_STRIP_CONFIG
+ *  Change type of LEDs and their number on a single strip (MLF_STRIP_ID),
+ *  up to capacity of firmware. Layout of frame changes, so host should ask
+ *  for info again - queued and fragmented frames and transition in progress
+ *  are dropped. Not allowed inside MLF_CMD_BATCH, as it can't be undone.
+ */
+#define MLF_REQ_CMD_SET_STRIP_CONFIG_LEN	(sizeof struct MLF_req_cmd_set_strip_config)
+
+struct MLF_req_cmd_set_strip_config {
+	uint8_t strip;			// MLF_STRIP_ID
+	uint8_t led_type;		// MLF_LED_TYPE
+	uint16_t leds_count;
+} PACKED;
+
 /*
  * MLF_CMD_SET_EFFECT
  */
@@ -151,6 +303,65 @@ struct MLF_resp_cmd_get_on_state {
 	uint8_t is_on;
 };
 
+/*
+ * MLF_CMD_SET_FLOW_CONTROL
+ *  Once enabled, controller grants host a credit for each frame pushed
+ *  out to LEDs. Every MLF_CMD_SET_COLOR consumes one credit. Current
+ *  number of credits is sent in response to both commands and in
+ *  MLF_RET_EVENT_CREDITS event whenever new credit is granted. MLF_CMD_GET_INFO
+ *  disables it again, so hosts handshaking without it never get events.
+ */
+#define MLF_REQ_CMD_SET_FLOW_CONTROL_LEN	(sizeof struct MLF_req_cmd_set_flow_control)
+#define MLF_RESP_FLOW_CREDITS_LEN			(sizeof struct MLF_resp_flow_credits)
+
+struct MLF_req_cmd_set_flow_control {
+	uint8_t enable;
+};
+
+struct MLF_resp_flow_credits {
+	uint8_t credits;
+};
+
+/*
+ * MLF_CMD_GET_CLOCK
+ *  Returns controller's free running microseconds counter (wraps every
+ *  ~71 minutes). Host uses it to estimate offset and drift of clocks.
+ */
+#define MLF_RESP_CMD_GET_CLOCK_LEN			(sizeof struct MLF_resp_cmd_get_clock)
+
+struct MLF_resp_cmd_get_clock {
+	uint32_t time_us;
+} PACKED;
+
+/*
+ * MLF_CMD_SET_COLOR_AT
+ *  Same as MLF_CMD_SET_COLOR, but colors are latched when controller's
+ *  clock reaches `present_at_us`. Not allowed inside MLF_CMD_BATCH, as
+ *  queued frames aren't rolled back.
+ */
+#define MLF_REQ_CMD_SET_COLOR_AT_LEN		(sizeof struct MLF_req_cmd_set_color_at)
+
+struct MLF_req_cmd_set_color_at {
+	uint32_t present_at_us;
+	uint8_t strip;
+	uint8_t colors[0];
+} PACKED;
+
+/*
+ * MLF_CMD_GET_PRESENT_STATS
+ *  Jitter is the difference between actual and requested presentation time
+ */
+#define MLF_RESP_CMD_GET_PRESENT_STATS_LEN	(sizeof struct MLF_resp_cmd_get_present_stats)
+
+struct MLF_resp_cmd_get_present_stats {
+	uint32_t presented;
+	uint32_t late;
+	uint32_t dropped;
+	int32_t jitter_min_us;
+	int32_t jitter_max_us;
+	int32_t jitter_avg_us;
+} PACKED;
+
 
 /**********************
  * PACKET BUFFER FOR INCOMMING TRANSMISSION
@@ -158,9 +369,15 @@ struct MLF_resp_cmd_get_on_state {
 struct MLF_ctx;
 struct packet_buffer;
 
-struct packet_buffer* packet_buffer_init(struct MLF_ctx* ctx);
+// Ring is full - caller keeps the rest of its data and stops receiving
+#define PACKET_BUFFER_PAUSED		1
+
+typedef void (*packet_buffer_resume_func)(void);
+
+struct packet_buffer* packet_buffer_init(struct MLF_ctx* ctx, uint8_t slots, packet_buffer_resume_func resume);
 void packet_buffer_deinit(struct packet_buffer*);
 int packet_buffer_append(struct packet_buffer*, uint8_t*, uint32_t);
+int packet_buffer_is_paused(struct packet_buffer*);
 
 
 /**********************
@@ -168,6 +385,11 @@ int packet_buffer_append(struct packet_buffer*, uint8_t*, uint32_t);
  **********************/
 typedef int (*MLF_command_handler)(uint8_t*, uint16_t, uint8_t*, uint16_t*);
 typedef int (*MLF_write_func)(uint8_t*, uint16_t);
+typedef void (*MLF_batch_begin_hook)(void);
+typedef void (*MLF_batch_end_hook)(int);
+typedef int (*MLF_stream_begin_hook)(uint8_t, uint8_t*, uint16_t);
+typedef void (*MLF_stream_data_hook)(uint8_t*, uint16_t);
+typedef void (*MLF_stream_end_hook)(int);
 
 enum MLF_OPTS {
 	MLF_OPTS_NONE				= 0,
@@ -177,10 +399,18 @@ enum MLF_OPTS {
 struct MLF_ctx {
 	MLF_write_func write_func;
 	MLF_command_handler ops[MLF_CMD_HANDLE_RESPONSE + 1];
-	uint16_t recv_packet_len;
-	uint8_t* recv_packet_buf;
-	uint8_t new_data_available;
+	struct packet_buffer* rx;		// packets are processed in its slots
 	uint8_t opts;
+
+	// Let application restore its state when batch fails in the middle
+	MLF_batch_begin_hook batch_begin;
+	MLF_batch_end_hook batch_end;
+
+	// Let application decode data of stream_cmds while it's being received
+	uint32_t stream_cmds;
+	MLF_stream_begin_hook stream_begin;
+	MLF_stream_data_hook stream_data;
+	MLF_stream_end_hook stream_end;
 };
 
 struct MLF_reroute {
@@ -194,7 +424,11 @@ int MLF_is_packet_available(struct MLF_ctx* ctx);
 void MLF_process_packet(struct MLF_ctx* ctx);
 void MLF_register_callback(struct MLF_ctx* ctx, enum MLF_commands cmd, MLF_command_handler cb);
 void MLF_register_reroute(struct MLF_ctx* from, struct MLF_ctx* to, enum MLF_commands cmd);
+void MLF_register_batch_hooks(struct MLF_ctx* ctx, MLF_batch_begin_hook begin, MLF_batch_end_hook end);
+void MLF_register_stream_hooks(struct MLF_ctx* ctx, enum MLF_commands cmd, MLF_stream_begin_hook begin,
+		MLF_stream_data_hook data, MLF_stream_end_hook end);
 void MLF_SendCmd(struct MLF_ctx* ctx, enum MLF_commands cmd, uint8_t* data, uint16_t size);
+void MLF_SendEvent(struct MLF_ctx* ctx, enum MLF_error_codes event, uint8_t* data, uint16_t size);
 
 #ifdef _MSC_VER
 	__pragma(pack(pop))
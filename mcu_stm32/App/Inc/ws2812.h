@@ -1,7 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0-only
 /*
- * ws2812.h - STM32 library for controlling LED strips based on
- * 			  WS2812B IC using SPI interface
+ * ws2812.h - STM32 library for controlling LED strips using SPI
+ * 			  interface, with drivers of WS2812B, SK6812 and APA102 ICs
  *  (C) 2022 Pawel Wieczorek
  */
 #ifndef INC_WS2812_H_
@@ -9,30 +9,106 @@
 
 #include <stm32f4xx_hal.h>
 
+#include "color_math.h"
+
 /*
  * Exported structures
  */
-struct Color {
-	uint8_t r;
-	uint8_t g;
-	uint8_t b;
-};
-
 struct Ratio {
 	uint8_t num;
 	uint8_t denum;
 };
 
+struct LEDParallelPort;
+struct LEDStrip;
+
+/* Output of every value of channels, for LEDs of one calibration segment */
+struct LEDChannelLUT {
+	uint8_t r[256];
+	uint8_t g[256];
+	uint8_t b[256];
+};
+
+/* Values are the same as MLF_LED_TYPE of protocol */
+enum LEDChipType {
+	LED_CHIP_WS2812B = 0,
+	LED_CHIP_APA102 = 1,
+	LED_CHIP_SK6812_RGBW = 2,
+};
+
+/*
+ * Driver of LED IC - SPI settings, layout of frame and encoding of LEDs.
+ *  Frame is header_len bytes, led_len bytes of every LED and trailer
+ *  up to frame_len.
+ */
+struct LEDDriver {
+	const char* name;
+	enum LEDChipType type;
+	uint32_t spi_clock_hz;			// the highest one, bus may be slower
+	uint32_t spi_first_bit;
+	uint32_t header_len;
+	uint32_t led_len;
+
+	uint32_t (*frame_len)(uint32_t len);
+	uint32_t (*refresh_time_us)(uint32_t len);
+	// Frame of dark LEDs, with header and trailer
+	void (*init_frame)(uint8_t* buffer, uint32_t len);
+	// `count` LEDs from `first` on, into `out` at the first of them
+	void (*encode_leds)(struct LEDStrip* strip, uint8_t* out, uint32_t first, uint32_t count);
+	// Scale of channels for brightness, if LED dims itself too (optional)
+	uint8_t (*lut_brightness)(uint8_t brightness);
+};
+
 struct LEDStrip {
 	SPI_HandleTypeDef* spi;
+	uint32_t spi_pclk_hz;			// clock of SPI peripheral
+	const struct LEDDriver* driver;
 	uint32_t len;
-	uint8_t* _data_buffer;
+	uint32_t capacity;				// LEDs which pixels are allocated for
 	uint8_t brightness;
 
+	// Colors as set by application - encoded by refresh_leds
+	struct Color* pixels;
+
+	// SPI bitstreams - DMA reads the front one while the other one is
+	//  encoded. Every buffer has its own span of LEDs changed since it was
+	//  encoded, [dirty_start, dirty_end).
+	uint8_t* _data_buffer[2];
+	uint8_t* _next_buffer[2];		// of new chip, see set_led_strip_chip
+	uint32_t dirty_start[2];
+	uint32_t dirty_end[2];
+	uint8_t changed;				// since the last refresh
+	volatile uint8_t front;
+	volatile uint8_t pending;		// back buffer waits for DMA to finish
+
+	// Streaming mode - there are no bitstreams of whole frame, LEDs are
+	//  encoded chunk by chunk into a small circular DMA buffer from SPI
+	//  interrupts
+	uint8_t streaming;
+	uint8_t* _stream_buffer;
+	volatile uint32_t stream_next;	// next chunk to be encoded
+	volatile uint32_t stream_sent;	// chunks already sent
+
+	// Parallel output - strip is a lane of GPIO port sent together with
+	//  other lanes, see ws2812_parallel.h. Only pixels and dirty spans of
+	//  strip are used then.
+	struct LEDParallelPort* port;
+	uint8_t lane;
+
+	// Number of DMA transfers started and finished (updated from IRQ)
+	volatile uint32_t frames_started;
+	volatile uint32_t frames_sent;
+
 	// Used for correcting color differences between strips
 	uint8_t apply_ratio;
 	uint16_t ratio_index;
 	struct Ratio rt1_r, rt1_g, rt1_b, rt2_r, rt2_g, rt2_b;
+	uint8_t gamma;
+
+	// Brightness, calibration and gamma folded together, rebuilt when any
+	//  of them changes. The second segment starts at ratio_index.
+	struct LEDChannelLUT* lut;
+	uint8_t lut_segments;
 };
 
 /*
@@ -41,17 +117,39 @@ struct LEDStrip {
 extern struct LEDStrip* led_strip_upper;
 extern struct LEDStrip* led_strip_bottom;
 
+extern const struct LEDDriver ws2812b_driver;
+extern const struct LEDDriver sk6812_rgbw_driver;
+extern const struct LEDDriver apa102_driver;
+
 /*
  * Exported functions
  */
 int init_led_strip(struct LEDStrip** stripp, SPI_HandleTypeDef* hspi, uint32_t len);
+int init_led_strip_chip(struct LEDStrip** stripp, SPI_HandleTypeDef* hspi,
+		const struct LEDDriver* driver, uint32_t len, uint32_t capacity);
+int init_led_strip_streaming(struct LEDStrip** stripp, SPI_HandleTypeDef* hspi, uint32_t len);
+int set_led_strip_chip(struct LEDStrip* strip, const struct LEDDriver* driver, uint32_t len);
+int finish_led_strip_chip(struct LEDStrip* strip);
+const struct LEDDriver* get_led_strip_chip(struct LEDStrip* strip);
 int get_leds_count(struct LEDStrip* strip);
+int get_leds_capacity(struct LEDStrip* strip);
+uint32_t get_refresh_time_us(struct LEDStrip* strip);
 void set_led_color(struct LEDStrip* strip, int idx, struct Color color);
+void set_leds_colors(struct LEDStrip* strip, uint32_t start, const struct Color* colors, uint32_t count);
+struct Color get_led_color(struct LEDStrip* strip, int idx);
 void refresh_leds(struct LEDStrip* strip);
+int is_refresh_done(struct LEDStrip* strip);
 void clear_leds(struct LEDStrip* strip);
 void set_leds_brightness(struct LEDStrip* strip, uint8_t brightness);
 void calibrate_leds_colors(struct LEDStrip* strip, struct Ratio r, struct Ratio g, struct Ratio b, uint16_t);
+void set_leds_gamma(struct LEDStrip* strip, uint8_t enable);
 
 struct Color int2Color(int color);
 
+/*
+ * Used by output drivers
+ */
+struct LEDStrip* alloc_led_strip(SPI_HandleTypeDef* hspi, uint32_t len);
+struct Color get_led_output_color(struct LEDStrip* strip, uint32_t idx);
+
 #endif /* INC_WS2812_H_ */
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * ws2812_parallel.h - parallel output of up to 16 WS2812B strips on pins
+ * 					   of a single GPIO port, driven by timer and DMA
+ *  (C) 2022 Pawel Wieczorek
+ */
+#ifndef INC_WS2812_PARALLEL_H_
+#define INC_WS2812_PARALLEL_H_
+
+#include <stm32f4xx_hal.h>
+
+#include "ws2812.h"
+
+#define LED_PORT_MAX_LANES		16
+
+/*
+ * Every WS2812B bit of all lanes is one timer period. Three DMA streams,
+ *  requested by timer update, CC1 and CC2 events, write port's BSRR:
+ *  - update sets all lanes high,
+ *  - CC1 (T0H) pulls low lanes sending 0, taken from bit-transposed buffer,
+ *  - CC2 (T1H) pulls all lanes low.
+ *
+ * Lane N is pin N of the port. Timer handle must have DMA handles of its
+ *  update, CC1 and CC2 requests linked (hdma[TIM_DMA_ID_*]), with Instance
+ *  and Channel set. Interrupt of CC2 stream has to be enabled and its
+ *  handler has to call HAL_DMA_IRQHandler.
+ */
+struct LEDParallelPort {
+	GPIO_TypeDef* gpio;
+	TIM_HandleTypeDef* htim;
+	uint8_t lanes;
+	uint8_t width;					// bytes per bit of all lanes - 1 or 2
+	uint16_t mask;					// pins of all lanes
+	uint32_t len;					// LEDs of the longest lane
+	struct LEDStrip* strips[LED_PORT_MAX_LANES];
+
+	// Bit-transposed frames, 24 words of lanes per LED - DMA reads the
+	//  front one while the other one is encoded
+	uint8_t* _bit_buffer[2];
+	volatile uint8_t front;
+	volatile uint8_t pending;		// back buffer waits for DMA to finish
+
+	// Number of DMA transfers started and finished (updated from IRQ)
+	volatile uint32_t frames_started;
+	volatile uint32_t frames_sent;
+};
+
+int init_led_port(struct LEDParallelPort** portp, GPIO_TypeDef* gpio, uint8_t lanes,
+		uint32_t len, TIM_HandleTypeDef* htim);
+int init_led_strip_parallel(struct LEDStrip** stripp, struct LEDParallelPort* port,
+		uint8_t lane, uint32_t len);
+uint32_t get_led_port_refresh_time_us(struct LEDParallelPort* port);
+void refresh_led_port(struct LEDParallelPort* port);
+int is_led_port_refresh_done(struct LEDParallelPort* port);
+
+#endif /* INC_WS2812_PARALLEL_H_ */
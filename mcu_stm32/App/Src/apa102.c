@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * apa102.c - driver of LED strips based on APA102 and SK9822 ICs, which
+ * 			  have separate clock and data lines driven by SPI
+ *  (C) 2022 Pawel Wieczorek
+ */
+
+#include "main.h"
+#include "ws2812.h"
+
+#include <stdint.h>
+#include <string.h>
+
+
+/************************
+ * PRIVATE MACROS
+ ************************/
+#define APA102_HEADER_LEN		4
+#define APA102_BYTES_PER_DIODE	4
+#define APA102_GLOBAL_MAX		31
+#define APA102_GLOBAL_MARK		0xe0
+
+/*
+ * Data is delayed by half of clock cycle on every LED, so at least one
+ *  clock edge per two LEDs has to follow the last one. SK9822 also needs
+ *  its end frame of zeros to latch colors.
+ */
+#define APA102_TRAILER_LEN(LEDS)	(4 + ((LEDS) + 15) / 16)
+
+// 32 bits per diode - APA102 takes up to 30 MHz, but long strips need slower clock
+#define APA102_CLOCK_HZ			10500000
+#define APA102_NS_PER_DIODE		3048
+
+
+/************************
+ * PRIVATE FUNCTIONS
+ ************************/
+static uint32_t apa102_frame_len(uint32_t len) {
+	return APA102_HEADER_LEN + len * APA102_BYTES_PER_DIODE + APA102_TRAILER_LEN(len);
+}
+
+static uint32_t apa102_refresh_time_us(uint32_t len) {
+	return (apa102_frame_len(len) * APA102_NS_PER_DIODE / APA102_BYTES_PER_DIODE) / 1000 + 1;
+}
+
+static void apa102_init_frame(uint8_t* buffer, uint32_t len) {
+	memset(buffer, 0, apa102_frame_len(len));
+	for(uint32_t i = 0; i < len; i++)
+		buffer[APA102_HEADER_LEN + i * APA102_BYTES_PER_DIODE] = APA102_GLOBAL_MARK;
+}
+
+/*
+ * Strip's brightness is mapped to the 5-bit global brightness of LED, which
+ *  dims it by PWM of constant current. Channels are scaled only by what's
+ *  left, so dark colors keep their resolution.
+ */
+static uint32_t apa102_global(uint8_t brightness) {
+	return (brightness * APA102_GLOBAL_MAX + 254) / 255;
+}
+
+static uint8_t apa102_lut_brightness(uint8_t brightness) {
+	uint32_t global = apa102_global(brightness);
+
+	return global ? (brightness * APA102_GLOBAL_MAX) / global : 0;
+}
+
+static void apa102_encode_leds(struct LEDStrip* strip, uint8_t* out, uint32_t first, uint32_t count) {
+	const uint8_t global = APA102_GLOBAL_MARK | apa102_global(strip->brightness);
+
+	for(uint32_t i = 0; i < count; i++, out += APA102_BYTES_PER_DIODE) {
+		struct Color color = get_led_output_color(strip, first + i);
+
+		// APA102 expects BGR order, MSB first
+		out[0] = global;
+		out[1] = color.b;
+		out[2] = color.g;
+		out[3] = color.r;
+	}
+}
+
+
+/************************
+ * EXPORTED GLOBALS
+ ************************/
+const struct LEDDriver apa102_driver = {
+		.name = "APA102",
+		.type = LED_CHIP_APA102,
+		.spi_clock_hz = APA102_CLOCK_HZ,
+		.spi_first_bit = SPI_FIRSTBIT_MSB,
+		.header_len = APA102_HEADER_LEN,
+		.led_len = APA102_BYTES_PER_DIODE,
+		.frame_len = apa102_frame_len,
+		.refresh_time_us = apa102_refresh_time_us,
+		.init_frame = apa102_init_frame,
+		.encode_leds = apa102_encode_leds,
+		.lut_brightness = apa102_lut_brightness,
+};
@@ -5,7 +5,9 @@
  */
 
 #include "app.h"
+#include "color_math.h"
 #include "ws2812.h"
+#include "ws2812_parallel.h"
 #include "mlf_protocol.h"
 #include "mlf_effects.h"
 #include "logger.h"
@@ -50,18 +52,156 @@ enum MLF_EFFECTS cur_effect_bottom = 0;
 uint32_t cur_effect_speed = 1;
 uint32_t cur_effect_top_data, cur_effect_bottom_data;
 
+/*
+ * Flow control - host gets one credit per frame actually pushed out to
+ *  LEDs, so there's at most one frame waiting in the controller
+ */
+#define FLOW_MAX_CREDITS	1
+
+static struct {
+	uint8_t enabled;
+	uint8_t credits;
+	uint8_t frame_received;		// SET_COLOR frame waiting for refresh
+	uint8_t frame_latched;		// SET_COLOR frame being sent over SPI
+} flow;
+
+static int app_flow_resp(uint8_t* resp, uint16_t* resp_len) {
+	struct MLF_resp_flow_credits credits = {
+			.credits = flow.credits,
+	};
+
+	memcpy(resp, &credits, sizeof credits);
+	*resp_len = sizeof credits;
+	return MLF_RET_OK;
+}
+
+static int app_set_flow_control(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_len) {
+	struct MLF_req_cmd_set_flow_control* cmd_data = NULL;
+
+	if(len < sizeof(*cmd_data)) {
+		printk(LOG_ERR "app: set flow control command got incorrect len(%d)", len);
+		return MLF_RET_INVALID_DATA;
+	}
+
+	cmd_data = (struct MLF_req_cmd_set_flow_control*) data;
+	flow.enabled = !!cmd_data->enable;
+	flow.credits = FLOW_MAX_CREDITS;
+	return app_flow_resp(resp, resp_len);
+}
+
+static void app_flow_update(void) {
+	if(!flow.enabled || !flow.frame_latched)
+		return;
+	if(!is_refresh_done(led_strip_bottom) || !is_refresh_done(led_strip_upper))
+		return;
+
+	flow.frame_latched = 0;
+	if(flow.credits < FLOW_MAX_CREDITS)
+		flow.credits++;
+
+	struct MLF_resp_flow_credits credits = {
+			.credits = flow.credits,
+	};
+	MLF_SendEvent(&usb_ctx, MLF_RET_EVENT_CREDITS, (uint8_t*) &credits, sizeof credits);
+}
+
+/*
+ * Strips encoded just in time into a small circular DMA buffer need a third
+ *  of RAM, but frame changed during transfer may be torn
+ */
+#ifndef APP_LED_STREAMING
+#define APP_LED_STREAMING	0
+#endif
+
+/*
+ * Both strips as lanes 0 and 1 of parallel port on PC0-PC7, sent at once.
+ *  Board routes strips to SPI pins, so it needs strips rewired.
+ */
+#ifndef APP_LED_PARALLEL
+#define APP_LED_PARALLEL	0
+#endif
+
+/*
+ * Rate of frame clock - effects and transitions are rendered on its ticks.
+ *  At least 16 fps, as TIM3 is a 16-bit counter of microseconds.
+ */
+#ifndef APP_FRAME_FPS
+#define APP_FRAME_FPS		60
+#endif
+
+/*
+ * Strips driven by SPI can be changed by host to another LED IC or length,
+ *  up to this number of LEDs each. Streaming and parallel strips are fixed.
+ */
+#ifndef APP_LED_CAPACITY
+#define APP_LED_CAPACITY	300
+#endif
+
+/*
+ * Gamma correction of colors, so they are sent as perceived brightness.
+ *  Dark colors lose their resolution.
+ */
+#ifndef APP_LED_GAMMA
+#define APP_LED_GAMMA		0
+#endif
+
+#define APP_FW_VERSION		1
+#define APP_CAPS			(MLF_CAP_PIXFMT_RGB32 | MLF_CAP_PIXFMT_RGB24 | MLF_CAP_FRAGMENTS | \
+							 MLF_CAP_FLOW_CONTROL | MLF_CAP_CLOCK_SYNC | MLF_CAP_ASYNC_EVENTS | \
+							 MLF_CAP_BATCH | MLF_CAP_LINK_PROBE | MLF_CAP_TRANSITIONS | \
+							 MLF_CAP_STRIP_CONFIG)
+
 int app_get_info(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_len) {
 	struct MLF_resp_cmd_get_info info = {
-			.fw_version = 1,
+			.fw_version = APP_FW_VERSION,
 			.leds_count_top = get_leds_count(led_strip_upper),
 			.leds_count_bottom = get_leds_count(led_strip_bottom),
 	};
+	struct MLF_resp_cmd_get_info_ext* ext = (struct MLF_resp_cmd_get_info_ext*) resp;
+	uint32_t refresh_us;
+
+	// Hosts not aware of capabilities don't send any data
+	if(len < sizeof(struct MLF_req_cmd_get_info)) {
+		memcpy(resp, &info, sizeof info);
+		*resp_len = sizeof info;
+		return MLF_RET_OK;
+	}
 
-	memcpy(resp, &info, sizeof info);
-	*resp_len = sizeof info;
+	refresh_us = get_refresh_time_us(led_strip_bottom);
+	if(get_refresh_time_us(led_strip_upper) > refresh_us)
+		refresh_us = get_refresh_time_us(led_strip_upper);
+
+	ext->info = info;
+	ext->protocol_version = MLF_PROTOCOL_VERSION;
+	ext->caps = APP_CAPS;
+	ext->max_payload = MLF_MAX_DATA_SIZE;
+	ext->max_fps = 1000000 / refresh_us;
+	ext->strips_count = 2;
+	ext->strips[0] = (struct MLF_strip_info) {
+			.strip = STRIP_BOTTOM,
+			.led_type = get_led_strip_chip(led_strip_bottom)->type,
+			.leds_count = info.leds_count_bottom,
+			.first_led = 0,
+	};
+	ext->strips[1] = (struct MLF_strip_info) {
+			.strip = STRIP_TOP,
+			.led_type = get_led_strip_chip(led_strip_upper)->type,
+			.leds_count = info.leds_count_top,
+			.first_led = info.leds_count_bottom,
+	};
+
+	*resp_len = sizeof(*ext) + ext->strips_count * sizeof(struct MLF_strip_info);
 	return MLF_RET_OK;
 }
 
+/* Host which opened the port anew may not know flow control at all */
+static int app_usb_get_info(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_len) {
+	flow.enabled = 0;
+	flow.frame_received = 0;
+	flow.frame_latched = 0;
+	return app_get_info(data, len, resp, resp_len);
+}
+
 int app_turn_on(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_len) {
 	app_mode = old_app_mode;
 	return MLF_RET_OK;
@@ -118,29 +258,464 @@ int app_set_effect(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_le
 	return MLF_RET_OK;
 }
 
+/*
+ * Batch is applied atomically - if any sub-command fails, state changed by
+ *  the preceding ones is restored before LEDs get refreshed. Frames and
+ *  flow control aren't restored - protocol refuses them inside a batch.
+ */
+static struct {
+	enum APP_OP_MODE mode, old_mode;
+	enum MLF_EFFECTS effect_top, effect_bottom;
+	uint32_t effect_speed, effect_top_data, effect_bottom_data;
+	uint8_t brightness_top, brightness_bottom;
+	uint16_t transition_ms;
+} batch_snapshot;
+
+static void transition_set_duration(uint16_t duration_ms);
+static uint16_t transition_get_duration(void);
+
+static void app_batch_begin(void) {
+	batch_snapshot.mode = app_mode;
+	batch_snapshot.old_mode = old_app_mode;
+	batch_snapshot.effect_top = cur_effect_top;
+	batch_snapshot.effect_bottom = cur_effect_bottom;
+	batch_snapshot.effect_speed = cur_effect_speed;
+	batch_snapshot.effect_top_data = cur_effect_top_data;
+	batch_snapshot.effect_bottom_data = cur_effect_bottom_data;
+	batch_snapshot.brightness_top = led_strip_upper->brightness;
+	batch_snapshot.brightness_bottom = led_strip_bottom->brightness;
+	batch_snapshot.transition_ms = transition_get_duration();
+}
+
+static void app_batch_end(int ret) {
+	if(ret == MLF_RET_OK)
+		return;
+
+	app_mode = batch_snapshot.mode;
+	old_app_mode = batch_snapshot.old_mode;
+	cur_effect_top = batch_snapshot.effect_top;
+	cur_effect_bottom = batch_snapshot.effect_bottom;
+	cur_effect_speed = batch_snapshot.effect_speed;
+	cur_effect_top_data = batch_snapshot.effect_top_data;
+	cur_effect_bottom_data = batch_snapshot.effect_bottom_data;
+	set_leds_brightness(led_strip_upper, batch_snapshot.brightness_top);
+	set_leds_brightness(led_strip_bottom, batch_snapshot.brightness_bottom);
+	transition_set_duration(batch_snapshot.transition_ms);
+}
+
+/*
+ * LEDs are addressed as a single string - bottom strip goes first
+ */
+static int app_set_led(int i, struct Color color) {
+	int bottomLedsCnt = get_leds_count(led_strip_bottom);
+
+	if(i >= bottomLedsCnt + get_leds_count(led_strip_upper))
+		return -1;
+	else if(i >= bottomLedsCnt)
+		set_led_color(led_strip_upper, i - bottomLedsCnt, color);
+	else
+		set_led_color(led_strip_bottom, i, color);
+	return 0;
+}
+
+/***********************
+ * KEYFRAME TRANSITIONS
+ ***********************/
+/*
+ * With transitions enabled frames are received into `next` and the main
+ *  loop fades every LED from `from` to `to`. New keyframe starts from
+ *  colors shown at the moment, so it may cut a transition short. Weight of
+ *  `to` is 0..256, so blending needs neither division nor floats.
+ */
+#define TRANSITION_MIN_STEP_US		10000		// at most 100 fps of output
+#define TRANSITION_WEIGHT_MAX		COLOR_BLEND_MAX
+
+static uint32_t app_get_time_us(void);
+
+static struct {
+	uint16_t duration_ms;
+	uint8_t active;
+	uint32_t start_us;
+	uint32_t last_step_us;
+	uint32_t step_us;
+	uint32_t leds_count;
+
+	struct Color* from;
+	struct Color* to;
+	struct Color* next;
+} transition;
+
+/* Strips were (re)configured - transition in progress is dropped */
+static void transition_reset(void) {
+	uint32_t refresh_us = get_refresh_time_us(led_strip_bottom);
+
+	if(get_refresh_time_us(led_strip_upper) > refresh_us)
+		refresh_us = get_refresh_time_us(led_strip_upper);
+	transition.step_us = refresh_us > TRANSITION_MIN_STEP_US ? refresh_us : TRANSITION_MIN_STEP_US;
+	transition.leds_count = get_leds_count(led_strip_bottom) + get_leds_count(led_strip_upper);
+	transition.active = 0;
+
+	memset(transition.from, 0, transition.leds_count * sizeof(struct Color));
+	memset(transition.to, 0, transition.leds_count * sizeof(struct Color));
+	memset(transition.next, 0, transition.leds_count * sizeof(struct Color));
+}
+
+static void transition_init(void) {
+	uint32_t capacity = get_leds_capacity(led_strip_bottom) + get_leds_capacity(led_strip_upper);
+
+	transition.from = calloc(capacity, sizeof(struct Color));
+	transition.to = calloc(capacity, sizeof(struct Color));
+	transition.next = calloc(capacity, sizeof(struct Color));
+	if(transition.from == NULL || transition.to == NULL || transition.next == NULL)
+		panic("app: failed to allocate transition buffers");
+	transition_reset();
+}
+
+static uint32_t transition_weight(uint32_t now) {
+	uint32_t elapsed = now - transition.start_us;
+	uint32_t weight;
+
+	if(!transition.active)
+		return TRANSITION_WEIGHT_MAX;
+
+	// Duration is at least 1000us, so the divisor is never 0
+	weight = elapsed / ((transition.duration_ms * 1000UL) >> 8);
+	return weight < TRANSITION_WEIGHT_MAX ? weight : TRANSITION_WEIGHT_MAX;
+}
+
+static void transition_apply(uint32_t weight) {
+	for(uint32_t i = 0; i < transition.leds_count; i++) {
+		app_set_led(i, color_blend(transition.from[i], transition.to[i], weight));
+	}
+}
+
+/*
+ * Frames are received LED by LED - shown right away without transitions,
+ *  otherwise kept until the whole keyframe arrives
+ */
+static int app_frame_led(uint32_t i, struct Color color) {
+	if(i >= transition.leds_count)
+		return -1;
+
+	if(transition.duration_ms) {
+		transition.next[i] = color;
+		return 0;
+	}
+
+	transition.to[i] = color;
+	return app_set_led(i, color);
+}
+
+static void app_frame_done(void) {
+	uint32_t now = app_get_time_us();
+	uint32_t weight = transition_weight(now);
+	struct Color* swap;
+
+	if(!transition.duration_ms)
+		return;
+
+	for(uint32_t i = 0; i < transition.leds_count; i++) {
+		transition.from[i] = color_blend(transition.from[i], transition.to[i], weight);
+	}
+
+	swap = transition.to;
+	transition.to = transition.next;
+	transition.next = swap;
+
+	// LEDs missing in the next frame keep their target
+	memcpy(transition.next, transition.to, transition.leds_count * sizeof(struct Color));
+
+	transition.active = 1;
+	transition.start_us = now;
+	transition.last_step_us = now - transition.step_us;
+}
+
+/**
+ * Move LEDs one step closer to the keyframe, if it's time for it
+ *
+ * @return 1 if LEDs have to be refreshed, 0 otherwise
+ */
+static int transition_step(void) {
+	uint32_t now = app_get_time_us();
+	uint32_t weight;
+
+	if(!transition.active || now - transition.last_step_us < transition.step_us)
+		return 0;
+
+	weight = transition_weight(now);
+	transition_apply(weight);
+	transition.last_step_us = now;
+	transition.active = weight < TRANSITION_WEIGHT_MAX;
+	return 1;
+}
+
+static void transition_set_duration(uint16_t duration_ms) {
+	if(duration_ms == transition.duration_ms)
+		return;
+
+	// Colors shown directly so far are the starting point
+	if(!transition.duration_ms) {
+		memcpy(transition.from, transition.to, transition.leds_count * sizeof(struct Color));
+		memcpy(transition.next, transition.to, transition.leds_count * sizeof(struct Color));
+	}
+
+	// Pending transition is finished at once
+	if(!duration_ms && transition.active) {
+		transition_apply(TRANSITION_WEIGHT_MAX);
+		transition.active = 0;
+	}
+
+	transition.duration_ms = duration_ms;
+}
+
+static uint16_t transition_get_duration(void) {
+	return transition.duration_ms;
+}
+
+static int app_set_transition(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_len) {
+	struct MLF_req_cmd_set_transition* cmd_data = NULL;
+
+	if(len < sizeof(*cmd_data)) {
+		printk(LOG_ERR "app: set transition command got incorrect len(%d)", len);
+		return MLF_RET_INVALID_DATA;
+	}
+
+	cmd_data = (struct MLF_req_cmd_set_transition*) data;
+	transition_set_duration(cmd_data->duration_ms);
+	return MLF_RET_OK;
+}
+
+/***********************
+ * STREAMED FRAMES
+ ***********************/
+/*
+ * SET_COLOR and SET_COLOR_FRAGMENT received over USB are decoded into
+ *  `stream.colors` from USB IRQ, chunk by chunk while the rest of packet is
+ *  still on its way. Command handler then only copies decoded LEDs, if it got
+ *  the packet which was decoded. Packet dropped by its footer or timeout is
+ *  never shown.
+ */
+static struct {
+	struct Color* colors;
+	uint8_t* data;					// of packet being decoded
+	uint16_t data_size;
+	uint16_t header_len;			// command header preceding colors
+	uint8_t bytes_per_led;			// 0 until command header is received
+	uint16_t offset;				// of the first decoded LED in frame
+	uint16_t count;
+	volatile uint16_t decoded;
+	volatile uint8_t complete;
+} stream;
+
+static void stream_init(void) {
+	uint32_t capacity = get_leds_capacity(led_strip_bottom) + get_leds_capacity(led_strip_upper);
+
+	stream.colors = calloc(capacity, sizeof(struct Color));
+	if(stream.colors == NULL)
+		panic("app: failed to allocate stream buffer");
+}
+
+static void stream_set_layout(uint16_t offset, uint8_t bytes_per_led) {
+	uint32_t count = (stream.data_size - stream.header_len) / bytes_per_led;
+
+	if(offset >= transition.leds_count)
+		count = 0;
+	else if(count > transition.leds_count - offset)
+		count = transition.leds_count - offset;
+
+	stream.offset = offset;
+	stream.count = count;
+	stream.bytes_per_led = bytes_per_led;
+}
+
+static int app_stream_begin(uint8_t cmd, uint8_t* data, uint16_t data_size) {
+	stream.header_len = (cmd == MLF_CMD_SET_COLOR_FRAGMENT) ?
+			sizeof(struct MLF_req_cmd_set_color_fragment) : sizeof(struct MLF_req_cmd_set_color);
+	if(data_size < stream.header_len)
+		return -1;
+
+	stream.data = data;
+	stream.data_size = data_size;
+	stream.bytes_per_led = 0;
+	stream.decoded = 0;
+	stream.complete = 0;
+
+	// Colors of SET_COLOR are little endian integers - red is the lowest byte
+	if(cmd == MLF_CMD_SET_COLOR)
+		stream_set_layout(0, 4);
+	return 0;
+}
+
+/* Called with `received` bytes of data in place - only whole LEDs are decoded */
+static void app_stream_data(uint8_t* data, uint16_t received) {
+	uint8_t* leds = data + stream.header_len;
+	uint32_t available;
+
+	if(received < stream.header_len)
+		return;
+
+	if(!stream.bytes_per_led) {
+		struct MLF_req_cmd_set_color_fragment* hdr = (struct MLF_req_cmd_set_color_fragment*) data;
+		stream_set_layout(hdr->offset, (hdr->flags & MLF_FRAGMENT_RGB24) ? 3 : 4);
+	}
+
+	available = (received - stream.header_len) / stream.bytes_per_led;
+	if(available > stream.count)
+		available = stream.count;
+
+	for(uint32_t i = stream.decoded; i < available; i++) {
+		uint8_t* led = &leds[i * stream.bytes_per_led];
+		stream.colors[i] = (struct Color) { .r = led[0], .g = led[1], .b = led[2] };
+	}
+	if(available > stream.decoded)
+		stream.decoded = available;
+}
+
+static void app_stream_end(int complete) {
+	stream.complete = complete && stream.bytes_per_led && stream.decoded == stream.count;
+}
+
+/*
+ * Whether `data` has been decoded already - decoded LEDs are usable once.
+ *  Packet of other interface (USART) leaves stream of USB packet alone.
+ */
+static int app_stream_take(uint8_t* data) {
+	int ready;
+
+	if(stream.data != data)
+		return 0;
+
+	ready = stream.complete;
+	stream.complete = 0;
+	stream.data = NULL;
+	return ready;
+}
+
+/* Decoded LEDs go where app_frame_led would put them, LED by LED */
+static void app_stream_commit(void) {
+	uint32_t first = stream.offset, count = stream.count;
+	uint32_t bottom = get_leds_count(led_strip_bottom);
+
+	// Strips could be reconfigured in the meantime
+	if(first >= transition.leds_count)
+		return;
+	if(count > transition.leds_count - first)
+		count = transition.leds_count - first;
+
+	if(transition.duration_ms) {
+		memcpy(&transition.next[first], stream.colors, count * sizeof(struct Color));
+		return;
+	}
+
+	memcpy(&transition.to[first], stream.colors, count * sizeof(struct Color));
+	if(first < bottom) {
+		uint32_t n = (first + count < bottom) ? count : bottom - first;
+		set_leds_colors(led_strip_bottom, first, stream.colors, n);
+	}
+	if(first + count > bottom) {
+		uint32_t skip = (first < bottom) ? bottom - first : 0;
+		set_leds_colors(led_strip_upper, first + skip - bottom, stream.colors + skip, count - skip);
+	}
+}
+
 int app_set_color(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_len) {
 	int* leds = (int*)(data + sizeof(struct MLF_req_cmd_set_color));
-	int upperLedsCnt, bottomLedsCnt;
 	struct MLF_req_cmd_set_color* cmd_data = (struct MLF_req_cmd_set_color*) data;
 
 	if(len < sizeof(*cmd_data))
 		return MLF_RET_INVALID_DATA;
 	len -= sizeof(*cmd_data);
 
-	upperLedsCnt = get_leds_count(led_strip_upper);
-	bottomLedsCnt = get_leds_count(led_strip_bottom);
+	if(app_stream_take(data)) {
+		app_stream_commit();
+	} else {
+		for(int i = 0; i < len / 4; i++) {
+			if(app_frame_led(i, int2Color(leds[i])))
+				break;
+		}
+	}
+
+	app_frame_done();
+	app_mode = SHOW_COLORS;
+	if(!flow.enabled)
+		return MLF_RET_OK;
+
+	if(flow.credits)
+		flow.credits--;
+	flow.frame_received = 1;
+	return app_flow_resp(resp, resp_len);
+}
+
+/*
+ * Fragmented frames are written straight into LEDs buffers. LEDs are not
+ *  refreshed until the last fragment arrives, so partial frames are never
+ *  shown. Frame with missing fragment is abandoned.
+ */
+#define FRAGMENT_TIMEOUT_MS		100
 
-	for(int i = 0; i < len / 4; i++) {
-		if(i >= bottomLedsCnt + upperLedsCnt)
-			break;
-		else if(i >= bottomLedsCnt)
-			set_led_color(led_strip_upper, i - bottomLedsCnt, int2Color(leds[i]));
-		else
-			set_led_color(led_strip_bottom, i, int2Color(leds[i]));
+static struct {
+	uint8_t active;
+	uint8_t frame_id;
+	uint16_t next_offset;
+	uint32_t last_tick;
+} fragment;
+
+static int app_set_color_fragment(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_len) {
+	struct MLF_req_cmd_set_color_fragment* cmd_data = (struct MLF_req_cmd_set_color_fragment*) data;
+	uint8_t* leds = data + sizeof(*cmd_data);
+	int count, bytes_per_led, streamed = app_stream_take(data);
+
+	if(len < sizeof(*cmd_data))
+		return MLF_RET_INVALID_DATA;
+	bytes_per_led = (cmd_data->flags & MLF_FRAGMENT_RGB24) ? 3 : 4;
+	count = (len - sizeof(*cmd_data)) / bytes_per_led;
+
+	if(cmd_data->offset == 0) {
+		fragment.active = 1;
+		fragment.frame_id = cmd_data->frame_id;
+		fragment.next_offset = 0;
+	} else if(!fragment.active || fragment.frame_id != cmd_data->frame_id ||
+			  fragment.next_offset != cmd_data->offset) {
+		printk(LOG_ERR "app: dropping out of order fragment (frame %d, offset %d)",
+				cmd_data->frame_id, cmd_data->offset);
+		fragment.active = 0;
+		return MLF_RET_INVALID_DATA;
+	}
+
+	if(streamed) {
+		app_stream_commit();
+	} else {
+		for(int i = 0; i < count; i++) {
+			uint8_t* led = &leds[i * bytes_per_led];
+			struct Color color = { .r = led[0], .g = led[1], .b = led[2] };
+			if(app_frame_led(cmd_data->offset + i, color))
+				break;
+		}
 	}
+	fragment.next_offset += count;
+	fragment.last_tick = HAL_GetTick();
 
+	if(!(cmd_data->flags & MLF_FRAGMENT_LAST))
+		return MLF_RET_OK;
+
+	fragment.active = 0;
+	app_frame_done();
 	app_mode = SHOW_COLORS;
-	return MLF_RET_OK;
+	if(!flow.enabled)
+		return MLF_RET_OK;
+
+	if(flow.credits)
+		flow.credits--;
+	flow.frame_received = 1;
+	return app_flow_resp(resp, resp_len);
+}
+
+static int app_frame_incomplete(void) {
+	if(fragment.active && HAL_GetTick() - fragment.last_tick >= FRAGMENT_TIMEOUT_MS) {
+		printk(LOG_WARNING "app: fragmented frame %d timed out", fragment.frame_id);
+		fragment.active = 0;
+	}
+	return fragment.active;
 }
 
 static int app_get_brightness(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_len) {
@@ -176,6 +751,224 @@ static int app_get_on_state(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t
 	return MLF_RET_OK;
 }
 
+/***********************
+ * TIMESTAMPED PRESENTATION
+ ***********************/
+#define PRESENT_QUEUE_LEN		3
+#define PRESENT_LATE_US			2000
+#define PRESENT_MAX_AHEAD_US	(60UL * 1000 * 1000)
+
+struct present_frame {
+	uint8_t used;
+	uint32_t present_at;
+	struct Color* colors;
+};
+
+static struct {
+	struct present_frame frames[PRESENT_QUEUE_LEN];
+	uint32_t leds_count;
+
+	struct MLF_resp_cmd_get_present_stats stats;
+	int64_t jitter_sum;
+} present;
+
+/*
+ * Microseconds since boot - SysTick counts down from LOAD every 1ms
+ */
+static uint32_t app_get_time_us(void) {
+	uint32_t tick, val;
+
+	do {
+		tick = HAL_GetTick();
+		val = SysTick->VAL;
+	} while(tick != HAL_GetTick());
+
+	return tick * 1000 + ((SysTick->LOAD - val) * 1000) / (SysTick->LOAD + 1);
+}
+
+/* Strips were (re)configured - queued frames have stale layout */
+static void present_reset(void) {
+	present.leds_count = get_leds_count(led_strip_bottom) + get_leds_count(led_strip_upper);
+
+	for(int i = 0; i < PRESENT_QUEUE_LEN; i++) {
+		if(present.frames[i].used)
+			present.stats.dropped++;
+		present.frames[i].used = 0;
+	}
+}
+
+static void present_init(void) {
+	uint32_t capacity = get_leds_capacity(led_strip_bottom) + get_leds_capacity(led_strip_upper);
+
+	for(int i = 0; i < PRESENT_QUEUE_LEN; i++) {
+		present.frames[i].colors = malloc(capacity * sizeof(struct Color));
+		if(present.frames[i].colors == NULL)
+			panic("app: failed to allocate presentation queue");
+	}
+	present_reset();
+}
+
+/**
+ * Latch the latest frame which presentation time has already come
+ *
+ * @return 1 if LEDs have to be refreshed, 0 otherwise
+ */
+static int present_update(void) {
+	struct present_frame* due = NULL;
+	uint32_t now = app_get_time_us();
+	int32_t jitter;
+
+	for(int i = 0; i < PRESENT_QUEUE_LEN; i++) {
+		struct present_frame* frame = &present.frames[i];
+		if(!frame->used || (int32_t)(now - frame->present_at) < 0)
+			continue;
+
+		if(due == NULL || (int32_t)(frame->present_at - due->present_at) > 0) {
+			// Older due frame has been overtaken - it'll never be shown
+			if(due != NULL) {
+				due->used = 0;
+				present.stats.dropped++;
+			}
+			due = frame;
+		} else {
+			frame->used = 0;
+			present.stats.dropped++;
+		}
+	}
+
+	if(due == NULL)
+		return 0;
+
+	for(uint32_t i = 0; i < present.leds_count; i++)
+		app_frame_led(i, due->colors[i]);
+	app_frame_done();
+	app_mode = SHOW_COLORS;
+	due->used = 0;
+
+	jitter = app_get_time_us() - due->present_at;
+	if(present.stats.presented == 0 || jitter < present.stats.jitter_min_us)
+		present.stats.jitter_min_us = jitter;
+	if(present.stats.presented == 0 || jitter > present.stats.jitter_max_us)
+		present.stats.jitter_max_us = jitter;
+	if(jitter > PRESENT_LATE_US)
+		present.stats.late++;
+	present.stats.presented++;
+	present.jitter_sum += jitter;
+	return 1;
+}
+
+static int app_get_clock(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_len) {
+	struct MLF_resp_cmd_get_clock clock = {
+			.time_us = app_get_time_us(),
+	};
+
+	memcpy(resp, &clock, sizeof clock);
+	*resp_len = sizeof clock;
+	return MLF_RET_OK;
+}
+
+/*
+ * Link probes measure the transport only - they must not cause refresh of
+ *  LEDs, which would wait for the previous SPI transfer to finish.
+ */
+static uint8_t link_probe_received;
+
+static int app_link_probe(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_len) {
+	link_probe_received = 1;
+	return MLF_RET_OK;
+}
+
+static int app_set_color_at(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_len) {
+	struct MLF_req_cmd_set_color_at* cmd_data = (struct MLF_req_cmd_set_color_at*) data;
+	struct present_frame* frame = NULL;
+	uint32_t count;
+	int* leds;
+
+	if(len < sizeof(*cmd_data))
+		return MLF_RET_INVALID_DATA;
+	if((int32_t)(cmd_data->present_at_us - app_get_time_us()) > (int32_t)PRESENT_MAX_AHEAD_US)
+		return MLF_RET_INVALID_DATA;
+
+	for(int i = 0; i < PRESENT_QUEUE_LEN && frame == NULL; i++) {
+		if(!present.frames[i].used)
+			frame = &present.frames[i];
+	}
+	if(frame == NULL) {
+		present.stats.dropped++;
+		return MLF_RET_NOT_READY;
+	}
+
+	leds = (int*)(data + sizeof(*cmd_data));
+	count = (len - sizeof(*cmd_data)) / 4;
+	if(count > present.leds_count)
+		count = present.leds_count;
+
+	memset(frame->colors, 0, present.leds_count * sizeof(struct Color));
+	for(uint32_t i = 0; i < count; i++)
+		frame->colors[i] = int2Color(leds[i]);
+	frame->present_at = cmd_data->present_at_us;
+	frame->used = 1;
+	return MLF_RET_OK;
+}
+
+static int app_get_present_stats(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_len) {
+	struct MLF_resp_cmd_get_present_stats stats = present.stats;
+
+	if(stats.presented)
+		stats.jitter_avg_us = present.jitter_sum / (int32_t)stats.presented;
+
+	memcpy(resp, &stats, sizeof stats);
+	*resp_len = sizeof stats;
+	return MLF_RET_OK;
+}
+
+/***********************
+ * STRIP CONFIGURATION
+ ***********************/
+static const struct LEDDriver* app_led_driver(uint8_t led_type) {
+	switch(led_type) {
+	case MLF_LED_WS2812B:
+		return &ws2812b_driver;
+	case MLF_LED_APA102:
+		return &apa102_driver;
+	case MLF_LED_SK6812_RGBW:
+		return &sk6812_rgbw_driver;
+	default:
+		return NULL;
+	}
+}
+
+static int app_set_strip_config(uint8_t* data, uint16_t len, uint8_t* resp, uint16_t* resp_len) {
+	struct MLF_req_cmd_set_strip_config* cmd_data = NULL;
+	const struct LEDDriver* driver;
+	struct LEDStrip* strip;
+
+	if(len < sizeof(*cmd_data)) {
+		printk(LOG_ERR "app: set strip config command got incorrect len(%d)", len);
+		return MLF_RET_INVALID_DATA;
+	}
+
+	cmd_data = (struct MLF_req_cmd_set_strip_config*) data;
+	if(cmd_data->strip == STRIP_TOP)
+		strip = led_strip_upper;
+	else if(cmd_data->strip == STRIP_BOTTOM)
+		strip = led_strip_bottom;
+	else
+		return MLF_RET_INVALID_DATA;
+
+	driver = app_led_driver(cmd_data->led_type);
+	if(driver == NULL || cmd_data->leds_count == 0)
+		return MLF_RET_INVALID_DATA;
+	if(set_led_strip_chip(strip, driver, cmd_data->leds_count))
+		return MLF_RET_INVALID_DATA;
+
+	// LEDs of the other strip moved in frame as well
+	fragment.active = 0;
+	transition_reset();
+	present_reset();
+	return MLF_RET_OK;
+}
+
 static int USB_CDC_Transmit_FS(uint8_t* buf, uint16_t size) {
 	int ret = CDC_Transmit_FS(buf, size);
 	switch(ret) {
@@ -232,6 +1025,115 @@ exit:
 	return ret;
 }
 
+/***********************
+ * LED PARALLEL PORT
+ ***********************/
+#if APP_LED_PARALLEL
+#define LED_PORT_LANES			8
+#define LED_PORT_LEN			216
+
+static TIM_HandleTypeDef led_port_tim = { .Instance = TIM1 };
+static DMA_HandleTypeDef led_port_dma_update = { .Instance = DMA2_Stream5, .Init.Channel = DMA_CHANNEL_6 };
+static DMA_HandleTypeDef led_port_dma_cc1 = { .Instance = DMA2_Stream1, .Init.Channel = DMA_CHANNEL_6 };
+static DMA_HandleTypeDef led_port_dma_cc2 = { .Instance = DMA2_Stream2, .Init.Channel = DMA_CHANNEL_6 };
+static struct LEDParallelPort* led_port;
+
+static void led_port_init(void) {
+	__HAL_RCC_GPIOC_CLK_ENABLE();
+	__HAL_RCC_TIM1_CLK_ENABLE();
+	__HAL_LINKDMA(&led_port_tim, hdma[TIM_DMA_ID_UPDATE], led_port_dma_update);
+	__HAL_LINKDMA(&led_port_tim, hdma[TIM_DMA_ID_CC1], led_port_dma_cc1);
+	__HAL_LINKDMA(&led_port_tim, hdma[TIM_DMA_ID_CC2], led_port_dma_cc2);
+
+	if(init_led_port(&led_port, GPIOC, LED_PORT_LANES, LED_PORT_LEN, &led_port_tim))
+		panic("app: failed to initialise LED port");
+	HAL_NVIC_SetPriority(DMA2_Stream2_IRQn, 3, 0);
+	HAL_NVIC_EnableIRQ(DMA2_Stream2_IRQn);
+
+	init_led_strip_parallel(&led_strip_bottom, led_port, 1, 216);
+	init_led_strip_parallel(&led_strip_upper, led_port, 0, 90);
+}
+
+void DMA2_Stream2_IRQHandler(void) {
+	HAL_DMA_IRQHandler(&led_port_dma_cc2);
+}
+#endif
+
+/***********************
+ * FRAME CLOCK
+ ***********************/
+/*
+ * TIM3 ticks at APP_FRAME_FPS no matter how many packets arrive. Its clock
+ *  is 84 MHz (APB1 x2), prescaled to 1 MHz.
+ */
+#define FRAME_TIM_PRESCALER		84
+#define FRAME_TIM_CLOCK_HZ		1000000
+
+static TIM_HandleTypeDef frame_tim = { .Instance = TIM3 };
+static volatile uint8_t frame_tick;
+
+static void frame_clock_init(void) {
+	__HAL_RCC_TIM3_CLK_ENABLE();
+
+	frame_tim.Init.Prescaler = FRAME_TIM_PRESCALER - 1;
+	frame_tim.Init.CounterMode = TIM_COUNTERMODE_UP;
+	frame_tim.Init.Period = FRAME_TIM_CLOCK_HZ / APP_FRAME_FPS - 1;
+	frame_tim.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+	frame_tim.Init.RepetitionCounter = 0;
+	if(HAL_TIM_Base_Init(&frame_tim) != HAL_OK)
+		panic("app: failed to initialise frame clock");
+
+	HAL_NVIC_SetPriority(TIM3_IRQn, 5, 0);
+	HAL_NVIC_EnableIRQ(TIM3_IRQn);
+	if(HAL_TIM_Base_Start_IT(&frame_tim) != HAL_OK)
+		panic("app: failed to start frame clock");
+}
+
+void TIM3_IRQHandler(void) {
+	HAL_TIM_IRQHandler(&frame_tim);
+}
+
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef* htim) {
+	if(htim == &frame_tim)
+		frame_tick = 1;
+}
+
+/*
+ * Effects advance with time instead of frames. `frame` passed to them is
+ *  counted in steps of 15ms (pace of the former polling loop) multiplied by
+ *  speed, so speed can change without a jump of animation.
+ */
+#define EFFECT_STEP_US			15000
+
+static struct {
+	uint64_t phase_us;			// elapsed time multiplied by speed
+	uint32_t last_us;
+} effect_clock;
+
+static uint32_t effect_clock_advance(uint8_t running) {
+	uint32_t now = app_get_time_us();
+
+	if(running)
+		effect_clock.phase_us += (uint64_t)(now - effect_clock.last_us) * cur_effect_speed;
+	effect_clock.last_us = now;
+	return effect_clock.phase_us / EFFECT_STEP_US;
+}
+
+/*
+ * Core sleeps until the next interrupt unless there's an event to handle.
+ *  Flags are checked with interrupts masked - WFI still wakes up on
+ *  interrupt which got pending meanwhile and its handler runs right after
+ *  unmasking. SysTick keeps waking the core every 1ms, as it's the clock of
+ *  timestamped presentation and timeouts.
+ */
+static void app_idle(void) {
+	__disable_irq();
+	if(!frame_tick && !USART2_IRQ_buffer.size &&
+			!MLF_is_packet_available(&usb_ctx) && !MLF_is_packet_available(&usart_ctx))
+		__WFI();
+	__enable_irq();
+}
+
 /***********************
  * USART2 MLF SUPPORT
  ***********************/
@@ -260,9 +1162,17 @@ static void register_default_callback(struct MLF_ctx* ctx) {
 	MLF_register_callback(ctx, MLF_CMD_SET_EFFECT, app_set_effect);
 	MLF_register_callback(ctx, MLF_CMD_SET_BRIGHTNESS, app_set_brightness);
 	MLF_register_callback(ctx, MLF_CMD_SET_COLOR, app_set_color);
+	MLF_register_callback(ctx, MLF_CMD_SET_COLOR_FRAGMENT, app_set_color_fragment);
 	MLF_register_callback(ctx, MLF_CMD_GET_BRIGHTNESS, app_get_brightness);
 	MLF_register_callback(ctx, MLF_CMD_GET_EFFECT, app_get_effect);
 	MLF_register_callback(ctx, MLF_CMD_GET_ON_STATE, app_get_on_state);
+	MLF_register_callback(ctx, MLF_CMD_GET_CLOCK, app_get_clock);
+	MLF_register_callback(ctx, MLF_CMD_SET_COLOR_AT, app_set_color_at);
+	MLF_register_callback(ctx, MLF_CMD_GET_PRESENT_STATS, app_get_present_stats);
+	MLF_register_callback(ctx, MLF_CMD_LINK_PROBE, app_link_probe);
+	MLF_register_callback(ctx, MLF_CMD_SET_TRANSITION, app_set_transition);
+	MLF_register_callback(ctx, MLF_CMD_SET_STRIP_CONFIG, app_set_strip_config);
+	MLF_register_batch_hooks(ctx, app_batch_begin, app_batch_end);
 }
 
 /***********************
@@ -274,12 +1184,19 @@ void app_init(void) {
 
 	// Setup MLF protocol for internal USART2
 	MLF_init(&usart_ctx, USART2_WriteData);
-	usart_packet_buf = packet_buffer_init(&usart_ctx);
+	usart_packet_buf = packet_buffer_init(&usart_ctx, APP_USART_RX_SLOTS, NULL);
 	__HAL_UART_ENABLE_IT(&huart2, UART_IT_RXNE);
 
 	printk(LOG_INFO "app: Initialising LED strip");
-	init_led_strip(&led_strip_bottom, &hspi2, 216);
-	init_led_strip(&led_strip_upper, &hspi1, 90);
+#if APP_LED_PARALLEL
+	led_port_init();
+#elif APP_LED_STREAMING
+	init_led_strip_streaming(&led_strip_bottom, &hspi2, 216);
+	init_led_strip_streaming(&led_strip_upper, &hspi1, 90);
+#else
+	init_led_strip_chip(&led_strip_bottom, &hspi2, &ws2812b_driver, 216, APP_LED_CAPACITY);
+	init_led_strip_chip(&led_strip_upper, &hspi1, &ws2812b_driver, 90, APP_LED_CAPACITY);
+#endif
 
 	calibrate_leds_colors(led_strip_bottom,
 			(struct Ratio){1, 1},		// red - no change
@@ -291,8 +1208,14 @@ void app_init(void) {
 				(struct Ratio){0x80, 0xa0},	// green - 0x80 -> 0xa0
 				(struct Ratio){1, 1},		// blue - no change
 				144 /* From 144th LED in strip */);
+	set_leds_gamma(led_strip_bottom, APP_LED_GAMMA);
+	set_leds_gamma(led_strip_upper, APP_LED_GAMMA);
 	refresh_leds(led_strip_bottom);
 	refresh_leds(led_strip_upper);
+	present_init();
+	transition_init();
+	stream_init();
+	frame_clock_init();
 
 	register_default_callback(&usb_ctx);
 	register_default_callback(&usart_ctx);
@@ -301,73 +1224,100 @@ void app_init(void) {
 	MLF_register_reroute(&usb_ctx, &usart_ctx, MLF_CMD_SET_EFFECT);
 	MLF_register_reroute(&usb_ctx, &usart_ctx, MLF_CMD_TURN_OFF);
 	MLF_register_reroute(&usb_ctx, &usart_ctx, MLF_CMD_TURN_ON);
+
+	// Only PC streams frames, so flow control makes sense on USB only
+	MLF_register_callback(&usb_ctx, MLF_CMD_SET_FLOW_CONTROL, app_set_flow_control);
+	MLF_register_callback(&usb_ctx, MLF_CMD_GET_INFO, app_usb_get_info);
+	MLF_register_stream_hooks(&usb_ctx, MLF_CMD_SET_COLOR, app_stream_begin, app_stream_data, app_stream_end);
+	MLF_register_stream_hooks(&usb_ctx, MLF_CMD_SET_COLOR_FRAGMENT, app_stream_begin, app_stream_data,
+			app_stream_end);
 }
 
 
 void app_main_loop(void) {
-	uint8_t data_buffer[64];
-	uint32_t tick_start;
+	// Held by packet ring while it's full, so it's not popped into then
+	static uint8_t data_buffer[64];
 	uint8_t refresh = 1;
-	uint32_t frame = 0;
+	uint32_t frame;
 
 	printk(LOG_INFO "app: Starting main loop");
+	effect_clock_advance(0);
 
 	while(1) {
 		// Pet watchdog
 		HAL_IWDG_Refresh(&hiwdg);
 
-		// Wait at least 10ms or shorter if packet arrives
-		tick_start = HAL_GetTick();
-		while(HAL_GetTick() - tick_start < 15) {
-			// Handle new bytes in USART2 IRQ queue
-			int ret;
-			uint16_t size = sizeof(data_buffer);
-			ret = IRQ_buffer_pop(data_buffer, &size);
-			if(ret >= 0)
-				packet_buffer_append(usart_packet_buf, data_buffer, size);
-
-			// Check for new packets
-			if(MLF_is_packet_available(&usb_ctx)) {
-				MLF_process_packet(&usb_ctx);
-
-				// Always refresh LEDs state upon receiving new packet
-				refresh = 1;
-				break;
-			} else if(MLF_is_packet_available(&usart_ctx)) {
-				MLF_process_packet(&usart_ctx);
-				refresh = 1;
-				break;
-			}
+		// Handle new bytes in USART2 IRQ queue
+		uint16_t size = sizeof(data_buffer);
+		if(!packet_buffer_is_paused(usart_packet_buf) && IRQ_buffer_pop(data_buffer, &size) >= 0)
+			packet_buffer_append(usart_packet_buf, data_buffer, size);
+
+		// Grant host a credit as soon as the frame reached LEDs
+		app_flow_update();
+
+		// Latch scheduled frames as close to their time as possible
+		refresh |= present_update();
+
+		// Always refresh LEDs state upon receiving new packet
+		if(MLF_is_packet_available(&usb_ctx)) {
+			MLF_process_packet(&usb_ctx);
+			refresh |= !link_probe_received;
+			link_probe_received = 0;
+		} else if(MLF_is_packet_available(&usart_ctx)) {
+			MLF_process_packet(&usart_ctx);
+			refresh |= !link_probe_received;
+			link_probe_received = 0;
 		}
 
-		switch(app_mode) {
-		case TURN_OFF:
-			if(refresh) {
-				clear_leds(led_strip_bottom);
-				clear_leds(led_strip_upper);
-			}
-			break;
+		// Strips switched to another chip are sent once the last frame of
+		//  the old one is out
+		refresh |= finish_led_strip_chip(led_strip_bottom);
+		refresh |= finish_led_strip_chip(led_strip_upper);
+
+		// Transitions step on their own deadline (TRANSITION_MIN_STEP_US at
+		//  least) - SysTick wakes the loop every 1ms anyway
+		if(app_mode == SHOW_COLORS)
+			refresh |= transition_step();
+
+		// Effects run on frame clock only
+		if(frame_tick) {
+			frame_tick = 0;
+			frame = effect_clock_advance(app_mode == SHOW_EFFECT);
+
+			switch(app_mode) {
+			case TURN_OFF:
+				break;
 
-		case SHOW_EFFECT:
-			refresh |= run_effect_frame(led_strip_upper, cur_effect_top, frame, cur_effect_top_data);
-			refresh |= run_effect_frame(led_strip_bottom, cur_effect_bottom, frame, cur_effect_bottom_data);
-			frame += cur_effect_speed;
-			break;
+			case SHOW_EFFECT:
+				refresh |= run_effect_frame(led_strip_upper, cur_effect_top, frame, cur_effect_top_data);
+				refresh |= run_effect_frame(led_strip_bottom, cur_effect_bottom, frame, cur_effect_bottom_data);
+				break;
 
-		case SHOW_COLORS:
-			// Everything is already done by a handler
-			break;
+			case SHOW_COLORS:
+				break;
 
-		default:
-			panic("Unexpected APP_MODE has been selected");
-			break;
+			default:
+				panic("Unexpected APP_MODE has been selected");
+				break;
+			}
 		}
 
-		// Reconfigure LEDs signal only when required
-		if(refresh) {
+		if(refresh && app_mode == TURN_OFF) {
+			clear_leds(led_strip_bottom);
+			clear_leds(led_strip_upper);
+		}
+
+		// Reconfigure LEDs signal only when required (and never in the
+		//  middle of fragmented frame)
+		if(refresh && !app_frame_incomplete()) {
 			refresh_leds(led_strip_bottom);
 			refresh_leds(led_strip_upper);
+
+			flow.frame_latched |= flow.frame_received;
+			flow.frame_received = 0;
+			refresh = 0;
 		}
-		refresh = 0;
+
+		app_idle();
 	}
 }
@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * color_math.c - fixed-point color math for effects and transitions, with
+ * 				  hue wheel in flash and saturating blends of 8-bit channels
+ *  (C) 2022 Pawel Wieczorek
+ */
+
+#include "color_math.h"
+
+#include <stdint.h>
+
+// Must hold regardless of width of unsigned long - see mlf_color_math32 in lib
+_Static_assert(COLOR_HUE_STEP(2) == 0x80000000UL && COLOR_HUE_STEP(306) == 14035840UL,
+		"hue step overflows");
+
+/************************
+ * EXPORTED GLOBALS
+ ************************/
+/*
+ * Generated from float hsl2rgb(i / 1024., 1, 0.5), which effects used
+ *  before, so rainbow looks the same
+ */
+const struct Color color_wheel_lut[COLOR_WHEEL_STEPS] = {
+		{0xff, 0x00, 0x00}, {0xff, 0x01, 0x00}, {0xff, 0x03, 0x00}, {0xff, 0x04, 0x00}, {0xff, 0x06, 0x00}, {0xff, 0x07, 0x00},
+		{0xff, 0x09, 0x00}, {0xff, 0x0a, 0x00}, {0xff, 0x0c, 0x00}, {0xff, 0x0d, 0x00}, {0xff, 0x0f, 0x00}, {0xff, 0x10, 0x00},
+		{0xff, 0x12, 0x00}, {0xff, 0x13, 0x00}, {0xff, 0x15, 0x00}, {0xff, 0x16, 0x00}, {0xff, 0x18, 0x00}, {0xff, 0x19, 0x00},
+		{0xff, 0x1b, 0x00}, {0xff, 0x1c, 0x00}, {0xff, 0x1e, 0x00}, {0xff, 0x1f, 0x00}, {0xff, 0x21, 0x00}, {0xff, 0x22, 0x00},
+		{0xff, 0x24, 0x00}, {0xff, 0x25, 0x00}, {0xff, 0x27, 0x00}, {0xff, 0x28, 0x00}, {0xff, 0x2a, 0x00}, {0xff, 0x2b, 0x00},
+		{0xff, 0x2d, 0x00}, {0xff, 0x2e, 0x00}, {0xff, 0x30, 0x00}, {0xff, 0x31, 0x00}, {0xff, 0x33, 0x00}, {0xff, 0x34, 0x00},
+		{0xff, 0x36, 0x00}, {0xff, 0x37, 0x00}, {0xff, 0x39, 0x00}, {0xff, 0x3a, 0x00}, {0xff, 0x3c, 0x00}, {0xff, 0x3d, 0x00},
+		{0xff, 0x3f, 0x00}, {0xff, 0x40, 0x00}, {0xff, 0x42, 0x00}, {0xff, 0x43, 0x00}, {0xff, 0x45, 0x00}, {0xff, 0x46, 0x00},
+		{0xff, 0x48, 0x00}, {0xff, 0x49, 0x00}, {0xff, 0x4b, 0x00}, {0xff, 0x4c, 0x00}, {0xff, 0x4e, 0x00}, {0xff, 0x4f, 0x00},
+		{0xff, 0x51, 0x00}, {0xff, 0x52, 0x00}, {0xff, 0x54, 0x00}, {0xff, 0x55, 0x00}, {0xff, 0x57, 0x00}, {0xff, 0x58, 0x00},
+		{0xff, 0x5a, 0x00}, {0xff, 0x5b, 0x00}, {0xff, 0x5d, 0x00}, {0xff, 0x5e, 0x00}, {0xff, 0x60, 0x00}, {0xff, 0x61, 0x00},
+		{0xff, 0x63, 0x00}, {0xff, 0x64, 0x00}, {0xff, 0x66, 0x00}, {0xff, 0x67, 0x00}, {0xff, 0x69, 0x00}, {0xff, 0x6a, 0x00},
+		{0xff, 0x6c, 0x00}, {0xff, 0x6d, 0x00}, {0xff, 0x6f, 0x00}, {0xff, 0x70, 0x00}, {0xff, 0x72, 0x00}, {0xff, 0x73, 0x00},
+		{0xff, 0x75, 0x00}, {0xff, 0x76, 0x00}, {0xff, 0x78, 0x00}, {0xff, 0x79, 0x00}, {0xff, 0x7b, 0x00}, {0xff, 0x7c, 0x00},
+		{0xff, 0x7e, 0x00}, {0xff, 0x7f, 0x00}, {0xff, 0x80, 0x00}, {0xff, 0x82, 0x00}, {0xff, 0x83, 0x00}, {0xff, 0x85, 0x00},
+		{0xff, 0x86, 0x00}, {0xff, 0x88, 0x00}, {0xff, 0x89, 0x00}, {0xff, 0x8b, 0x00}, {0xff, 0x8c, 0x00}, {0xff, 0x8e, 0x00},
+		{0xff, 0x8f, 0x00}, {0xff, 0x91, 0x00}, {0xff, 0x92, 0x00}, {0xff, 0x94, 0x00}, {0xff, 0x95, 0x00}, {0xff, 0x97, 0x00},
+		{0xff, 0x98, 0x00}, {0xff, 0x9a, 0x00}, {0xff, 0x9b, 0x00}, {0xff, 0x9d, 0x00}, {0xff, 0x9e, 0x00}, {0xff, 0xa0, 0x00},
+		{0xff, 0xa1, 0x00}, {0xff, 0xa3, 0x00}, {0xff, 0xa4, 0x00}, {0xff, 0xa6, 0x00}, {0xff, 0xa7, 0x00}, {0xff, 0xa9, 0x00},
+		{0xff, 0xaa, 0x00}, {0xff, 0xac, 0x00}, {0xff, 0xad, 0x00}, {0xff, 0xaf, 0x00}, {0xff, 0xb0, 0x00}, {0xff, 0xb2, 0x00},
+		{0xff, 0xb3, 0x00}, {0xff, 0xb5, 0x00}, {0xff, 0xb6, 0x00}, {0xff, 0xb8, 0x00}, {0xff, 0xb9, 0x00}, {0xff, 0xbb, 0x00},
+		{0xff, 0xbc, 0x00}, {0xff, 0xbe, 0x00}, {0xff, 0xbf, 0x00}, {0xff, 0xc1, 0x00}, {0xff, 0xc2, 0x00}, {0xff, 0xc4, 0x00},
+		{0xff, 0xc5, 0x00}, {0xff, 0xc7, 0x00}, {0xff, 0xc8, 0x00}, {0xff, 0xca, 0x00}, {0xff, 0xcb, 0x00}, {0xff, 0xcd, 0x00},
+		{0xff, 0xce, 0x00}, {0xff, 0xd0, 0x00}, {0xff, 0xd1, 0x00}, {0xff, 0xd3, 0x00}, {0xff, 0xd4, 0x00}, {0xff, 0xd6, 0x00},
+		{0xff, 0xd7, 0x00}, {0xff, 0xd9, 0x00}, {0xff, 0xda, 0x00}, {0xff, 0xdc, 0x00}, {0xff, 0xdd, 0x00}, {0xff, 0xdf, 0x00},
+		{0xff, 0xe0, 0x00}, {0xff, 0xe2, 0x00}, {0xff, 0xe3, 0x00}, {0xff, 0xe5, 0x00}, {0xff, 0xe6, 0x00}, {0xff, 0xe8, 0x00},
+		{0xff, 0xe9, 0x00}, {0xff, 0xeb, 0x00}, {0xff, 0xec, 0x00}, {0xff, 0xee, 0x00}, {0xff, 0xef, 0x00}, {0xff, 0xf1, 0x00},
+		{0xff, 0xf2, 0x00}, {0xff, 0xf4, 0x00}, {0xff, 0xf5, 0x00}, {0xff, 0xf7, 0x00}, {0xff, 0xf8, 0x00}, {0xff, 0xfa, 0x00},
+		{0xff, 0xfb, 0x00}, {0xff, 0xfd, 0x00}, {0xff, 0xfe, 0x00}, {0xff, 0xff, 0x00}, {0xfd, 0xff, 0x00}, {0xfc, 0xff, 0x00},
+		{0xfa, 0xff, 0x00}, {0xf9, 0xff, 0x00}, {0xf7, 0xff, 0x00}, {0xf6, 0xff, 0x00}, {0xf4, 0xff, 0x00}, {0xf3, 0xff, 0x00},
+		{0xf1, 0xff, 0x00}, {0xf0, 0xff, 0x00}, {0xee, 0xff, 0x00}, {0xed, 0xff, 0x00}, {0xeb, 0xff, 0x00}, {0xea, 0xff, 0x00},
+		{0xe8, 0xff, 0x00}, {0xe7, 0xff, 0x00}, {0xe5, 0xff, 0x00}, {0xe4, 0xff, 0x00}, {0xe2, 0xff, 0x00}, {0xe1, 0xff, 0x00},
+		{0xdf, 0xff, 0x00}, {0xde, 0xff, 0x00}, {0xdc, 0xff, 0x00}, {0xdb, 0xff, 0x00}, {0xd9, 0xff, 0x00}, {0xd8, 0xff, 0x00},
+		{0xd6, 0xff, 0x00}, {0xd5, 0xff, 0x00}, {0xd3, 0xff, 0x00}, {0xd2, 0xff, 0x00}, {0xd0, 0xff, 0x00}, {0xcf, 0xff, 0x00},
+		{0xcd, 0xff, 0x00}, {0xcc, 0xff, 0x00}, {0xca, 0xff, 0x00}, {0xc9, 0xff, 0x00}, {0xc7, 0xff, 0x00}, {0xc6, 0xff, 0x00},
+		{0xc4, 0xff, 0x00}, {0xc3, 0xff, 0x00}, {0xc1, 0xff, 0x00}, {0xc0, 0xff, 0x00}, {0xbe, 0xff, 0x00}, {0xbd, 0xff, 0x00},
+		{0xbb, 0xff, 0x00}, {0xba, 0xff, 0x00}, {0xb8, 0xff, 0x00}, {0xb7, 0xff, 0x00}, {0xb5, 0xff, 0x00}, {0xb4, 0xff, 0x00},
+		{0xb2, 0xff, 0x00}, {0xb1, 0xff, 0x00}, {0xaf, 0xff, 0x00}, {0xae, 0xff, 0x00}, {0xac, 0xff, 0x00}, {0xab, 0xff, 0x00},
+		{0xa9, 0xff, 0x00}, {0xa8, 0xff, 0x00}, {0xa6, 0xff, 0x00}, {0xa5, 0xff, 0x00}, {0xa3, 0xff, 0x00}, {0xa2, 0xff, 0x00},
+		{0xa0, 0xff, 0x00}, {0x9f, 0xff, 0x00}, {0x9d, 0xff, 0x00}, {0x9c, 0xff, 0x00}, {0x9a, 0xff, 0x00}, {0x99, 0xff, 0x00},
+		{0x97, 0xff, 0x00}, {0x96, 0xff, 0x00}, {0x94, 0xff, 0x00}, {0x93, 0xff, 0x00}, {0x91, 0xff, 0x00}, {0x90, 0xff, 0x00},
+		{0x8e, 0xff, 0x00}, {0x8d, 0xff, 0x00}, {0x8b, 0xff, 0x00}, {0x8a, 0xff, 0x00}, {0x88, 0xff, 0x00}, {0x87, 0xff, 0x00},
+		{0x85, 0xff, 0x00}, {0x84, 0xff, 0x00}, {0x82, 0xff, 0x00}, {0x81, 0xff, 0x00}, {0x80, 0xff, 0x00}, {0x7e, 0xff, 0x00},
+		{0x7d, 0xff, 0x00}, {0x7b, 0xff, 0x00}, {0x7a, 0xff, 0x00}, {0x78, 0xff, 0x00}, {0x77, 0xff, 0x00}, {0x75, 0xff, 0x00},
+		{0x74, 0xff, 0x00}, {0x72, 0xff, 0x00}, {0x71, 0xff, 0x00}, {0x6f, 0xff, 0x00}, {0x6e, 0xff, 0x00}, {0x6c, 0xff, 0x00},
+		{0x6b, 0xff, 0x00}, {0x69, 0xff, 0x00}, {0x68, 0xff, 0x00}, {0x66, 0xff, 0x00}, {0x65, 0xff, 0x00}, {0x63, 0xff, 0x00},
+		{0x62, 0xff, 0x00}, {0x60, 0xff, 0x00}, {0x5f, 0xff, 0x00}, {0x5d, 0xff, 0x00}, {0x5c, 0xff, 0x00}, {0x5a, 0xff, 0x00},
+		{0x59, 0xff, 0x00}, {0x57, 0xff, 0x00}, {0x56, 0xff, 0x00}, {0x54, 0xff, 0x00}, {0x53, 0xff, 0x00}, {0x51, 0xff, 0x00},
+		{0x50, 0xff, 0x00}, {0x4e, 0xff, 0x00}, {0x4d, 0xff, 0x00}, {0x4b, 0xff, 0x00}, {0x4a, 0xff, 0x00}, {0x48, 0xff, 0x00},
+		{0x47, 0xff, 0x00}, {0x45, 0xff, 0x00}, {0x44, 0xff, 0x00}, {0x42, 0xff, 0x00}, {0x41, 0xff, 0x00}, {0x3f, 0xff, 0x00},
+		{0x3e, 0xff, 0x00}, {0x3c, 0xff, 0x00}, {0x3b, 0xff, 0x00}, {0x39, 0xff, 0x00}, {0x38, 0xff, 0x00}, {0x36, 0xff, 0x00},
+		{0x35, 0xff, 0x00}, {0x33, 0xff, 0x00}, {0x32, 0xff, 0x00}, {0x30, 0xff, 0x00}, {0x2f, 0xff, 0x00}, {0x2d, 0xff, 0x00},
+		{0x2c, 0xff, 0x00}, {0x2a, 0xff, 0x00}, {0x29, 0xff, 0x00}, {0x27, 0xff, 0x00}, {0x26, 0xff, 0x00}, {0x24, 0xff, 0x00},
+		{0x23, 0xff, 0x00}, {0x21, 0xff, 0x00}, {0x20, 0xff, 0x00}, {0x1e, 0xff, 0x00}, {0x1d, 0xff, 0x00}, {0x1b, 0xff, 0x00},
+		{0x1a, 0xff, 0x00}, {0x18, 0xff, 0x00}, {0x17, 0xff, 0x00}, {0x15, 0xff, 0x00}, {0x14, 0xff, 0x00}, {0x12, 0xff, 0x00},
+		{0x11, 0xff, 0x00}, {0x0f, 0xff, 0x00}, {0x0e, 0xff, 0x00}, {0x0c, 0xff, 0x00}, {0x0b, 0xff, 0x00}, {0x09, 0xff, 0x00},
+		{0x08, 0xff, 0x00}, {0x06, 0xff, 0x00}, {0x05, 0xff, 0x00}, {0x03, 0xff, 0x00}, {0x02, 0xff, 0x00}, {0x00, 0xff, 0x00},
+		{0x00, 0xff, 0x01}, {0x00, 0xff, 0x02}, {0x00, 0xff, 0x04}, {0x00, 0xff, 0x05}, {0x00, 0xff, 0x07}, {0x00, 0xff, 0x08},
+		{0x00, 0xff, 0x0a}, {0x00, 0xff, 0x0b}, {0x00, 0xff, 0x0d}, {0x00, 0xff, 0x0e}, {0x00, 0xff, 0x10}, {0x00, 0xff, 0x11},
+		{0x00, 0xff, 0x13}, {0x00, 0xff, 0x14}, {0x00, 0xff, 0x16}, {0x00, 0xff, 0x17}, {0x00, 0xff, 0x19}, {0x00, 0xff, 0x1a},
+		{0x00, 0xff, 0x1c}, {0x00, 0xff, 0x1d}, {0x00, 0xff, 0x1f}, {0x00, 0xff, 0x20}, {0x00, 0xff, 0x22}, {0x00, 0xff, 0x23},
+		{0x00, 0xff, 0x25}, {0x00, 0xff, 0x26}, {0x00, 0xff, 0x28}, {0x00, 0xff, 0x29}, {0x00, 0xff, 0x2b}, {0x00, 0xff, 0x2c},
+		{0x00, 0xff, 0x2e}, {0x00, 0xff, 0x2f}, {0x00, 0xff, 0x31}, {0x00, 0xff, 0x32}, {0x00, 0xff, 0x34}, {0x00, 0xff, 0x35},
+		{0x00, 0xff, 0x37}, {0x00, 0xff, 0x38}, {0x00, 0xff, 0x3a}, {0x00, 0xff, 0x3b}, {0x00, 0xff, 0x3d}, {0x00, 0xff, 0x3e},
+		{0x00, 0xff, 0x40}, {0x00, 0xff, 0x41}, {0x00, 0xff, 0x43}, {0x00, 0xff, 0x44}, {0x00, 0xff, 0x46}, {0x00, 0xff, 0x47},
+		{0x00, 0xff, 0x49}, {0x00, 0xff, 0x4a}, {0x00, 0xff, 0x4c}, {0x00, 0xff, 0x4d}, {0x00, 0xff, 0x4f}, {0x00, 0xff, 0x50},
+		{0x00, 0xff, 0x52}, {0x00, 0xff, 0x53}, {0x00, 0xff, 0x55}, {0x00, 0xff, 0x56}, {0x00, 0xff, 0x58}, {0x00, 0xff, 0x59},
+		{0x00, 0xff, 0x5b}, {0x00, 0xff, 0x5c}, {0x00, 0xff, 0x5e}, {0x00, 0xff, 0x5f}, {0x00, 0xff, 0x61}, {0x00, 0xff, 0x62},
+		{0x00, 0xff, 0x64}, {0x00, 0xff, 0x65}, {0x00, 0xff, 0x67}, {0x00, 0xff, 0x68}, {0x00, 0xff, 0x6a}, {0x00, 0xff, 0x6b},
+		{0x00, 0xff, 0x6d}, {0x00, 0xff, 0x6e}, {0x00, 0xff, 0x70}, {0x00, 0xff, 0x71}, {0x00, 0xff, 0x73}, {0x00, 0xff, 0x74},
+		{0x00, 0xff, 0x76}, {0x00, 0xff, 0x77}, {0x00, 0xff, 0x79}, {0x00, 0xff, 0x7a}, {0x00, 0xff, 0x7c}, {0x00, 0xff, 0x7d},
+		{0x00, 0xff, 0x7f}, {0x00, 0xff, 0x80}, {0x00, 0xff, 0x81}, {0x00, 0xff, 0x83}, {0x00, 0xff, 0x84}, {0x00, 0xff, 0x86},
+		{0x00, 0xff, 0x87}, {0x00, 0xff, 0x89}, {0x00, 0xff, 0x8a}, {0x00, 0xff, 0x8c}, {0x00, 0xff, 0x8d}, {0x00, 0xff, 0x8f},
+		{0x00, 0xff, 0x90}, {0x00, 0xff, 0x92}, {0x00, 0xff, 0x93}, {0x00, 0xff, 0x95}, {0x00, 0xff, 0x96}, {0x00, 0xff, 0x98},
+		{0x00, 0xff, 0x99}, {0x00, 0xff, 0x9b}, {0x00, 0xff, 0x9c}, {0x00, 0xff, 0x9e}, {0x00, 0xff, 0x9f}, {0x00, 0xff, 0xa1},
+		{0x00, 0xff, 0xa2}, {0x00, 0xff, 0xa4}, {0x00, 0xff, 0xa5}, {0x00, 0xff, 0xa7}, {0x00, 0xff, 0xa8}, {0x00, 0xff, 0xaa},
+		{0x00, 0xff, 0xab}, {0x00, 0xff, 0xad}, {0x00, 0xff, 0xae}, {0x00, 0xff, 0xb0}, {0x00, 0xff, 0xb1}, {0x00, 0xff, 0xb3},
+		{0x00, 0xff, 0xb4}, {0x00, 0xff, 0xb6}, {0x00, 0xff, 0xb7}, {0x00, 0xff, 0xb9}, {0x00, 0xff, 0xba}, {0x00, 0xff, 0xbc},
+		{0x00, 0xff, 0xbd}, {0x00, 0xff, 0xbf}, {0x00, 0xff, 0xc0}, {0x00, 0xff, 0xc2}, {0x00, 0xff, 0xc3}, {0x00, 0xff, 0xc5},
+		{0x00, 0xff, 0xc6}, {0x00, 0xff, 0xc8}, {0x00, 0xff, 0xc9}, {0x00, 0xff, 0xcb}, {0x00, 0xff, 0xcc}, {0x00, 0xff, 0xce},
+		{0x00, 0xff, 0xcf}, {0x00, 0xff, 0xd1}, {0x00, 0xff, 0xd2}, {0x00, 0xff, 0xd4}, {0x00, 0xff, 0xd5}, {0x00, 0xff, 0xd7},
+		{0x00, 0xff, 0xd8}, {0x00, 0xff, 0xda}, {0x00, 0xff, 0xdb}, {0x00, 0xff, 0xdd}, {0x00, 0xff, 0xde}, {0x00, 0xff, 0xe0},
+		{0x00, 0xff, 0xe1}, {0x00, 0xff, 0xe3}, {0x00, 0xff, 0xe4}, {0x00, 0xff, 0xe6}, {0x00, 0xff, 0xe7}, {0x00, 0xff, 0xe9},
+		{0x00, 0xff, 0xea}, {0x00, 0xff, 0xec}, {0x00, 0xff, 0xed}, {0x00, 0xff, 0xef}, {0x00, 0xff, 0xf0}, {0x00, 0xff, 0xf2},
+		{0x00, 0xff, 0xf3}, {0x00, 0xff, 0xf5}, {0x00, 0xff, 0xf6}, {0x00, 0xff, 0xf8}, {0x00, 0xff, 0xf9}, {0x00, 0xff, 0xfb},
+		{0x00, 0xff, 0xfc}, {0x00, 0xff, 0xfe}, {0x00, 0xff, 0xff}, {0x00, 0xfe, 0xff}, {0x00, 0xfc, 0xff}, {0x00, 0xfb, 0xff},
+		{0x00, 0xf9, 0xff}, {0x00, 0xf8, 0xff}, {0x00, 0xf6, 0xff}, {0x00, 0xf5, 0xff}, {0x00, 0xf3, 0xff}, {0x00, 0xf2, 0xff},
+		{0x00, 0xf0, 0xff}, {0x00, 0xef, 0xff}, {0x00, 0xed, 0xff}, {0x00, 0xec, 0xff}, {0x00, 0xea, 0xff}, {0x00, 0xe9, 0xff},
+		{0x00, 0xe7, 0xff}, {0x00, 0xe6, 0xff}, {0x00, 0xe4, 0xff}, {0x00, 0xe3, 0xff}, {0x00, 0xe1, 0xff}, {0x00, 0xe0, 0xff},
+		{0x00, 0xde, 0xff}, {0x00, 0xdd, 0xff}, {0x00, 0xdb, 0xff}, {0x00, 0xda, 0xff}, {0x00, 0xd8, 0xff}, {0x00, 0xd7, 0xff},
+		{0x00, 0xd5, 0xff}, {0x00, 0xd4, 0xff}, {0x00, 0xd2, 0xff}, {0x00, 0xd1, 0xff}, {0x00, 0xcf, 0xff}, {0x00, 0xce, 0xff},
+		{0x00, 0xcc, 0xff}, {0x00, 0xcb, 0xff}, {0x00, 0xc9, 0xff}, {0x00, 0xc8, 0xff}, {0x00, 0xc6, 0xff}, {0x00, 0xc5, 0xff},
+		{0x00, 0xc3, 0xff}, {0x00, 0xc2, 0xff}, {0x00, 0xc0, 0xff}, {0x00, 0xbf, 0xff}, {0x00, 0xbd, 0xff}, {0x00, 0xbc, 0xff},
+		{0x00, 0xba, 0xff}, {0x00, 0xb9, 0xff}, {0x00, 0xb7, 0xff}, {0x00, 0xb6, 0xff}, {0x00, 0xb4, 0xff}, {0x00, 0xb3, 0xff},
+		{0x00, 0xb1, 0xff}, {0x00, 0xb0, 0xff}, {0x00, 0xae, 0xff}, {0x00, 0xad, 0xff}, {0x00, 0xab, 0xff}, {0x00, 0xaa, 0xff},
+		{0x00, 0xa8, 0xff}, {0x00, 0xa7, 0xff}, {0x00, 0xa5, 0xff}, {0x00, 0xa4, 0xff}, {0x00, 0xa2, 0xff}, {0x00, 0xa1, 0xff},
+		{0x00, 0x9f, 0xff}, {0x00, 0x9e, 0xff}, {0x00, 0x9c, 0xff}, {0x00, 0x9b, 0xff}, {0x00, 0x99, 0xff}, {0x00, 0x98, 0xff},
+		{0x00, 0x96, 0xff}, {0x00, 0x95, 0xff}, {0x00, 0x93, 0xff}, {0x00, 0x92, 0xff}, {0x00, 0x90, 0xff}, {0x00, 0x8f, 0xff},
+		{0x00, 0x8d, 0xff}, {0x00, 0x8c, 0xff}, {0x00, 0x8a, 0xff}, {0x00, 0x89, 0xff}, {0x00, 0x87, 0xff}, {0x00, 0x86, 0xff},
+		{0x00, 0x84, 0xff}, {0x00, 0x83, 0xff}, {0x00, 0x81, 0xff}, {0x00, 0x80, 0xff}, {0x00, 0x7f, 0xff}, {0x00, 0x7d, 0xff},
+		{0x00, 0x7c, 0xff}, {0x00, 0x7a, 0xff}, {0x00, 0x79, 0xff}, {0x00, 0x77, 0xff}, {0x00, 0x76, 0xff}, {0x00, 0x74, 0xff},
+		{0x00, 0x73, 0xff}, {0x00, 0x71, 0xff}, {0x00, 0x70, 0xff}, {0x00, 0x6e, 0xff}, {0x00, 0x6d, 0xff}, {0x00, 0x6b, 0xff},
+		{0x00, 0x6a, 0xff}, {0x00, 0x68, 0xff}, {0x00, 0x67, 0xff}, {0x00, 0x65, 0xff}, {0x00, 0x64, 0xff}, {0x00, 0x62, 0xff},
+		{0x00, 0x61, 0xff}, {0x00, 0x5f, 0xff}, {0x00, 0x5e, 0xff}, {0x00, 0x5c, 0xff}, {0x00, 0x5b, 0xff}, {0x00, 0x59, 0xff},
+		{0x00, 0x58, 0xff}, {0x00, 0x56, 0xff}, {0x00, 0x55, 0xff}, {0x00, 0x53, 0xff}, {0x00, 0x52, 0xff}, {0x00, 0x50, 0xff},
+		{0x00, 0x4f, 0xff}, {0x00, 0x4d, 0xff}, {0x00, 0x4c, 0xff}, {0x00, 0x4a, 0xff}, {0x00, 0x49, 0xff}, {0x00, 0x47, 0xff},
+		{0x00, 0x46, 0xff}, {0x00, 0x44, 0xff}, {0x00, 0x43, 0xff}, {0x00, 0x41, 0xff}, {0x00, 0x40, 0xff}, {0x00, 0x3e, 0xff},
+		{0x00, 0x3d, 0xff}, {0x00, 0x3b, 0xff}, {0x00, 0x3a, 0xff}, {0x00, 0x38, 0xff}, {0x00, 0x37, 0xff}, {0x00, 0x35, 0xff},
+		{0x00, 0x34, 0xff}, {0x00, 0x32, 0xff}, {0x00, 0x31, 0xff}, {0x00, 0x2f, 0xff}, {0x00, 0x2e, 0xff}, {0x00, 0x2c, 0xff},
+		{0x00, 0x2b, 0xff}, {0x00, 0x29, 0xff}, {0x00, 0x28, 0xff}, {0x00, 0x26, 0xff}, {0x00, 0x25, 0xff}, {0x00, 0x23, 0xff},
+		{0x00, 0x22, 0xff}, {0x00, 0x20, 0xff}, {0x00, 0x1f, 0xff}, {0x00, 0x1d, 0xff}, {0x00, 0x1c, 0xff}, {0x00, 0x1a, 0xff},
+		{0x00, 0x19, 0xff}, {0x00, 0x17, 0xff}, {0x00, 0x16, 0xff}, {0x00, 0x14, 0xff}, {0x00, 0x13, 0xff}, {0x00, 0x11, 0xff},
+		{0x00, 0x10, 0xff}, {0x00, 0x0e, 0xff}, {0x00, 0x0d, 0xff}, {0x00, 0x0b, 0xff}, {0x00, 0x0a, 0xff}, {0x00, 0x08, 0xff},
+		{0x00, 0x07, 0xff}, {0x00, 0x05, 0xff}, {0x00, 0x04, 0xff}, {0x00, 0x02, 0xff}, {0x00, 0x01, 0xff}, {0x00, 0x00, 0xff},
+		{0x02, 0x00, 0xff}, {0x03, 0x00, 0xff}, {0x05, 0x00, 0xff}, {0x06, 0x00, 0xff}, {0x08, 0x00, 0xff}, {0x09, 0x00, 0xff},
+		{0x0b, 0x00, 0xff}, {0x0c, 0x00, 0xff}, {0x0e, 0x00, 0xff}, {0x0f, 0x00, 0xff}, {0x11, 0x00, 0xff}, {0x12, 0x00, 0xff},
+		{0x14, 0x00, 0xff}, {0x15, 0x00, 0xff}, {0x17, 0x00, 0xff}, {0x18, 0x00, 0xff}, {0x1a, 0x00, 0xff}, {0x1b, 0x00, 0xff},
+		{0x1d, 0x00, 0xff}, {0x1e, 0x00, 0xff}, {0x20, 0x00, 0xff}, {0x21, 0x00, 0xff}, {0x23, 0x00, 0xff}, {0x24, 0x00, 0xff},
+		{0x26, 0x00, 0xff}, {0x27, 0x00, 0xff}, {0x29, 0x00, 0xff}, {0x2a, 0x00, 0xff}, {0x2c, 0x00, 0xff}, {0x2d, 0x00, 0xff},
+		{0x2f, 0x00, 0xff}, {0x30, 0x00, 0xff}, {0x32, 0x00, 0xff}, {0x33, 0x00, 0xff}, {0x35, 0x00, 0xff}, {0x36, 0x00, 0xff},
+		{0x38, 0x00, 0xff}, {0x39, 0x00, 0xff}, {0x3b, 0x00, 0xff}, {0x3c, 0x00, 0xff}, {0x3e, 0x00, 0xff}, {0x3f, 0x00, 0xff},
+		{0x41, 0x00, 0xff}, {0x42, 0x00, 0xff}, {0x44, 0x00, 0xff}, {0x45, 0x00, 0xff}, {0x47, 0x00, 0xff}, {0x48, 0x00, 0xff},
+		{0x4a, 0x00, 0xff}, {0x4b, 0x00, 0xff}, {0x4d, 0x00, 0xff}, {0x4e, 0x00, 0xff}, {0x50, 0x00, 0xff}, {0x51, 0x00, 0xff},
+		{0x53, 0x00, 0xff}, {0x54, 0x00, 0xff}, {0x56, 0x00, 0xff}, {0x57, 0x00, 0xff}, {0x59, 0x00, 0xff}, {0x5a, 0x00, 0xff},
+		{0x5c, 0x00, 0xff}, {0x5d, 0x00, 0xff}, {0x5f, 0x00, 0xff}, {0x60, 0x00, 0xff}, {0x62, 0x00, 0xff}, {0x63, 0x00, 0xff},
+		{0x65, 0x00, 0xff}, {0x66, 0x00, 0xff}, {0x68, 0x00, 0xff}, {0x69, 0x00, 0xff}, {0x6b, 0x00, 0xff}, {0x6c, 0x00, 0xff},
+		{0x6e, 0x00, 0xff}, {0x6f, 0x00, 0xff}, {0x71, 0x00, 0xff}, {0x72, 0x00, 0xff}, {0x74, 0x00, 0xff}, {0x75, 0x00, 0xff},
+		{0x77, 0x00, 0xff}, {0x78, 0x00, 0xff}, {0x7a, 0x00, 0xff}, {0x7b, 0x00, 0xff}, {0x7d, 0x00, 0xff}, {0x7e, 0x00, 0xff},
+		{0x80, 0x00, 0xff}, {0x81, 0x00, 0xff}, {0x82, 0x00, 0xff}, {0x84, 0x00, 0xff}, {0x85, 0x00, 0xff}, {0x87, 0x00, 0xff},
+		{0x88, 0x00, 0xff}, {0x8a, 0x00, 0xff}, {0x8b, 0x00, 0xff}, {0x8d, 0x00, 0xff}, {0x8e, 0x00, 0xff}, {0x90, 0x00, 0xff},
+		{0x91, 0x00, 0xff}, {0x93, 0x00, 0xff}, {0x94, 0x00, 0xff}, {0x96, 0x00, 0xff}, {0x97, 0x00, 0xff}, {0x99, 0x00, 0xff},
+		{0x9a, 0x00, 0xff}, {0x9c, 0x00, 0xff}, {0x9d, 0x00, 0xff}, {0x9f, 0x00, 0xff}, {0xa0, 0x00, 0xff}, {0xa2, 0x00, 0xff},
+		{0xa3, 0x00, 0xff}, {0xa5, 0x00, 0xff}, {0xa6, 0x00, 0xff}, {0xa8, 0x00, 0xff}, {0xa9, 0x00, 0xff}, {0xab, 0x00, 0xff},
+		{0xac, 0x00, 0xff}, {0xae, 0x00, 0xff}, {0xaf, 0x00, 0xff}, {0xb1, 0x00, 0xff}, {0xb2, 0x00, 0xff}, {0xb4, 0x00, 0xff},
+		{0xb5, 0x00, 0xff}, {0xb7, 0x00, 0xff}, {0xb8, 0x00, 0xff}, {0xba, 0x00, 0xff}, {0xbb, 0x00, 0xff}, {0xbd, 0x00, 0xff},
+		{0xbe, 0x00, 0xff}, {0xc0, 0x00, 0xff}, {0xc1, 0x00, 0xff}, {0xc3, 0x00, 0xff}, {0xc4, 0x00, 0xff}, {0xc6, 0x00, 0xff},
+		{0xc7, 0x00, 0xff}, {0xc9, 0x00, 0xff}, {0xca, 0x00, 0xff}, {0xcc, 0x00, 0xff}, {0xcd, 0x00, 0xff}, {0xcf, 0x00, 0xff},
+		{0xd0, 0x00, 0xff}, {0xd2, 0x00, 0xff}, {0xd3, 0x00, 0xff}, {0xd5, 0x00, 0xff}, {0xd6, 0x00, 0xff}, {0xd8, 0x00, 0xff},
+		{0xd9, 0x00, 0xff}, {0xdb, 0x00, 0xff}, {0xdc, 0x00, 0xff}, {0xde, 0x00, 0xff}, {0xdf, 0x00, 0xff}, {0xe1, 0x00, 0xff},
+		{0xe2, 0x00, 0xff}, {0xe4, 0x00, 0xff}, {0xe5, 0x00, 0xff}, {0xe7, 0x00, 0xff}, {0xe8, 0x00, 0xff}, {0xea, 0x00, 0xff},
+		{0xeb, 0x00, 0xff}, {0xed, 0x00, 0xff}, {0xee, 0x00, 0xff}, {0xf0, 0x00, 0xff}, {0xf1, 0x00, 0xff}, {0xf3, 0x00, 0xff},
+		{0xf4, 0x00, 0xff}, {0xf6, 0x00, 0xff}, {0xf7, 0x00, 0xff}, {0xf9, 0x00, 0xff}, {0xfa, 0x00, 0xff}, {0xfc, 0x00, 0xff},
+		{0xfd, 0x00, 0xff}, {0xff, 0x00, 0xff}, {0xff, 0x00, 0xfe}, {0xff, 0x00, 0xfd}, {0xff, 0x00, 0xfb}, {0xff, 0x00, 0xfa},
+		{0xff, 0x00, 0xf8}, {0xff, 0x00, 0xf7}, {0xff, 0x00, 0xf5}, {0xff, 0x00, 0xf4}, {0xff, 0x00, 0xf2}, {0xff, 0x00, 0xf1},
+		{0xff, 0x00, 0xef}, {0xff, 0x00, 0xee}, {0xff, 0x00, 0xec}, {0xff, 0x00, 0xeb}, {0xff, 0x00, 0xe9}, {0xff, 0x00, 0xe8},
+		{0xff, 0x00, 0xe6}, {0xff, 0x00, 0xe5}, {0xff, 0x00, 0xe3}, {0xff, 0x00, 0xe2}, {0xff, 0x00, 0xe0}, {0xff, 0x00, 0xdf},
+		{0xff, 0x00, 0xdd}, {0xff, 0x00, 0xdc}, {0xff, 0x00, 0xda}, {0xff, 0x00, 0xd9}, {0xff, 0x00, 0xd7}, {0xff, 0x00, 0xd6},
+		{0xff, 0x00, 0xd4}, {0xff, 0x00, 0xd3}, {0xff, 0x00, 0xd1}, {0xff, 0x00, 0xd0}, {0xff, 0x00, 0xce}, {0xff, 0x00, 0xcd},
+		{0xff, 0x00, 0xcb}, {0xff, 0x00, 0xca}, {0xff, 0x00, 0xc8}, {0xff, 0x00, 0xc7}, {0xff, 0x00, 0xc5}, {0xff, 0x00, 0xc4},
+		{0xff, 0x00, 0xc2}, {0xff, 0x00, 0xc1}, {0xff, 0x00, 0xbf}, {0xff, 0x00, 0xbe}, {0xff, 0x00, 0xbc}, {0xff, 0x00, 0xbb},
+		{0xff, 0x00, 0xb9}, {0xff, 0x00, 0xb8}, {0xff, 0x00, 0xb6}, {0xff, 0x00, 0xb5}, {0xff, 0x00, 0xb3}, {0xff, 0x00, 0xb2},
+		{0xff, 0x00, 0xb0}, {0xff, 0x00, 0xaf}, {0xff, 0x00, 0xad}, {0xff, 0x00, 0xac}, {0xff, 0x00, 0xaa}, {0xff, 0x00, 0xa9},
+		{0xff, 0x00, 0xa7}, {0xff, 0x00, 0xa6}, {0xff, 0x00, 0xa4}, {0xff, 0x00, 0xa3}, {0xff, 0x00, 0xa1}, {0xff, 0x00, 0xa0},
+		{0xff, 0x00, 0x9e}, {0xff, 0x00, 0x9d}, {0xff, 0x00, 0x9b}, {0xff, 0x00, 0x9a}, {0xff, 0x00, 0x98}, {0xff, 0x00, 0x97},
+		{0xff, 0x00, 0x95}, {0xff, 0x00, 0x94}, {0xff, 0x00, 0x92}, {0xff, 0x00, 0x91}, {0xff, 0x00, 0x8f}, {0xff, 0x00, 0x8e},
+		{0xff, 0x00, 0x8c}, {0xff, 0x00, 0x8b}, {0xff, 0x00, 0x89}, {0xff, 0x00, 0x88}, {0xff, 0x00, 0x86}, {0xff, 0x00, 0x85},
+		{0xff, 0x00, 0x83}, {0xff, 0x00, 0x82}, {0xff, 0x00, 0x80}, {0xff, 0x00, 0x7f}, {0xff, 0x00, 0x7e}, {0xff, 0x00, 0x7c},
+		{0xff, 0x00, 0x7b}, {0xff, 0x00, 0x79}, {0xff, 0x00, 0x78}, {0xff, 0x00, 0x76}, {0xff, 0x00, 0x75}, {0xff, 0x00, 0x73},
+		{0xff, 0x00, 0x72}, {0xff, 0x00, 0x70}, {0xff, 0x00, 0x6f}, {0xff, 0x00, 0x6d}, {0xff, 0x00, 0x6c}, {0xff, 0x00, 0x6a},
+		{0xff, 0x00, 0x69}, {0xff, 0x00, 0x67}, {0xff, 0x00, 0x66}, {0xff, 0x00, 0x64}, {0xff, 0x00, 0x63}, {0xff, 0x00, 0x61},
+		{0xff, 0x00, 0x60}, {0xff, 0x00, 0x5e}, {0xff, 0x00, 0x5d}, {0xff, 0x00, 0x5b}, {0xff, 0x00, 0x5a}, {0xff, 0x00, 0x58},
+		{0xff, 0x00, 0x57}, {0xff, 0x00, 0x55}, {0xff, 0x00, 0x54}, {0xff, 0x00, 0x52}, {0xff, 0x00, 0x51}, {0xff, 0x00, 0x4f},
+		{0xff, 0x00, 0x4e}, {0xff, 0x00, 0x4c}, {0xff, 0x00, 0x4b}, {0xff, 0x00, 0x49}, {0xff, 0x00, 0x48}, {0xff, 0x00, 0x46},
+		{0xff, 0x00, 0x45}, {0xff, 0x00, 0x43}, {0xff, 0x00, 0x42}, {0xff, 0x00, 0x40}, {0xff, 0x00, 0x3f}, {0xff, 0x00, 0x3d},
+		{0xff, 0x00, 0x3c}, {0xff, 0x00, 0x3a}, {0xff, 0x00, 0x39}, {0xff, 0x00, 0x37}, {0xff, 0x00, 0x36}, {0xff, 0x00, 0x34},
+		{0xff, 0x00, 0x33}, {0xff, 0x00, 0x31}, {0xff, 0x00, 0x30}, {0xff, 0x00, 0x2e}, {0xff, 0x00, 0x2d}, {0xff, 0x00, 0x2b},
+		{0xff, 0x00, 0x2a}, {0xff, 0x00, 0x28}, {0xff, 0x00, 0x27}, {0xff, 0x00, 0x25}, {0xff, 0x00, 0x24}, {0xff, 0x00, 0x22},
+		{0xff, 0x00, 0x21}, {0xff, 0x00, 0x1f}, {0xff, 0x00, 0x1e}, {0xff, 0x00, 0x1c}, {0xff, 0x00, 0x1b}, {0xff, 0x00, 0x19},
+		{0xff, 0x00, 0x18}, {0xff, 0x00, 0x16}, {0xff, 0x00, 0x15}, {0xff, 0x00, 0x13}, {0xff, 0x00, 0x12}, {0xff, 0x00, 0x10},
+		{0xff, 0x00, 0x0f}, {0xff, 0x00, 0x0d}, {0xff, 0x00, 0x0c}, {0xff, 0x00, 0x0a}, {0xff, 0x00, 0x09}, {0xff, 0x00, 0x07},
+		{0xff, 0x00, 0x06}, {0xff, 0x00, 0x04}, {0xff, 0x00, 0x03}, {0xff, 0x00, 0x01},
+};
+
+const uint8_t color_gamma_lut[256] = {
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+		0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+		0x03, 0x03, 0x03, 0x03, 0x03, 0x04, 0x04, 0x04, 0x04, 0x05, 0x05, 0x05, 0x05, 0x06, 0x06, 0x06,
+		0x06, 0x07, 0x07, 0x07, 0x08, 0x08, 0x08, 0x09, 0x09, 0x09, 0x0a, 0x0a, 0x0b, 0x0b, 0x0b, 0x0c,
+		0x0c, 0x0d, 0x0d, 0x0d, 0x0e, 0x0e, 0x0f, 0x0f, 0x10, 0x10, 0x11, 0x11, 0x12, 0x12, 0x13, 0x13,
+		0x14, 0x14, 0x15, 0x16, 0x16, 0x17, 0x17, 0x18, 0x19, 0x19, 0x1a, 0x1a, 0x1b, 0x1c, 0x1c, 0x1d,
+		0x1e, 0x1e, 0x1f, 0x20, 0x21, 0x21, 0x22, 0x23, 0x23, 0x24, 0x25, 0x26, 0x27, 0x27, 0x28, 0x29,
+		0x2a, 0x2b, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+		0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+		0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x51, 0x52, 0x53, 0x54, 0x55, 0x57, 0x58, 0x59, 0x5a,
+		0x5b, 0x5d, 0x5e, 0x5f, 0x61, 0x62, 0x63, 0x64, 0x66, 0x67, 0x69, 0x6a, 0x6b, 0x6d, 0x6e, 0x6f,
+		0x71, 0x72, 0x74, 0x75, 0x77, 0x78, 0x79, 0x7b, 0x7c, 0x7e, 0x7f, 0x81, 0x82, 0x84, 0x85, 0x87,
+		0x89, 0x8a, 0x8c, 0x8d, 0x8f, 0x91, 0x92, 0x94, 0x95, 0x97, 0x99, 0x9a, 0x9c, 0x9e, 0x9f, 0xa1,
+		0xa3, 0xa5, 0xa6, 0xa8, 0xaa, 0xac, 0xad, 0xaf, 0xb1, 0xb3, 0xb5, 0xb6, 0xb8, 0xba, 0xbc, 0xbe,
+		0xc0, 0xc2, 0xc4, 0xc5, 0xc7, 0xc9, 0xcb, 0xcd, 0xcf, 0xd1, 0xd3, 0xd5, 0xd7, 0xd9, 0xdb, 0xdd,
+		0xdf, 0xe1, 0xe3, 0xe5, 0xe7, 0xea, 0xec, 0xee, 0xf0, 0xf2, 0xf4, 0xf6, 0xf8, 0xfb, 0xfd, 0xff,
+};
+
+
+/************************
+ * EXPORTED FUNCTIONS
+ ************************/
+/*
+ * Circle is split into 6 sectors, in each of them one channel goes up or
+ *  down linearly, others stay at val or at its unsaturated part
+ */
+struct Color color_hsv(uint16_t hue, uint8_t sat, uint8_t val) {
+	uint32_t sector = (uint32_t)hue * 6;
+	uint8_t pos = (sector >> 8) & 0xff;
+	uint8_t p = scale8(val, 255 - sat);
+	uint8_t q = scale8(val, 255 - scale8(sat, pos));
+	uint8_t t = scale8(val, 255 - scale8(sat, 255 - pos));
+
+	switch(sector >> 16) {
+	case 0:
+		return (struct Color) { val, t, p };
+	case 1:
+		return (struct Color) { q, val, p };
+	case 2:
+		return (struct Color) { p, val, t };
+	case 3:
+		return (struct Color) { p, q, val };
+	case 4:
+		return (struct Color) { t, p, val };
+	default:
+		return (struct Color) { val, p, q };
+	}
+}
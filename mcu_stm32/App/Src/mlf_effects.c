@@ -6,76 +6,44 @@
 
 #include "mlf_effects.h"
 
+#include "color_math.h"
 #include "ws2812.h"
 
-#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 /***************************
- * UTILS
+ * RGB EFFECTS IMPLEMENTATION
  ***************************/
 /*
- * HSL2RGB code adapted from:
- *  https://stackoverflow.com/a/9493060
+ * Hue goes around the wheel once per 1000 frames, and once along the strip.
+ *  It's 16-bit fraction of circle, so it wraps on its own.
  */
-static float hue2rgb(float p, float q, float t) {
-  if (t < 0) t += 1;
-  if (t > 1) t -= 1;
-  if (t < 1./6) return p + (q - p) * 6 * t;
-  if (t < 1./2) return q;
-  if (t < 2./3) return p + (q - p) * (2./3 - t) * 6;
-  return p;
-}
-
-static struct Color hsl2rgb(float h, float s, float l) {
-  struct Color result;
-
-  if(0 == s)
-    result.r = result.g = result.b = l;
-  else {
-    float q = l < 0.5 ? l * (1 + s) : l + s - l * s;
-    float p = 2 * l - q;
-    result.r = round(hue2rgb(p, q, h + 1./3) * 255);
-    result.g = round(hue2rgb(p, q, h) * 255);
-    result.b = round(hue2rgb(p, q, h - 1./3) * 255);
-  }
-
-  return result;
+static uint16_t effect_hue(uint32_t frame) {
+	return (frame % 1000) * COLOR_HUE_MAX / 1000;
 }
 
-/***************************
- * RGB EFFECTS IMPLEMENTATION
- ***************************/
 static int effect_rainbow(struct LEDStrip* strip, uint32_t frame, uint32_t data) {
 	int i;
-	float partialHue;
-	float hue = 0.001 * frame;
 	const int leds_count = get_leds_count(strip);
+	uint32_t hue = (uint32_t)effect_hue(frame) << 16;
+	uint32_t step;
 
-	// Convert hue to range [0,1]
-	hue = hue - (long)hue;
-
-	for(i = 0; i < leds_count; i++) {
-		partialHue = hue + (float)i / leds_count;
-		if(partialHue > 1.0f)
-		  partialHue -= 1.0f;
+	if(leds_count == 0)
+		return 0;
 
-		set_led_color(strip, i, hsl2rgb(partialHue, 1, 0.5));
-	}
+	// 16.16 fixed point, so long strips don't lose the step
+	step = COLOR_HUE_STEP(leds_count);
+	for(i = 0; i < leds_count; i++, hue += step)
+		set_led_color(strip, i, color_wheel(hue >> 16));
 
 	return MLF_EFFECT_REFRESH_REQ;
 }
 
 static int effect_color_cycle(struct LEDStrip* strip, uint32_t frame, uint32_t data) {
 	int i;
-	float hue = 0.001 * frame;
 	const int leds_count = get_leds_count(strip);
-	struct Color color;
-
-	// Convert hue to range [0,1]
-	hue = hue - (long)hue;
-	color = hsl2rgb(hue, 1, 0.5);
+	struct Color color = color_wheel(effect_hue(frame));
 
 	for(i = 0; i < leds_count; i++)
 		set_led_color(strip, i, color);
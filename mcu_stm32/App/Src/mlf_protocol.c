@@ -14,7 +14,6 @@
 static void MLF_resp_error(struct MLF_ctx* ctx, enum MLF_error_codes error);
 static int MLF_validate_header(struct MLF_ctx* ctx, uint8_t* buf);
 static int MLF_validate_footer(struct MLF_ctx* ctx, uint8_t* buf);
-static void MLF_submit_packet(struct MLF_ctx* ctx, uint8_t* buf, uint32_t len);
 
 /**********************
  * COMPATIBILITY LAYER
@@ -37,9 +36,11 @@ static void MLF_submit_packet(struct MLF_ctx* ctx, uint8_t* buf, uint32_t len);
 #endif
 /**********************
  * PACKET BUFFER SUPPORT
- *  - for processing data received from client, we need
- *    simple buffer to which data can be appended and which
- *    will drop partial transfers
+ *  - data received from client is appended straight into
+ *    a slot of ring, which is parsed in place by
+ *    MLF_process_packet. Receiver (USB IRQ or USART pump)
+ *    owns head, main loop owns tail. When no slot is free,
+ *    reception is paused until a packet is processed.
  **********************/
 #define PACKET_BUFFER_MAX_DELAY		1000
 #define PACKET_BUFFER_MAX_SIZE		(MLF_MAX_DATA_SIZE + \
@@ -48,81 +49,168 @@ static void MLF_submit_packet(struct MLF_ctx* ctx, uint8_t* buf, uint32_t len);
 
 struct packet_buffer {
 	struct MLF_ctx* ctx;
+	packet_buffer_resume_func resume;
 
+	// Packet being received into the head slot
 	uint8_t  header_validated;
+	uint8_t  streaming;				// its data is passed to stream hooks
 	uint32_t time_last_packet;
 	uint32_t size;
-	uint8_t  buffer[PACKET_BUFFER_MAX_SIZE];
+
+	// Rest of data which came when ring was full, still in caller's buffer
+	uint8_t* held;
+	uint32_t held_len;
+	volatile uint8_t paused;
+
+	// Number of packets received and processed
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	uint8_t  slots_count;
+	uint8_t* slots;
 };
 
 
+static void packet_buffer_stream_end(struct packet_buffer* pkt, int complete) {
+	if(!pkt->streaming)
+		return;
+
+	pkt->streaming = 0;
+	pkt->ctx->stream_end(complete);
+}
+
 static void packet_buffer_clear(struct packet_buffer* pkt) {
+	packet_buffer_stream_end(pkt, 0);
 	pkt->size = 0;
 	pkt->time_last_packet = 0;
 	pkt->header_validated = 0;
-	memset(pkt->buffer, 0, sizeof pkt->buffer);
 }
 
-struct packet_buffer* packet_buffer_init(struct MLF_ctx* ctx) {
+static uint8_t* packet_buffer_slot(struct packet_buffer* pkt, uint32_t idx) {
+	return pkt->slots + (idx % pkt->slots_count) * PACKET_BUFFER_MAX_SIZE;
+}
+
+static int packet_buffer_full(struct packet_buffer* pkt) {
+	return pkt->head - pkt->tail >= pkt->slots_count;
+}
+
+/*
+ * Only the packet which is processed next is streamed, so application
+ *  decodes a single packet at a time and commits it before the next one
+ */
+static uint8_t packet_buffer_stream_begin(struct packet_buffer* pkt, struct MLF_req_packet_header* hdr) {
+	struct MLF_ctx* ctx = pkt->ctx;
+
+	if(hdr->magic != MLF_HEADER_MAGIC || hdr->cmd >= 32 || !(ctx->stream_cmds & (1UL << hdr->cmd)))
+		return 0;
+	if(pkt->head != pkt->tail)
+		return 0;
+
+	return ctx->stream_begin(hdr->cmd, hdr->data, hdr->data_size) == 0;
+}
+
+struct packet_buffer* packet_buffer_init(struct MLF_ctx* ctx, uint8_t slots, packet_buffer_resume_func resume) {
 	struct packet_buffer* pkt;
 
-	pkt = malloc(sizeof *pkt);
+	pkt = calloc(1, sizeof *pkt);
 	if(pkt == NULL) {
 		LOG_ERROR("Failed to allocate memory for new packet_buffer");
 		return NULL;
 	}
 
+	pkt->slots = malloc(slots * PACKET_BUFFER_MAX_SIZE);
+	if(pkt->slots == NULL) {
+		LOG_ERROR("Failed to allocate %d slots of packet_buffer", slots);
+		free(pkt);
+		return NULL;
+	}
+
 	pkt->ctx = ctx;
-	packet_buffer_clear(pkt);
+	pkt->resume = resume;
+	pkt->slots_count = slots;
+	ctx->rx = pkt;
 	return pkt;
 }
 
 void packet_buffer_deinit(struct packet_buffer* pkt) {
+	if(pkt == NULL)
+		return;
+
+	packet_buffer_clear(pkt);
+	pkt->ctx->rx = NULL;
+	free(pkt->slots);
 	free(pkt);
 }
 
+int packet_buffer_is_paused(struct packet_buffer* pkt) {
+	return pkt->paused;
+}
+
 static int packet_buffer_overtime(struct packet_buffer* pkt) {
 	return pkt->time_last_packet && (HAL_GetTick() - pkt->time_last_packet >= PACKET_BUFFER_MAX_DELAY);
 }
 
+/*
+ * Slot is filled up to the end of header, then up to the end of footer, so
+ *  the next packet of the same chunk goes to the next slot. When the ring
+ *  gets full, the rest of chunk is left in caller's buffer - caller must
+ *  keep it and stop receiving until resume callback is called.
+ */
 int packet_buffer_append(struct packet_buffer* pkt, uint8_t* buf, uint32_t len) {
+	struct MLF_req_packet_header* hdr;
+	uint8_t* slot;
+	uint32_t packet_len, take;
 	int ret;
-	uint32_t footer_offset;
 
-	if(len == 0)
-		return 0;
+	while(len) {
+		if(packet_buffer_full(pkt)) {
+			pkt->held = buf;
+			pkt->held_len = len;
+			pkt->paused = 1;
+			return PACKET_BUFFER_PAUSED;
+		}
 
-	if(packet_buffer_overtime(pkt)) {
-		LOG_WARN("Packet timeout. Treating data as a new packet");
-		packet_buffer_clear(pkt);
-	}
+		if(packet_buffer_overtime(pkt)) {
+			LOG_WARN("Packet timeout. Treating data as a new packet");
+			packet_buffer_clear(pkt);
+		}
 
-	if(pkt->size + len >= PACKET_BUFFER_MAX_SIZE) {
-		LOG_ERROR("Packet buffer overflow");
-		packet_buffer_clear(pkt);
-		MLF_resp_error(pkt->ctx, MLF_RET_DATA_TOO_LARGE);
-		return -1;
-	}
+		slot = packet_buffer_slot(pkt, pkt->head);
+		hdr = (struct MLF_req_packet_header*) slot;
+		packet_len = sizeof(*hdr);
+		if(pkt->header_validated)
+			packet_len += hdr->data_size + sizeof(struct MLF_packet_footer);
+
+		take = packet_len - pkt->size < len ? packet_len - pkt->size : len;
+		memcpy(slot + pkt->size, buf, take);
+		pkt->size += take;
+		buf += take;
+		len -= take;
+
+		if(pkt->streaming) {
+			uint32_t received = pkt->size - sizeof(*hdr);
+			pkt->ctx->stream_data(hdr->data, received < hdr->data_size ? received : hdr->data_size);
+		}
 
-	// Append new data to our packed buffer
-	memcpy(pkt->buffer + pkt->size, buf, len);
-	pkt->size += len;
+		if(pkt->size < packet_len) {
+			pkt->time_last_packet = HAL_GetTick();
+			break;
+		}
 
-	// Validate header and footer of received data
-	if(!pkt->header_validated && pkt->size >= sizeof(struct MLF_req_packet_header)) {
-		ret = MLF_validate_header(pkt->ctx, pkt->buffer);
-		if(ret) {
-			// MLF_validate_header already reports an error to host
-			packet_buffer_clear(pkt);
-			return -1;
+		// Validate header and footer of received data
+		if(!pkt->header_validated) {
+			ret = MLF_validate_header(pkt->ctx, slot);
+			if(ret) {
+				// MLF_validate_header already reports an error to host
+				packet_buffer_clear(pkt);
+				return -1;
+			}
+			pkt->header_validated = 1;
+			pkt->streaming = packet_buffer_stream_begin(pkt, hdr);
+			pkt->time_last_packet = HAL_GetTick();
+			continue;
 		}
-		pkt->header_validated = 1;
-	}
 
-	footer_offset = sizeof(struct MLF_req_packet_header) +
-					((struct MLF_req_packet_header*)pkt->buffer)->data_size;
-	if(pkt->size >= footer_offset + sizeof(struct MLF_packet_footer)) {
-		ret = MLF_validate_footer(pkt->ctx, pkt->buffer);
+		ret = MLF_validate_footer(pkt->ctx, slot);
 		if(ret) {
 			// MLF_validate_footer already reports an error to host
 			packet_buffer_clear(pkt);
@@ -130,15 +218,37 @@ int packet_buffer_append(struct packet_buffer* pkt, uint8_t* buf, uint32_t len)
 		}
 
 		// Full packet has been received
-		MLF_submit_packet(pkt->ctx, pkt->buffer, pkt->size);
+		packet_buffer_stream_end(pkt, 1);
 		packet_buffer_clear(pkt);
-		return 0;
+		pkt->head++;
 	}
 
-	pkt->time_last_packet = HAL_GetTick();
+	if(packet_buffer_full(pkt)) {
+		pkt->paused = 1;
+		return PACKET_BUFFER_PAUSED;
+	}
 	return 0;
 }
 
+/* Called by consumer - data held while ring was full goes in first */
+static void packet_buffer_release(struct packet_buffer* pkt) {
+	uint8_t* held = pkt->held;
+	uint32_t held_len = pkt->held_len;
+
+	pkt->tail++;
+	if(!pkt->paused)
+		return;
+
+	pkt->held = NULL;
+	pkt->held_len = 0;
+	pkt->paused = 0;
+	if(packet_buffer_append(pkt, held, held_len) == PACKET_BUFFER_PAUSED)
+		return;
+
+	if(pkt->resume)
+		pkt->resume();
+}
+
 
 /**********************
  * MegaLeaf (MLF) Packet Support
@@ -153,14 +263,11 @@ uint32_t reroute_start_time;
 uint8_t reroute_count;
 
 int MLF_init(struct MLF_ctx* ctx, MLF_write_func write_func) {
-	memset(ctx, 0, sizeof(*ctx));
+	// USB may enumerate and attach its ring before protocol is set up
+	struct packet_buffer* rx = ctx->rx;
 
-	ctx->recv_packet_buf = malloc(PACKET_BUFFER_MAX_SIZE);
-	if(ctx->recv_packet_buf == NULL) {
-		printk(LOG_EMERG "mlf_protocol: failed to allocate memory for recv_packet_buf");
-		return -1;
-	}
-	memset(ctx->recv_packet_buf, 0, PACKET_BUFFER_MAX_SIZE);
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->rx = rx;
 	ctx->write_func = write_func;
 
 	return 0;
@@ -283,21 +390,8 @@ static int MLF_validate_footer(struct MLF_ctx* ctx, uint8_t* buf) {
 	return 0;
 }
 
-static void MLF_submit_packet(struct MLF_ctx* ctx, uint8_t* buf, uint32_t len) {
-
-	if(len > PACKET_BUFFER_MAX_SIZE)
-		len = PACKET_BUFFER_MAX_SIZE;
-	if(ctx->new_data_available) {
-		LOG_ERROR("Dropping packet - previous hasn't been processed yet");
-		return;
-	}
-
-	memcpy(ctx->recv_packet_buf, buf, len);
-	ctx->new_data_available = 1;
-}
-
 int MLF_is_packet_available(struct MLF_ctx* ctx) {
-	return ctx->new_data_available;
+	return ctx->rx && ctx->rx->head != ctx->rx->tail;
 }
 
 static void MLF_reroute(struct MLF_ctx* current, enum MLF_commands cmd, uint8_t* data, uint16_t size) {
@@ -313,7 +407,7 @@ static void MLF_reroute(struct MLF_ctx* current, enum MLF_commands cmd, uint8_t*
 	}
 
 	if(reroute_count > REROUTE_RATELIMIT_BURST_SIZE) {
-		printk(LOG_WARNING, "mlf-protocol: rate-limiting rerouted messages");
+		printk(LOG_WARNING "mlf-protocol: rate-limiting rerouted messages");
 		return;
 	}
 	reroute_count++;
@@ -321,16 +415,117 @@ static void MLF_reroute(struct MLF_ctx* current, enum MLF_commands cmd, uint8_t*
 	MLF_SendCmd(g_reroute.to, cmd, data, size);
 }
 
+/*
+ * Every sub-command of batch may respond with up to MLF_CMD_RESPONSE_SIZE
+ *  bytes, so combined response always fits into the output buffer
+ */
+#define MLF_CMD_RESPONSE_SIZE		64
+#define MLF_BATCH_RESPONSE_SIZE		(sizeof(struct MLF_resp_cmd_batch) + MLF_BATCH_MAX_CMDS * \
+										(sizeof(struct MLF_batch_resp) + MLF_CMD_RESPONSE_SIZE))
+static uint8_t batch_response[MLF_BATCH_RESPONSE_SIZE];
+
+/*
+ * Frames, flow control and commands which can't be undone would leave
+ *  a failed batch half-applied, so they are sent on their own
+ */
+static int MLF_batchable(uint8_t cmd) {
+	switch(cmd) {
+	case MLF_CMD_SET_COLOR:
+	case MLF_CMD_SET_COLOR_AT:
+	case MLF_CMD_SET_COLOR_FRAGMENT:
+	case MLF_CMD_SET_FLOW_CONTROL:
+	case MLF_CMD_BATCH:
+	case MLF_CMD_LINK_PROBE:
+	case MLF_CMD_SET_STRIP_CONFIG:
+		return 0;
+	default:
+		return cmd < MLF_CMD_MAX;
+	}
+}
+
+static int MLF_validate_batch(struct MLF_ctx* ctx, uint8_t* data, uint16_t len) {
+	struct MLF_batch_cmd* sub;
+	uint32_t offset = 0;
+	int count = 0;
+
+	while(offset < len) {
+		sub = (struct MLF_batch_cmd*)(data + offset);
+		if(offset + sizeof(*sub) > len || offset + sizeof(*sub) + sub->data_size > len)
+			return MLF_RET_INVALID_DATA;
+		if(!MLF_batchable(sub->cmd) || ctx->ops[sub->cmd] == NULL)
+			return MLF_RET_INVALID_CMD;
+		if(++count > MLF_BATCH_MAX_CMDS)
+			return MLF_RET_DATA_TOO_LARGE;
+
+		offset += sizeof(*sub) + sub->data_size;
+	}
+
+	return MLF_RET_OK;
+}
+
+static int MLF_process_batch(struct MLF_ctx* ctx, uint8_t* data, uint16_t len, uint16_t* resp_len) {
+	struct MLF_resp_cmd_batch* resp = (struct MLF_resp_cmd_batch*) batch_response;
+	struct MLF_batch_cmd* sub;
+	struct MLF_batch_resp* sub_resp;
+	uint32_t offset = 0;
+	uint16_t sub_resp_len;
+	int ret;
+
+	resp->count = 0;
+	*resp_len = sizeof(*resp);
+
+	ret = MLF_validate_batch(ctx, data, len);
+	if(ret != MLF_RET_OK) {
+		LOG_ERROR("Dropping malformed batch (%d)", ret);
+		return ret;
+	}
+
+	if(ctx->batch_begin)
+		ctx->batch_begin();
+
+	while(offset < len) {
+		sub = (struct MLF_batch_cmd*)(data + offset);
+		sub_resp = (struct MLF_batch_resp*)(batch_response + *resp_len);
+		sub_resp_len = 0;
+
+		ret = ctx->ops[sub->cmd](sub->data, sub->data_size, sub_resp->data, &sub_resp_len);
+		if(ret != MLF_RET_OK)
+			sub_resp_len = 0;
+		sub_resp->error_code = ret;
+		sub_resp->data_size = sub_resp_len;
+
+		resp->count++;
+		*resp_len += sizeof(*sub_resp) + sub_resp->data_size;
+		offset += sizeof(*sub) + sub->data_size;
+
+		if(ret != MLF_RET_OK)
+			break;
+	}
+
+	if(ctx->batch_end)
+		ctx->batch_end(ret);
+	if(ret != MLF_RET_OK)
+		return ret;
+
+	// Other MCU gets sub-commands only once none of them can be rolled back
+	for(offset = 0; offset < len; offset += sizeof(*sub) + sub->data_size) {
+		sub = (struct MLF_batch_cmd*)(data + offset);
+		MLF_reroute(ctx, sub->cmd, sub->data, sub->data_size);
+	}
+	return ret;
+}
+
 void MLF_process_packet(struct MLF_ctx* ctx) {
 	int ret = MLF_RET_NOT_READY;
-	uint8_t response[64];
+	uint8_t response[MLF_CMD_RESPONSE_SIZE];
+	uint8_t* response_buf = response;
 	uint16_t response_size = 0;
 	struct MLF_req_packet_header* hdr;
 
-	if(!ctx->new_data_available)
+	if(!MLF_is_packet_available(ctx))
 		return;
 
-	hdr = (struct MLF_req_packet_header*) ctx->recv_packet_buf;
+	hdr = (struct MLF_req_packet_header*) packet_buffer_slot(ctx->rx, ctx->rx->tail);
 
 	if(hdr->magic == MLF_RESP_HEADER_MAGIC) {
 		// Handle response packet
@@ -340,26 +535,49 @@ void MLF_process_packet(struct MLF_ctx* ctx) {
 				LOG_WARN("Encountered an error while processing response (%d)", ret);
 		}
 
-		ctx->new_data_available = 0;
+		packet_buffer_release(ctx->rx);
 		return;
 	}
 
-	if(ctx->ops[hdr->cmd] != NULL)
-		ret = ctx->ops[hdr->cmd](hdr->data, hdr->data_size, response, &response_size);
-	if(ret != MLF_RET_OK)
-		LOG_WARN("Command processing finished with code %d", ret)
-	else
-		MLF_reroute(ctx, hdr->cmd, hdr->data, hdr->data_size);
+	if(hdr->cmd == MLF_CMD_BATCH) {
+		// Sub-commands are rerouted one by one, after the whole batch succeeded
+		response_buf = batch_response;
+		ret = MLF_process_batch(ctx, hdr->data, hdr->data_size, &response_size);
+		if(ret != MLF_RET_OK)
+			LOG_WARN("Batch processing finished with code %d", ret)
+	} else {
+		if(ctx->ops[hdr->cmd] != NULL)
+			ret = ctx->ops[hdr->cmd](hdr->data, hdr->data_size, response, &response_size);
+		if(ret != MLF_RET_OK)
+			LOG_WARN("Command processing finished with code %d", ret)
+		else
+			MLF_reroute(ctx, hdr->cmd, hdr->data, hdr->data_size);
+	}
 
+	// Data held by paused receiver may be answered with an error, so
+	//  slot is released after the response has been sent
 	hdr = NULL;
-	ctx->new_data_available = 0;
-	MLF_resp_data(ctx, ret, response, response_size);
+	MLF_resp_data(ctx, ret, response_buf, response_size);
+	packet_buffer_release(ctx->rx);
 }
 
 void MLF_register_callback(struct MLF_ctx* ctx, enum MLF_commands cmd, MLF_command_handler cb) {
 	ctx->ops[cmd] = cb;
 }
 
+void MLF_register_batch_hooks(struct MLF_ctx* ctx, MLF_batch_begin_hook begin, MLF_batch_end_hook end) {
+	ctx->batch_begin = begin;
+	ctx->batch_end = end;
+}
+
+void MLF_register_stream_hooks(struct MLF_ctx* ctx, enum MLF_commands cmd, MLF_stream_begin_hook begin,
+		MLF_stream_data_hook data, MLF_stream_end_hook end) {
+	ctx->stream_cmds |= 1UL << cmd;
+	ctx->stream_begin = begin;
+	ctx->stream_data = data;
+	ctx->stream_end = end;
+}
+
 void MLF_register_reroute(struct MLF_ctx* from, struct MLF_ctx* to, enum MLF_commands cmd) {
 	if(g_reroute.from && g_reroute.from != from) {
 		printk(LOG_ERR "mlf-protocol: Failed to register reroute - from is already set(%p), requested %p",
@@ -374,7 +592,7 @@ void MLF_register_reroute(struct MLF_ctx* from, struct MLF_ctx* to, enum MLF_com
 	}
 
 	if(cmd == MLF_CMD_HANDLE_RESPONSE) {
-		printk(LOG_ERR, "mlf-protocol: Cannot reroute response command to another context (%d)", cmd);
+		printk(LOG_ERR "mlf-protocol: Cannot reroute response command to another context (%d)", cmd);
 		return;
 	}
 
@@ -428,3 +646,8 @@ void MLF_SendCmd(struct MLF_ctx* ctx, enum MLF_commands cmd, uint8_t* data, uint
 	if(ret == HAL_BUSY)
 		LOG_ERROR("Failed to send command - write_func is BUSY");
 }
+
+void MLF_SendEvent(struct MLF_ctx* ctx, enum MLF_error_codes event, uint8_t* data, uint16_t size) {
+	// Events share format with responses, only error code differs
+	MLF_resp_data(ctx, event, data, size);
+}
@@ -0,0 +1,291 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * ws2812_parallel.c - parallel output of up to 16 WS2812B strips on pins
+ * 					   of a single GPIO port, driven by timer and DMA
+ *  (C) 2022 Pawel Wieczorek
+ */
+
+#include "main.h"
+#include "ws2812.h"
+#include "ws2812_parallel.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/************************
+ * PRIVATE MACROS
+ ************************/
+#define PORT_MAX_PORTS			2
+
+// Timer runs at 84 MHz (TIM1 on APB2 of STM32F401) - bit takes 1.25us
+#define PORT_TIM_PERIOD			105
+#define PORT_T0H_TICKS			32			// 0.38us, as 100 symbol on SPI
+#define PORT_T1H_TICKS			64			// 0.76us, as 110 symbol on SPI
+
+#define PORT_BITS_PER_LED		24
+#define PORT_US_PER_LED			30
+
+// Lanes are kept low for the last bit periods, as long as SPI reset signal
+#define PORT_RESET_SLOTS		300
+#define PORT_RESET_US			((PORT_RESET_SLOTS * 5) / 4)
+
+#define PORT_SLOT(PORT, BUF, IDX)	((PORT)->_bit_buffer[BUF] + (IDX) * PORT_BITS_PER_LED * (PORT)->width)
+
+
+/************************
+ * PRIVATE GLOBALS
+ ************************/
+static struct LEDParallelPort* ports[PORT_MAX_PORTS];
+
+
+/************************
+ * PRIVATE FUNCTIONS
+ ************************/
+/*
+ * Lane's pin is pulled low at T0H of every bit it sends as 0, so bit of
+ *  LED is set in the buffer when LED's bit is cleared
+ */
+static void encode_lane_led(struct LEDParallelPort* port, uint8_t* slots, struct LEDStrip* strip, uint32_t idx) {
+	struct Color color = get_led_output_color(strip, idx);
+	uint32_t grb = ((uint32_t) color.g << 16) | ((uint32_t) color.r << 8) | color.b;
+	uint16_t lane_bit = 1 << strip->lane;
+
+	// WS2812B expects GRB order, MSB first
+	if(port->width == 1) {
+		for(int bit = 0; bit < PORT_BITS_PER_LED; bit++, grb <<= 1) {
+			if(grb & (1 << 23))
+				slots[bit] &= ~lane_bit;
+			else
+				slots[bit] |= lane_bit;
+		}
+	} else {
+		uint16_t* slots16 = (uint16_t*) slots;
+		for(int bit = 0; bit < PORT_BITS_PER_LED; bit++, grb <<= 1) {
+			if(grb & (1 << 23))
+				slots16[bit] &= ~lane_bit;
+			else
+				slots16[bit] |= lane_bit;
+		}
+	}
+}
+
+static int init_port_dma(struct LEDParallelPort* port, DMA_HandleTypeDef* hdma, uint32_t minc) {
+	if(hdma == NULL)
+		return -1;
+
+	hdma->Init.Direction = DMA_MEMORY_TO_PERIPH;
+	hdma->Init.PeriphInc = DMA_PINC_DISABLE;
+	hdma->Init.MemInc = minc;
+	hdma->Init.PeriphDataAlignment = port->width == 1 ? DMA_PDATAALIGN_BYTE : DMA_PDATAALIGN_HALFWORD;
+	hdma->Init.MemDataAlignment = port->width == 1 ? DMA_MDATAALIGN_BYTE : DMA_MDATAALIGN_HALFWORD;
+	hdma->Init.Mode = DMA_NORMAL;
+	hdma->Init.Priority = DMA_PRIORITY_VERY_HIGH;
+	hdma->Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+	return HAL_DMA_Init(hdma) == HAL_OK ? 0 : -1;
+}
+
+/*
+ * Send back buffer and make it the front one - called with interrupts
+ *  disabled or from DMA interrupt. Lanes are set high by update stream,
+ *  so it stops after the last bit, while clear stream keeps lanes low for
+ *  reset and reports the end of frame.
+ */
+static void start_port_transfer(struct LEDParallelPort* port) {
+	TIM_HandleTypeDef* htim = port->htim;
+	uintptr_t set_reg = (uintptr_t) &port->gpio->BSRR;
+	uintptr_t reset_reg = set_reg + 2;
+	uint32_t bits = port->len * PORT_BITS_PER_LED;
+	uint8_t back = !port->front;
+
+	port->frames_started++;
+	if(HAL_DMA_Start(htim->hdma[TIM_DMA_ID_UPDATE], (uintptr_t) &port->mask, set_reg, bits) != HAL_OK)
+		goto err;
+	if(HAL_DMA_Start(htim->hdma[TIM_DMA_ID_CC1], (uintptr_t) port->_bit_buffer[back], reset_reg, bits) != HAL_OK)
+		goto err_update;
+	if(HAL_DMA_Start_IT(htim->hdma[TIM_DMA_ID_CC2], (uintptr_t) &port->mask, reset_reg,
+			bits + PORT_RESET_SLOTS) != HAL_OK)
+		goto err_data;
+
+	// The first event is update, the next timer tick
+	__HAL_TIM_SET_COUNTER(htim, PORT_TIM_PERIOD - 1);
+	HAL_TIM_Base_Start(htim);
+	port->front = back;
+	return;
+
+err_data:
+	HAL_DMA_Abort(htim->hdma[TIM_DMA_ID_CC1]);
+err_update:
+	HAL_DMA_Abort(htim->hdma[TIM_DMA_ID_UPDATE]);
+err:
+	printk(LOG_ERR "WS2812B: failed to start DMA of parallel port\n");
+	port->frames_started--;
+}
+
+static void port_transfer_complete(DMA_HandleTypeDef* hdma) {
+	struct LEDParallelPort* port = NULL;
+
+	for(int i = 0; i < PORT_MAX_PORTS; i++) {
+		if(ports[i] && ports[i]->htim == hdma->Parent)
+			port = ports[i];
+	}
+	if(port == NULL)
+		return;
+
+	// Streams of update and CC1 have finished with the last bit
+	HAL_TIM_Base_Stop(port->htim);
+	HAL_DMA_Abort(port->htim->hdma[TIM_DMA_ID_UPDATE]);
+	HAL_DMA_Abort(port->htim->hdma[TIM_DMA_ID_CC1]);
+
+	port->frames_sent++;
+	if(port->pending) {
+		port->pending = 0;
+		start_port_transfer(port);
+	}
+}
+
+
+/************************
+ * EXPORTED FUNCTIONS
+ ************************/
+/*
+ * Up to 8 lanes use pins 0-7 of port and byte transfers, up to 16 lanes use
+ *  all pins and half-word transfers. Both need 3 bytes of RAM per LED of
+ *  every lane for each of two buffers.
+ */
+int init_led_port(struct LEDParallelPort** portp, GPIO_TypeDef* gpio, uint8_t lanes,
+		uint32_t len, TIM_HandleTypeDef* htim) {
+	GPIO_InitTypeDef gpio_init = {0};
+	struct LEDParallelPort* port;
+	int slot;
+
+	if(lanes == 0 || lanes > LED_PORT_MAX_LANES)
+		return -1;
+	for(slot = 0; slot < PORT_MAX_PORTS && ports[slot]; slot++);
+	if(slot == PORT_MAX_PORTS)
+		return -1;
+
+	*portp = port = calloc(1, sizeof(struct LEDParallelPort));
+	if(port == NULL)
+		return -1;
+
+	port->gpio = gpio;
+	port->htim = htim;
+	port->lanes = lanes;
+	port->width = lanes <= 8 ? 1 : 2;
+	port->mask = (1 << lanes) - 1;
+	port->len = len;
+
+	// Every lane sends zeros until strip is attached to it
+	for(int buf = 0; buf < 2; buf++) {
+		port->_bit_buffer[buf] = malloc(len * PORT_BITS_PER_LED * port->width);
+		if(port->_bit_buffer[buf] == NULL)
+			return -1;
+
+		for(uint32_t i = 0; i < len * PORT_BITS_PER_LED; i++) {
+			if(port->width == 1)
+				port->_bit_buffer[buf][i] = port->mask;
+			else
+				((uint16_t*) port->_bit_buffer[buf])[i] = port->mask;
+		}
+	}
+
+	gpio_init.Pin = port->mask;
+	gpio_init.Mode = GPIO_MODE_OUTPUT_PP;
+	gpio_init.Pull = GPIO_NOPULL;
+	gpio_init.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+	HAL_GPIO_Init(gpio, &gpio_init);
+	gpio->BSRR = (uint32_t) port->mask << 16;
+
+	if(init_port_dma(port, htim->hdma[TIM_DMA_ID_UPDATE], DMA_MINC_DISABLE) ||
+			init_port_dma(port, htim->hdma[TIM_DMA_ID_CC1], DMA_MINC_ENABLE) ||
+			init_port_dma(port, htim->hdma[TIM_DMA_ID_CC2], DMA_MINC_DISABLE))
+		return -1;
+	htim->hdma[TIM_DMA_ID_CC2]->XferCpltCallback = port_transfer_complete;
+
+	// Compare channels are frozen - they only request DMA
+	htim->Init.Prescaler = 0;
+	htim->Init.CounterMode = TIM_COUNTERMODE_UP;
+	htim->Init.Period = PORT_TIM_PERIOD - 1;
+	htim->Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+	htim->Init.RepetitionCounter = 0;
+	if(HAL_TIM_Base_Init(htim) != HAL_OK)
+		return -1;
+	__HAL_TIM_SET_COMPARE(htim, TIM_CHANNEL_1, PORT_T0H_TICKS);
+	__HAL_TIM_SET_COMPARE(htim, TIM_CHANNEL_2, PORT_T1H_TICKS);
+	__HAL_TIM_ENABLE_DMA(htim, TIM_DMA_UPDATE | TIM_DMA_CC1 | TIM_DMA_CC2);
+
+	ports[slot] = port;
+	return 0;
+}
+
+/* Strip can be shorter than the port, its lane sends zeros past its end */
+int init_led_strip_parallel(struct LEDStrip** stripp, struct LEDParallelPort* port,
+		uint8_t lane, uint32_t len) {
+	struct LEDStrip* strip;
+
+	if(lane >= port->lanes || port->strips[lane] || len > port->len)
+		return -1;
+
+	*stripp = strip = alloc_led_strip(NULL, len);
+	if(strip == NULL)
+		return -1;
+
+	strip->port = port;
+	strip->lane = lane;
+	strip->dirty_start[0] = strip->dirty_start[1] = 0;
+	strip->dirty_end[0] = strip->dirty_end[1] = len;
+	port->strips[lane] = strip;
+	return 0;
+}
+
+uint32_t get_led_port_refresh_time_us(struct LEDParallelPort* port) {
+	return port->len * PORT_US_PER_LED + PORT_RESET_US;
+}
+
+/*
+ * All lanes are sent at once - refreshing any strip of port sends changes
+ *  of every lane, and the other strips have nothing to send afterwards.
+ *  Otherwise it works as refresh of SPI strip: frame is encoded into back
+ *  buffer and queued if the previous one is still sent.
+ */
+void refresh_led_port(struct LEDParallelPort* port) {
+	uint8_t back, queued, changed = 0;
+	struct LEDStrip* strip;
+
+	__disable_irq();
+	queued = port->pending;
+	port->pending = 0;
+	__enable_irq();
+
+	for(int lane = 0; lane < port->lanes; lane++) {
+		if(port->strips[lane] && port->strips[lane]->changed)
+			changed = 1;
+	}
+	if(!queued && !changed)
+		return;
+
+	back = !port->front;
+	for(int lane = 0; lane < port->lanes; lane++) {
+		strip = port->strips[lane];
+		if(strip == NULL)
+			continue;
+
+		strip->changed = 0;
+		for(uint32_t i = strip->dirty_start[back]; i < strip->dirty_end[back]; i++)
+			encode_lane_led(port, PORT_SLOT(port, back, i), strip, i);
+		strip->dirty_start[back] = strip->dirty_end[back] = 0;
+	}
+
+	__disable_irq();
+	if(port->frames_sent == port->frames_started)
+		start_port_transfer(port);
+	else
+		port->pending = 1;
+	__enable_irq();
+}
+
+int is_led_port_refresh_done(struct LEDParallelPort* port) {
+	return port->frames_sent == port->frames_started && !port->pending;
+}
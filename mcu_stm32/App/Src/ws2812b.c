@@ -1,12 +1,13 @@
 // SPDX-License-Identifier: GPL-2.0-only
 /*
- * ws2812b.c - STM32 library for controlling LED strips based on
- * 			   WS2812B IC using SPI interface
+ * ws2812b.c - STM32 library for controlling LED strips using SPI
+ * 			   interface, with drivers of WS2812B and SK6812 RGBW ICs
  *  (C) 2022 Pawel Wieczorek
  */
 
 #include "main.h"
 #include "ws2812.h"
+#include "ws2812_parallel.h"
 
 #include <stdint.h>
 #include <stdio.h>
@@ -22,8 +23,26 @@
 #define SPI_BYTES_PER_DIODE		9
 #define SPI_MAX_DELAY			-1
 #define SPI_RES_SIGNAL_LEN		125
+#define SPI_CLOCK_HZ			2625000		// WS2812B bit is 3 SPI bits, 1.14us
 
-#define SPI_BUF_LEN(LEDS)		((LEDS * SPI_BYTES_PER_DIODE) + SPI_RES_SIGNAL_LEN)
+/*
+ * Streaming mode sends frame in chunks of LEDs through a circular buffer of
+ *  two halves - one is sent while the other is encoded. Reset signal
+ *  follows the last LED as chunks of zeros.
+ */
+#define STREAM_CHUNK_LEDS		16
+#define STREAM_CHUNK_LEN		(STREAM_CHUNK_LEDS * SPI_BYTES_PER_DIODE)
+#define STREAM_RESET_CHUNKS		((SPI_RES_SIGNAL_LEN + STREAM_CHUNK_LEN - 1) / STREAM_CHUNK_LEN)
+#define STREAM_CHUNKS(LEDS)		(((LEDS) + STREAM_CHUNK_LEDS - 1) / STREAM_CHUNK_LEDS + STREAM_RESET_CHUNKS)
+
+// WS2812B needs 24 bits * 1.25us per diode and at least 50us of reset
+#define WS2812B_US_PER_DIODE	30
+#define WS2812B_RESET_US		50
+
+// SK6812 RGBW has the same timing, with 32 bits per diode and 80us of reset
+#define SK6812_BYTES_PER_DIODE	12
+#define SK6812_US_PER_DIODE		40
+#define SK6812_RESET_US			80
 
 
 /************************
@@ -32,6 +51,16 @@
 struct LEDStrip* led_strip_upper;
 struct LEDStrip* led_strip_bottom;
 
+/************************
+ * PRIVATE GLOBALS
+ ************************/
+/*
+ * SPI bitstream of every byte value, built once - encoding LED is then
+ *  three table lookups instead of 24 iterations over bits
+ */
+static uint8_t encode_table[256][3];
+static uint8_t encode_table_ready;
+
 /************************
  * PRIVATE FUNCTIONS
  ************************/
@@ -58,27 +87,375 @@ static void clear_buffer(uint8_t* buffer, uint32_t len) {
 		memcpy(&buffer[i], &pattern, 3);
 }
 
+static void init_encode_table(void) {
+	uint32_t data;
+
+	for(int byte = 0; byte < 256; byte++) {
+		data = encode_byte(byte);
+		memcpy(encode_table[byte], &data, 3);
+	}
+	encode_table_ready = 1;
+}
+
+static void mark_dirty(struct LEDStrip* strip, uint32_t start, uint32_t end) {
+	strip->changed = 1;
+	for(int buf = 0; buf < 2; buf++) {
+		if(strip->dirty_start[buf] >= strip->dirty_end[buf]) {
+			strip->dirty_start[buf] = start;
+			strip->dirty_end[buf] = end;
+			continue;
+		}
+
+		if(start < strip->dirty_start[buf])
+			strip->dirty_start[buf] = start;
+		if(end > strip->dirty_end[buf])
+			strip->dirty_end[buf] = end;
+	}
+}
+
+static void build_channel_lut(uint8_t* lut, const struct Ratio* ratio, uint8_t gamma, uint32_t brightness) {
+	for(uint32_t value = 0; value < 256; value++) {
+		uint32_t out = gamma ? color_gamma_lut[value] : value;
+
+		out = out * brightness / 255;
+		if(ratio && ratio->denum) {
+			out = out * ratio->num / ratio->denum;
+			if(out > 0xff)
+				out = 0xff;
+		}
+		lut[value] = out;
+	}
+}
+
+/*
+ * Gamma first, then brightness and calibration in the order encode_led has
+ *  always used, each rounded down - so dim LEDs round the same way as before
+ */
+static void build_luts(struct LEDStrip* strip) {
+	uint32_t brightness = strip->brightness;
+
+	if(strip->driver->lut_brightness)
+		brightness = strip->driver->lut_brightness(strip->brightness);
+
+	for(int seg = 0; seg < strip->lut_segments; seg++) {
+		struct LEDChannelLUT* lut = &strip->lut[seg];
+		uint8_t apply = strip->apply_ratio;
+
+		build_channel_lut(lut->r, apply ? (seg ? &strip->rt2_r : &strip->rt1_r) : NULL, strip->gamma, brightness);
+		build_channel_lut(lut->g, apply ? (seg ? &strip->rt2_g : &strip->rt1_g) : NULL, strip->gamma, brightness);
+		build_channel_lut(lut->b, apply ? (seg ? &strip->rt2_b : &strip->rt1_b) : NULL, strip->gamma, brightness);
+	}
+}
+
+/*
+ * Brightness and color calibration are applied by drivers while encoding,
+ *  so changing them affects LEDs on the next refresh
+ */
+struct Color get_led_output_color(struct LEDStrip* strip, uint32_t idx) {
+	struct Color color = strip->pixels[idx];
+	const struct LEDChannelLUT* lut = strip->lut;
+
+	if(strip->lut_segments > 1 && idx >= strip->ratio_index)
+		lut++;
+	return (struct Color) { lut->r[color.r], lut->g[color.g], lut->b[color.b] };
+}
+
 /************************
- * EXPORTED FUNCTIONS
+ * WS2812B DRIVER
  ************************/
-int init_led_strip(struct LEDStrip** stripp, SPI_HandleTypeDef* hspi, uint32_t len) {
-	struct LEDStrip* strip;
+static uint32_t ws2812b_frame_len(uint32_t len) {
+	return len * SPI_BYTES_PER_DIODE + SPI_RES_SIGNAL_LEN;
+}
 
-	*stripp = malloc(sizeof(struct LEDStrip));
-	if(*stripp == NULL)
+static uint32_t ws2812b_refresh_time_us(uint32_t len) {
+	return len * WS2812B_US_PER_DIODE + WS2812B_RESET_US;
+}
+
+static void ws2812b_init_frame(uint8_t* buffer, uint32_t len) {
+	clear_buffer(buffer, len * SPI_BYTES_PER_DIODE);
+	memset(buffer + len * SPI_BYTES_PER_DIODE, 0, SPI_RES_SIGNAL_LEN);
+}
+
+static inline void ws2812b_encode_led(struct LEDStrip* strip, uint8_t* out, uint32_t idx) {
+	struct Color color = get_led_output_color(strip, idx);
+
+	// WS2812B expects GRB order
+	memcpy(out, encode_table[color.g], 3);
+	memcpy(out + 3, encode_table[color.r], 3);
+	memcpy(out + 6, encode_table[color.b], 3);
+}
+
+static void ws2812b_encode_leds(struct LEDStrip* strip, uint8_t* out, uint32_t first, uint32_t count) {
+	for(uint32_t i = 0; i < count; i++)
+		ws2812b_encode_led(strip, out + i * SPI_BYTES_PER_DIODE, first + i);
+}
+
+const struct LEDDriver ws2812b_driver = {
+		.name = "WS2812B",
+		.type = LED_CHIP_WS2812B,
+		.spi_clock_hz = SPI_CLOCK_HZ,
+		.spi_first_bit = SPI_FIRSTBIT_LSB,
+		.header_len = 0,
+		.led_len = SPI_BYTES_PER_DIODE,
+		.frame_len = ws2812b_frame_len,
+		.refresh_time_us = ws2812b_refresh_time_us,
+		.init_frame = ws2812b_init_frame,
+		.encode_leds = ws2812b_encode_leds,
+};
+
+/************************
+ * SK6812 RGBW DRIVER
+ ************************/
+static uint32_t sk6812_frame_len(uint32_t len) {
+	return len * SK6812_BYTES_PER_DIODE + SPI_RES_SIGNAL_LEN;
+}
+
+static uint32_t sk6812_refresh_time_us(uint32_t len) {
+	return len * SK6812_US_PER_DIODE + SK6812_RESET_US;
+}
+
+static void sk6812_init_frame(uint8_t* buffer, uint32_t len) {
+	clear_buffer(buffer, len * SK6812_BYTES_PER_DIODE);
+	memset(buffer + len * SK6812_BYTES_PER_DIODE, 0, SPI_RES_SIGNAL_LEN);
+}
+
+/*
+ * Common part of red, green and blue is shown by white LED, which gives
+ *  cleaner white and draws less current than three colors
+ */
+static inline void sk6812_encode_led(struct LEDStrip* strip, uint8_t* out, uint32_t idx) {
+	struct Color color = get_led_output_color(strip, idx);
+	uint8_t white = color.r;
+
+	if(color.g < white)
+		white = color.g;
+	if(color.b < white)
+		white = color.b;
+
+	// SK6812 RGBW expects GRBW order
+	memcpy(out, encode_table[color.g - white], 3);
+	memcpy(out + 3, encode_table[color.r - white], 3);
+	memcpy(out + 6, encode_table[color.b - white], 3);
+	memcpy(out + 9, encode_table[white], 3);
+}
+
+static void sk6812_encode_leds(struct LEDStrip* strip, uint8_t* out, uint32_t first, uint32_t count) {
+	for(uint32_t i = 0; i < count; i++)
+		sk6812_encode_led(strip, out + i * SK6812_BYTES_PER_DIODE, first + i);
+}
+
+const struct LEDDriver sk6812_rgbw_driver = {
+		.name = "SK6812 RGBW",
+		.type = LED_CHIP_SK6812_RGBW,
+		.spi_clock_hz = SPI_CLOCK_HZ,
+		.spi_first_bit = SPI_FIRSTBIT_LSB,
+		.header_len = 0,
+		.led_len = SK6812_BYTES_PER_DIODE,
+		.frame_len = sk6812_frame_len,
+		.refresh_time_us = sk6812_refresh_time_us,
+		.init_frame = sk6812_init_frame,
+		.encode_leds = sk6812_encode_leds,
+};
+
+/************************
+ * STRIPS
+ ************************/
+/*
+ * MX_SPIx_Init configures bus for WS2812B, so clock of SPI peripheral is
+ *  found from its prescaler. Prescalers are powers of two from 2 to 256.
+ */
+static uint32_t get_spi_pclk_hz(SPI_HandleTypeDef* hspi) {
+	return SPI_CLOCK_HZ * (2 << (hspi->Init.BaudRatePrescaler / SPI_BAUDRATEPRESCALER_4));
+}
+
+/* SPI clock (the fastest one not above driver's) and bit order of driver */
+static int configure_spi(struct LEDStrip* strip) {
+	SPI_HandleTypeDef* hspi = strip->spi;
+	uint32_t prescaler = SPI_BAUDRATEPRESCALER_2;
+	uint32_t clock_hz = strip->spi_pclk_hz / 2;
+
+	while(clock_hz > strip->driver->spi_clock_hz && prescaler < SPI_BAUDRATEPRESCALER_256) {
+		clock_hz /= 2;
+		prescaler += SPI_BAUDRATEPRESCALER_4;
+	}
+
+	if(hspi->Init.BaudRatePrescaler == prescaler && hspi->Init.FirstBit == strip->driver->spi_first_bit)
+		return 0;
+
+	hspi->Init.BaudRatePrescaler = prescaler;
+	hspi->Init.FirstBit = strip->driver->spi_first_bit;
+	return HAL_SPI_Init(hspi) == HAL_OK ? 0 : -1;
+}
+
+/* Both bitstreams for `len` LEDs of driver, as dark LEDs */
+static int alloc_frame_buffers(uint8_t** buffers, const struct LEDDriver* driver, uint32_t len) {
+	buffers[0] = malloc(driver->frame_len(len));
+	buffers[1] = malloc(driver->frame_len(len));
+	if(buffers[0] == NULL || buffers[1] == NULL) {
+		free(buffers[0]);
+		free(buffers[1]);
+		buffers[0] = buffers[1] = NULL;
 		return -1;
-	strip = *stripp;
+	}
+
+	for(int buf = 0; buf < 2; buf++)
+		driver->init_frame(buffers[buf], len);
+	return 0;
+}
+
+/* Bitstreams replace the current ones, all LEDs are encoded by the next refresh - DMA must be idle */
+static void set_frame_buffers(struct LEDStrip* strip, uint8_t** buffers) {
+	for(int buf = 0; buf < 2; buf++) {
+		free(strip->_data_buffer[buf]);
+		strip->_data_buffer[buf] = buffers[buf];
+		buffers[buf] = NULL;
+		strip->dirty_start[buf] = 0;
+		strip->dirty_end[buf] = strip->len;
+	}
+	strip->changed = 1;
+}
+
+struct LEDStrip* alloc_led_strip(SPI_HandleTypeDef* hspi, uint32_t len) {
+	struct LEDStrip* strip;
+
+	strip = calloc(1, sizeof(struct LEDStrip));
+	if(strip == NULL)
+		return NULL;
 
 	strip->spi = hspi;
+	strip->driver = &ws2812b_driver;
 	strip->len = len;
+	strip->capacity = len;
 	strip->brightness = 255;
 	strip->apply_ratio = 0;
-	strip->_data_buffer = malloc(SPI_BUF_LEN(len));
-	if(strip->_data_buffer == NULL)
+	strip->frames_started = 0;
+	strip->frames_sent = 0;
+	strip->front = 0;
+	strip->pending = 0;
+	strip->changed = 1;
+	strip->pixels = calloc(len, sizeof(struct Color));
+	strip->lut = malloc(sizeof(struct LEDChannelLUT));
+	if(strip->pixels == NULL || strip->lut == NULL) {
+		free(strip->pixels);
+		free(strip->lut);
+		free(strip);
+		return NULL;
+	}
+	strip->lut_segments = 1;
+	build_luts(strip);
+	if(!encode_table_ready)
+		init_encode_table();
+
+	return strip;
+}
+
+/************************
+ * EXPORTED FUNCTIONS
+ ************************/
+int init_led_strip(struct LEDStrip** stripp, SPI_HandleTypeDef* hspi, uint32_t len) {
+	return init_led_strip_chip(stripp, hspi, &ws2812b_driver, len, len);
+}
+
+/*
+ * Strip can be reconfigured later to any length up to its capacity - the
+ *  framebuffer is allocated for capacity, bitstreams for current length
+ */
+int init_led_strip_chip(struct LEDStrip** stripp, SPI_HandleTypeDef* hspi,
+		const struct LEDDriver* driver, uint32_t len, uint32_t capacity) {
+	struct LEDStrip* strip;
+	uint8_t* buffers[2];
+
+	if(len > capacity)
+		return -1;
+
+	*stripp = strip = alloc_led_strip(hspi, capacity);
+	if(strip == NULL)
+		return -1;
+	strip->spi_pclk_hz = get_spi_pclk_hz(hspi);
+
+	// First refresh turns all LEDs off
+	if(alloc_frame_buffers(buffers, driver, len))
+		return -1;
+	strip->driver = driver;
+	strip->len = len;
+	build_luts(strip);
+	set_frame_buffers(strip, buffers);
+	return configure_spi(strip);
+}
+
+/*
+ * Change type and number of LEDs of strip at runtime. Strip takes the new
+ *  layout right away, while its bitstreams are switched by
+ *  finish_led_strip_chip once the frame being sent is finished. LEDs keep
+ *  their colors and are sent on the next refresh after that. Streaming and
+ *  parallel strips are WS2812B only.
+ */
+int set_led_strip_chip(struct LEDStrip* strip, const struct LEDDriver* driver, uint32_t len) {
+	uint8_t* buffers[2];
+
+	if(strip->streaming || strip->port || len > strip->capacity)
 		return -1;
-	clear_buffer(strip->_data_buffer, len * SPI_BYTES_PER_DIODE);
-	memset(strip->_data_buffer + len * SPI_BYTES_PER_DIODE, 0, SPI_RES_SIGNAL_LEN);
+	if(driver == strip->driver && len == strip->len)
+		return 0;
+	if(alloc_frame_buffers(buffers, driver, len))
+		return -1;
+
+	// Queued frame is dropped, it'd be sent with the old layout
+	__disable_irq();
+	strip->pending = 0;
+	__enable_irq();
 
+	// Replaces bitstreams of switch which hasn't been finished yet
+	for(int buf = 0; buf < 2; buf++) {
+		free(strip->_next_buffer[buf]);
+		strip->_next_buffer[buf] = buffers[buf];
+	}
+	strip->driver = driver;
+	strip->len = len;
+	build_luts(strip);
+	return 0;
+}
+
+/*
+ * Called from main loop - nothing is refreshed while bitstreams of the old
+ *  chip may still be read by DMA
+ *
+ * @return 1 if strip has just been switched and has to be refreshed, 0 otherwise
+ */
+int finish_led_strip_chip(struct LEDStrip* strip) {
+	if(strip->_next_buffer[0] == NULL || !is_refresh_done(strip))
+		return 0;
+
+	set_frame_buffers(strip, strip->_next_buffer);
+	if(configure_spi(strip))
+		printk(LOG_ERR "WS2812B: failed to configure SPI for %s", strip->driver->name);
+	return 1;
+}
+
+const struct LEDDriver* get_led_strip_chip(struct LEDStrip* strip) {
+	return strip->driver;
+}
+
+/*
+ * Strip in streaming mode needs 3 bytes of RAM per LED instead of 18 (two
+ *  bitstreams) and its DMA buffer doesn't grow with number of LEDs. DMA
+ *  stream of SPI is switched to circular mode for good.
+ */
+int init_led_strip_streaming(struct LEDStrip** stripp, SPI_HandleTypeDef* hspi, uint32_t len) {
+	struct LEDStrip* strip;
+
+	*stripp = strip = alloc_led_strip(hspi, len);
+	if(strip == NULL)
+		return -1;
+
+	strip->streaming = 1;
+	strip->_stream_buffer = malloc(2 * STREAM_CHUNK_LEN);
+	if(strip->_stream_buffer == NULL)
+		return -1;
+
+	hspi->hdmatx->Init.Mode = DMA_CIRCULAR;
+	if(HAL_DMA_Init(hspi->hdmatx) != HAL_OK)
+		return -1;
 	return 0;
 }
 
@@ -86,9 +463,18 @@ int get_leds_count(struct LEDStrip* strip) {
 	return strip->len;
 }
 
+int get_leds_capacity(struct LEDStrip* strip) {
+	return strip->capacity;
+}
+
+uint32_t get_refresh_time_us(struct LEDStrip* strip) {
+	if(strip->port)
+		return get_led_port_refresh_time_us(strip->port);
+	return strip->driver->refresh_time_us(strip->len);
+}
+
 void set_led_color(struct LEDStrip* strip, int idx, struct Color color) {
-	uint32_t data;
-	uint32_t offset = idx * SPI_BYTES_PER_DIODE;
+	struct Color* pixel;
 
 	if(idx >= strip->len) {
 		printk(LOG_ERR "WS2812B: set_led_color invoked with invalid idx (%d) "
@@ -96,53 +482,256 @@ void set_led_color(struct LEDStrip* strip, int idx, struct Color color) {
 		return;
 	}
 
-	// Apply brightness to selected color
-	color.r = ((uint16_t) color.r * strip->brightness) / 255;
-	color.g = ((uint16_t) color.g * strip->brightness) / 255;
-	color.b = ((uint16_t) color.b * strip->brightness) / 255;
-
-	// Apply color calibration data
-	if(strip->apply_ratio) {
-		if(idx < strip->ratio_index) {
-			color.r = ((uint32_t) color.r * strip->rt1_r.num) / strip->rt1_r.denum;
-			color.g = ((uint32_t) color.g * strip->rt1_g.num) / strip->rt1_g.denum;
-			color.b = ((uint32_t) color.b * strip->rt1_b.num) / strip->rt1_b.denum;
-		} else {
-			color.r = ((uint32_t) color.r * strip->rt2_r.num) / strip->rt2_r.denum;
-			color.g = ((uint32_t) color.g * strip->rt2_g.num) / strip->rt2_g.denum;
-			color.b = ((uint32_t) color.b * strip->rt2_b.num) / strip->rt2_b.denum;
-		}
+	// LED set to the same color doesn't have to be encoded again
+	pixel = &strip->pixels[idx];
+	if(pixel->r == color.r && pixel->g == color.g && pixel->b == color.b)
+		return;
+
+	*pixel = color;
+	mark_dirty(strip, idx, idx + 1);
+}
+
+/* Only the span of LEDs which changed is encoded again, as with set_led_color */
+void set_leds_colors(struct LEDStrip* strip, uint32_t start, const struct Color* colors, uint32_t count) {
+	uint32_t first = count, last = 0;
+
+	if(start >= strip->len)
+		return;
+	if(count > strip->len - start)
+		count = strip->len - start;
+
+	for(uint32_t i = 0; i < count; i++) {
+		struct Color* pixel = &strip->pixels[start + i];
+
+		if(pixel->r == colors[i].r && pixel->g == colors[i].g && pixel->b == colors[i].b)
+			continue;
+		if(first == count)
+			first = i;
+		last = i;
+		*pixel = colors[i];
 	}
 
-	data = encode_byte(color.g);
-	memcpy(&strip->_data_buffer[offset], &data, 3);
-	data = encode_byte(color.r);
-	memcpy(&strip->_data_buffer[offset + 3], &data, 3);
-	data = encode_byte(color.b);
-	memcpy(&strip->_data_buffer[offset + 6], &data, 3);
+	if(first < count)
+		mark_dirty(strip, start + first, start + last + 1);
 }
 
-void refresh_leds(struct LEDStrip* strip) {
+struct Color get_led_color(struct LEDStrip* strip, int idx) {
+	if(idx >= strip->len)
+		return (struct Color) {0, 0, 0};
+	return strip->pixels[idx];
+}
+
+/*
+ * Send back buffer and make it the front one - called with interrupts
+ *  disabled or from SPI interrupt
+ */
+static void start_transfer(struct LEDStrip* strip) {
+	uint8_t back = !strip->front;
 	int ret;
 
-	// Await for DMA to be ready
-	while(HAL_SPI_GetState(strip->spi) != HAL_SPI_STATE_READY) {}
+	strip->frames_started++;
+	ret = HAL_SPI_Transmit_DMA(strip->spi, strip->_data_buffer[back], strip->driver->frame_len(strip->len));
+	if(ret != HAL_OK) {
+		printk(LOG_ERR "WS2812B: HAL_SPI transmit returned with an error - %d\n", ret);
+		strip->frames_started--;
+		return;
+	}
+	strip->front = back;
+}
+
+/*
+ * Encode chunk of frame into half of circular buffer - the last chunk of
+ *  LEDs is padded with zeros, which start the reset signal
+ */
+static void encode_chunk(struct LEDStrip* strip, uint32_t chunk, uint8_t* out) {
+	uint32_t first = chunk * STREAM_CHUNK_LEDS;
+	uint32_t count = 0;
+
+	if(first < strip->len)
+		count = strip->len - first < STREAM_CHUNK_LEDS ? strip->len - first : STREAM_CHUNK_LEDS;
 
-	ret = HAL_SPI_Transmit_DMA(strip->spi, strip->_data_buffer, SPI_BUF_LEN(strip->len));
+	ws2812b_encode_leds(strip, out, first, count);
+	memset(out + count * SPI_BYTES_PER_DIODE, 0, STREAM_CHUNK_LEN - count * SPI_BYTES_PER_DIODE);
+}
+
+/* Called with interrupts disabled or from SPI interrupt */
+static void start_stream(struct LEDStrip* strip) {
+	int ret;
+
+	encode_chunk(strip, 0, strip->_stream_buffer);
+	encode_chunk(strip, 1, strip->_stream_buffer + STREAM_CHUNK_LEN);
+	strip->stream_next = 2;
+	strip->stream_sent = 0;
+
+	strip->frames_started++;
+	ret = HAL_SPI_Transmit_DMA(strip->spi, strip->_stream_buffer, 2 * STREAM_CHUNK_LEN);
 	if(ret != HAL_OK) {
 		printk(LOG_ERR "WS2812B: HAL_SPI transmit returned with an error - %d\n", ret);
+		strip->frames_started--;
 	}
 }
 
+/*
+ * Half of circular buffer has just been sent - refill it with the next
+ *  chunk or stop DMA after the last one. Colors are read when chunk is
+ *  encoded, so frame changed during transfer may show partially.
+ */
+static void stream_chunk_sent(struct LEDStrip* strip, uint8_t half) {
+	if(++strip->stream_sent >= STREAM_CHUNKS(strip->len)) {
+		// Other half holds zeros already - stopping in its middle is fine
+		HAL_SPI_DMAStop(strip->spi);
+		strip->frames_sent++;
+		if(strip->pending) {
+			strip->pending = 0;
+			start_stream(strip);
+		}
+		return;
+	}
+
+	encode_chunk(strip, strip->stream_next++, strip->_stream_buffer + half * STREAM_CHUNK_LEN);
+}
+
+static void refresh_leds_streaming(struct LEDStrip* strip) {
+	if(!strip->changed)
+		return;
+	strip->changed = 0;
+
+	// Frame in progress is finished first, the new one follows it
+	__disable_irq();
+	if(HAL_SPI_GetState(strip->spi) == HAL_SPI_STATE_READY)
+		start_stream(strip);
+	else
+		strip->pending = 1;
+	__enable_irq();
+}
+
+/*
+ * Frame is encoded into back buffer while the previous one may still be
+ *  sent. If it is, back buffer is queued and sent from completion
+ *  interrupt, so the caller never waits for SPI. Frame queued but not
+ *  sent yet is replaced by the newer one. LEDs keep their colors without
+ *  being refreshed, so frame without any change isn't sent at all.
+ */
+void refresh_leds(struct LEDStrip* strip) {
+	uint8_t back, queued;
+	uint32_t first;
+
+	if(strip->streaming) {
+		refresh_leds_streaming(strip);
+		return;
+	}
+	if(strip->port) {
+		refresh_led_port(strip->port);
+		return;
+	}
+
+	// Frame is encoded for the new chip after finish_led_strip_chip
+	if(strip->_next_buffer[0])
+		return;
+
+	// Take queued buffer back from interrupt, it gets the newer frame
+	__disable_irq();
+	queued = strip->pending;
+	strip->pending = 0;
+	__enable_irq();
+
+	back = !strip->front;
+	if(!queued && !strip->changed)
+		return;
+	strip->changed = 0;
+
+	first = strip->dirty_start[back];
+	if(strip->dirty_end[back] > first)
+		strip->driver->encode_leds(strip, strip->_data_buffer[back] + strip->driver->header_len +
+				first * strip->driver->led_len, first, strip->dirty_end[back] - first);
+	strip->dirty_start[back] = strip->dirty_end[back] = 0;
+
+	__disable_irq();
+	if(HAL_SPI_GetState(strip->spi) == HAL_SPI_STATE_READY)
+		start_transfer(strip);
+	else
+		strip->pending = 1;
+	__enable_irq();
+}
+
+int is_refresh_done(struct LEDStrip* strip) {
+	if(strip->port)
+		return is_led_port_refresh_done(strip->port);
+	return strip->frames_sent == strip->frames_started && !strip->pending;
+}
+
+static void transfer_complete(struct LEDStrip* strip) {
+	if(strip->streaming) {
+		stream_chunk_sent(strip, 1);
+		return;
+	}
+
+	strip->frames_sent++;
+	if(strip->pending) {
+		strip->pending = 0;
+		start_transfer(strip);
+	}
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef* hspi) {
+	if(led_strip_upper && led_strip_upper->spi == hspi)
+		transfer_complete(led_strip_upper);
+	else if(led_strip_bottom && led_strip_bottom->spi == hspi)
+		transfer_complete(led_strip_bottom);
+}
+
+/* Raised in circular mode only, when the first half has been sent */
+void HAL_SPI_TxHalfCpltCallback(SPI_HandleTypeDef* hspi) {
+	if(led_strip_upper && led_strip_upper->spi == hspi && led_strip_upper->streaming)
+		stream_chunk_sent(led_strip_upper, 0);
+	else if(led_strip_bottom && led_strip_bottom->spi == hspi && led_strip_bottom->streaming)
+		stream_chunk_sent(led_strip_bottom, 0);
+}
+
 void clear_leds(struct LEDStrip* strip) {
-	clear_buffer(strip->_data_buffer, strip->len * SPI_BYTES_PER_DIODE);
+	for(uint32_t i = 0; i < strip->len; i++)
+		set_led_color(strip, i, (struct Color) {0, 0, 0});
 }
 
 void set_leds_brightness(struct LEDStrip* strip, uint8_t brightness) {
+	if(strip->brightness == brightness)
+		return;
+
 	strip->brightness = brightness;
+	build_luts(strip);
+	mark_dirty(strip, 0, strip->len);
+}
+
+/*
+ * Tables of the second segment are allocated with its calibration. Pointer
+ *  is swapped with interrupts disabled, streaming strips read it from IRQ.
+ */
+static int alloc_lut_segments(struct LEDStrip* strip, uint8_t segments) {
+	struct LEDChannelLUT* lut;
+	struct LEDChannelLUT* old = strip->lut;
+
+	if(strip->lut_segments >= segments)
+		return 0;
+
+	lut = malloc(segments * sizeof(struct LEDChannelLUT));
+	if(lut == NULL)
+		return -1;
+	memcpy(lut, old, strip->lut_segments * sizeof(struct LEDChannelLUT));
+
+	__disable_irq();
+	strip->lut = lut;
+	strip->lut_segments = segments;
+	__enable_irq();
+	free(old);
+	return 0;
 }
 
 void calibrate_leds_colors(struct LEDStrip* strip, struct Ratio r, struct Ratio g, struct Ratio b, uint16_t idx) {
+	if(idx != 0 && alloc_lut_segments(strip, 2)) {
+		printk(LOG_ERR "WS2812B: no memory for calibration from LED %d", idx);
+		return;
+	}
+
 	if(idx == 0) {
 		strip->rt1_r = r;
 		strip->rt1_g = g;
@@ -155,6 +744,17 @@ void calibrate_leds_colors(struct LEDStrip* strip, struct Ratio r, struct Ratio
 		strip->ratio_index = idx;
 	}
 	strip->apply_ratio = 1;
+	build_luts(strip);
+	mark_dirty(strip, 0, strip->len);
+}
+
+void set_leds_gamma(struct LEDStrip* strip, uint8_t enable) {
+	if(strip->gamma == !!enable)
+		return;
+
+	strip->gamma = !!enable;
+	build_luts(strip);
+	mark_dirty(strip, 0, strip->len);
 }
 
 struct Color int2Color(int color) {
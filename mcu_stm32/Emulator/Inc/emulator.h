@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * emulator.h - glue between HAL shim and MLF emulator
+ *  (C) 2022 Pawel Wieczorek
+ */
+#ifndef INC_EMULATOR_H_
+#define INC_EMULATOR_H_
+
+#include "stm32f4xx_hal.h"
+
+/*
+ * Interrupts are emulated synchronously - they're delivered from HAL calls
+ *  made by application (HAL_GetTick, HAL_SPI_GetState, HAL_Delay), so
+ *  firmware runs in a single thread exactly as written for MCU.
+ */
+
+/**
+ * Microseconds since emulator start
+ */
+uint64_t emu_time_us(void);
+
+/**
+ * USB OTG interrupt - pass received bytes to application
+ *
+ * @return !0 if any data has been received
+ */
+int emu_usb_irq(void);
+
+/**
+ * Called when SPI DMA transfer starts - LED chip may be switched before
+ *  it finishes, so bitstream is decoded as chip it's been encoded for
+ * @param hspi handle of SPI bus
+ * @return MLF_LED_TYPE of strip driven by the bus
+ */
+uint8_t emu_spi_led_type(SPI_HandleTypeDef* hspi);
+
+/**
+ * Called after SPI DMA transfer has finished
+ * @param hspi handle of SPI bus with captured bitstream
+ */
+void emu_spi_complete(SPI_HandleTypeDef* hspi);
+
+/**
+ * Called after frame of parallel LED port has been sent
+ * @param lane pin of GPIO port
+ * @param data waveform of lane converted to SPI bitstream
+ * @param size size of data in bytes
+ */
+void emu_lane_complete(uint8_t lane, const uint8_t* data, uint32_t size);
+
+/**
+ * Sleep until data from host arrives or timeout expires (__WFI)
+ * @param timeout_us maximal time to sleep
+ */
+void emu_wait_for_irq(uint64_t timeout_us);
+
+#endif /* INC_EMULATOR_H_ */
@@ -0,0 +1,12 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * main.h - common includes of application built for MLF emulator
+ *  (C) 2022 Pawel Wieczorek
+ */
+#ifndef __MAIN_H
+#define __MAIN_H
+
+#include "stm32f4xx_hal.h"
+#include "logger.h"
+
+#endif /* __MAIN_H */
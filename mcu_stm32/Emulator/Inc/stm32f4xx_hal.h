@@ -0,0 +1,289 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * stm32f4xx_hal.h - subset of STM32 HAL used by application, implemented
+ *  on top of POSIX by MLF emulator
+ *  (C) 2022 Pawel Wieczorek
+ */
+#ifndef INC_STM32F4XX_HAL_H_
+#define INC_STM32F4XX_HAL_H_
+
+#include <stdint.h>
+
+typedef enum {
+	HAL_OK			= 0x00,
+	HAL_ERROR		= 0x01,
+	HAL_BUSY		= 0x02,
+	HAL_TIMEOUT		= 0x03,
+} HAL_StatusTypeDef;
+
+/**********************
+ * DMA (mode of SPI TX stream, memory to GPIO transfers requested by timer)
+ **********************/
+#define DMA_CHANNEL_6			0x0C000000U
+#define DMA_MEMORY_TO_PERIPH	0x00000040U
+#define DMA_PINC_DISABLE		0x00000000U
+#define DMA_MINC_DISABLE		0x00000000U
+#define DMA_MINC_ENABLE			0x00000400U
+#define DMA_PDATAALIGN_BYTE		0x00000000U
+#define DMA_PDATAALIGN_HALFWORD	0x00000800U
+#define DMA_MDATAALIGN_BYTE		0x00000000U
+#define DMA_MDATAALIGN_HALFWORD	0x00002000U
+#define DMA_NORMAL				0x00000000U
+#define DMA_CIRCULAR			0x00000100U
+#define DMA_PRIORITY_VERY_HIGH	0x00030000U
+#define DMA_FIFOMODE_DISABLE	0x00000000U
+
+typedef enum {
+	HAL_DMA_STATE_RESET		= 0x00,
+	HAL_DMA_STATE_READY		= 0x01,
+	HAL_DMA_STATE_BUSY		= 0x02,
+} HAL_DMA_StateTypeDef;
+
+typedef struct {
+	uint8_t stream;
+} DMA_Stream_TypeDef;
+
+extern DMA_Stream_TypeDef emu_dma2_streams[8];
+#define DMA2_Stream1			(&emu_dma2_streams[1])
+#define DMA2_Stream2			(&emu_dma2_streams[2])
+#define DMA2_Stream5			(&emu_dma2_streams[5])
+
+typedef struct {
+	uint32_t Channel;
+	uint32_t Direction;
+	uint32_t PeriphInc;
+	uint32_t MemInc;
+	uint32_t PeriphDataAlignment;
+	uint32_t MemDataAlignment;
+	uint32_t Mode;
+	uint32_t Priority;
+	uint32_t FIFOMode;
+} DMA_InitTypeDef;
+
+typedef struct __DMA_HandleTypeDef {
+	DMA_Stream_TypeDef* Instance;
+	DMA_InitTypeDef Init;
+	volatile HAL_DMA_StateTypeDef State;
+	void* Parent;
+	void (*XferCpltCallback)(struct __DMA_HandleTypeDef* hdma);
+
+	// Transfer started by application, run by emulated timer
+	uintptr_t src, dst;
+	uint32_t count;
+	uint8_t it;
+} DMA_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef* hdma);
+HAL_StatusTypeDef HAL_DMA_Start(DMA_HandleTypeDef* hdma, uintptr_t src, uintptr_t dst, uint32_t count);
+HAL_StatusTypeDef HAL_DMA_Start_IT(DMA_HandleTypeDef* hdma, uintptr_t src, uintptr_t dst, uint32_t count);
+HAL_StatusTypeDef HAL_DMA_Abort(DMA_HandleTypeDef* hdma);
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef* hdma);
+
+#define __HAL_LINKDMA(H, F, D)		do { (H)->F = &(D); (D).Parent = (H); } while(0)
+
+/**********************
+ * GPIO (only BSRR writes of DMA are emulated)
+ **********************/
+typedef struct {
+	volatile uint32_t ODR;
+	volatile uint32_t BSRR;
+
+	uint32_t outputs;					// pins initialised by application
+} GPIO_TypeDef;
+
+typedef struct {
+	uint32_t Pin;
+	uint32_t Mode;
+	uint32_t Pull;
+	uint32_t Speed;
+} GPIO_InitTypeDef;
+
+#define GPIO_MODE_OUTPUT_PP			0x00000001U
+#define GPIO_NOPULL					0x00000000U
+#define GPIO_SPEED_FREQ_VERY_HIGH	0x00000003U
+
+extern GPIO_TypeDef emu_gpioc;
+#define GPIOC						(&emu_gpioc)
+
+void HAL_GPIO_Init(GPIO_TypeDef* gpio, GPIO_InitTypeDef* init);
+
+/**********************
+ * TIM (timer of parallel LED port, only its DMA requests are emulated)
+ **********************/
+typedef struct {
+	volatile uint32_t CR1;
+	volatile uint32_t DIER;
+	volatile uint32_t CNT;
+	volatile uint32_t ARR;
+	volatile uint32_t CCR1;
+	volatile uint32_t CCR2;
+} TIM_TypeDef;
+
+typedef struct {
+	uint32_t Prescaler;
+	uint32_t CounterMode;
+	uint32_t Period;
+	uint32_t ClockDivision;
+	uint32_t RepetitionCounter;
+} TIM_Base_InitTypeDef;
+
+typedef enum {
+	HAL_TIM_STATE_RESET		= 0x00,
+	HAL_TIM_STATE_READY		= 0x01,
+	HAL_TIM_STATE_BUSY		= 0x02,
+} HAL_TIM_StateTypeDef;
+
+typedef struct {
+	TIM_TypeDef* Instance;
+	TIM_Base_InitTypeDef Init;
+	DMA_HandleTypeDef* hdma[7];
+	volatile HAL_TIM_StateTypeDef State;
+
+	// Frame in progress - every DMA transfer is run at its start
+	uint64_t complete_at_us;
+
+	// Next update interrupt of timer started with HAL_TIM_Base_Start_IT
+	uint64_t update_at_us;
+} TIM_HandleTypeDef;
+
+extern TIM_TypeDef emu_tim1;
+extern TIM_TypeDef emu_tim3;
+#define TIM1						(&emu_tim1)
+#define TIM3						(&emu_tim3)
+
+#define TIM_COUNTERMODE_UP			0x00000000U
+#define TIM_CLOCKDIVISION_DIV1		0x00000000U
+#define TIM_CHANNEL_1				0x00000000U
+#define TIM_CHANNEL_2				0x00000004U
+#define TIM_DMA_ID_UPDATE			0
+#define TIM_DMA_ID_CC1				1
+#define TIM_DMA_ID_CC2				2
+#define TIM_DMA_UPDATE				(1 << 8)
+#define TIM_DMA_CC1					(1 << 9)
+#define TIM_DMA_CC2					(1 << 10)
+
+#define __HAL_TIM_SET_COUNTER(H, V)		((H)->Instance->CNT = (V))
+#define __HAL_TIM_SET_COMPARE(H, C, V)	(*((C) == TIM_CHANNEL_1 ? &(H)->Instance->CCR1 : &(H)->Instance->CCR2) = (V))
+#define __HAL_TIM_ENABLE_DMA(H, D)		((H)->Instance->DIER |= (D))
+
+HAL_StatusTypeDef HAL_TIM_Base_Init(TIM_HandleTypeDef* htim);
+HAL_StatusTypeDef HAL_TIM_Base_Start(TIM_HandleTypeDef* htim);
+HAL_StatusTypeDef HAL_TIM_Base_Stop(TIM_HandleTypeDef* htim);
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef* htim);
+HAL_StatusTypeDef HAL_TIM_Base_Stop_IT(TIM_HandleTypeDef* htim);
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef* htim);
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef* htim);
+
+/**********************
+ * RCC AND NVIC (nothing to do)
+ **********************/
+typedef enum {
+	TIM3_IRQn				= 29,
+	DMA2_Stream2_IRQn		= 58,
+} IRQn_Type;
+
+#define __HAL_RCC_GPIOC_CLK_ENABLE()	do {} while(0)
+#define __HAL_RCC_TIM1_CLK_ENABLE()		do {} while(0)
+#define __HAL_RCC_TIM3_CLK_ENABLE()		do {} while(0)
+#define HAL_NVIC_SetPriority(I, P, S)	do {} while(0)
+#define HAL_NVIC_EnableIRQ(I)			do {} while(0)
+
+/**********************
+ * SPI (DMA transfers are timed by prescaler of 84 MHz peripheral clock)
+ **********************/
+#define SPI_BAUDRATEPRESCALER_2		0x00U
+#define SPI_BAUDRATEPRESCALER_4		0x08U
+#define SPI_BAUDRATEPRESCALER_8		0x10U
+#define SPI_BAUDRATEPRESCALER_16	0x18U
+#define SPI_BAUDRATEPRESCALER_32	0x20U
+#define SPI_BAUDRATEPRESCALER_64	0x28U
+#define SPI_BAUDRATEPRESCALER_128	0x30U
+#define SPI_BAUDRATEPRESCALER_256	0x38U
+#define SPI_FIRSTBIT_MSB			0x00U
+#define SPI_FIRSTBIT_LSB			0x80U
+
+typedef struct {
+	uint32_t BaudRatePrescaler;
+	uint32_t FirstBit;
+} SPI_InitTypeDef;
+
+typedef enum {
+	HAL_SPI_STATE_RESET		= 0x00,
+	HAL_SPI_STATE_READY		= 0x01,
+	HAL_SPI_STATE_BUSY_TX	= 0x03,
+} HAL_SPI_StateTypeDef;
+
+typedef struct {
+	uint8_t bus;						// SPI1, SPI2, ...
+	SPI_InitTypeDef Init;
+	volatile HAL_SPI_StateTypeDef State;
+	DMA_HandleTypeDef* hdmatx;
+
+	// Transfer in progress - data is captured at start of transfer, or
+	//  half by half as it's sent in circular mode
+	uint64_t complete_at_us;
+	uint8_t* tx_buffer;
+	uint32_t tx_size;
+	uint8_t tx_led_type;
+	uint8_t* dma_data;
+	uint16_t dma_size;
+	uint8_t dma_half;
+} SPI_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_SPI_Init(SPI_HandleTypeDef* hspi);
+HAL_SPI_StateTypeDef HAL_SPI_GetState(SPI_HandleTypeDef* hspi);
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef* hspi, uint8_t* data, uint16_t size);
+HAL_StatusTypeDef HAL_SPI_DMAStop(SPI_HandleTypeDef* hspi);
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef* hspi);
+void HAL_SPI_TxHalfCpltCallback(SPI_HandleTypeDef* hspi);
+
+/**********************
+ * UART (link to ESP32 is not emulated - nothing is ever received)
+ **********************/
+typedef struct {
+	volatile uint32_t SR;
+	volatile uint32_t DR;
+} USART_TypeDef;
+
+typedef struct {
+	USART_TypeDef* Instance;
+} UART_HandleTypeDef;
+
+#define UART_FLAG_RXNE					(1 << 5)
+#define UART_FLAG_ORE					(1 << 3)
+#define UART_IT_RXNE					(1 << 5)
+
+#define __HAL_UART_GET_FLAG(H, F)		(((H)->Instance->SR & (F)) == (F))
+#define __HAL_UART_ENABLE_IT(H, I)		do {} while(0)
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size, uint32_t timeout);
+
+/**********************
+ * WATCHDOG
+ **********************/
+typedef struct {
+	uint32_t reloads;
+} IWDG_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_IWDG_Refresh(IWDG_HandleTypeDef* hiwdg);
+
+/**********************
+ * CORE
+ **********************/
+typedef struct {
+	volatile uint32_t CTRL;
+	volatile uint32_t LOAD;
+	volatile uint32_t VAL;
+	volatile uint32_t CALIB;
+} SysTick_Type;
+
+extern SysTick_Type* const SysTick;
+
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t delay);
+
+void __disable_irq(void);
+void __enable_irq(void);
+void __WFI(void);
+
+#endif /* INC_STM32F4XX_HAL_H_ */
@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * usbd_cdc_if.h - USB CDC interface of MLF emulator (pseudo-terminal)
+ *  (C) 2022 Pawel Wieczorek
+ */
+#ifndef __USBD_CDC_IF_H__
+#define __USBD_CDC_IF_H__
+
+#include <stdint.h>
+
+#define USBD_OK					0U
+#define USBD_BUSY				1U
+#define USBD_FAIL				3U
+
+uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
+
+#endif /* __USBD_CDC_IF_H__ */
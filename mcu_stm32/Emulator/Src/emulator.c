@@ -0,0 +1,424 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * emulator.c - MLF Controller emulator running the actual application
+ *  sources on Linux. Host talks to it over a pseudo-terminal, exactly as
+ *  over USB CDC, and every SPI transfer is captured bit by bit.
+ *
+ * SPI dump (--dump) is a sequence of records:
+ *  | time_us (u64) | bus (u8) | led_type (u8) | size (u16) | data[size] |
+ *  where data is the SPI bitstream in bit order configured on MCU (LSB
+ *  first for WS2812B and SK6812, MSB first for APA102) and led_type is
+ *  MLF_LED_TYPE of strip.
+ *  Longer transfers (streaming mode only) are split into records of
+ *  65535 bytes at most. Lanes of parallel port are stored as bus 0x10 + pin,
+ *  with waveform converted to the same bitstream.
+ *
+ *  (C) 2022 Pawel Wieczorek
+ */
+
+#include "app.h"
+#include "emulator.h"
+#include "mlf_protocol.h"
+#include "ws2812.h"
+#include "usbd_cdc_if.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+/************************
+ * PRIVATE MACROS
+ ************************/
+// USB Full Speed bulk endpoint: 64 bytes per packet, at most 19 per 1ms frame
+#define USB_FS_PACKET_SIZE		64
+#define USB_FS_BYTES_PER_MS		(19 * USB_FS_PACKET_SIZE)
+
+// WS2812B bit is sent as 3 SPI bits: 100 for 0, 110 for 1
+#define WS_SYMBOL_BITS			3
+#define WS_BITS_PER_LED			24
+#define SK6812_BITS_PER_LED		32
+#define MAX_DECODED_LEDS		4096
+
+// APA102 frame starts with 32 zero bits, LED is 111 + 5-bit global, B, G, R
+#define APA102_HEADER_LEN		4
+#define APA102_LED_MARK			0xe0
+
+#define SPI_BUSES				2
+#define PORT_LANES				16
+#define OUTPUTS					(SPI_BUSES + PORT_LANES)
+#define LANE_BUS_ID				0x10
+
+
+/************************
+ * HAL HANDLES USED BY APPLICATION
+ ************************/
+DMA_HandleTypeDef hdma_spi1_tx = { .Init.Mode = DMA_NORMAL };
+DMA_HandleTypeDef hdma_spi2_tx = { .Init.Mode = DMA_NORMAL };
+SPI_HandleTypeDef hspi1 = {
+		.bus = 1,
+		.Init = { .BaudRatePrescaler = SPI_BAUDRATEPRESCALER_32, .FirstBit = SPI_FIRSTBIT_LSB },
+		.State = HAL_SPI_STATE_READY,
+		.hdmatx = &hdma_spi1_tx,
+};
+SPI_HandleTypeDef hspi2 = {
+		.bus = 2,
+		.Init = { .BaudRatePrescaler = SPI_BAUDRATEPRESCALER_32, .FirstBit = SPI_FIRSTBIT_LSB },
+		.State = HAL_SPI_STATE_READY,
+		.hdmatx = &hdma_spi2_tx,
+};
+
+static USART_TypeDef usart2;
+UART_HandleTypeDef huart2 = { .Instance = &usart2 };
+IWDG_HandleTypeDef hiwdg;
+
+extern struct MLF_ctx usb_ctx;
+extern int emu_verbose;
+
+
+/************************
+ * PRIVATE GLOBALS
+ ************************/
+static struct {
+	int master, slave;
+	const char* link;
+	uint8_t unlimited;
+	struct packet_buffer* packet_buf;
+
+	// OUT endpoint isn't armed while packet ring holds part of rx_buf
+	uint8_t rx_buf[USB_FS_PACKET_SIZE];
+	uint8_t rx_paused;
+
+	uint32_t budget;
+	uint64_t budget_at_us;
+	uint64_t rx_bytes, tx_bytes;
+} usb = {
+		.master = -1,
+		.slave = -1,
+};
+
+static struct {
+	FILE* dump;
+	uint8_t print;
+
+	// SPI buses first, lanes of parallel port after them
+	uint32_t frames[OUTPUTS];
+	uint64_t bytes[OUTPUTS];
+	uint32_t invalid_symbols[OUTPUTS];
+	uint64_t first_us[OUTPUTS], last_us[OUTPUTS];
+} spi;
+
+static volatile sig_atomic_t emu_stop;
+
+
+/************************
+ * STATISTICS
+ ************************/
+static void emu_exit(void) {
+	fprintf(stderr, "mlf_emulator: usb rx %llu bytes, tx %llu bytes\n",
+			(unsigned long long) usb.rx_bytes, (unsigned long long) usb.tx_bytes);
+
+	for(int i = 0; i < OUTPUTS; i++) {
+		double secs = (spi.last_us[i] - spi.first_us[i]) / 1e6;
+		if(i >= SPI_BUSES && spi.frames[i] == 0)
+			continue;
+		fprintf(stderr, "mlf_emulator: %s%d %u frames, %llu bytes, %.1f fps, %u invalid symbols\n",
+				i < SPI_BUSES ? "spi" : "lane", i < SPI_BUSES ? i + 1 : i - SPI_BUSES,
+				spi.frames[i], (unsigned long long) spi.bytes[i],
+				(spi.frames[i] > 1 && secs > 0) ? (spi.frames[i] - 1) / secs : 0.0,
+				spi.invalid_symbols[i]);
+	}
+
+	if(spi.dump)
+		fclose(spi.dump);
+	if(usb.link)
+		unlink(usb.link);
+	exit(0);
+}
+
+static void emu_signal(int sig) {
+	emu_stop = 1;
+}
+
+
+/************************
+ * SPI BITSTREAM
+ ************************/
+static int get_bit(const uint8_t* data, uint32_t bit) {
+	return (data[bit / 8] >> (bit % 8)) & 1;
+}
+
+/**
+ * Decode WS2812B (24 bits per LED) or SK6812 RGBW (32 bits) colors from SPI
+ *  bitstream
+ *
+ * @param colors decoded colors in the same format as used by host (0xBBGGRR),
+ *  with white in the top byte for RGBW LEDs
+ * @return number of decoded LEDs
+ */
+static int decode_bitstream(const uint8_t* data, uint32_t size, int led_bits, uint32_t* colors, uint32_t* invalid) {
+	const uint32_t bits = size * 8;
+	uint32_t bit = 0;
+	int leds = 0;
+
+	while(leds < MAX_DECODED_LEDS && bit + led_bits * WS_SYMBOL_BITS <= bits) {
+		uint32_t grb = 0, white = 0;
+
+		// Bus kept low means reset - end of frame
+		if(!get_bit(data, bit))
+			break;
+
+		for(int i = 0; i < led_bits; i++, bit += WS_SYMBOL_BITS) {
+			if(!get_bit(data, bit) || get_bit(data, bit + 2))
+				(*invalid)++;
+			if(i < WS_BITS_PER_LED)
+				grb = (grb << 1) | get_bit(data, bit + 1);
+			else
+				white = (white << 1) | get_bit(data, bit + 1);
+		}
+
+		colors[leds++] = ((grb >> 8) & 0xff) | ((grb >> 16) << 8) | ((grb & 0xff) << 16) | (white << 24);
+	}
+
+	return leds;
+}
+
+/**
+ * Decode APA102 colors from SPI bitstream (sent MSB first), as shown by LEDs
+ *  - with global brightness applied
+ */
+static int decode_apa102(const uint8_t* data, uint32_t size, uint32_t* colors, uint32_t* invalid) {
+	uint32_t off = APA102_HEADER_LEN;
+	int leds = 0;
+
+	for(uint32_t i = 0; i < APA102_HEADER_LEN && i < size; i++)
+		*invalid += data[i] != 0;
+
+	// End frame is all zeros
+	while(leds < MAX_DECODED_LEDS && off + 4 <= size && (data[off] & APA102_LED_MARK) == APA102_LED_MARK) {
+		uint32_t global = data[off] & ~APA102_LED_MARK;
+
+		colors[leds++] = (data[off + 3] * global / 31) | ((data[off + 2] * global / 31) << 8) |
+				((data[off + 1] * global / 31) << 16);
+		off += 4;
+	}
+
+	return leds;
+}
+
+static void output_complete(int idx, uint8_t bus, uint8_t led_type, const uint8_t* data, uint32_t data_size) {
+	static uint32_t colors[MAX_DECODED_LEDS];
+	uint64_t now = emu_time_us();
+	int leds;
+
+	if(spi.frames[idx] == 0)
+		spi.first_us[idx] = now;
+	spi.last_us[idx] = now;
+	spi.frames[idx]++;
+	spi.bytes[idx] += data_size;
+
+	if(led_type == MLF_LED_APA102)
+		leds = decode_apa102(data, data_size, colors, &spi.invalid_symbols[idx]);
+	else
+		leds = decode_bitstream(data, data_size, led_type == MLF_LED_SK6812_RGBW ? SK6812_BITS_PER_LED : WS_BITS_PER_LED,
+				colors, &spi.invalid_symbols[idx]);
+
+	for(uint32_t off = 0; spi.dump && off < data_size; off += UINT16_MAX) {
+		uint16_t size = data_size - off < UINT16_MAX ? data_size - off : UINT16_MAX;
+		uint8_t bus_info[2] = { bus, led_type };
+
+		fwrite(&now, sizeof now, 1, spi.dump);
+		fwrite(bus_info, sizeof bus_info, 1, spi.dump);
+		fwrite(&size, sizeof size, 1, spi.dump);
+		fwrite(data + off, size, 1, spi.dump);
+	}
+
+	if(spi.print) {
+		if(idx < SPI_BUSES)
+			printf("%llu spi%d %d:", (unsigned long long) now, bus, leds);
+		else
+			printf("%llu lane%d %d:", (unsigned long long) now, idx - SPI_BUSES, leds);
+		for(int i = 0; i < leds; i++)
+			printf(led_type == MLF_LED_SK6812_RGBW ? " %08x" : " %06x", colors[i]);
+		printf("\n");
+		fflush(stdout);
+	}
+}
+
+uint8_t emu_spi_led_type(SPI_HandleTypeDef* hspi) {
+	// Bitstream is decoded as LEDs of strip driven by the bus
+	if(led_strip_upper && led_strip_upper->spi == hspi)
+		return get_led_strip_chip(led_strip_upper)->type;
+	else if(led_strip_bottom && led_strip_bottom->spi == hspi)
+		return get_led_strip_chip(led_strip_bottom)->type;
+	return MLF_LED_WS2812B;
+}
+
+void emu_spi_complete(SPI_HandleTypeDef* hspi) {
+	output_complete(hspi->bus - 1, hspi->bus, hspi->tx_led_type, hspi->tx_buffer, hspi->tx_size);
+}
+
+void emu_lane_complete(uint8_t lane, const uint8_t* data, uint32_t size) {
+	if(lane < PORT_LANES)
+		output_complete(SPI_BUSES + lane, LANE_BUS_ID + lane, MLF_LED_WS2812B, data, size);
+}
+
+
+/************************
+ * USB CDC
+ ************************/
+static void emu_usb_resume(void) {
+	usb.rx_paused = 0;
+}
+
+int emu_usb_irq(void) {
+	uint32_t len = sizeof usb.rx_buf;
+	uint64_t now;
+	ssize_t ret;
+
+	if(emu_stop)
+		emu_exit();
+	if(usb.packet_buf == NULL || usb.rx_paused)
+		return 0;
+
+	// Host can't push data faster than USB Full Speed allows
+	if(!usb.unlimited) {
+		now = emu_time_us();
+		usb.budget += (now - usb.budget_at_us) * USB_FS_BYTES_PER_MS / 1000;
+		usb.budget_at_us = now;
+		if(usb.budget > USB_FS_BYTES_PER_MS)
+			usb.budget = USB_FS_BYTES_PER_MS;
+		if(usb.budget < len)
+			return 0;
+	}
+
+	ret = read(usb.master, usb.rx_buf, len);
+	if(ret <= 0)
+		return 0;
+
+	usb.budget -= usb.unlimited ? 0 : ret;
+	usb.rx_bytes += ret;
+	if(packet_buffer_append(usb.packet_buf, usb.rx_buf, ret) == PACKET_BUFFER_PAUSED)
+		usb.rx_paused = 1;
+	return 1;
+}
+
+uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len) {
+	struct pollfd pfd = { .fd = usb.master, .events = POLLOUT };
+	uint16_t written = 0;
+	ssize_t ret;
+
+	// Nothing could be sent at all - IN endpoint is still busy
+	ret = write(usb.master, Buf, Len);
+	if(ret < 0)
+		return (errno == EAGAIN) ? USBD_BUSY : USBD_FAIL;
+
+	// Once started, transfer is always finished
+	for(written = ret; written < Len; written += ret > 0 ? ret : 0) {
+		poll(&pfd, 1, 100);
+		ret = write(usb.master, Buf + written, Len - written);
+		if(ret < 0 && errno != EAGAIN)
+			return USBD_FAIL;
+	}
+
+	usb.tx_bytes += Len;
+	return USBD_OK;
+}
+
+void emu_wait_for_irq(uint64_t timeout_us) {
+	struct pollfd pfd = { .fd = usb.master, .events = POLLIN };
+	struct timespec timeout = {
+			.tv_sec = timeout_us / 1000000,
+			.tv_nsec = (timeout_us % 1000000) * 1000,
+	};
+
+	ppoll(&pfd, 1, &timeout, NULL);
+}
+
+static void usb_init(void) {
+	struct termios tty;
+
+	usb.master = posix_openpt(O_RDWR | O_NOCTTY);
+	if(usb.master < 0 || grantpt(usb.master) || unlockpt(usb.master)) {
+		perror("mlf_emulator: failed to create pseudo-terminal");
+		exit(1);
+	}
+
+	// Keep slave open, so host can reconnect without hang up on master
+	usb.slave = open(ptsname(usb.master), O_RDWR | O_NOCTTY);
+	if(usb.slave < 0 || tcgetattr(usb.slave, &tty)) {
+		perror("mlf_emulator: failed to open pseudo-terminal");
+		exit(1);
+	}
+	cfmakeraw(&tty);
+	tcsetattr(usb.slave, TCSANOW, &tty);
+	fcntl(usb.master, F_SETFL, fcntl(usb.master, F_GETFL) | O_NONBLOCK);
+
+	if(usb.link) {
+		unlink(usb.link);
+		if(symlink(ptsname(usb.master), usb.link)) {
+			perror("mlf_emulator: failed to create link to pseudo-terminal");
+			exit(1);
+		}
+	}
+}
+
+
+/************************
+ * ENTRY POINT
+ ************************/
+static void usage(const char* name) {
+	fprintf(stderr,
+			"Usage: %s [options]\n"
+			"  --link PATH      create symlink to emulated device\n"
+			"  --dump FILE      write SPI bitstream of every transfer to FILE\n"
+			"  --print-frames   print decoded colors of every transfer to stdout\n"
+			"  --usb-unlimited  don't limit host transfers to USB Full Speed rate\n"
+			"  --verbose        print informational logs of firmware\n",
+			name);
+}
+
+int main(int argc, char** argv) {
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "--link") && i + 1 < argc) {
+			usb.link = argv[++i];
+		} else if(!strcmp(argv[i], "--dump") && i + 1 < argc) {
+			spi.dump = fopen(argv[++i], "wb");
+			if(spi.dump == NULL) {
+				perror("mlf_emulator: failed to open dump file");
+				return 1;
+			}
+		} else if(!strcmp(argv[i], "--print-frames")) {
+			spi.print = 1;
+		} else if(!strcmp(argv[i], "--usb-unlimited")) {
+			usb.unlimited = 1;
+		} else if(!strcmp(argv[i], "--verbose")) {
+			emu_verbose = 1;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	signal(SIGINT, emu_signal);
+	signal(SIGTERM, emu_signal);
+	emu_time_us();
+
+	usb_init();
+	printf("%s\n", ptsname(usb.master));
+	fflush(stdout);
+
+	app_init();
+
+	// USB enumeration done - CDC_Init_FS
+	usb.packet_buf = packet_buffer_init(&usb_ctx, APP_USB_RX_SLOTS, emu_usb_resume);
+
+	app_main_loop();
+	return 0;
+}
@@ -0,0 +1,562 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * hal_shim.c - STM32 HAL functions used by application implemented
+ *  on top of POSIX
+ *  (C) 2022 Pawel Wieczorek
+ */
+
+#include "stm32f4xx_hal.h"
+#include "emulator.h"
+#include "logger.h"
+#include "panic.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/************************
+ * PRIVATE MACROS
+ ************************/
+// SysTick reloads every 1ms at 84MHz, just like on STM32F401
+#define SYSTICK_LOAD			(84000 - 1)
+
+// SPI peripheral clock is 84 MHz, prescaler of 32 gives 2.625 MBits/s
+#define SPI_PCLK_MHZ			84
+#define SPI_NS_PER_BYTE(H)		((8 * 1000 * (2 << ((H)->Init.BaudRatePrescaler / SPI_BAUDRATEPRESCALER_4))) / SPI_PCLK_MHZ)
+
+// Timers run at 84 MHz, as TIM1 (APB2) and TIM3 (APB1 x2) on STM32F401
+#define TIM_CLOCK_MHZ			84
+#define GPIO_PINS				16
+
+// Number of HAL calls without any interrupt after which CPU goes to sleep
+#define IDLE_CALLS_BEFORE_WFI	32
+#define WFI_MAX_US				500
+
+
+/************************
+ * PRIVATE GLOBALS
+ ************************/
+static SysTick_Type systick = {
+		.LOAD = SYSTICK_LOAD,
+		.VAL = SYSTICK_LOAD,
+};
+SysTick_Type* const SysTick = &systick;
+
+static SPI_HandleTypeDef* spi_busy[2];
+
+DMA_Stream_TypeDef emu_dma2_streams[8];
+GPIO_TypeDef emu_gpioc;
+TIM_TypeDef emu_tim1;
+TIM_TypeDef emu_tim3;
+
+// Timer raising update interrupts (frame clock of application)
+static TIM_HandleTypeDef* tim_it;
+
+// Frame of parallel LED port - waveform of every pin as SPI bitstream
+static struct {
+	TIM_HandleTypeDef* htim;
+	GPIO_TypeDef* gpio;
+	uint8_t* lanes[GPIO_PINS];
+	uint32_t size;
+} port_frame;
+
+static struct {
+	uint8_t disabled;
+	uint8_t in_irq;
+	uint32_t idle_calls;
+} irq;
+
+
+/************************
+ * INTERRUPTS EMULATION
+ ************************/
+uint64_t emu_time_us(void) {
+	static uint64_t start_ns;
+	struct timespec ts;
+	uint64_t now_ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	if(start_ns == 0)
+		start_ns = now_ns;
+
+	return (now_ns - start_ns) / 1000;
+}
+
+static uint64_t tim_period_us(TIM_HandleTypeDef* htim) {
+	uint64_t period_us = (uint64_t) (htim->Init.Prescaler + 1) * (htim->Init.Period + 1) / TIM_CLOCK_MHZ;
+
+	return period_us ? period_us : 1;
+}
+
+static uint64_t next_irq_us(void) {
+	uint64_t next = UINT64_MAX;
+
+	for(int i = 0; i < 2; i++) {
+		if(spi_busy[i] && spi_busy[i]->complete_at_us < next)
+			next = spi_busy[i]->complete_at_us;
+	}
+	if(port_frame.htim && port_frame.htim->complete_at_us < next)
+		next = port_frame.htim->complete_at_us;
+	if(tim_it && tim_it->update_at_us < next)
+		next = tim_it->update_at_us;
+	return next;
+}
+
+/*
+ * Circular DMA raises half and full transfer interrupts until it's stopped.
+ *  Every half is captured as it's finished, application refills it in the
+ *  callback. All overdue halves are handled at once if emulator falls
+ *  behind - real hardware would send stale data then.
+ */
+static void spi_circular_irqs(SPI_HandleTypeDef* hspi, uint64_t now) {
+	const uint16_t half_size = hspi->dma_size / 2;
+	uint8_t half;
+
+	while(spi_busy[hspi->bus - 1] == hspi && hspi->complete_at_us <= now) {
+		half = hspi->dma_half;
+		hspi->dma_half ^= 1;
+		hspi->complete_at_us += ((uint64_t) half_size * SPI_NS_PER_BYTE(hspi)) / 1000;
+
+		hspi->tx_buffer = realloc(hspi->tx_buffer, hspi->tx_size + half_size);
+		if(hspi->tx_buffer == NULL) {
+			fprintf(stderr, "mlf_emulator: out of memory\n");
+			exit(1);
+		}
+		memcpy(hspi->tx_buffer + hspi->tx_size, hspi->dma_data + half * half_size, half_size);
+		hspi->tx_size += half_size;
+
+		if(half == 0)
+			HAL_SPI_TxHalfCpltCallback(hspi);
+		else
+			HAL_SPI_TxCpltCallback(hspi);
+	}
+}
+
+/*
+ * Frame of parallel port has been sent - report every lane and raise
+ *  interrupts of DMA streams started with them
+ */
+static void port_complete(void) {
+	TIM_HandleTypeDef* htim = port_frame.htim;
+
+	port_frame.htim = NULL;
+	for(int pin = 0; pin < GPIO_PINS; pin++) {
+		if(port_frame.gpio->outputs & (1 << pin))
+			emu_lane_complete(pin, port_frame.lanes[pin], port_frame.size);
+	}
+
+	for(int i = 0; i < 7; i++) {
+		DMA_HandleTypeDef* hdma = htim->hdma[i];
+		if(hdma == NULL || hdma->State != HAL_DMA_STATE_BUSY || !hdma->it)
+			continue;
+
+		hdma->State = HAL_DMA_STATE_READY;
+		if(hdma->XferCpltCallback)
+			hdma->XferCpltCallback(hdma);
+	}
+}
+
+/**
+ * Run handlers of all pending interrupts
+ *
+ * @return 1 if any interrupt was handled
+ */
+static int dispatch_irqs(void) {
+	uint64_t now = emu_time_us();
+	int handled = 0;
+
+	// Interrupts are neither nested nor delivered while masked
+	if(irq.disabled || irq.in_irq)
+		return 0;
+	irq.in_irq = 1;
+
+	for(int i = 0; i < 2; i++) {
+		SPI_HandleTypeDef* hspi = spi_busy[i];
+		if(hspi == NULL || hspi->complete_at_us > now)
+			continue;
+
+		if(hspi->hdmatx && hspi->hdmatx->Init.Mode == DMA_CIRCULAR) {
+			spi_circular_irqs(hspi, now);
+			handled = 1;
+			continue;
+		}
+
+		spi_busy[i] = NULL;
+		hspi->State = HAL_SPI_STATE_READY;
+		emu_spi_complete(hspi);
+		HAL_SPI_TxCpltCallback(hspi);
+		handled = 1;
+	}
+
+	if(port_frame.htim && port_frame.htim->complete_at_us <= now) {
+		port_complete();
+		handled = 1;
+	}
+
+	// Missed updates are merged into one, as with a single pending flag
+	if(tim_it && tim_it->update_at_us <= now) {
+		while(tim_it->update_at_us <= now)
+			tim_it->update_at_us += tim_period_us(tim_it);
+		HAL_TIM_PeriodElapsedCallback(tim_it);
+		handled = 1;
+	}
+
+	handled |= emu_usb_irq();
+
+	irq.in_irq = 0;
+	return handled;
+}
+
+/*
+ * Application polls HAL_GetTick while waiting for packets. Let the host
+ *  CPU sleep if nothing has happened for a while.
+ */
+static void idle(int handled) {
+	uint64_t now, next;
+
+	if(handled || irq.disabled || irq.in_irq) {
+		irq.idle_calls = 0;
+		return;
+	}
+	if(++irq.idle_calls < IDLE_CALLS_BEFORE_WFI)
+		return;
+	irq.idle_calls = 0;
+
+	now = emu_time_us();
+	next = next_irq_us();
+	if(next <= now)
+		return;
+	emu_wait_for_irq(next - now < WFI_MAX_US ? next - now : WFI_MAX_US);
+}
+
+void __disable_irq(void) {
+	irq.disabled = 1;
+}
+
+void __enable_irq(void) {
+	irq.disabled = 0;
+}
+
+/*
+ * Sleep until the next interrupt - SysTick wakes CPU up every 1ms at least.
+ *  With interrupts masked it only wakes up, handlers run on the next HAL
+ *  call after unmasking.
+ */
+void __WFI(void) {
+	uint64_t now = emu_time_us();
+	uint64_t next = next_irq_us();
+	uint64_t tick = (now / 1000 + 1) * 1000;
+
+	if(next > tick)
+		next = tick;
+	if(next > now)
+		emu_wait_for_irq(next - now);
+	if(!irq.disabled)
+		dispatch_irqs();
+}
+
+
+/************************
+ * CORE
+ ************************/
+uint32_t HAL_GetTick(void) {
+	uint64_t now;
+
+	idle(dispatch_irqs());
+
+	// Keep SysTick counter consistent with returned tick
+	now = emu_time_us();
+	systick.VAL = SYSTICK_LOAD - (now % 1000) * (SYSTICK_LOAD + 1) / 1000;
+	return (uint32_t)(now / 1000);
+}
+
+void HAL_Delay(uint32_t delay) {
+	uint64_t end = emu_time_us() + delay * 1000ULL;
+
+	while(emu_time_us() < end) {
+		if(!dispatch_irqs())
+			emu_wait_for_irq(WFI_MAX_US);
+	}
+}
+
+HAL_StatusTypeDef HAL_IWDG_Refresh(IWDG_HandleTypeDef* hiwdg) {
+	hiwdg->reloads++;
+	return HAL_OK;
+}
+
+
+/************************
+ * SPI
+ ************************/
+/* Settings are only used to time transfers and decode them */
+HAL_StatusTypeDef HAL_SPI_Init(SPI_HandleTypeDef* hspi) {
+	return hspi->State == HAL_SPI_STATE_READY ? HAL_OK : HAL_BUSY;
+}
+
+HAL_SPI_StateTypeDef HAL_SPI_GetState(SPI_HandleTypeDef* hspi) {
+	dispatch_irqs();
+	return hspi->State;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef* hspi, uint8_t* data, uint16_t size) {
+	if(hspi->State != HAL_SPI_STATE_READY)
+		return HAL_BUSY;
+	if(hspi->bus < 1 || hspi->bus > 2 || size == 0)
+		return HAL_ERROR;
+	hspi->tx_led_type = emu_spi_led_type(hspi);
+
+	if(hspi->hdmatx && hspi->hdmatx->Init.Mode == DMA_CIRCULAR) {
+		if(size % 2)
+			return HAL_ERROR;
+
+		// Halves are captured when they're finished
+		hspi->dma_data = data;
+		hspi->dma_size = size;
+		hspi->dma_half = 0;
+		hspi->tx_size = 0;
+		hspi->complete_at_us = emu_time_us() + ((uint64_t) size / 2 * SPI_NS_PER_BYTE(hspi)) / 1000;
+		hspi->State = HAL_SPI_STATE_BUSY_TX;
+		spi_busy[hspi->bus - 1] = hspi;
+		return HAL_OK;
+	}
+
+	// Real DMA reads memory during transfer, but application never
+	//  touches buffer until completion, so capturing it now is exact
+	hspi->tx_buffer = realloc(hspi->tx_buffer, size);
+	if(hspi->tx_buffer == NULL)
+		return HAL_ERROR;
+	memcpy(hspi->tx_buffer, data, size);
+	hspi->tx_size = size;
+
+	hspi->complete_at_us = emu_time_us() + ((uint64_t) size * SPI_NS_PER_BYTE(hspi)) / 1000;
+	hspi->State = HAL_SPI_STATE_BUSY_TX;
+	spi_busy[hspi->bus - 1] = hspi;
+	return HAL_OK;
+}
+
+/* Everything sent so far in circular mode is reported as one transfer */
+HAL_StatusTypeDef HAL_SPI_DMAStop(SPI_HandleTypeDef* hspi) {
+	if(spi_busy[hspi->bus - 1] != hspi)
+		return HAL_OK;
+
+	spi_busy[hspi->bus - 1] = NULL;
+	hspi->State = HAL_SPI_STATE_READY;
+	if(hspi->tx_size)
+		emu_spi_complete(hspi);
+	return HAL_OK;
+}
+
+__attribute__((weak)) void HAL_SPI_TxHalfCpltCallback(SPI_HandleTypeDef* hspi) {
+}
+
+
+/************************
+ * DMA
+ ************************/
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef* hdma) {
+	hdma->State = HAL_DMA_STATE_READY;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_Start(DMA_HandleTypeDef* hdma, uintptr_t src, uintptr_t dst, uint32_t count) {
+	if(hdma->State != HAL_DMA_STATE_READY)
+		return HAL_BUSY;
+
+	hdma->src = src;
+	hdma->dst = dst;
+	hdma->count = count;
+	hdma->it = 0;
+	hdma->State = HAL_DMA_STATE_BUSY;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_Start_IT(DMA_HandleTypeDef* hdma, uintptr_t src, uintptr_t dst, uint32_t count) {
+	HAL_StatusTypeDef ret = HAL_DMA_Start(hdma, src, dst, count);
+
+	hdma->it = ret == HAL_OK;
+	return ret;
+}
+
+HAL_StatusTypeDef HAL_DMA_Abort(DMA_HandleTypeDef* hdma) {
+	hdma->State = HAL_DMA_STATE_READY;
+	return HAL_OK;
+}
+
+/* Completion interrupts are raised by emulator itself */
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef* hdma) {
+}
+
+
+/************************
+ * GPIO
+ ************************/
+void HAL_GPIO_Init(GPIO_TypeDef* gpio, GPIO_InitTypeDef* init) {
+	gpio->outputs |= init->Pin & ((1 << GPIO_PINS) - 1);
+}
+
+/* DMA write to BSRR (set half) or BSRR + 2 (reset half) of GPIOC */
+static int gpio_dma_write(DMA_HandleTypeDef* hdma, uint32_t idx) {
+	const uint8_t width = hdma->Init.MemDataAlignment == DMA_MDATAALIGN_HALFWORD ? 2 : 1;
+	const uintptr_t bsrr = (uintptr_t) &emu_gpioc.BSRR;
+	const uint8_t* src = (const uint8_t*) hdma->src;
+	uint16_t value = 0;
+
+	if(hdma->Init.MemInc == DMA_MINC_ENABLE)
+		src += idx * width;
+	memcpy(&value, src, width);
+
+	if(hdma->dst == bsrr)
+		emu_gpioc.ODR |= value;
+	else if(hdma->dst == bsrr + 2)
+		emu_gpioc.ODR &= ~(uint32_t) value;
+	else
+		return -1;
+	return 0;
+}
+
+
+/************************
+ * TIM
+ ************************/
+HAL_StatusTypeDef HAL_TIM_Base_Init(TIM_HandleTypeDef* htim) {
+	htim->Instance->ARR = htim->Init.Period;
+	htim->State = HAL_TIM_STATE_READY;
+	return HAL_OK;
+}
+
+static void set_bit(uint8_t* data, uint32_t bit, int value) {
+	if(value)
+		data[bit / 8] |= 1 << (bit % 8);
+}
+
+/*
+ * Every transfer requested by timer is run at once - update first, then
+ *  compare channels in order of their compare values. Level of pins after
+ *  each of three requests of bit period makes the same 3-bit symbol as
+ *  WS2812B bit sent over SPI, so lanes are decoded as SPI bitstreams.
+ */
+static int port_run(TIM_HandleTypeDef* htim) {
+	TIM_TypeDef* tim = htim->Instance;
+	DMA_HandleTypeDef* requests[3] = {
+			(tim->DIER & TIM_DMA_UPDATE) ? htim->hdma[TIM_DMA_ID_UPDATE] : NULL,
+			(tim->DIER & TIM_DMA_CC1) ? htim->hdma[TIM_DMA_ID_CC1] : NULL,
+			(tim->DIER & TIM_DMA_CC2) ? htim->hdma[TIM_DMA_ID_CC2] : NULL,
+	};
+	uint32_t slots = 0;
+
+	if(tim->CCR2 < tim->CCR1) {
+		DMA_HandleTypeDef* tmp = requests[1];
+		requests[1] = requests[2];
+		requests[2] = tmp;
+	}
+
+	for(int r = 0; r < 3; r++) {
+		if(requests[r] && requests[r]->State == HAL_DMA_STATE_BUSY && requests[r]->count > slots)
+			slots = requests[r]->count;
+	}
+
+	port_frame.size = (slots * 3 + 7) / 8;
+	for(int pin = 0; pin < GPIO_PINS; pin++) {
+		port_frame.lanes[pin] = realloc(port_frame.lanes[pin], port_frame.size);
+		if(port_frame.lanes[pin] == NULL)
+			return -1;
+		memset(port_frame.lanes[pin], 0, port_frame.size);
+	}
+
+	for(uint32_t slot = 0; slot < slots; slot++) {
+		for(int r = 0; r < 3; r++) {
+			DMA_HandleTypeDef* hdma = requests[r];
+			if(hdma && hdma->State == HAL_DMA_STATE_BUSY && slot < hdma->count &&
+					gpio_dma_write(hdma, slot))
+				return -1;
+
+			for(int pin = 0; pin < GPIO_PINS; pin++)
+				set_bit(port_frame.lanes[pin], slot * 3 + r, emu_gpioc.ODR & (1 << pin));
+		}
+	}
+
+	port_frame.htim = htim;
+	port_frame.gpio = &emu_gpioc;
+	htim->complete_at_us = emu_time_us() + (uint64_t) slots * (tim->ARR + 1) / TIM_CLOCK_MHZ;
+	return 0;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start(TIM_HandleTypeDef* htim) {
+	if(htim->State != HAL_TIM_STATE_READY)
+		return HAL_BUSY;
+	if(port_run(htim))
+		return HAL_ERROR;
+
+	htim->State = HAL_TIM_STATE_BUSY;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Stop(TIM_HandleTypeDef* htim) {
+	htim->State = HAL_TIM_STATE_READY;
+	return HAL_OK;
+}
+
+/* Only one timer can raise update interrupts - nothing else needs it */
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef* htim) {
+	if(htim->State != HAL_TIM_STATE_READY || tim_it)
+		return HAL_BUSY;
+
+	htim->update_at_us = emu_time_us() + tim_period_us(htim);
+	htim->State = HAL_TIM_STATE_BUSY;
+	tim_it = htim;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Stop_IT(TIM_HandleTypeDef* htim) {
+	if(tim_it == htim)
+		tim_it = NULL;
+	htim->State = HAL_TIM_STATE_READY;
+	return HAL_OK;
+}
+
+/* Interrupts of timer are delivered straight to the callback */
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef* htim) {
+}
+
+
+/************************
+ * UART
+ ************************/
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size, uint32_t timeout) {
+	return HAL_OK;
+}
+
+
+/************************
+ * LOGGING AND PANIC
+ ************************/
+int emu_verbose;
+
+void printk(const char* fmt, ...) {
+	static const char* const levels[] = { "EMERG", "ERR", "WARN", "INFO", "DEBUG" };
+	const char* level = "INFO";
+	va_list args;
+
+	if(fmt[0] == LOG_SOH[0] && fmt[1] >= '0' && fmt[1] <= '4') {
+		level = levels[fmt[1] - '0'];
+		fmt += 2;
+	}
+	if(!emu_verbose && (!strcmp(level, "INFO") || !strcmp(level, "DEBUG")))
+		return;
+
+	fprintf(stderr, "[%10.3f] [%s] ", emu_time_us() / 1000.0, level);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	if(fmt[0] == '\0' || fmt[strlen(fmt) - 1] != '\n')
+		fputc('\n', stderr);
+}
+
+void panic(const char* error_msg) {
+	fprintf(stderr, "[%10.3f] [PANIC] %s\n", emu_time_us() / 1000.0, error_msg);
+	exit(1);
+}
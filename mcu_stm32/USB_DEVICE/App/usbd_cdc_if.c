@@ -22,6 +22,7 @@
 #include "usbd_cdc_if.h"
 
 /* USER CODE BEGIN INCLUDE */
+#include "app.h"
 #include "logger.h"
 #include "mlf_protocol.h"
 /* USER CODE END INCLUDE */
@@ -132,6 +133,7 @@ static int8_t CDC_Receive_FS(uint8_t* pbuf, uint32_t *Len);
 static int8_t CDC_TransmitCplt_FS(uint8_t *pbuf, uint32_t *Len, uint8_t epnum);
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
+static void CDC_Resume_FS(void);
 
 /* USER CODE END PRIVATE_FUNCTIONS_DECLARATION */
 
@@ -162,7 +164,7 @@ static int8_t CDC_Init_FS(void)
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, UserRxBufferFS);
 
   // Initialise packet buffer
-  packet_buf = packet_buffer_init(&usb_ctx);
+  packet_buf = packet_buffer_init(&usb_ctx, APP_USB_RX_SLOTS, CDC_Resume_FS);
   if(packet_buf == NULL) {
 	printk(LOG_ERR "usb: Failed to initialize packet buffer");
 	return USBD_FAIL;
@@ -277,6 +279,8 @@ static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 6 */
   int ret = packet_buffer_append(packet_buf, Buf, *Len);
+  if(ret == PACKET_BUFFER_PAUSED)
+    return (USBD_OK); // Host is NAKed until a packet is processed - see CDC_Resume_FS
   if(ret)
     ; // TODO: Consider returning USBD_FAIL
 
@@ -336,6 +340,15 @@ static int8_t CDC_TransmitCplt_FS(uint8_t *Buf, uint32_t *Len, uint8_t epnum)
 }
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
+/**
+  * @brief  Called by main loop once a slot of packet ring is free again.
+  *         Data which didn't fit has been taken out of the receive buffer
+  *         by then, so OUT endpoint is armed for the next packet.
+  */
+static void CDC_Resume_FS(void)
+{
+  USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+}
 
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
@@ -178,7 +178,8 @@ bool AmbiLights::runFrame(void) {
 	applyColorCorrections(screenWidth, screenWidth * 2 - 1, bottomLeds);
 	applyColorCorrections(0, screenWidth - 1, topLeds);
 
-	WaitForSingleObject(mutexHandle, INFINITE);
+	// MLFProtoLib is thread-safe on its own. Don't hold the mutex here, so
+	//  brightness/state changes from UI thread are not stuck behind frames
 	try {
 		controller->setColors(colors.data(), colors.size());
 	}
@@ -186,7 +187,6 @@ bool AmbiLights::runFrame(void) {
 		err = ex.what();
 		ret = false;
 	}
-	ReleaseMutex(mutexHandle);
 
 	return ret;
 }